@@ -0,0 +1,181 @@
+/*
+ * Config benchmark (hosted): a loadbalancer of services x servers set up
+ * by one service add and server add command a line, then by config apply
+ * of the same file, each in a fresh process over in-memory NICs.
+ *
+ *   make bench && ./bench/config [-n services] [-m servers] [-s rr,r,l,h,w,ch]
+ *
+ * For both it prints the time to set up from nothing and, for config
+ * apply, the time of a second push changing a tenth of the servers (new,
+ * removed and reweighted ones). Last come the server lists of the first
+ * service, which must match the file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <util/map.h>
+#include <util/list.h>
+#include <util/cmd.h>
+#include <net/ni.h>
+#include <net/ip.h>
+
+#include "loadbalancer.h"
+#include "service.h"
+#include "server.h"
+#include "config.h"
+#include "memory.h"
+
+#define CONFIG_PATH	"/tmp/lb-bench.conf"
+#define CHURN		10	//1 in CHURN servers changes in the second push
+
+static uint32_t service_count = 50;
+static uint32_t server_count = 500;
+static char* schedule = "rr";
+
+/* 10.0.0.x:1 ~ on NIC 0, 250 per /24 */
+static void service_line(char* line, size_t size, char* prefix, uint32_t index) {
+	snprintf(line, size, "%s-u 10.0.%d.%d:%d 0 -s %s -out 10.1.255.%d 1", prefix, index / 250, index % 250 + 1,
+			index + 1, schedule, index % 250 + 1);
+}
+
+/* 10.1.0.2 ~ on NIC 1. generation moves the last servers and weighs some anew */
+static void server_line(char* line, size_t size, char* prefix, uint32_t index, uint32_t generation) {
+	uint32_t host = index;
+	uint32_t weight = index % 4 + 1;
+	if(generation && index % CHURN == 0)
+		host += server_count;
+	else if(generation && index % CHURN == 1)
+		weight = weight % 4 + 1;
+
+	snprintf(line, size, "%s-u 10.1.%d.%d:53 1 -m dnat -w %d", prefix, host / 250, host % 250 + 2, weight);
+}
+
+static bool config_write(uint32_t generation) {
+	FILE* fp = fopen(CONFIG_PATH, "w");
+	if(!fp)
+		return false;
+
+	char line[256];
+	for(uint32_t i = 0; i < service_count; i++) {
+		service_line(line, sizeof(line), "service ", i);
+		fprintf(fp, "%s\n", line);
+	}
+	for(uint32_t i = 0; i < server_count; i++) {
+		server_line(line, sizeof(line), "server ", i, generation);
+		fprintf(fp, "%s\n", line);
+	}
+	fclose(fp);
+
+	return true;
+}
+
+static double apply_ms(ConfigDiff* diff) {
+	uint64_t start = memory_ns();
+	if(!config_apply(CONFIG_PATH, diff))
+		return -1;
+
+	return (memory_ns() - start) / 1e6;
+}
+
+static void lists_dump() {
+	Endpoint endpoint = { .ni = ni_get(0), .ni_num = 0, .protocol = IP_PROTOCOL_UDP, .addr = 0x0a000001, .port = 1 };
+	Service* service = service_get(&endpoint);
+	if(!service || !service->active_servers) {
+		printf("\tno first service\n");
+		return;
+	}
+
+	printf("\tfirst service: %u active, %u removing, %u backup servers\n", list_size(service->active_servers),
+			list_size(service->deactive_servers), list_size(service->backup_servers));
+}
+
+static void run_lines() {
+	char* commands[] = { NULL };
+	if(!memory_init(NULL, commands))
+		exit(1);
+
+	char line[256];
+	uint64_t start = memory_ns();
+	for(uint32_t i = 0; i < service_count; i++) {
+		service_line(line, sizeof(line), "service add ", i);
+		cmd_exec(line, NULL);
+	}
+	for(uint32_t i = 0; i < server_count; i++) {
+		server_line(line, sizeof(line), "server add ", i, 0);
+		cmd_exec(line, NULL);
+	}
+	double ms = (memory_ns() - start) / 1e6;
+
+	printf("Commands\tset up %10.2f ms\n", ms);
+	lists_dump();
+}
+
+static void run_config() {
+	char* commands[] = { NULL };
+	if(!memory_init(NULL, commands))
+		exit(1);
+
+	ConfigDiff diff;
+	if(!config_write(0))
+		exit(1);
+	double ms = apply_ms(&diff);
+	printf("Config apply\tset up %10.2f ms\t%u services, %u servers added\n", ms, diff.added[0], diff.added[1]);
+
+	if(!config_write(1))
+		exit(1);
+	ms = apply_ms(&diff);
+	printf("Config apply\tpush   %10.2f ms\t%u servers added, %u changed, %u removed\n", ms, diff.added[1],
+			diff.changed[1], diff.removed[1]);
+	lists_dump();
+
+	unlink(CONFIG_PATH);
+}
+
+static void usage(char* name) {
+	printf("Usage: %s [-n services] [-m servers] [-s rr,r,l,h,w,ch]\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	int option;
+	while((option = getopt(argc, argv, "n:m:s:")) != -1) {
+		switch(option) {
+			case 'n':
+				service_count = strtoul(optarg, NULL, 0);
+				break;
+			case 'm':
+				server_count = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				schedule = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(!service_count || service_count > 250 * 250 || !server_count || server_count * 2 > 250 * 250)
+		usage(argv[0]);
+
+	printf("%u services x %u servers, %s\n", service_count, server_count, schedule);
+
+	//A process each: both start from nothing
+	void (*runs[])() = { run_lines, run_config };
+	for(int i = 0; i < 2; i++) {
+		fflush(stdout);
+		pid_t pid = fork();
+		if(pid == 0) {
+			runs[i]();
+			fflush(stdout);
+			_exit(0);
+		}
+
+		int status;
+		waitpid(pid, &status, 0);
+	}
+
+	return 0;
+}
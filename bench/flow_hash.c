@@ -0,0 +1,143 @@
+/*
+ * Flow hash quality/throughput benchmark (hosted).
+ *
+ *   make bench && ./bench/flow_hash [keys]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flow.h"
+
+#define BUCKETS	4096
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t legacy_key(FlowKey* key) {
+	return (uint64_t)key->protocol << 48 | (uint64_t)key->source << 16 | (uint64_t)key->source_port;
+}
+
+typedef void (*KeyGen)(FlowKey* key, uint32_t i);
+
+static void gen_ports(FlowKey* key, uint32_t i) {
+	//one client, sequential source ports
+	flow_key_init(key, 0x06, 0xc0a80a01, 1024 + (i & 0xffff), 0xc0a864dc, 80);
+}
+
+static void gen_clients(FlowKey* key, uint32_t i) {
+	//a /16 of clients with the same source port
+	flow_key_init(key, 0x06, 0x0a000000 | (i & 0xffff), 40000, 0xc0a864dc, 80);
+}
+
+static void gen_vips(FlowKey* key, uint32_t i) {
+	//same client ip:port talking to many VIPs
+	flow_key_init(key, 0x11, 0xc0a80a01, 5353, 0xc0a86400 | (i & 0xff), 7 + (i >> 8));
+}
+
+static int key_compare(const void* a, const void* b) {
+	uint64_t x = *(uint64_t*)a;
+	uint64_t y = *(uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void quality(const char* name, KeyGen gen, uint32_t count) {
+	static uint32_t legacy[BUCKETS];
+	static uint32_t flow[BUCKETS];
+	memset(legacy, 0, sizeof(legacy));
+	memset(flow, 0, sizeof(flow));
+
+	//distinct legacy keys among distinct flows
+	uint64_t* keys = malloc(sizeof(uint64_t) * count);
+	uint32_t collisions = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		FlowKey key;
+		gen(&key, i);
+		keys[i] = legacy_key(&key);
+		legacy[keys[i] % BUCKETS]++;
+		flow[flow_hash(&key) % BUCKETS]++;
+	}
+
+	qsort(keys, count, sizeof(uint64_t), key_compare);
+	for(uint32_t i = 1; i < count; i++)
+		if(keys[i] == keys[i - 1])
+			collisions++;
+	free(keys);
+
+	void report(const char* hash, uint32_t* buckets) {
+		double mean = (double)count / BUCKETS;
+		double chi = 0;
+		uint32_t max = 0;
+		for(int i = 0; i < BUCKETS; i++) {
+			chi += (buckets[i] - mean) * (buckets[i] - mean) / mean;
+			if(buckets[i] > max)
+				max = buckets[i];
+		}
+		printf("  %-8s max/mean %8.2f  chi2/df %10.2f\n", hash, max / mean, chi / (BUCKETS - 1));
+	}
+
+	printf("%s (%u flows, %d buckets, %u legacy key collisions)\n", name, count, BUCKETS, collisions);
+	report("legacy", legacy);
+	report("flow", flow);
+}
+
+static void throughput(uint32_t count) {
+	FlowKey* keys = malloc(sizeof(FlowKey) * count);
+	for(uint32_t i = 0; i < count; i++)
+		flow_key_init(&keys[i], 0x06, 0x0a000000 + i * 2654435761U, i, 0xc0a864dc, 80);
+
+	volatile uint32_t sink = 0;
+	uint64_t* words = (uint64_t*)keys;
+
+	uint64_t start = now_ns();
+	uint32_t crc = 0;
+	if(flow_hw_crc32c()) {
+		for(uint32_t i = 0; i < count * 2; i++)
+			crc = flow_crc32c_hw(crc, words[i]);
+		sink ^= crc;
+		printf("crc32c hw  %6.2f ns/word\n", (double)(now_ns() - start) / (count * 2));
+	} else
+		printf("crc32c hw  unsupported\n");
+
+	start = now_ns();
+	crc = 0;
+	for(uint32_t i = 0; i < count * 2; i++)
+		crc = flow_crc32c_sw(crc, words[i]);
+	sink ^= crc;
+	printf("crc32c sw  %6.2f ns/word\n", (double)(now_ns() - start) / (count * 2));
+
+	start = now_ns();
+	for(uint32_t i = 0; i < count; i++)
+		sink ^= flow_hash(&keys[i]);
+	printf("flow_hash  %6.2f ns/key\n", (double)(now_ns() - start) / count);
+
+	uint32_t asymmetric = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		FlowKey reverse;
+		flow_key_init(&reverse, keys[i].protocol, keys[i].destination, keys[i].destination_port, keys[i].source, keys[i].source_port);
+		if(flow_hash(&reverse) != flow_hash(&keys[i]))
+			asymmetric++;
+	}
+	printf("symmetry   %u/%u reversed keys differ\n", asymmetric, count);
+
+	free(keys);
+	(void)sink;
+}
+
+int main(int argc, char** argv) {
+	uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : 1 << 20;
+
+	flow_init();
+
+	throughput(count);
+	quality("sequential ports", gen_ports, 1 << 16);
+	quality("client /16", gen_clients, 1 << 16);
+	quality("many VIPs", gen_vips, 1 << 16);
+
+	return 0;
+}
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <thread.h>
+#include <util/map.h>
+#include <util/cmd.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+
+#include "hosted.h"
+#include "loadbalancer.h"
+#include "server.h"
+#include "service.h"
+#include "memory.h"
+
+/* src/main.c, main is lb_main */
+int ginit(int argc, char** argv);
+void init(int argc, char** argv);
+
+static Packet* pool[MEMORY_POOL_COUNT];
+static uint32_t pool_count;
+static uint8_t* frames;
+static bool taken[MEMORY_POOL_COUNT];	//By frame: a packet freed twice aborts the run
+static Packet* answers[MEMORY_POOL_COUNT];
+static uint32_t answer_head;
+static uint32_t answer_tail;
+static Packet* pending;		//Taken from the source by has_input
+
+static MemorySource source;
+static MemoryAnswer answer = memory_swap;
+static uint64_t loop_cycles;
+
+uint64_t memory_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool memory_open(NetworkInterface* ni, char* ifname, int queue_count, char* option) {
+	ni->mac = 0x020000ff0000UL | ni_count();
+
+	return true;
+}
+
+static bool memory_attach(NetworkInterface* ni, int queue) {
+	return true;
+}
+
+static Packet* memory_alloc(NetworkInterface* ni, uint16_t size) {
+	if(!pool_count)
+		return NULL;
+
+	Packet* packet = pool[--pool_count];
+	taken[((uint8_t*)packet - frames) / MEMORY_FRAME_SIZE] = true;
+	packet->ni = ni;
+	packet->time = 0;
+	packet->start = MEMORY_HEADROOM;
+	packet->end = MEMORY_HEADROOM + size;
+	packet->size = MEMORY_FRAME_SIZE - sizeof(Packet);
+
+	return packet;
+}
+
+static void memory_free(Packet* packet) {
+	uint32_t frame = ((uint8_t*)packet - frames) / MEMORY_FRAME_SIZE;
+	if(!taken[frame]) {
+		fprintf(stderr, "Packet %u freed twice\n", frame);
+		abort();
+	}
+
+	taken[frame] = false;
+	pool[pool_count++] = packet;
+}
+
+static bool memory_has_input(NetworkInterface* ni) {
+	if(ni != ni_get(0))
+		return answer_head != answer_tail;
+
+	if(!pending && source)
+		pending = source(ni);
+
+	return pending != NULL;
+}
+
+static Packet* memory_input(NetworkInterface* ni) {
+	if(ni != ni_get(0)) {
+		if(answer_head == answer_tail)
+			return NULL;
+
+		Packet* packet = answers[answer_head++ % MEMORY_POOL_COUNT];
+		packet->ni = ni;
+
+		return packet;
+	}
+
+	if(!memory_has_input(ni))
+		return NULL;
+
+	Packet* packet = pending;
+	pending = NULL;
+
+	return packet;
+}
+
+static bool memory_output(NetworkInterface* ni, Packet* packet) {
+	if(answer && ni == ni_get(1) && answer(packet)) {
+		answers[answer_tail++ % MEMORY_POOL_COUNT] = packet;
+		return true;
+	}
+
+	memory_free(packet);
+
+	return true;
+}
+
+static Driver memory_driver = {
+	.name		= "memory",
+	.open		= memory_open,
+	.attach		= memory_attach,
+	.alloc		= memory_alloc,
+	.free		= memory_free,
+	.has_input	= memory_has_input,
+	.input		= memory_input,
+	.output		= memory_output,
+};
+
+Driver* hosted_driver = &memory_driver;
+
+bool memory_init(char* script, char** commands) {
+	frames = calloc(MEMORY_POOL_COUNT, MEMORY_FRAME_SIZE);
+	if(!frames)
+		return false;
+	for(uint32_t i = 0; i < MEMORY_POOL_COUNT; i++)
+		pool[pool_count++] = (Packet*)(frames + (size_t)i * MEMORY_FRAME_SIZE);
+
+	if(!hosted_ni_add("mem0", 1, NULL) || !hosted_ni_add("mem1", 1, NULL))
+		return false;
+	hosted_thread_setup(1);
+	hosted_thread_init(0);
+
+	char* argv[] = { "bench", NULL };
+	if(ginit(1, argv) != 0) {
+		printf("Can'nt initialize loadbalancer\n");
+		return false;
+	}
+	init(1, argv);
+
+	char line[256];
+	if(!script) {
+		for(int i = 0; commands[i]; i++) {
+			strncpy(line, commands[i], sizeof(line) - 1);
+			line[sizeof(line) - 1] = '\0';
+			cmd_exec(line, NULL);
+		}
+
+		return true;
+	}
+
+	FILE* fp = fopen(script, "r");
+	if(!fp) {
+		printf("Can'nt open %s\n", script);
+		return false;
+	}
+
+	while(fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if(line[0] && line[0] != '#')
+			cmd_exec(line, NULL);
+	}
+	fclose(fp);
+
+	return true;
+}
+
+void memory_source(MemorySource _source) {
+	source = _source;
+}
+
+void memory_answer(MemoryAnswer _answer) {
+	answer = _answer;
+}
+
+bool memory_swap(Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	if(endian16(ether->type) != ETHER_TYPE_IPv4)
+		return false;
+
+	IP* ip = (IP*)ether->payload;
+	if(ip->protocol != IP_PROTOCOL_TCP && ip->protocol != IP_PROTOCOL_UDP)
+		return false;
+
+	uint64_t mac = ether->dmac;
+	ether->dmac = ether->smac;
+	ether->smac = mac;
+
+	uint32_t addr = ip->source;
+	ip->source = ip->destination;
+	ip->destination = addr;
+
+	//TCP and UDP ports are at the same offset
+	UDP* udp = (UDP*)ip->body;
+	uint16_t port = udp->source;
+	udp->source = udp->destination;
+	udp->destination = port;
+
+	if(ip->protocol == IP_PROTOCOL_TCP)
+		((TCP*)ip->body)->ack = 1;
+
+	return true;
+}
+
+void memory_run(bool single) {
+	Packet* packets[LB_BURST];
+	int count = ni_count();
+	bool busy = true;
+
+	while(busy) {
+		busy = false;
+		for(int i = 0; i < count; i++) {
+			NetworkInterface* ni = ni_get(i);
+			int burst = 0;
+			while(burst < LB_BURST && ni_has_input(ni)) {
+				Packet* packet = ni_input(ni);
+				if(!packet)
+					break;
+
+				packets[burst++] = packet;
+			}
+
+			if(!burst)
+				continue;
+
+			busy = true;
+			if(single) {
+				for(int j = 0; j < burst; j++)
+					if(!lb_process(packets[j], i))
+						ni_free(packets[j]);
+			} else {
+				lb_process_burst(packets, burst, i);
+			}
+		}
+
+		uint64_t start = memory_cycles();
+		lb_loop();
+		loop_cycles += memory_cycles() - start;
+	}
+}
+
+uint64_t memory_loop_cycles() {
+	return loop_cycles;
+}
+
+void memory_arp_seed(int ni_num, uint32_t addr) {
+	NetworkInterface* ni = ni_get(ni_num);
+	Packet* packet = ni_alloc(ni, ETHER_LEN + ARP_LEN);
+	if(!packet)
+		return;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->dmac = endian48(ni->mac);
+	ether->smac = endian48(0x020000000000UL | (addr & 0xffffff));
+	ether->type = endian16(ETHER_TYPE_ARP);
+
+	ARP* arp = (ARP*)ether->payload;
+	arp->htype = endian16(1);
+	arp->ptype = endian16(ETHER_TYPE_IPv4);
+	arp->hlen = 6;
+	arp->plen = 4;
+	arp->operation = endian16(ARP_OPERATION_REPLY);
+	arp->sha = ether->smac;
+	arp->spa = endian32(addr);
+	arp->tha = ether->dmac;
+	arp->tpa = 0;
+
+	if(!lb_process(packet, ni_num))
+		ni_free(packet);
+}
+
+void memory_arp_seed_servers() {
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* servers = ni_config_get(ni_get(i), SERVERS);
+		if(!servers)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, servers);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Server* server = entry->data;
+			memory_arp_seed(i, server->endpoint.addr);
+		}
+	}
+}
+
+void memory_sessions_expire() {
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* sessions = lb_get_sessions(i);
+		size_t size = map_size(sessions);
+		if(!size)
+			continue;
+
+		//Each session is in the maps twice: keep the public key entries
+		Session** list = malloc(sizeof(Session*) * size);
+		if(!list)
+			return;
+
+		size_t list_count = 0;
+		MapIterator iter;
+		map_iterator_init(&iter, sessions);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Session* session = entry->data;
+			if(entry->key == session_get_public_key(session))
+				list[list_count++] = session;
+		}
+
+		for(size_t j = 0; j < list_count; j++)
+			service_free_session(list[j]);
+		free(list);
+	}
+}
+
+void memory_reset() {
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		LoadBalancer* lb = lb_get(i);
+		for(int j = 0; j < thread_count(); j++)
+			bzero(lb->cores[j].classes, sizeof(lb->cores[j].classes));
+	}
+	lb_latency_reset();
+}
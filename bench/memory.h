@@ -0,0 +1,52 @@
+#ifndef __MEMORY_H__
+#define __MEMORY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+#include <net/packet.h>
+
+/*
+ * In-memory NICs for the hosted benchmarks. NIC 0 faces the clients: its
+ * packets come from a source. NIC 1 faces the servers: what the
+ * loadbalancer sends there is turned into the servers' answers.
+ */
+
+#define MEMORY_FRAME_SIZE	2048
+#define MEMORY_HEADROOM		128
+#define MEMORY_POOL_COUNT	8192
+
+/* Next client packet from ni_alloc(), NULL when there is none */
+typedef Packet* (*MemorySource)(NetworkInterface* ni);
+/* Turn a packet sent to a server into its answer, false drops it */
+typedef bool (*MemoryAnswer)(Packet* packet);
+
+/* Two NICs, the loadbalancer, then the commands of script or commands */
+bool memory_init(char* script, char** commands);
+void memory_source(MemorySource source);
+void memory_answer(MemoryAnswer answer);
+
+/* Answer with addresses and ports swapped and ACK set */
+bool memory_swap(Packet* packet);
+
+/* Process until the source is dry and every answer is processed */
+void memory_run(bool single);
+/* Cycles memory_run() spent in lb_loop(): timers */
+uint64_t memory_loop_cycles();
+
+/* Resolve addr on NIC ni_num, as an ARP reply would */
+void memory_arp_seed(int ni_num, uint32_t addr);
+void memory_arp_seed_servers();
+
+/* Free every session, as if all flows had ended */
+void memory_sessions_expire();
+/* Clear the loadbalancer's counters */
+void memory_reset();
+
+static inline uint64_t memory_cycles() {
+	return __builtin_ia32_rdtsc();
+}
+
+uint64_t memory_ns();
+
+#endif /*__MEMORY_H__*/
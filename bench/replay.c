@@ -0,0 +1,475 @@
+/*
+ * Datapath benchmark (hosted): replays a pcap file or synthesized flows
+ * through lb_process_burst() on in-memory NIs, then once more with stage
+ * profiling on.
+ *
+ *   make bench && ./bench/replay [-f script] [-r pcap] [-n flows] [-p packets] [-t seconds] [-l rate] [-c servers] [-m frames] [-u] [-k] [-o] [-1]
+ *
+ * NIC 0 is the client side, NIC 1 the server side. Without -f the
+ * services below are configured. Packets the loadbalancer sends to NIC 1
+ * come back as the server's answer unless -o is given. -l limits new
+ * sessions of the TCP service with -r: SYNs over the rate are answered
+ * with RST inside the burst loop, and a packet freed twice aborts. -c
+ * adds servers to it capped at one session: once full, the sessions the
+ * scheduler gives them spill over to the servers with room. -m flips the
+ * servers of port 80 between ipip and nat in the middle of the bursts:
+ * servers with sessions refuse, the others retire their tunnel while
+ * packets still use it, as with a -stateless service in the -f script.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <util/map.h>
+#include <util/set.h>
+#include <util/cmd.h>
+#include <thread.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+
+#include "hosted.h"
+#include "loadbalancer.h"
+#include "server.h"
+#include "memory.h"
+
+#define FRAME_LEN	64	//Synthesized frames, without FCS
+#define VIP		0x0a000064	//10.0.0.100
+#define CLIENT_COUNT	250	//Clients of synthesized flows: 192.168.0.1 ~
+
+static char* default_script[] = {
+	"server add -t 10.1.0.2:80 1 -m nat",
+	"server add -t 10.1.0.3:80 1 -m nat",
+	"server add -t 10.1.0.4:80 1 -m nat",
+	"server add -t 10.1.0.5:80 1 -m nat",
+	"service add -t 10.0.0.100:80 0 -s rr -out 10.1.0.100 1",
+	"server add -u 10.1.0.2:53 1 -m nat",
+	"server add -u 10.1.0.3:53 1 -m nat",
+	"server add -u 10.1.0.4:53 1 -m nat",
+	"server add -u 10.1.0.5:53 1 -m nat",
+	"service add -u 10.0.0.100:53 0 -s rr -out 10.1.0.101 1",
+	NULL
+};
+
+/* Frames to replay, all received by NIC 0 */
+typedef struct _Trace {
+	uint8_t*	data;
+	uint32_t*	offsets;
+	uint16_t*	lengths;
+	uint32_t	count;
+	uint32_t	capacity;
+	size_t		size;
+} Trace;
+
+static Trace trace;
+static uint32_t cursor;
+static uint32_t flip;		//Frames between mode flips, 0 for none
+static uint64_t flips[2];	//Done, refused
+
+static bool trace_add(uint8_t* frame, uint16_t length) {
+	if(trace.count == trace.capacity) {
+		trace.capacity = trace.capacity ? trace.capacity * 2 : 4096;
+		trace.offsets = realloc(trace.offsets, sizeof(uint32_t) * trace.capacity);
+		trace.lengths = realloc(trace.lengths, sizeof(uint16_t) * trace.capacity);
+		trace.data = realloc(trace.data, (size_t)trace.capacity * FRAME_LEN * 2);
+		if(!trace.offsets || !trace.lengths || !trace.data)
+			return false;
+	}
+
+	if(trace.size + length > (size_t)trace.capacity * FRAME_LEN * 2) {
+		trace.data = realloc(trace.data, trace.size + length + (size_t)trace.capacity * FRAME_LEN);
+		if(!trace.data)
+			return false;
+	}
+
+	memcpy(trace.data + trace.size, frame, length);
+	trace.offsets[trace.count] = trace.size;
+	trace.lengths[trace.count] = length;
+	trace.size += length;
+	trace.count++;
+
+	return true;
+}
+
+/* Ethernet frames of a classic pcap file */
+static bool trace_load(char* file) {
+	FILE* fp = fopen(file, "r");
+	if(!fp) {
+		printf("Can'nt open %s\n", file);
+		return false;
+	}
+
+	struct {
+		uint32_t magic;
+		uint16_t major;
+		uint16_t minor;
+		int32_t zone;
+		uint32_t sigfigs;
+		uint32_t snaplen;
+		uint32_t linktype;
+	} header;
+
+	if(fread(&header, sizeof(header), 1, fp) != 1) {
+		printf("Can'nt read %s\n", file);
+		fclose(fp);
+		return false;
+	}
+
+	bool swapped = header.magic == 0xd4c3b2a1 || header.magic == 0x4d3cb2a1;
+	if(!swapped && header.magic != 0xa1b2c3d4 && header.magic != 0xa1b23c4d) {
+		printf("%s is not a pcap file\n", file);
+		fclose(fp);
+		return false;
+	}
+
+	uint32_t linktype = swapped ? __builtin_bswap32(header.linktype) : header.linktype;
+	if(linktype != 1) {
+		printf("Only Ethernet captures are supported\n");
+		fclose(fp);
+		return false;
+	}
+
+	uint32_t record[4];
+	uint8_t frame[MEMORY_FRAME_SIZE];
+	uint32_t skipped = 0;
+	while(fread(record, sizeof(record), 1, fp) == 1) {
+		uint32_t length = swapped ? __builtin_bswap32(record[2]) : record[2];
+		if(length > MEMORY_FRAME_SIZE - MEMORY_HEADROOM - sizeof(Packet)) {
+			fseek(fp, length, SEEK_CUR);
+			skipped++;
+			continue;
+		}
+
+		if(fread(frame, length, 1, fp) != 1)
+			break;
+
+		if(!trace_add(frame, length)) {
+			printf("Can'nt allocate trace\n");
+			fclose(fp);
+			return false;
+		}
+	}
+	fclose(fp);
+
+	if(skipped)
+		printf("%u jumbo frames skipped\n", skipped);
+
+	return trace.count > 0;
+}
+
+/* Round robin over flows: the first packet of every flow, the second, ... */
+static bool trace_synthesize(uint32_t flows, uint32_t packets, uint8_t protocol) {
+	uint8_t frame[FRAME_LEN];
+
+	for(uint32_t round = 0; round < packets; round++) {
+		for(uint32_t flow = 0; flow < flows; flow++) {
+			bzero(frame, sizeof(frame));
+
+			Ether* ether = (Ether*)frame;
+			ether->dmac = endian48(ni_get(0)->mac);
+			ether->smac = endian48(0x020000000000UL | flow % CLIENT_COUNT);
+			ether->type = endian16(ETHER_TYPE_IPv4);
+
+			IP* ip = (IP*)ether->payload;
+			ip->version = 4;
+			ip->ihl = 5;
+			ip->ttl = 64;
+			ip->protocol = protocol;
+			ip->length = endian16(FRAME_LEN - ETHER_LEN);
+			ip->source = endian32(0xc0a80001 + flow % CLIENT_COUNT);
+			ip->destination = endian32(VIP);
+
+			uint16_t port = 1024 + flow / CLIENT_COUNT;
+			if(protocol == IP_PROTOCOL_TCP) {
+				TCP* tcp = (TCP*)ip->body;
+				tcp->source = endian16(port);
+				tcp->destination = endian16(80);
+				tcp->offset = 5;
+				tcp->syn = round == 0;
+				tcp->ack = round != 0;
+				tcp->sequence = endian32(round);
+			} else {
+				UDP* udp = (UDP*)ip->body;
+				udp->source = endian16(port);
+				udp->destination = endian16(53);
+				udp->length = endian16(FRAME_LEN - ETHER_LEN - IP_LEN);
+			}
+
+			if(!trace_add(frame, FRAME_LEN))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Servers of port 80 on NIC 1, 10.1.0.2:80 ~ of the default script */
+static void flip_servers() {
+	Map* servers = ni_config_get(ni_get(1), SERVERS);
+	if(!servers)
+		return;
+
+	MapIterator iter;
+	map_iterator_init(&iter, servers);
+	while(map_iterator_has_next(&iter)) {
+		Server* server = map_iterator_next(&iter)->data;
+		if(server->endpoint.port != 80)
+			continue;
+
+		flips[!server_set_mode(server, server->mode == MODE_IPIP ? MODE_NAT : MODE_IPIP)]++;
+	}
+}
+
+/* Next trace frame, copied as a NIC would receive it */
+static Packet* trace_source(NetworkInterface* ni) {
+	if(cursor >= trace.count)
+		return NULL;
+
+	if(flip && cursor % flip == 0)
+		flip_servers();
+
+	uint16_t length = trace.lengths[cursor];
+	Packet* packet = ni_alloc(ni, length);
+	if(!packet)
+		return NULL;
+
+	memcpy(packet->buffer + packet->start, trace.data + trace.offsets[cursor], length);
+	cursor++;
+
+	return packet;
+}
+
+static void arp_seed_clients() {
+	Set* clients = set_create(1024, NULL, NULL, NULL);
+	for(uint32_t i = 0; i < trace.count; i++) {
+		Ether* ether = (Ether*)(trace.data + trace.offsets[i]);
+		if(trace.lengths[i] < ETHER_LEN + IP_LEN || endian16(ether->type) != ETHER_TYPE_IPv4)
+			continue;
+
+		uint32_t addr = endian32(((IP*)ether->payload)->source);
+		if(!set_contains(clients, (void*)(uint64_t)addr)) {
+			set_put(clients, (void*)(uint64_t)addr);
+			memory_arp_seed(0, addr);
+		}
+	}
+	set_destroy(clients);
+}
+
+typedef struct _Result {
+	uint64_t	ns;
+	uint64_t	cycles;
+	uint64_t	packets;
+	uint64_t	new_sessions;
+	uint64_t	passes;
+	uint64_t	stages[LB_STAGE_COUNT];
+	Histogram	latency[LB_STAGE_COUNT];	//Every NIC
+} Result;
+
+/* One pass over the trace, with the answers of the servers */
+static void run_pass(bool single) {
+	cursor = 0;
+	memory_run(single);
+}
+
+static void run(Result* result, uint64_t duration, bool single, bool keep) {
+	bzero(result, sizeof(Result));
+
+	//Warm up: with keep, flows are established before the clock starts
+	run_pass(single);
+	if(!keep)
+		memory_sessions_expire();
+	memory_reset();
+
+	while(result->ns < duration) {
+		uint64_t start = memory_ns();
+		uint64_t cycles = memory_cycles();
+		run_pass(single);
+		result->cycles += memory_cycles() - cycles;
+		result->ns += memory_ns() - start;
+		result->passes++;
+
+		//Not timed
+		if(!keep)
+			memory_sessions_expire();
+	}
+
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		LoadBalancerCore counters;
+		lb_sum(i, &counters);
+		for(int j = 0; j < LB_CLASS_COUNT; j++)
+			result->packets += counters.classes[j];
+		for(int j = 0; j < LB_STAGE_COUNT; j++) {
+			result->stages[j] += counters.stages[j];
+
+			Histogram latency;
+			lb_latency(i, j, &latency);
+			histogram_merge(&result->latency[j], &latency);
+		}
+		result->new_sessions += counters.new_sessions;
+	}
+}
+
+static void usage(char* name) {
+	printf("Usage: %s [-f script] [-r pcap] [-n flows] [-p packets] [-t seconds] [-l rate] [-c servers] [-m frames] [-u] [-k] [-o] [-1]\n", name);
+	printf("\t-f script\tConfiguration commands (default: NAT TCP :80 and UDP :53 on 10.0.0.100)\n");
+	printf("\t-r pcap\t\tReplay an Ethernet pcap instead of synthesized flows\n");
+	printf("\t-n flows\tSynthesized flows (default 8192). NAT has %d ports per -out address:\n", 65536 - PORT_FIRST);
+	printf("\t\t\tuse a dnat or dr script for more concurrent flows\n");
+	printf("\t-p packets\tPackets per flow (default 8)\n");
+	printf("\t-t seconds\tDuration of each run (default 2)\n");
+	printf("\t-l rate\t\tNew sessions per second of 10.0.0.100:80, SYNs over it reset\n");
+	printf("\t-c servers\tMore servers of 10.0.0.100:80, capped at 1 session: most are full\n");
+	printf("\t-m frames\tFlip servers of port 80 between ipip and nat every frames\n");
+	printf("\t-u\t\tUDP flows instead of TCP\n");
+	printf("\t-k\t\tKeep sessions between passes: established flows only\n");
+	printf("\t-o\t\tOne way: servers do not answer\n");
+	printf("\t-1\t\tlb_process() per packet instead of lb_process_burst()\n");
+}
+
+int main(int argc, char** argv) {
+	char* script = NULL;
+	char* pcap = NULL;
+	uint32_t flows = 8192;
+	uint32_t packets = 8;
+	uint32_t seconds = 2;
+	uint32_t limit = 0;
+	uint32_t capped = 0;
+	uint8_t protocol = IP_PROTOCOL_TCP;
+	bool keep = false;
+	bool single = false;
+	bool reflect = true;
+
+	int opt;
+	while((opt = getopt(argc, argv, "f:r:n:p:t:l:c:m:uko1h")) != -1) {
+		switch(opt) {
+			case 'f':
+				script = optarg;
+				break;
+			case 'r':
+				pcap = optarg;
+				break;
+			case 'n':
+				flows = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				packets = strtoul(optarg, NULL, 0);
+				break;
+			case 't':
+				seconds = strtoul(optarg, NULL, 0);
+				break;
+			case 'l':
+				limit = strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				capped = strtoul(optarg, NULL, 0);
+				break;
+			case 'm':
+				flip = strtoul(optarg, NULL, 0);
+				break;
+			case 'u':
+				protocol = IP_PROTOCOL_UDP;
+				break;
+			case 'k':
+				keep = true;
+				break;
+			case 'o':
+				reflect = false;
+				break;
+			case '1':
+				single = true;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if(!flows || !packets || !seconds) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(!memory_init(script, default_script))
+		return 1;
+
+	if(limit) {
+		char command[64];
+		snprintf(command, sizeof(command), "limit -t 10.0.0.100:80 0 -s %u/%u -r", limit, limit);
+		if(cmd_exec(command, NULL) != 0) {
+			printf("Can'nt limit 10.0.0.100:80\n");
+			return 1;
+		}
+	}
+
+	//10.1.1.1 ~, after the servers with room in the list
+	for(uint32_t i = 0; i < capped; i++) {
+		char command[64];
+		snprintf(command, sizeof(command), "server add -t 10.1.%u.%u:80 1 -m nat -c 1", 1 + i / 250, i % 250 + 1);
+		if(cmd_exec(command, NULL) != 0) {
+			printf("Can'nt add capped server %u\n", i);
+			return 1;
+		}
+	}
+
+	if(pcap ? !trace_load(pcap) : !trace_synthesize(flows, packets, protocol)) {
+		printf("Can'nt build trace\n");
+		return 1;
+	}
+	memory_source(trace_source);
+	if(!reflect)
+		memory_answer(NULL);
+	memory_arp_seed_servers();
+	arp_seed_clients();
+
+	if(pcap)
+		printf("replay %s: %u frames\n", pcap, trace.count);
+	else
+		printf("replay %u %s flows x %u packets: %u frames\n", flows, protocol == IP_PROTOCOL_TCP ? "TCP" : "UDP", packets, trace.count);
+	printf("%s, %s, %s\n", single ? "lb_process" : "lb_process_burst", keep ? "sessions kept" : "sessions expired every pass",
+			reflect ? "servers answer" : "one way");
+
+	Result result;
+	uint64_t duration = (uint64_t)seconds * 1000000000ULL;
+	run(&result, duration, single, keep);
+
+	double mpps = (double)result.packets * 1000.0 / result.ns;
+	printf("%lu packets in %lu passes, %.3f s\n", result.packets, result.passes, result.ns / 1e9);
+	printf("  %8.3f Mpps\n", mpps);
+	printf("  %8.1f ns/packet\n", (double)result.ns / result.packets);
+	printf("  %8.1f cycles/packet\n", (double)result.cycles / result.packets);
+	printf("  %8.0f new flows/s\n", result.new_sessions * 1e9 / result.ns);
+	if(flip)
+		printf("  %8lu mode flips, %lu refused with sessions\n", flips[0], flips[1]);
+
+	//Same again with the stages timed
+	lb_profile_set(true);
+	run(&result, duration, single, keep);
+	lb_profile_set(false);
+
+	static const char* names[LB_STAGE_COUNT] = { "classify", "lookup", "session", "forward", "output", "slow" };
+	uint64_t total = 0;
+	for(int i = 0; i < LB_STAGE_COUNT; i++)
+		total += result.stages[i];
+
+	printf("stages (profiled, %.3f Mpps)\n", (double)result.packets * 1000.0 / result.ns);
+	for(int i = 0; i < LB_STAGE_COUNT; i++) {
+		printf("  %-9s %8.1f cycles/packet %5.1f%%", names[i], (double)result.stages[i] / result.packets,
+				total ? result.stages[i] * 100.0 / total : 0);
+		Histogram* latency = &result.latency[i];
+		if(latency->count)
+			printf("  p50 %5lu p99 %6lu p99.9 %7lu", histogram_percentile(latency, 50),
+					histogram_percentile(latency, 99), histogram_percentile(latency, 99.9));
+		if(i == LB_STAGE_SESSION && result.new_sessions)
+			printf("  %8.1f cycles/new flow", (double)result.stages[i] / result.new_sessions);
+		printf("\n");
+	}
+	printf("  %-9s %8.1f cycles/packet\n", "other", (double)(result.cycles - total) / result.packets);
+
+	return 0;
+}
@@ -0,0 +1,629 @@
+/*
+ * Scale test (hosted): keeps a number of concurrent flows open against the
+ * loadbalancer on in-memory NICs and reports where it stops scaling.
+ *
+ *   make bench && ./bench/scale [-f script] [-n flows] [-s size] [-u percent] [-e fin,rst,idle] [-r flows/s] [-t seconds]
+ *
+ * Flows are opened in ten steps first, each step reporting the cost of a
+ * new session and the memory per session. Then flows of random size come
+ * and go for t seconds: finished flows are replaced, so concurrency stays
+ * put. Last come lookup, timer and per packet latency percentiles, the
+ * sessions per server and a forced removal of the busiest server.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <util/map.h>
+#include <util/list.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+
+#include "hosted.h"
+#include "loadbalancer.h"
+#include "service.h"
+#include "server.h"
+#include "session.h"
+#include "memory.h"
+
+#define FRAME_LEN	64
+#define VIP		0x0a000064	//10.0.0.100
+#define CLIENT_COUNT	250	//192.168.0.1 ~, ports 1024 ~ per client
+#define PORT_COUNT	64512
+#define SAMPLE_COUNT	1000000
+#define CLOSE_DELAY	(LB_BURST * 2)	//Packets between FIN and the last ACK
+
+#define FLOW_FREE	0
+#define FLOW_OPEN	1
+#define FLOW_CLOSING	2	//FIN sent, last ACK pending
+
+#define END_FIN		0
+#define END_RST		1
+#define END_IDLE	2	//Left to the session timeout
+#define END_COUNT	3
+
+#define SIZE_FIXED	0
+#define SIZE_EXP	1
+#define SIZE_PARETO	2
+
+typedef struct _Flow {
+	uint32_t	tuple;		//Client address and port
+	uint32_t	remaining;	//Packets before the end
+	uint8_t		protocol;
+	uint8_t		state;
+	uint8_t		end;
+} Flow;
+
+static char* default_script[] = {
+	"server add -t 10.1.0.2:80 1 -m dnat",
+	"server add -t 10.1.0.3:80 1 -m dnat",
+	"server add -t 10.1.0.4:80 1 -m dnat",
+	"server add -t 10.1.0.5:80 1 -m dnat",
+	"service add -t 10.0.0.100:80 0 -s rr -out 10.1.0.100 1",
+	"server add -u 10.1.0.2:53 1 -m dnat",
+	"server add -u 10.1.0.3:53 1 -m dnat",
+	"server add -u 10.1.0.4:53 1 -m dnat",
+	"server add -u 10.1.0.5:53 1 -m dnat",
+	"service add -u 10.0.0.100:53 0 -s rr -out 10.1.0.101 1",
+	NULL
+};
+
+static Flow* flows;
+static uint32_t flow_count;
+static uint32_t opened;		//Slots used so far
+static uint32_t* frees;		//Finished slots
+static uint32_t free_count;
+static uint32_t next_tuple;
+
+/* FIN sent: slot and the packet sequence when it was sent */
+static uint32_t* closing;
+static uint64_t* closing_sequence;
+static uint32_t closing_head;
+static uint32_t closing_tail;
+
+static uint8_t size_kind = SIZE_EXP;
+static double size_mean = 10;
+static uint32_t udp_percent = 20;
+static uint32_t ends[END_COUNT] = { 80, 10, 10 };
+static uint64_t rate;		//New flows per second, 0 is unlimited
+
+static uint32_t ramp_target;
+static bool steady;
+static uint64_t deadline;
+static uint64_t started_ns;
+static uint64_t now;
+
+static uint64_t sequence;	//Client packets
+static uint64_t started;	//New flows of the steady run
+static uint64_t ended[END_COUNT];
+static uint64_t seed = 0x9e3779b97f4a7c15;
+
+static uint64_t random64() {
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	return seed;
+}
+
+/* (0, 1] */
+static double random_unit() {
+	return ((random64() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static uint32_t flow_size() {
+	double size;
+	switch(size_kind) {
+		case SIZE_FIXED:
+			size = size_mean;
+			break;
+		case SIZE_EXP:
+			size = -size_mean * log(random_unit());
+			break;
+		default:
+			//Pareto, alpha 1.5: a few elephants among mice
+			size = size_mean / 3 / pow(random_unit(), 1 / 1.5);
+			break;
+	}
+
+	if(size < 1)
+		return 1;
+	if(size > 1000000)
+		return 1000000;
+
+	return (uint32_t)size;
+}
+
+static Packet* packet_build(NetworkInterface* ni, Flow* flow, bool syn, bool fin, bool rst) {
+	Packet* packet = ni_alloc(ni, FRAME_LEN);
+	if(!packet)
+		return NULL;
+
+	uint8_t* frame = packet->buffer + packet->start;
+	bzero(frame, FRAME_LEN);
+
+	uint32_t client = flow->tuple % CLIENT_COUNT;
+	Ether* ether = (Ether*)frame;
+	ether->dmac = endian48(ni->mac);
+	ether->smac = endian48(0x020000000000UL | (0xc0a80001 + client));
+	ether->type = endian16(ETHER_TYPE_IPv4);
+
+	IP* ip = (IP*)ether->payload;
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->ttl = 64;
+	ip->protocol = flow->protocol;
+	ip->length = endian16(FRAME_LEN - ETHER_LEN);
+	ip->source = endian32(0xc0a80001 + client);
+	ip->destination = endian32(VIP);
+
+	uint16_t port = 1024 + flow->tuple / CLIENT_COUNT;
+	if(flow->protocol == IP_PROTOCOL_TCP) {
+		TCP* tcp = (TCP*)ip->body;
+		tcp->source = endian16(port);
+		tcp->destination = endian16(80);
+		tcp->offset = 5;
+		tcp->syn = syn;
+		tcp->ack = !syn;
+		tcp->fin = fin;
+		tcp->rst = rst;
+	} else {
+		UDP* udp = (UDP*)ip->body;
+		udp->source = endian16(port);
+		udp->destination = endian16(53);
+		udp->length = endian16(FRAME_LEN - ETHER_LEN - IP_LEN);
+	}
+
+	sequence++;
+
+	return packet;
+}
+
+static void flow_release(uint32_t slot) {
+	flows[slot].state = FLOW_FREE;
+	frees[free_count++] = slot;
+}
+
+static Packet* flow_open(NetworkInterface* ni, uint32_t slot) {
+	Flow* flow = &flows[slot];
+	flow->tuple = next_tuple;
+	next_tuple = (next_tuple + 1) % (CLIENT_COUNT * PORT_COUNT);
+	flow->protocol = random64() % 100 < udp_percent ? IP_PROTOCOL_UDP : IP_PROTOCOL_TCP;
+	flow->remaining = flow_size();
+	flow->state = FLOW_OPEN;
+
+	uint32_t pick = random64() % (ends[END_FIN] + ends[END_RST] + ends[END_IDLE]);
+	if(pick < ends[END_FIN])
+		flow->end = END_FIN;
+	else if(pick < ends[END_FIN] + ends[END_RST])
+		flow->end = END_RST;
+	else
+		flow->end = END_IDLE;
+
+	//UDP has no FIN and no RST
+	if(flow->protocol == IP_PROTOCOL_UDP)
+		flow->end = END_IDLE;
+
+	return packet_build(ni, flow, flow->protocol == IP_PROTOCOL_TCP, false, false);
+}
+
+/* Next packet of an open flow, NULL when it ended without one */
+static Packet* flow_next(NetworkInterface* ni, uint32_t slot) {
+	Flow* flow = &flows[slot];
+	if(flow->remaining) {
+		flow->remaining--;
+		return packet_build(ni, flow, false, false, false);
+	}
+
+	ended[flow->end]++;
+	switch(flow->end) {
+		case END_FIN:
+			flow->state = FLOW_CLOSING;
+			closing[closing_tail % flow_count] = slot;
+			closing_sequence[closing_tail % flow_count] = sequence;
+			closing_tail++;
+			return packet_build(ni, flow, false, true, false);
+		case END_RST:
+			flow_release(slot);
+			return packet_build(ni, flow, false, false, true);
+		default:
+			flow_release(slot);
+			return NULL;
+	}
+}
+
+static bool rate_allows() {
+	if(!rate)
+		return true;
+
+	return started * 1000000000ULL < rate * (now - started_ns);
+}
+
+static Packet* scale_source(NetworkInterface* ni) {
+	//Last ACK once the server's FIN went through
+	if(closing_head != closing_tail && sequence - closing_sequence[closing_head % flow_count] >= CLOSE_DELAY) {
+		uint32_t slot = closing[closing_head++ % flow_count];
+		Packet* packet = packet_build(ni, &flows[slot], false, false, false);
+		flow_release(slot);
+
+		return packet;
+	}
+
+	if(!steady) {
+		if(opened >= ramp_target)
+			return NULL;
+
+		return flow_open(ni, opened++);
+	}
+
+	if((sequence & 1023) == 0) {
+		now = memory_ns();
+		if(now >= deadline)
+			return NULL;
+	}
+
+	while(true) {
+		if(free_count && rate_allows()) {
+			started++;
+			return flow_open(ni, frees[--free_count]);
+		}
+
+		uint32_t slot = random64() % flow_count;
+		if(flows[slot].state != FLOW_OPEN) {
+			//All closing or waiting for the rate: let the answers through
+			if(free_count + (closing_tail - closing_head) >= flow_count)
+				return NULL;
+			continue;
+		}
+
+		Packet* packet = flow_next(ni, slot);
+		if(packet)
+			return packet;
+	}
+}
+
+/* RST is not answered */
+static bool scale_answer(Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	if(endian16(ether->type) == ETHER_TYPE_IPv4 && ip->protocol == IP_PROTOCOL_TCP && ((TCP*)ip->body)->rst)
+		return false;
+
+	return memory_swap(packet);
+}
+
+static size_t heap_used() {
+	return mallinfo2().uordblks;
+}
+
+static uint32_t session_count() {
+	//Public and private keys: each session is in the NIC maps twice
+	return (map_size(lb_get_sessions(0)) + map_size(lb_get_sessions(1))) / 2;
+}
+
+static int compare(const void* a, const void* b) {
+	uint32_t x = *(uint32_t*)a;
+	uint32_t y = *(uint32_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void percentiles(char* name, uint32_t* samples, uint32_t count, double ns_per_cycle) {
+	if(!count)
+		return;
+
+	qsort(samples, count, sizeof(uint32_t), compare);
+	printf("  %-9s p50 %6u  p90 %6u  p99 %6u  p99.9 %7u  max %8u cycles  (p99 %.0f ns)\n", name,
+			samples[count / 2], samples[count * 9 / 10], samples[count * 99 / 100],
+			samples[count * 999 / 1000], samples[count - 1], samples[count * 99 / 100] * ns_per_cycle);
+}
+
+static void ramp() {
+	printf("ramp to %u flows\n", flow_count);
+	printf("  %10s %10s %12s %12s %10s\n", "flows", "sessions", "ns/new flow", "bytes/flow", "timers %");
+
+	size_t heap = heap_used();
+	uint32_t step = flow_count / 10 ? flow_count / 10 : flow_count;
+	while(opened < flow_count) {
+		uint32_t from = opened;
+		ramp_target = opened + step < flow_count ? opened + step : flow_count;
+
+		uint64_t loop = memory_loop_cycles();
+		uint64_t cycles = memory_cycles();
+		uint64_t start = memory_ns();
+		memory_run(false);
+		uint64_t ns = memory_ns() - start;
+		cycles = memory_cycles() - cycles;
+		loop = memory_loop_cycles() - loop;
+
+		printf("  %10u %10u %12.1f %12.1f %9.1f%%\n", opened, session_count(), (double)ns / (opened - from),
+				(double)(heap_used() - heap) / session_count(), loop * 100.0 / cycles);
+	}
+}
+
+static void steady_run(uint64_t seconds) {
+	memory_reset();
+	bzero(ended, sizeof(ended));
+	started = 0;
+
+	uint64_t packets = sequence;
+	uint64_t loop = memory_loop_cycles();
+	uint64_t cycles = memory_cycles();
+	started_ns = now = memory_ns();
+	deadline = started_ns + seconds * 1000000000ULL;
+	steady = true;
+	memory_run(false);
+	steady = false;
+	uint64_t ns = memory_ns() - started_ns;
+	cycles = memory_cycles() - cycles;
+	loop = memory_loop_cycles() - loop;
+
+	uint64_t total = 0;
+	for(int i = 0; i < ni_count(); i++) {
+		LoadBalancerCore counters;
+		lb_sum(i, &counters);
+		for(int j = 0; j < LB_CLASS_COUNT; j++)
+			total += counters.classes[j];
+	}
+
+	printf("steady %.2f s: %lu client packets, %lu with answers\n", ns / 1e9, sequence - packets, total);
+	printf("  %8.3f Mpps\n", total * 1000.0 / ns);
+	printf("  %8.0f new flows/s\n", started * 1e9 / ns);
+	printf("  ended   %lu FIN, %lu RST, %lu idle\n", ended[END_FIN], ended[END_RST], ended[END_IDLE]);
+	printf("  flows   %u open, %u sessions (RST and idle flows hold theirs until timeout)\n",
+			flow_count - free_count - (closing_tail - closing_head), session_count());
+	printf("  timers  %.1f cycles/packet in lb_loop, %.1f%% of the run\n", (double)loop / total, loop * 100.0 / cycles);
+}
+
+static void latency(double ns_per_cycle) {
+	uint32_t* lookups = malloc(sizeof(uint32_t) * SAMPLE_COUNT);
+	uint32_t* timers = malloc(sizeof(uint32_t) * SAMPLE_COUNT);
+	uint32_t* packets = malloc(sizeof(uint32_t) * SAMPLE_COUNT);
+	uint32_t lookup_count = 0;
+	uint32_t timer_count = 0;
+	uint32_t packet_count = 0;
+
+	//Lookup and recharge of random open flows, as the datapath does them
+	for(uint32_t i = 0; i < SAMPLE_COUNT * 4 && lookup_count < SAMPLE_COUNT; i++) {
+		Flow* flow = &flows[random64() % flow_count];
+		if(flow->state != FLOW_OPEN)
+			continue;
+
+		Endpoint client = { .ni = ni_get(0), .ni_num = 0, .protocol = flow->protocol,
+			.addr = 0xc0a80001 + flow->tuple % CLIENT_COUNT, .port = 1024 + flow->tuple / CLIENT_COUNT };
+		Endpoint service = { .ni = ni_get(0), .ni_num = 0, .protocol = flow->protocol,
+			.addr = VIP, .port = flow->protocol == IP_PROTOCOL_TCP ? 80 : 53 };
+
+		uint64_t start = memory_cycles();
+		Session* session = service_get_session(&client, &service);
+		uint64_t middle = memory_cycles();
+		lookups[lookup_count++] = middle - start;
+		if(!session)
+			continue;
+
+		session_recharge(session);
+		timers[timer_count++] = memory_cycles() - middle;
+	}
+
+	//Whole packets, one at a time, answers included
+	NetworkInterface* client_ni = ni_get(0);
+	NetworkInterface* server_ni = ni_get(1);
+	now = memory_ns();
+	deadline = UINT64_MAX;
+	steady = true;
+	while(packet_count < SAMPLE_COUNT) {
+		NetworkInterface* ni = ni_has_input(server_ni) ? server_ni : client_ni;
+		if(!ni_has_input(ni))
+			break;
+
+		Packet* packet = ni_input(ni);
+		int ni_num = ni == client_ni ? 0 : 1;
+
+		uint64_t start = memory_cycles();
+		if(!lb_process(packet, ni_num))
+			ni_free(packet);
+		packets[packet_count++] = memory_cycles() - start;
+
+		if((packet_count & (LB_BURST - 1)) == 0)
+			lb_loop();
+	}
+	steady = false;
+	memory_run(false);
+
+	printf("latency\n");
+	percentiles("lookup", lookups, lookup_count, ns_per_cycle);
+	percentiles("recharge", timers, timer_count, ns_per_cycle);
+	percentiles("packet", packets, packet_count, ns_per_cycle);
+
+	free(lookups);
+	free(timers);
+	free(packets);
+}
+
+/* Sessions per active server of every service */
+static Server* balance() {
+	Server* busiest = NULL;
+	size_t busiest_count = 0;
+
+	printf("balance (sessions per server)\n");
+	Map* services = ni_config_get(ni_get(0), SERVICES);
+	if(!services)
+		return NULL;
+
+	MapIterator iter;
+	map_iterator_init(&iter, services);
+	while(map_iterator_has_next(&iter)) {
+		MapEntry* entry = map_iterator_next(&iter);
+		Service* service = entry->data;
+
+		size_t min = SIZE_MAX;
+		size_t max = 0;
+		size_t total = 0;
+		int count = 0;
+		ListIterator servers;
+		list_iterator_init(&servers, service->active_servers);
+		while(list_iterator_has_next(&servers)) {
+			Server* server = list_iterator_next(&servers);
+			size_t size = server->sessions ? map_size(server->sessions) : 0;
+			if(size < min)
+				min = size;
+			if(size > max)
+				max = size;
+			total += size;
+			count++;
+
+			if(size > busiest_count) {
+				busiest = server;
+				busiest_count = size;
+			}
+		}
+
+		if(!count)
+			continue;
+
+		uint32_t addr = service->endpoint.addr;
+		printf("  %d.%d.%d.%d:%-5d %s  %d servers  min %zu  max %zu  max/mean %.3f\n", addr >> 24, (addr >> 16) & 0xff,
+				(addr >> 8) & 0xff, addr & 0xff, service->endpoint.port,
+				service->endpoint.protocol == IP_PROTOCOL_TCP ? "TCP" : "UDP", count, min, max,
+				total ? (double)max * count / total : 0);
+	}
+
+	return busiest;
+}
+
+static void remove_force(Server* server, uint64_t seconds) {
+	if(!server)
+		return;
+
+	size_t count = map_size(server->sessions);
+	uint32_t before = session_count();
+	uint32_t addr = server->endpoint.addr;
+	uint16_t port = server->endpoint.port;
+
+	uint64_t start = memory_ns();
+	bool result = server_remove_force(server);
+	uint64_t ns = memory_ns() - start;
+
+	printf("server_remove_force %d.%d.%d.%d:%d: %s, %zu sessions in %.2f ms (%.0f ns each), %u -> %u sessions\n",
+			addr >> 24, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff, port,
+			result ? "ok" : "failed", count, ns / 1e6, count ? (double)ns / count : 0, before, session_count());
+
+	//Flows of the removed server now miss their session
+	steady_run(seconds);
+}
+
+static bool parse_size(char* arg) {
+	char* colon = strchr(arg, ':');
+	if(!colon)
+		return false;
+
+	*colon = '\0';
+	size_mean = atof(colon + 1);
+	if(!strcmp(arg, "fixed"))
+		size_kind = SIZE_FIXED;
+	else if(!strcmp(arg, "exp"))
+		size_kind = SIZE_EXP;
+	else if(!strcmp(arg, "pareto"))
+		size_kind = SIZE_PARETO;
+	else
+		return false;
+
+	return size_mean >= 1;
+}
+
+static void usage(char* name) {
+	printf("Usage: %s [-f script] [-n flows] [-s size] [-u percent] [-e fin,rst,idle] [-r flows/s] [-t seconds]\n", name);
+	printf("\t-f script\tConfiguration commands (default: DNAT TCP :80 and UDP :53 on 10.0.0.100)\n");
+	printf("\t-n flows\tConcurrent flows, 1000 ~ 10000000 (default 100000)\n");
+	printf("\t-s size\t\tPackets per flow: fixed:N, exp:MEAN or pareto:MEAN (default exp:10)\n");
+	printf("\t-u percent\tUDP flows (default 20)\n");
+	printf("\t-e fin,rst,idle\tHow TCP flows end, weights (default 80,10,10)\n");
+	printf("\t-r flows/s\tCap of new flows per second (default none)\n");
+	printf("\t-t seconds\tSteady run (default 5)\n");
+}
+
+int main(int argc, char** argv) {
+	char* script = NULL;
+	uint64_t seconds = 5;
+	flow_count = 100000;
+
+	int opt;
+	while((opt = getopt(argc, argv, "f:n:s:u:e:r:t:h")) != -1) {
+		switch(opt) {
+			case 'f':
+				script = optarg;
+				break;
+			case 'n':
+				flow_count = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				if(!parse_size(optarg)) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'u':
+				udp_percent = strtoul(optarg, NULL, 0);
+				break;
+			case 'e':
+				if(sscanf(optarg, "%u,%u,%u", &ends[END_FIN], &ends[END_RST], &ends[END_IDLE]) != 3 ||
+						!(ends[END_FIN] + ends[END_RST] + ends[END_IDLE])) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'r':
+				rate = strtoull(optarg, NULL, 0);
+				break;
+			case 't':
+				seconds = strtoull(optarg, NULL, 0);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if(flow_count < 1 || flow_count > CLIENT_COUNT * PORT_COUNT / 2 || udp_percent > 100 || !seconds) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	flows = calloc(flow_count, sizeof(Flow));
+	frees = malloc(sizeof(uint32_t) * flow_count);
+	closing = malloc(sizeof(uint32_t) * flow_count);
+	closing_sequence = malloc(sizeof(uint64_t) * flow_count);
+	if(!flows || !frees || !closing || !closing_sequence) {
+		printf("Can'nt allocate %u flows\n", flow_count);
+		return 1;
+	}
+
+	if(!memory_init(script, default_script))
+		return 1;
+
+	memory_source(scale_source);
+	memory_answer(scale_answer);
+	memory_arp_seed_servers();
+	for(uint32_t i = 0; i < CLIENT_COUNT; i++)
+		memory_arp_seed(0, 0xc0a80001 + i);
+
+	uint64_t cycles = memory_cycles();
+	uint64_t start = memory_ns();
+
+	ramp();
+	steady_run(seconds);
+
+	double ns_per_cycle = (double)(memory_ns() - start) / (memory_cycles() - cycles);
+	latency(ns_per_cycle);
+
+	remove_force(balance(), seconds < 2 ? seconds : 2);
+	balance();
+
+	return 0;
+}
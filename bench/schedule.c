@@ -0,0 +1,335 @@
+/*
+ * Scheduler benchmark (hosted): every function of src/schedule.c on one
+ * UDP service of 2, 16, 256 and 4096 DNAT servers, weights 1 ~ 4.
+ *
+ *   make bench && ./bench/schedule [-c clients] [-s rr,r,l,h,w,ch]
+ *
+ * For each scheduler and server count it prints:
+ *   ns/pick	service->next() alone, clients in a fixed random order
+ *   max/mean	sessions of the busiest server over the mean, after real
+ *		sessions came and went (w: over the weighted share)
+ *   cv		stddev / mean of the same
+ *   remove	clients that changed server when one server left (ideal 1/n)
+ *   add	clients that changed server when it came back (ideal 1/n)
+ *   same	clients picking the same server when the run is replayed
+ *
+ * l picks by load, not by client: without sessions it always picks the
+ * first server, so remove, add and same say nothing of it and read n/a.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <math.h>
+#include <unistd.h>
+#include <util/map.h>
+#include <util/list.h>
+#include <util/cmd.h>
+#include <net/ni.h>
+#include <net/ip.h>
+
+#include "loadbalancer.h"
+#include "service.h"
+#include "server.h"
+#include "schedule.h"
+#include "memory.h"
+
+#define SERVER_MAX	4096
+#define SERVICE_ADDR	0x0a000064	//10.0.0.100:53
+#define SERVICE_PORT	53
+#define PICK_CYCLES	(1 << 26)	//Cap of servers * picks per timing
+#define REPLAY_COUNT	65536		//Clients of the disruption runs
+
+typedef struct _Scheduler {
+	char*	name;
+	uint8_t	schedule;
+	bool	enabled;
+	bool	by_client;	//Disruption columns mean something
+} Scheduler;
+
+static Scheduler schedulers[] = {
+	{ "rr", SCHEDULE_ROUND_ROBIN, true, true },
+	{ "r", SCHEDULE_RANDOM, true, true },
+	{ "l", SCHEDULE_LEAST, true, false },
+	{ "h", SCHEDULE_SOURCE_IP_HASH, true, true },
+	{ "w", SCHEDULE_WEIGHTED_ROUND_ROBIN, true, true },
+	{ "ch", SCHEDULE_CONSISTENT_HASH, true, true },
+};
+
+#define SCHEDULER_COUNT	(sizeof(schedulers) / sizeof(Scheduler))
+
+static uint32_t server_counts[] = { 2, 16, 256, SERVER_MAX };
+
+static Service* service;
+static Endpoint* clients;
+static uint32_t client_count = 1 << 20;
+static uint32_t server_count;
+static uint32_t* picks;		//Server address per client
+static uint32_t* replays;
+static uint64_t seed = 0x9e3779b97f4a7c15;
+
+static uint64_t random64() {
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	return seed;
+}
+
+/* 10.1.0.2 ~, 250 per /24 */
+static uint32_t server_addr(uint32_t index) {
+	return 0x0a010000 | (index / 250) << 8 | (index % 250 + 2);
+}
+
+static uint8_t server_weight(uint32_t index) {
+	return index % 4 + 1;
+}
+
+static bool command(char* format, ...) {
+	char line[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	return cmd_exec(line, NULL) == 0;
+}
+
+static bool server_add(uint32_t index) {
+	uint32_t addr = server_addr(index);
+
+	return command("server add -u %d.%d.%d.%d:53 1 -m dnat -w %d", addr >> 24, (addr >> 16) & 0xff,
+			(addr >> 8) & 0xff, addr & 0xff, server_weight(index));
+}
+
+static Server* server_find(uint32_t index) {
+	Endpoint endpoint = { .ni = ni_get(1), .ni_num = 1, .protocol = IP_PROTOCOL_UDP,
+		.addr = server_addr(index), .port = SERVICE_PORT };
+
+	return server_get(&endpoint);
+}
+
+/* Fresh scheduler state: round robin counters, Maglev generations */
+static void schedule_reset(uint8_t schedule) {
+	service_set_schedule(service, schedule);
+}
+
+static double pick_ns(uint8_t schedule) {
+	schedule_reset(schedule);
+
+	uint32_t count = PICK_CYCLES / server_count;
+	if(count > (1 << 20))
+		count = 1 << 20;
+
+	Server* last = NULL;
+	uint64_t start = memory_ns();
+	for(uint32_t i = 0; i < count; i++) {
+		Server* server = service->next(service, &clients[i & (client_count - 1)]);
+		//Keep the call from being optimized away
+		if(server)
+			last = server;
+	}
+	uint64_t ns = memory_ns() - start;
+
+	return last ? (double)ns / count : 0;
+}
+
+/* Sessions come and go: concurrency stays at 16 per server */
+static void balance(uint8_t schedule, double* max_mean, double* cv) {
+	schedule_reset(schedule);
+
+	//Every client has one session at most
+	uint32_t concurrency = server_count * 16;
+	if(concurrency > client_count / 5)
+		concurrency = client_count / 5;
+
+	Session** sessions = calloc(concurrency, sizeof(Session*));
+	for(uint32_t i = 0; i < concurrency; i++)
+		sessions[i] = service_alloc_session(service, &clients[i], NULL);
+
+	//Each new client replaces a random one
+	uint32_t next = concurrency;
+	for(uint32_t i = 0; i < concurrency * 4; i++) {
+		uint32_t slot = random64() % concurrency;
+		if(sessions[slot])
+			service_free_session(sessions[slot]);
+
+		sessions[slot] = service_alloc_session(service, &clients[next++], NULL);
+	}
+
+	uint32_t whole_weight = 0;
+	uint32_t total = 0;
+	for(uint32_t i = 0; i < server_count; i++) {
+		Server* server = server_find(i);
+		whole_weight += server->weight;
+		total += server->sessions ? map_size(server->sessions) : 0;
+	}
+
+	//Load over the share the scheduler should give each server
+	double max = 0;
+	double sum = 0;
+	double square = 0;
+	for(uint32_t i = 0; i < server_count; i++) {
+		Server* server = server_find(i);
+		double share = schedule == SCHEDULE_WEIGHTED_ROUND_ROBIN ?
+				(double)total * server->weight / whole_weight : (double)total / server_count;
+		double load = (server->sessions ? map_size(server->sessions) : 0) / share;
+		if(load > max)
+			max = load;
+		sum += load;
+		square += load * load;
+	}
+
+	double mean = sum / server_count;
+	*max_mean = total ? max / mean : 0;
+	*cv = total ? sqrt(square / server_count - mean * mean) / mean : 0;
+
+	for(uint32_t i = 0; i < concurrency; i++)
+		if(sessions[i])
+			service_free_session(sessions[i]);
+	free(sessions);
+}
+
+static void pick_all(uint8_t schedule, uint32_t* result) {
+	schedule_reset(schedule);
+
+	for(uint32_t i = 0; i < REPLAY_COUNT; i++) {
+		Server* server = service->next(service, &clients[i]);
+		result[i] = server ? server->endpoint.addr : 0;
+	}
+}
+
+static double changed(uint32_t* a, uint32_t* b) {
+	uint32_t count = 0;
+	for(uint32_t i = 0; i < REPLAY_COUNT; i++)
+		if(a[i] != b[i])
+			count++;
+
+	return (double)count / REPLAY_COUNT;
+}
+
+/* The middle server leaves, then comes back at the end of the list */
+static void disruption(uint8_t schedule, double* removed, double* added, double* same) {
+	pick_all(schedule, picks);
+	pick_all(schedule, replays);
+	*same = 1 - changed(picks, replays);
+
+	uint32_t index = server_count / 2;
+	server_remove_force(server_find(index));
+	pick_all(schedule, replays);
+	*removed = changed(picks, replays);
+
+	uint32_t* before = picks;
+	picks = replays;
+	replays = before;
+
+	server_add(index);
+	pick_all(schedule, replays);
+	*added = changed(picks, replays);
+}
+
+static bool parse_schedulers(char* arg) {
+	for(int i = 0; i < SCHEDULER_COUNT; i++)
+		schedulers[i].enabled = false;
+
+	for(char* name = strtok(arg, ","); name; name = strtok(NULL, ",")) {
+		int i;
+		for(i = 0; i < SCHEDULER_COUNT; i++) {
+			if(!strcmp(schedulers[i].name, name)) {
+				schedulers[i].enabled = true;
+				break;
+			}
+		}
+
+		if(i == SCHEDULER_COUNT)
+			return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while((opt = getopt(argc, argv, "c:s:h")) != -1) {
+		switch(opt) {
+			case 'c':
+				client_count = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				if(!parse_schedulers(optarg)) {
+					printf("Wrong scheduler: %s\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				printf("Usage: %s [-c clients] [-s rr,r,l,h,w,ch]\n", argv[0]);
+				printf("\t-c clients\tDistinct clients, power of 2 (default 1048576)\n");
+				printf("\t-s schedulers\tSchedulers to run (default all)\n");
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if(client_count < REPLAY_COUNT || client_count & (client_count - 1)) {
+		printf("Clients must be a power of 2, %d at least\n", REPLAY_COUNT);
+		return 1;
+	}
+
+	char* commands[] = {
+		"service add -u 10.0.0.100:53 0 -s rr -out 10.1.255.254 1",
+		NULL
+	};
+	if(!memory_init(NULL, commands))
+		return 1;
+
+	Endpoint service_endpoint = { .ni = ni_get(0), .ni_num = 0, .protocol = IP_PROTOCOL_UDP,
+		.addr = SERVICE_ADDR, .port = SERVICE_PORT };
+	service = service_get(&service_endpoint);
+	if(!service) {
+		printf("Can'nt add service\n");
+		return 1;
+	}
+
+	clients = malloc(sizeof(Endpoint) * client_count);
+	picks = malloc(sizeof(uint32_t) * REPLAY_COUNT);
+	replays = malloc(sizeof(uint32_t) * REPLAY_COUNT);
+	for(uint32_t i = 0; i < client_count; i++) {
+		uint64_t random = random64();
+		clients[i] = (Endpoint){ .ni = ni_get(0), .ni_num = 0, .protocol = IP_PROTOCOL_UDP,
+			.addr = 0xc0000000 | (random & 0x3fffffff), .port = 1024 + (random >> 32) % 64512 };
+	}
+
+	printf("%-4s %7s %10s %9s %7s %8s %8s %7s\n", "", "servers", "ns/pick", "max/mean", "cv", "remove", "add", "same");
+	for(int i = 0; i < sizeof(server_counts) / sizeof(uint32_t); i++) {
+		while(server_count < server_counts[i]) {
+			if(!server_add(server_count)) {
+				printf("Can'nt add server %u\n", server_count);
+				return 1;
+			}
+			server_count++;
+		}
+
+		for(int j = 0; j < SCHEDULER_COUNT; j++) {
+			Scheduler* scheduler = &schedulers[j];
+			if(!scheduler->enabled)
+				continue;
+
+			double ns = pick_ns(scheduler->schedule);
+			double max_mean, cv;
+			balance(scheduler->schedule, &max_mean, &cv);
+			printf("%-4s %7u %10.1f %9.3f %7.3f", scheduler->name, server_count, ns, max_mean, cv);
+			if(!scheduler->by_client) {
+				printf(" %8s %8s %7s\n", "n/a", "n/a", "n/a");
+				continue;
+			}
+
+			double removed, added, same;
+			disruption(scheduler->schedule, &removed, &added, &same);
+			printf(" %7.1f%% %7.1f%% %6.1f%%\n", removed * 100, added * 100, same * 100);
+		}
+		printf("%-4s %7s %10s %9s %7s %7.1f%% %7.1f%%\n", "", "", "", "", "ideal", 100.0 / server_count,
+				100.0 / server_count);
+	}
+
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * UDP load generator for the hosted drivers (Linux, needs CAP_NET_RAW).
+ * Sends 64 byte UDP frames to a VIP over AF_PACKET, flows spread over the
+ * source ports, and prints the rate it could send.
+ *
+ *   make bench && ./bench/udp_flood ifname dmac source vip:port [seconds] [flows]
+ *
+ * Count what reached the servers on their side, e.g. rx_packets of s0:
+ *   ip netns exec cl ./bench/udp_flood c0 <l0 mac> 10.0.0.1 10.0.0.100:7 10 1024
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#define FRAME_SIZE	(ETH_HLEN + 20 + 8 + 18)	//64 bytes on the wire without FCS
+#define BATCH		64
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint16_t checksum(void* data, int length) {
+	uint32_t sum = 0;
+	uint16_t* p = data;
+	for(; length > 1; length -= 2)
+		sum += *p++;
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+static void frame_build(uint8_t* frame, uint8_t* smac, uint8_t* dmac, uint32_t source, uint32_t destination, uint16_t source_port, uint16_t port) {
+	struct ethhdr* ether = (struct ethhdr*)frame;
+	memcpy(ether->h_dest, dmac, ETH_ALEN);
+	memcpy(ether->h_source, smac, ETH_ALEN);
+	ether->h_proto = htons(ETH_P_IP);
+
+	struct iphdr* ip = (struct iphdr*)(frame + ETH_HLEN);
+	bzero(ip, sizeof(*ip));
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->tot_len = htons(FRAME_SIZE - ETH_HLEN);
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->saddr = source;
+	ip->daddr = destination;
+	ip->check = checksum(ip, sizeof(*ip));
+
+	//UDP checksum 0: none
+	struct udphdr* udp = (struct udphdr*)(ip + 1);
+	udp->source = htons(source_port);
+	udp->dest = htons(port);
+	udp->len = htons(FRAME_SIZE - ETH_HLEN - sizeof(*ip));
+	udp->check = 0;
+}
+
+int main(int argc, char** argv) {
+	if(argc < 5) {
+		printf("Usage: %s ifname dmac source vip:port [seconds] [flows]\n", argv[0]);
+		return 1;
+	}
+
+	uint8_t dmac[ETH_ALEN];
+	if(sscanf(argv[2], "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &dmac[0], &dmac[1], &dmac[2], &dmac[3], &dmac[4], &dmac[5]) != 6) {
+		printf("Wrong MAC: %s\n", argv[2]);
+		return 1;
+	}
+
+	char* colon = strchr(argv[4], ':');
+	if(!colon) {
+		printf("Wrong VIP: %s\n", argv[4]);
+		return 1;
+	}
+	*colon = '\0';
+	uint16_t port = atoi(colon + 1);
+
+	struct in_addr source, destination;
+	if(!inet_aton(argv[3], &source) || !inet_aton(argv[4], &destination)) {
+		printf("Wrong address\n");
+		return 1;
+	}
+
+	int seconds = argc > 5 ? atoi(argv[5]) : 10;
+	int flows = argc > 6 ? atoi(argv[6]) : 1024;
+	if(flows < 1 || flows > 60000)
+		flows = 1024;
+
+	int fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if(fd < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	struct ifreq ifr;
+	bzero(&ifr, sizeof(ifr));
+	strncpy(ifr.ifr_name, argv[1], IF_NAMESIZE - 1);
+	if(ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	struct sockaddr_ll addr;
+	bzero(&addr, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_ifindex = if_nametoindex(argv[1]);
+	addr.sll_halen = ETH_ALEN;
+	memcpy(addr.sll_addr, dmac, ETH_ALEN);
+
+	//One frame per flow, built once
+	uint8_t* frames = calloc(flows, FRAME_SIZE);
+	for(int i = 0; i < flows; i++)
+		frame_build(frames + i * FRAME_SIZE, (uint8_t*)ifr.ifr_hwaddr.sa_data, dmac,
+				source.s_addr, destination.s_addr, 10000 + i, port);
+
+	struct mmsghdr messages[BATCH];
+	struct iovec iovs[BATCH];
+	bzero(messages, sizeof(messages));
+	for(int i = 0; i < BATCH; i++) {
+		iovs[i].iov_len = FRAME_SIZE;
+		messages[i].msg_hdr.msg_iov = &iovs[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+		messages[i].msg_hdr.msg_name = &addr;
+		messages[i].msg_hdr.msg_namelen = sizeof(addr);
+	}
+
+	uint64_t start = now_ns();
+	uint64_t end = start + (uint64_t)seconds * 1000000000ULL;
+	uint64_t sent = 0;
+	uint32_t flow = 0;
+	uint64_t now;
+	while((now = now_ns()) < end) {
+		for(int i = 0; i < BATCH; i++) {
+			iovs[i].iov_base = frames + flow * FRAME_SIZE;
+			flow = flow + 1 == flows ? 0 : flow + 1;
+		}
+
+		int count = sendmmsg(fd, messages, BATCH, 0);
+		if(count > 0)
+			sent += count;
+	}
+
+	double elapsed = (double)(now - start) / 1000000000.0;
+	printf("sent %lu packets in %.2f s: %.3f Mpps (%d flows)\n", sent, elapsed, sent / elapsed / 1000000.0, flows);
+
+	close(fd);
+	free(frames);
+
+	return 0;
+}
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/arp.h>
+
+#include "hosted.h"
+
+/*
+ * Neighbour table, one per NI. arp_get_mac() runs for every forwarded
+ * packet on every core, so lookups take no lock: each entry is a small
+ * seqlock and writers are serialized by the table lock.
+ */
+
+#define ARP_TABLE_SIZE		4096
+#define ARP_REQUEST_INTERVAL	1000000	//Micro seconds between requests for one address
+#define ARP_BROADCAST		0xffffffffffffUL
+
+typedef struct _ArpEntry {
+	uint32_t	sequence;
+	uint32_t	addr;
+	uint64_t	mac;		//0 while unresolved
+	uint64_t	requested;
+} ArpEntry;
+
+typedef struct _ArpTable {
+	pthread_spinlock_t	lock;
+	ArpEntry		entries[ARP_TABLE_SIZE];
+} ArpTable;
+
+void* arp_create() {
+	ArpTable* table = calloc(1, sizeof(ArpTable));
+	if(table)
+		pthread_spin_init(&table->lock, PTHREAD_PROCESS_PRIVATE);
+
+	return table;
+}
+
+static inline uint32_t arp_index(uint32_t addr) {
+	return (addr * 0x9e3779b1) >> (32 - 12);
+}
+
+/* Copy of the entry of addr, mac 0 when absent */
+static bool arp_read(ArpTable* table, uint32_t addr, ArpEntry* result) {
+	for(uint32_t i = 0; i < ARP_TABLE_SIZE; i++) {
+		ArpEntry* entry = &table->entries[(arp_index(addr) + i) & (ARP_TABLE_SIZE - 1)];
+		uint32_t sequence;
+		do {
+			sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+			result->addr = entry->addr;
+			result->mac = entry->mac;
+			result->requested = entry->requested;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while((sequence & 1) || sequence != __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED));
+
+		if(result->addr == addr)
+			return true;
+		if(result->addr == 0)
+			return false;
+	}
+
+	return false;
+}
+
+/* Called with the table lock held */
+static void arp_write(ArpTable* table, uint32_t addr, uint64_t mac, uint64_t requested) {
+	for(uint32_t i = 0; i < ARP_TABLE_SIZE; i++) {
+		ArpEntry* entry = &table->entries[(arp_index(addr) + i) & (ARP_TABLE_SIZE - 1)];
+		if(entry->addr != addr && entry->addr != 0)
+			continue;
+
+		__atomic_store_n(&entry->sequence, entry->sequence + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		entry->addr = addr;
+		if(mac)
+			entry->mac = mac;
+		if(requested)
+			entry->requested = requested;
+		__atomic_store_n(&entry->sequence, entry->sequence + 1, __ATOMIC_RELEASE);
+		return;
+	}
+}
+
+static void arp_update(NetworkInterface* ni, uint32_t addr, uint64_t mac) {
+	ArpTable* table = ((HostedNI*)ni)->arp;
+
+	pthread_spin_lock(&table->lock);
+	arp_write(table, addr, mac, 0);
+	pthread_spin_unlock(&table->lock);
+}
+
+static bool arp_request(NetworkInterface* ni, uint32_t destination, uint32_t source) {
+	Packet* packet = ni_alloc(ni, ETHER_LEN + ARP_LEN);
+	if(!packet)
+		return false;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->dmac = endian48(ARP_BROADCAST);
+	ether->smac = endian48(ni->mac);
+	ether->type = endian16(ETHER_TYPE_ARP);
+
+	ARP* arp = (ARP*)ether->payload;
+	arp->htype = endian16(1);
+	arp->ptype = endian16(ETHER_TYPE_IPv4);
+	arp->hlen = 6;
+	arp->plen = 4;
+	arp->operation = endian16(ARP_OPERATION_REQUEST);
+	arp->sha = endian48(ni->mac);
+	arp->spa = endian32(source);
+	arp->tha = 0;
+	arp->tpa = endian32(destination);
+
+	packet->end = packet->start + ETHER_LEN + ARP_LEN;
+
+	return ni_output(ni, packet);
+}
+
+uint64_t arp_get_mac(NetworkInterface* ni, uint32_t destination, uint32_t source) {
+	ArpTable* table = ((HostedNI*)ni)->arp;
+	ArpEntry entry;
+
+	if(arp_read(table, destination, &entry) && entry.mac)
+		return entry.mac;
+
+	//Unresolved: ask at most once per interval, broadcast meanwhile
+	uint64_t now = hosted_time();
+	if(now - entry.requested >= ARP_REQUEST_INTERVAL || entry.addr != destination) {
+		pthread_spin_lock(&table->lock);
+		arp_write(table, destination, 0, now);
+		pthread_spin_unlock(&table->lock);
+
+		arp_request(ni, destination, source);
+	}
+
+	return ARP_BROADCAST;
+}
+
+bool arp_process(Packet* packet) {
+	NetworkInterface* ni = packet->ni;
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ARP* arp = (ARP*)ether->payload;
+
+	if(packet->end - packet->start < ETHER_LEN + ARP_LEN || endian16(arp->ptype) != ETHER_TYPE_IPv4)
+		return false;
+
+	uint32_t spa = endian32(arp->spa);
+	uint32_t tpa = endian32(arp->tpa);
+	if(spa)
+		arp_update(ni, spa, endian48(arp->sha));
+
+	if(endian16(arp->operation) != ARP_OPERATION_REQUEST || !ni_ip_get(ni, tpa))
+		return false;
+
+	//Answer in place
+	ether->dmac = ether->smac;
+	ether->smac = endian48(ni->mac);
+
+	arp->operation = endian16(ARP_OPERATION_REPLY);
+	arp->tha = arp->sha;
+	arp->tpa = arp->spa;
+	arp->sha = endian48(ni->mac);
+	arp->spa = endian32(tpa);
+
+	return ni_output(ni, packet);
+}
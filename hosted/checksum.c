@@ -0,0 +1,16 @@
+#include <net/checksum.h>
+
+uint16_t checksum(void* data, uint32_t size) {
+	uint32_t sum = 0;
+	uint8_t* p = data;
+
+	for(; size > 1; size -= 2, p += 2)
+		sum += (uint16_t)p[0] << 8 | p[1];
+	if(size)
+		sum += (uint16_t)p[0] << 8;
+
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <string.h>
+#include <util/cmd.h>
+
+#define CMD_ARGC_MAX	64
+#define CMD_ARGC_PAD	4	//Commands read past argc on short input
+
+void cmd_init(void) {
+}
+
+int cmd_help(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	for(Command* command = commands; command->name; command++) {
+		printf("%s\t%s\n", command->name, command->desc);
+		if(command->args && command->args[0])
+			printf("\t%s\n", command->args);
+	}
+
+	return 0;
+}
+
+/*
+ * Split line on blanks and run the command. A positive return of the
+ * command is the index of the wrong argument.
+ */
+int cmd_exec(char* line, void(*callback)(char* result, int exit_status)) {
+	char* argv[CMD_ARGC_MAX + CMD_ARGC_PAD];
+	int argc = 0;
+
+	char* save;
+	for(char* token = strtok_r(line, " \t\r\n", &save); token && argc < CMD_ARGC_MAX; token = strtok_r(NULL, " \t\r\n", &save))
+		argv[argc++] = token;
+
+	if(argc == 0 || argv[0][0] == '#')
+		return 0;
+
+	for(Command* command = commands; command->name; command++) {
+		if(strcmp(command->name, argv[0]))
+			continue;
+
+		for(int i = argc; i < argc + CMD_ARGC_PAD; i++)
+			argv[i] = "";
+
+		int status = command->func(argc, argv, callback);
+		if(status > 0 && status < argc)
+			printf("Wrong argument: %s\n", argv[status]);
+		else if(status > 0)
+			printf("Wrong number of arguments\n");
+		else if(status < 0)
+			printf("Error: %d\n", status);
+
+		if(callback)
+			callback(NULL, status);
+
+		return status;
+	}
+
+	printf("Command not found: %s\n", argv[0]);
+
+	return CMD_STATUS_NOT_FOUND;
+}
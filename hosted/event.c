@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <thread.h>
+#include <util/event.h>
+
+#include "hosted.h"
+
+/*
+ * Timers are per thread, like PacketNgin's cores. A timer id carries its
+ * owner thread, so a session timer can be recharged from any core.
+ *
+ * event_timer_update() is called for every forwarded packet: it only moves
+ * the deadline. The heap keeps the old key and the timer is pushed back
+ * with its real deadline when the old key expires.
+ */
+
+#define ID_THREAD_SHIFT		56
+#define ID_GENERATION_SHIFT	24
+#define ID_SLOT_MASK		0xffffff
+
+typedef struct _Timer {
+	TimerEventFunc	func;
+	void*		context;
+	clock_t		delay;
+	clock_t		period;
+	uint64_t	expire;		//Real deadline
+	uint32_t	generation;
+	bool		active;
+	bool		queued;		//In the heap
+} Timer;
+
+typedef struct _HeapEntry {
+	uint64_t	key;
+	uint32_t	slot;
+} HeapEntry;
+
+typedef struct _BusyEvent {
+	EventFunc	func;
+	void*		context;
+	uint64_t	id;
+} BusyEvent;
+
+typedef struct _EventQueue {
+	pthread_spinlock_t	lock;
+	uint64_t		now;
+	int			thread;
+
+	Timer*			timers;
+	uint32_t		timer_capacity;
+	uint32_t*		free_slots;
+	uint32_t		free_count;
+
+	HeapEntry*		heap;
+	uint32_t		heap_count;
+
+	BusyEvent*		busies;
+	uint32_t		busy_count;
+	uint32_t		busy_capacity;
+	uint64_t		busy_id;
+} EventQueue;
+
+static EventQueue* queues[THREAD_MAX];
+
+static EventQueue* event_queue() {
+	int thread = thread_id();
+	EventQueue* queue = queues[thread];
+	if(queue)
+		return queue;
+
+	queue = calloc(1, sizeof(EventQueue));
+	if(!queue) {
+		printf("Can'nt allocate event queue\n");
+		exit(1);
+	}
+
+	pthread_spin_init(&queue->lock, PTHREAD_PROCESS_PRIVATE);
+	queue->thread = thread;
+	queue->now = hosted_time();
+	queues[thread] = queue;
+
+	return queue;
+}
+
+static EventQueue* event_owner(uint64_t id) {
+	int thread = (id >> ID_THREAD_SHIFT) - 1;
+	if(thread < 0 || thread >= THREAD_MAX)
+		return NULL;
+
+	return queues[thread];
+}
+
+static Timer* event_timer(EventQueue* queue, uint64_t id) {
+	uint32_t slot = id & ID_SLOT_MASK;
+	if(slot >= queue->timer_capacity)
+		return NULL;
+
+	Timer* timer = &queue->timers[slot];
+	if(!timer->active || timer->generation != (uint32_t)(id >> ID_GENERATION_SHIFT))
+		return NULL;
+
+	return timer;
+}
+
+static void heap_push(EventQueue* queue, uint64_t key, uint32_t slot) {
+	uint32_t i = queue->heap_count++;
+	while(i > 0) {
+		uint32_t parent = (i - 1) / 2;
+		if(queue->heap[parent].key <= key)
+			break;
+
+		queue->heap[i] = queue->heap[parent];
+		i = parent;
+	}
+
+	queue->heap[i].key = key;
+	queue->heap[i].slot = slot;
+	queue->timers[slot].queued = true;
+}
+
+static uint32_t heap_pop(EventQueue* queue) {
+	uint32_t slot = queue->heap[0].slot;
+	HeapEntry last = queue->heap[--queue->heap_count];
+
+	uint32_t i = 0;
+	uint32_t count = queue->heap_count;
+	while(true) {
+		uint32_t child = i * 2 + 1;
+		if(child >= count)
+			break;
+		if(child + 1 < count && queue->heap[child + 1].key < queue->heap[child].key)
+			child++;
+		if(last.key <= queue->heap[child].key)
+			break;
+
+		queue->heap[i] = queue->heap[child];
+		i = child;
+	}
+	if(count)
+		queue->heap[i] = last;
+
+	queue->timers[slot].queued = false;
+
+	return slot;
+}
+
+static void slot_free(EventQueue* queue, uint32_t slot) {
+	queue->timers[slot].active = false;
+	queue->timers[slot].generation++;
+	queue->free_slots[queue->free_count++] = slot;
+}
+
+static bool slot_grow(EventQueue* queue) {
+	uint32_t capacity = queue->timer_capacity ? queue->timer_capacity * 2 : 1024;
+	if(capacity > ID_SLOT_MASK + 1)
+		return false;
+
+	Timer* timers = realloc(queue->timers, sizeof(Timer) * capacity);
+	if(!timers)
+		return false;
+	queue->timers = timers;
+
+	uint32_t* free_slots = realloc(queue->free_slots, sizeof(uint32_t) * capacity);
+	if(!free_slots)
+		return false;
+	queue->free_slots = free_slots;
+
+	HeapEntry* heap = realloc(queue->heap, sizeof(HeapEntry) * capacity);
+	if(!heap)
+		return false;
+	queue->heap = heap;
+
+	bzero(&timers[queue->timer_capacity], sizeof(Timer) * (capacity - queue->timer_capacity));
+	for(uint32_t slot = capacity; slot > queue->timer_capacity; slot--)
+		queue->free_slots[queue->free_count++] = slot - 1;
+	queue->timer_capacity = capacity;
+
+	return true;
+}
+
+void event_init() {
+	event_queue();
+}
+
+static void event_busy_run(EventQueue* queue) {
+	for(uint32_t i = 0; i < queue->busy_count;) {
+		BusyEvent* busy = &queue->busies[i];
+		if(busy->func(busy->context)) {
+			i++;
+			continue;
+		}
+
+		queue->busies[i] = queue->busies[--queue->busy_count];
+	}
+}
+
+void event_loop() {
+	EventQueue* queue = event_queue();
+
+	event_busy_run(queue);
+
+	pthread_spin_lock(&queue->lock);
+	uint64_t now = queue->now = hosted_time();
+
+	while(queue->heap_count && queue->heap[0].key <= now) {
+		uint32_t slot = heap_pop(queue);
+		Timer* timer = &queue->timers[slot];
+
+		if(!timer->active) {
+			slot_free(queue, slot);
+			continue;
+		}
+
+		//Recharged after it was queued
+		if(timer->expire > now) {
+			heap_push(queue, timer->expire, slot);
+			continue;
+		}
+
+		TimerEventFunc func = timer->func;
+		void* context = timer->context;
+		uint32_t generation = timer->generation;
+
+		pthread_spin_unlock(&queue->lock);
+		bool keep = func(context);
+		pthread_spin_lock(&queue->lock);
+
+		//Timers may be reallocated or removed by func
+		timer = &queue->timers[slot];
+		if(!timer->active || timer->generation != generation)
+			continue;
+
+		if(keep && timer->period) {
+			if(timer->expire <= now)
+				timer->expire = now + timer->period;
+			heap_push(queue, timer->expire, slot);
+		} else {
+			slot_free(queue, slot);
+		}
+	}
+
+	pthread_spin_unlock(&queue->lock);
+}
+
+uint64_t event_busy_add(EventFunc func, void* context) {
+	EventQueue* queue = event_queue();
+
+	if(queue->busy_count == queue->busy_capacity) {
+		uint32_t capacity = queue->busy_capacity ? queue->busy_capacity * 2 : 8;
+		BusyEvent* busies = realloc(queue->busies, sizeof(BusyEvent) * capacity);
+		if(!busies)
+			return 0;
+
+		queue->busies = busies;
+		queue->busy_capacity = capacity;
+	}
+
+	BusyEvent* busy = &queue->busies[queue->busy_count++];
+	busy->func = func;
+	busy->context = context;
+	busy->id = (uint64_t)(queue->thread + 1) << ID_THREAD_SHIFT | ++queue->busy_id;
+
+	return busy->id;
+}
+
+bool event_busy_remove(uint64_t id) {
+	EventQueue* queue = event_owner(id);
+	if(!queue)
+		return false;
+
+	for(uint32_t i = 0; i < queue->busy_count; i++) {
+		if(queue->busies[i].id == id) {
+			queue->busies[i] = queue->busies[--queue->busy_count];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+uint64_t event_timer_add(TimerEventFunc func, void* context, clock_t delay, clock_t period) {
+	EventQueue* queue = event_queue();
+
+	pthread_spin_lock(&queue->lock);
+	if(!queue->free_count && !slot_grow(queue)) {
+		pthread_spin_unlock(&queue->lock);
+		return 0;
+	}
+
+	uint32_t slot = queue->free_slots[--queue->free_count];
+	Timer* timer = &queue->timers[slot];
+	timer->func = func;
+	timer->context = context;
+	timer->delay = delay;
+	timer->period = period;
+	timer->expire = queue->now + delay;
+	timer->active = true;
+	heap_push(queue, timer->expire, slot);
+
+	uint64_t id = (uint64_t)(queue->thread + 1) << ID_THREAD_SHIFT |
+		(uint64_t)timer->generation << ID_GENERATION_SHIFT | slot;
+	pthread_spin_unlock(&queue->lock);
+
+	return id;
+}
+
+/* Restart the timer: it expires delay micro seconds from now */
+bool event_timer_update(uint64_t id) {
+	EventQueue* queue = event_owner(id);
+	if(!queue)
+		return false;
+
+	pthread_spin_lock(&queue->lock);
+	Timer* timer = event_timer(queue, id);
+	if(timer)
+		timer->expire = queue->now + timer->delay;
+	pthread_spin_unlock(&queue->lock);
+
+	return timer != NULL;
+}
+
+bool event_timer_remove(uint64_t id) {
+	EventQueue* queue = event_owner(id);
+	if(!queue)
+		return false;
+
+	pthread_spin_lock(&queue->lock);
+	Timer* timer = event_timer(queue, id);
+	if(timer) {
+		uint32_t slot = id & ID_SLOT_MASK;
+		//Queued slots are reclaimed when they reach the heap top
+		if(timer->queued) {
+			timer->active = false;
+			timer->generation++;
+		} else {
+			slot_free(queue, slot);
+		}
+	}
+	pthread_spin_unlock(&queue->lock);
+
+	return timer != NULL;
+}
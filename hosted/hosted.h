@@ -0,0 +1,65 @@
+#ifndef __HOSTED_H__
+#define __HOSTED_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/if.h>
+#include <net/ni.h>
+#include <net/packet.h>
+
+/*
+ * Hosted runtime: the PacketNgin surface (ni_*, map, list, event, cmd, ...)
+ * on Linux, so that src/ builds unchanged as a normal process. Packet I/O
+ * goes through one Driver, chosen at link time.
+ */
+
+#define THREAD_MAX	64
+#define PORT_FIRST	49152	//First ephemeral port
+
+/* Packet I/O backend. Queue state is per thread: thread i owns queue i */
+typedef struct _Driver {
+	char*	name;
+
+	/* Called once from the main thread before any core starts */
+	bool	(*open)(NetworkInterface* ni, char* ifname, int queue_count, char* option);
+	/* Called on every core before it enters the application */
+	bool	(*attach)(NetworkInterface* ni, int queue);
+	void	(*close)(NetworkInterface* ni);
+
+	Packet*	(*alloc)(NetworkInterface* ni, uint16_t size);
+	void	(*free)(Packet* packet);
+	bool	(*has_input)(NetworkInterface* ni);
+	Packet*	(*input)(NetworkInterface* ni);
+	bool	(*output)(NetworkInterface* ni, Packet* packet);
+} Driver;
+
+/* Defined by the linked backend */
+extern Driver* hosted_driver;
+
+/* NetworkInterface is the first member: NetworkInterface* casts to HostedNI* */
+typedef struct _HostedNI {
+	NetworkInterface	ni;
+	NIC			nic;
+	int			index;
+	char			name[IF_NAMESIZE];
+	void*			arp;
+} HostedNI;
+
+/* Register ifname as the next NI and open it with the driver */
+NetworkInterface* hosted_ni_add(char* ifname, int queue_count, char* option);
+void hosted_ni_close();
+bool hosted_ni_mac(char* ifname, uint64_t* mac);
+
+/* Before the cores start, then on every core */
+void hosted_thread_setup(int count);
+void hosted_thread_init(int id);
+
+/* Commands of script run before stdin */
+bool hosted_readline_open(char* script);
+
+/* Monotonic clock in micro seconds */
+uint64_t hosted_time();
+
+void* arp_create();
+
+#endif /*__HOSTED_H__*/
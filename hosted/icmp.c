@@ -0,0 +1,36 @@
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/ip.h>
+#include <net/icmp.h>
+#include <net/checksum.h>
+
+bool icmp_process(Packet* packet) {
+	NetworkInterface* ni = packet->ni;
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	ICMP* icmp = (ICMP*)(ether->payload + ip->ihl * 4);
+	uint16_t length = endian16(ip->length);
+
+	if(icmp->type != ICMP_TYPE_ECHO_REQUEST || !ni_ip_get(ni, endian32(ip->destination)))
+		return false;
+
+	if(packet->start + ETHER_LEN + length > packet->end || length < ip->ihl * 4 + ICMP_LEN)
+		return false;
+
+	//Answer in place
+	ether->dmac = ether->smac;
+	ether->smac = endian48(ni->mac);
+
+	uint32_t source = ip->source;
+	ip->source = ip->destination;
+	ip->destination = source;
+	ip->ttl = 64;
+	ip->checksum = 0;
+	ip->checksum = endian16(checksum(ip, ip->ihl * 4));
+
+	icmp->type = ICMP_TYPE_ECHO_REPLY;
+	icmp->checksum = 0;
+	icmp->checksum = endian16(checksum(icmp, length - ip->ihl * 4));
+
+	return ni_output(ni, packet);
+}
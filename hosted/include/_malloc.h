@@ -0,0 +1,10 @@
+#ifndef ___MALLOC_H__
+#define ___MALLOC_H__
+
+#include <stddef.h>
+
+/* Pool allocator. Hosted: pools are only tags, memory comes from libc */
+void* __malloc(size_t size, void* pool);
+void __free(void* ptr, void* pool);
+
+#endif /*___MALLOC_H__*/
@@ -0,0 +1,9 @@
+#ifndef __GMALLOC_H__
+#define __GMALLOC_H__
+
+#include <stddef.h>
+
+void* gmalloc(size_t size);
+void gfree(void* ptr);
+
+#endif /*__GMALLOC_H__*/
@@ -0,0 +1,31 @@
+#ifndef __NET_ARP_H__
+#define __NET_ARP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+
+#define ARP_LEN			28
+
+#define ARP_OPERATION_REQUEST	1
+#define ARP_OPERATION_REPLY	2
+
+typedef struct _ARP {
+	uint16_t	htype;
+	uint16_t	ptype;
+	uint8_t		hlen;
+	uint8_t		plen;
+	uint16_t	operation;
+	uint64_t	sha: 48;
+	uint32_t	spa;
+	uint64_t	tha: 48;
+	uint32_t	tpa;
+} __attribute__ ((packed)) ARP;
+
+/* Answers requests for the NI's addresses and learns senders */
+bool arp_process(Packet* packet);
+
+/* MAC of destination, 0xffffffffffff while it is being resolved from source */
+uint64_t arp_get_mac(NetworkInterface* ni, uint32_t destination, uint32_t source);
+
+#endif /*__NET_ARP_H__*/
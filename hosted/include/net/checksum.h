@@ -0,0 +1,9 @@
+#ifndef __NET_CHECKSUM_H__
+#define __NET_CHECKSUM_H__
+
+#include <stdint.h>
+
+/* Internet checksum of data in host byte order */
+uint16_t checksum(void* data, uint32_t size);
+
+#endif /*__NET_CHECKSUM_H__*/
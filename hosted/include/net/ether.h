@@ -0,0 +1,20 @@
+#ifndef __NET_ETHER_H__
+#define __NET_ETHER_H__
+
+#include <stdint.h>
+#include <util/types.h>
+
+#define ETHER_LEN	14
+
+#define ETHER_TYPE_IPv4	0x0800
+#define ETHER_TYPE_ARP	0x0806
+#define ETHER_TYPE_IPv6	0x86dd
+
+typedef struct _Ether {
+	uint64_t	dmac: 48;
+	uint64_t	smac: 48;
+	uint16_t	type;
+	uint8_t		payload[0];
+} __attribute__ ((packed)) Ether;
+
+#endif /*__NET_ETHER_H__*/
@@ -0,0 +1,25 @@
+#ifndef __NET_ICMP_H__
+#define __NET_ICMP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/packet.h>
+
+#define ICMP_LEN		8
+
+#define ICMP_TYPE_ECHO_REPLY	0
+#define ICMP_TYPE_ECHO_REQUEST	8
+
+typedef struct _ICMP {
+	uint8_t		type;
+	uint8_t		code;
+	uint16_t	checksum;
+	uint16_t	id;
+	uint16_t	seq;
+	uint8_t		body[0];
+} __attribute__ ((packed)) ICMP;
+
+/* Answers echo requests for the NI's addresses */
+bool icmp_process(Packet* packet);
+
+#endif /*__NET_ICMP_H__*/
@@ -0,0 +1,18 @@
+#ifndef __NET_INTERFACE_H__
+#define __NET_INTERFACE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <util/set.h>
+
+struct _IPv4Interface {
+	uint32_t	gateway;
+	uint32_t	netmask;
+	bool		_default;
+	Set*		tcp_ports;
+	Set*		udp_ports;
+	uint16_t	tcp_next_port;
+	uint16_t	udp_next_port;
+};
+
+#endif /*__NET_INTERFACE_H__*/
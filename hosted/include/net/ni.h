@@ -0,0 +1,53 @@
+#ifndef __NET_NI_H__
+#define __NET_NI_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/packet.h>
+#include <util/map.h>
+#include <util/list.h>
+
+#define NI_MAX_COUNT	16
+
+typedef struct _IPv4Interface IPv4Interface;
+
+typedef struct _NetworkInterface {
+	uint64_t	mac;
+	uint64_t	input_bandwidth;
+	uint64_t	output_bandwidth;
+	uint64_t	input_packets;
+	uint64_t	output_packets;
+	uint64_t	input_drop_packets;
+	uint64_t	output_drop_packets;
+	void*		pool;
+	Map*		config;
+	Map*		ip_interfaces;
+	void*		priv;
+} NetworkInterface;
+
+typedef struct _NIC {
+	NetworkInterface*	ni;
+	void*			pool;
+	uint64_t		mac;
+} NIC;
+
+int ni_count();
+NetworkInterface* ni_get(int index);
+NIC* nic_get(int index);
+
+Packet* ni_alloc(NetworkInterface* ni, uint16_t size);
+void ni_free(Packet* packet);
+bool ni_has_input(NetworkInterface* ni);
+Packet* ni_input(NetworkInterface* ni);
+bool ni_output(NetworkInterface* ni, Packet* packet);
+bool ni_output_available(NetworkInterface* ni);
+
+bool ni_ip_add(NetworkInterface* ni, uint32_t addr);
+IPv4Interface* ni_ip_get(NetworkInterface* ni, uint32_t addr);
+bool ni_ip_remove(NetworkInterface* ni, uint32_t addr);
+
+bool ni_config_put(NetworkInterface* ni, char* key, void* data);
+void* ni_config_get(NetworkInterface* ni, char* key);
+void* ni_config_remove(NetworkInterface* ni, char* key);
+
+#endif /*__NET_NI_H__*/
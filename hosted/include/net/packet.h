@@ -0,0 +1,18 @@
+#ifndef __NET_PACKET_H__
+#define __NET_PACKET_H__
+
+#include <stdint.h>
+
+struct _NetworkInterface;
+
+/* Frame data is buffer[start, end). buffer has size bytes */
+typedef struct _Packet {
+	struct _NetworkInterface*	ni;
+	uint64_t			time;
+	uint16_t			start;
+	uint16_t			end;
+	uint16_t			size;
+	uint8_t				buffer[0];
+} Packet;
+
+#endif /*__NET_PACKET_H__*/
@@ -0,0 +1,26 @@
+#ifndef __NET_UDP_H__
+#define __NET_UDP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/packet.h>
+#include <net/ni.h>
+
+#define UDP_LEN		8
+
+typedef struct _UDP {
+	uint16_t	source;
+	uint16_t	destination;
+	uint16_t	length;
+	uint16_t	checksum;
+	uint8_t		body[0];
+} __attribute__ ((packed)) UDP;
+
+bool udp_port_alloc0(NetworkInterface* ni, uint32_t addr, uint16_t port);
+uint16_t udp_port_alloc(NetworkInterface* ni, uint32_t addr);
+void udp_port_free(NetworkInterface* ni, uint32_t addr, uint16_t port);
+
+/* Checksum UDP and IP headers, udp_body_len bytes follow the UDP header */
+void udp_pack(Packet* packet, uint16_t udp_body_len);
+
+#endif /*__NET_UDP_H__*/
@@ -0,0 +1,7 @@
+#ifndef __READLINE_H__
+#define __READLINE_H__
+
+/* Non-blocking: NULL until a whole line is available */
+char* readline();
+
+#endif /*__READLINE_H__*/
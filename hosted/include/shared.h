@@ -0,0 +1,10 @@
+#ifndef __SHARED_H__
+#define __SHARED_H__
+
+#include <stddef.h>
+
+/* Memory other processes can map by name: /dev/shm/name, or name if it is a path */
+void* shared_map(char* name, size_t size);
+void shared_unmap(void* ptr, size_t size);
+
+#endif /*__SHARED_H__*/
@@ -0,0 +1,8 @@
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+int thread_id();
+int thread_count();
+void thread_barrior();
+
+#endif /*__THREAD_H__*/
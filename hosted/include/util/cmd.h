@@ -0,0 +1,25 @@
+#ifndef __UTIL_CMD_H__
+#define __UTIL_CMD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CMD_STATUS_WRONG_NUMBER	-1000
+#define CMD_STATUS_NOT_FOUND	-1001
+#define CMD_STATUS_ERROR	-1002
+
+typedef struct {
+	char*	name;
+	char*	desc;
+	char*	args;
+	int	(*func)(int argc, char** argv, void(*callback)(char* result, int exit_status));
+} Command;
+
+/* Defined by the application, terminated by a NULL name */
+extern Command commands[];
+
+void cmd_init(void);
+int cmd_help(int argc, char** argv, void(*callback)(char* result, int exit_status));
+int cmd_exec(char* line, void(*callback)(char* result, int exit_status));
+
+#endif /*__UTIL_CMD_H__*/
@@ -0,0 +1,23 @@
+#ifndef __UTIL_EVENT_H__
+#define __UTIL_EVENT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Return false to remove the event */
+typedef bool(*EventFunc)(void* context);
+typedef bool(*TimerEventFunc)(void* context);
+
+void event_init();
+void event_loop();
+
+uint64_t event_busy_add(EventFunc func, void* context);
+bool event_busy_remove(uint64_t id);
+
+/* delay and period are in micro seconds. period 0 fires once */
+uint64_t event_timer_add(TimerEventFunc func, void* context, clock_t delay, clock_t period);
+bool event_timer_update(uint64_t id);
+bool event_timer_remove(uint64_t id);
+
+#endif /*__UTIL_EVENT_H__*/
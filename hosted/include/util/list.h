@@ -0,0 +1,47 @@
+#ifndef __UTIL_LIST_H__
+#define __UTIL_LIST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct _ListEntry {
+	struct _ListEntry*	next;
+	struct _ListEntry*	prev;
+	void*			data;
+} ListEntry;
+
+typedef struct _List {
+	ListEntry*	head;
+	ListEntry*	tail;
+	size_t		size;
+	void*		pool;
+} List;
+
+typedef struct _ListIterator {
+	List*		list;
+	ListEntry*	prev;
+	ListEntry*	entry;
+} ListIterator;
+
+List* list_create(void* pool);
+void list_destroy(List* list);
+bool list_add(List* list, void* data);
+bool list_add_at(List* list, int index, void* data);
+void* list_get(List* list, int index);
+void* list_get_first(List* list);
+void* list_get_last(List* list);
+void* list_remove(List* list, int index);
+void* list_remove_first(List* list);
+void* list_remove_last(List* list);
+bool list_remove_data(List* list, void* data);
+int list_index_of(List* list, void* data, bool(*comp_fn)(void*, void*));
+int list_size(List* list);
+bool list_is_empty(List* list);
+
+void list_iterator_init(ListIterator* iter, List* list);
+bool list_iterator_has_next(ListIterator* iter);
+void* list_iterator_next(ListIterator* iter);
+void* list_iterator_remove(ListIterator* iter);
+
+#endif /*__UTIL_LIST_H__*/
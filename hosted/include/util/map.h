@@ -0,0 +1,57 @@
+#ifndef __UTIL_MAP_H__
+#define __UTIL_MAP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <util/list.h>
+
+typedef uint64_t(*MapHash)(void* key);
+typedef bool(*MapEquals)(void* key1, void* key2);
+
+typedef struct _MapEntry {
+	void*	key;
+	void*	data;
+} MapEntry;
+
+typedef struct _Map {
+	List**		table;
+	size_t		threshold;
+	size_t		capacity;
+	size_t		size;
+	MapHash		hash;
+	MapEquals	equals;
+	void*		pool;
+} Map;
+
+typedef struct _MapIterator {
+	Map*		map;
+	size_t		index;
+	ListIterator	list_iter;
+	MapEntry*	entry;
+} MapIterator;
+
+/* hash and equals default to map_uint64_hash and map_uint64_equals */
+Map* map_create(size_t initial_capacity, MapHash hash, MapEquals equals, void* pool);
+void map_destroy(Map* map);
+bool map_is_empty(Map* map);
+bool map_put(Map* map, void* key, void* data);
+bool map_update(Map* map, void* key, void* data);
+void* map_get(Map* map, void* key);
+void* map_get_key(Map* map, void* key);
+bool map_contains(Map* map, void* key);
+void* map_remove(Map* map, void* key);
+int map_capacity(Map* map);
+int map_size(Map* map);
+
+void map_iterator_init(MapIterator* iter, Map* map);
+bool map_iterator_has_next(MapIterator* iter);
+MapEntry* map_iterator_next(MapIterator* iter);
+MapEntry* map_iterator_remove(MapIterator* iter);
+
+uint64_t map_uint64_hash(void* key);
+bool map_uint64_equals(void* key1, void* key2);
+uint64_t map_string_hash(void* key);
+bool map_string_equals(void* key1, void* key2);
+
+#endif /*__UTIL_MAP_H__*/
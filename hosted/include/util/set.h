@@ -0,0 +1,16 @@
+#ifndef __UTIL_SET_H__
+#define __UTIL_SET_H__
+
+#include <util/map.h>
+
+typedef Map Set;
+
+Set* set_create(size_t initial_capacity, MapHash hash, MapEquals equals, void* pool);
+void set_destroy(Set* set);
+bool set_is_empty(Set* set);
+bool set_put(Set* set, void* key);
+bool set_contains(Set* set, void* key);
+bool set_remove(Set* set, void* key);
+size_t set_size(Set* set);
+
+#endif /*__UTIL_SET_H__*/
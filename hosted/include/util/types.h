@@ -0,0 +1,25 @@
+#ifndef __UTIL_TYPES_H__
+#define __UTIL_TYPES_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define endian8(v)	(v)
+#define endian16(v)	__builtin_bswap16((v))
+#define endian32(v)	__builtin_bswap32((v))
+#define endian64(v)	__builtin_bswap64((v))
+#define endian48(v)	(__builtin_bswap64((uint64_t)(v)) >> 16)
+
+bool is_uint8(const char* val);
+bool is_uint16(const char* val);
+bool is_uint32(const char* val);
+bool is_uint64(const char* val);
+
+uint8_t parse_uint8(const char* val);
+uint16_t parse_uint16(const char* val);
+uint32_t parse_uint32(const char* val);
+uint64_t parse_uint64(const char* val);
+
+#endif /*__UTIL_TYPES_H__*/
@@ -0,0 +1,193 @@
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+#include <util/list.h>
+
+List* list_create(void* pool) {
+	List* list = __malloc(sizeof(List), pool);
+	if(!list)
+		return NULL;
+
+	list->head = NULL;
+	list->tail = NULL;
+	list->size = 0;
+	list->pool = pool;
+
+	return list;
+}
+
+void list_destroy(List* list) {
+	ListEntry* entry = list->head;
+	while(entry) {
+		ListEntry* next = entry->next;
+		__free(entry, list->pool);
+		entry = next;
+	}
+
+	__free(list, list->pool);
+}
+
+static ListEntry* list_entry(List* list, int index) {
+	if(index < 0 || index >= list->size)
+		return NULL;
+
+	ListEntry* entry = list->head;
+	for(int i = 0; i < index; i++)
+		entry = entry->next;
+
+	return entry;
+}
+
+static void* list_unlink(List* list, ListEntry* entry) {
+	if(entry->prev)
+		entry->prev->next = entry->next;
+	else
+		list->head = entry->next;
+
+	if(entry->next)
+		entry->next->prev = entry->prev;
+	else
+		list->tail = entry->prev;
+
+	list->size--;
+
+	void* data = entry->data;
+	__free(entry, list->pool);
+
+	return data;
+}
+
+bool list_add(List* list, void* data) {
+	ListEntry* entry = __malloc(sizeof(ListEntry), list->pool);
+	if(!entry)
+		return false;
+
+	entry->data = data;
+	entry->next = NULL;
+	entry->prev = list->tail;
+
+	if(list->tail)
+		list->tail->next = entry;
+	else
+		list->head = entry;
+
+	list->tail = entry;
+	list->size++;
+
+	return true;
+}
+
+bool list_add_at(List* list, int index, void* data) {
+	if(index == list->size)
+		return list_add(list, data);
+
+	ListEntry* next = list_entry(list, index);
+	if(!next)
+		return false;
+
+	ListEntry* entry = __malloc(sizeof(ListEntry), list->pool);
+	if(!entry)
+		return false;
+
+	entry->data = data;
+	entry->next = next;
+	entry->prev = next->prev;
+
+	if(next->prev)
+		next->prev->next = entry;
+	else
+		list->head = entry;
+
+	next->prev = entry;
+	list->size++;
+
+	return true;
+}
+
+void* list_get(List* list, int index) {
+	ListEntry* entry = list_entry(list, index);
+
+	return entry ? entry->data : NULL;
+}
+
+void* list_get_first(List* list) {
+	return list->head ? list->head->data : NULL;
+}
+
+void* list_get_last(List* list) {
+	return list->tail ? list->tail->data : NULL;
+}
+
+void* list_remove(List* list, int index) {
+	ListEntry* entry = list_entry(list, index);
+
+	return entry ? list_unlink(list, entry) : NULL;
+}
+
+void* list_remove_first(List* list) {
+	return list->head ? list_unlink(list, list->head) : NULL;
+}
+
+void* list_remove_last(List* list) {
+	return list->tail ? list_unlink(list, list->tail) : NULL;
+}
+
+bool list_remove_data(List* list, void* data) {
+	for(ListEntry* entry = list->head; entry; entry = entry->next) {
+		if(entry->data == data) {
+			list_unlink(list, entry);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int list_index_of(List* list, void* data, bool(*comp_fn)(void*, void*)) {
+	int index = 0;
+	for(ListEntry* entry = list->head; entry; entry = entry->next, index++) {
+		if(comp_fn ? comp_fn(entry->data, data) : entry->data == data)
+			return index;
+	}
+
+	return -1;
+}
+
+int list_size(List* list) {
+	return list->size;
+}
+
+bool list_is_empty(List* list) {
+	return list->size == 0;
+}
+
+void list_iterator_init(ListIterator* iter, List* list) {
+	iter->list = list;
+	iter->prev = NULL;
+	iter->entry = list->head;
+}
+
+bool list_iterator_has_next(ListIterator* iter) {
+	return iter->entry != NULL;
+}
+
+void* list_iterator_next(ListIterator* iter) {
+	if(!iter->entry)
+		return NULL;
+
+	iter->prev = iter->entry;
+	iter->entry = iter->entry->next;
+
+	return iter->prev->data;
+}
+
+/* Removes the entry returned by the last list_iterator_next() */
+void* list_iterator_remove(ListIterator* iter) {
+	if(!iter->prev)
+		return NULL;
+
+	void* data = list_unlink(iter->list, iter->prev);
+	iter->prev = NULL;
+
+	return data;
+}
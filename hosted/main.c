@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "hosted.h"
+
+/* src/main.c, built with main renamed */
+int lb_main(int argc, char** argv);
+
+static int core_count = 1;
+static int lb_argc;
+static char** lb_argv;
+
+static void usage(char* name) {
+	printf("Usage: %s [-c cores] [-f script] [-o option] ifname...\n", name);
+	printf("\t-c cores\tOne RX/TX queue of every NI per core (default 1)\n");
+	printf("\t-f script\tRun commands of script before the console\n");
+	printf("\t-o option\t%s driver option\n", hosted_driver->name);
+	printf("\tifname\t\tNIC 0, 1, ... in the order given\n");
+}
+
+static void core_pin(int core) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void* core_main(void* context) {
+	int core = (int)(uint64_t)context;
+
+	hosted_thread_init(core);
+	core_pin(core);
+
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		if(!hosted_driver->attach(ni_get(i), core)) {
+			printf("Can'nt attach NIC %d queue %d\n", i, core);
+			exit(1);
+		}
+	}
+
+	return (void*)(uint64_t)lb_main(lb_argc, lb_argv);
+}
+
+int main(int argc, char** argv) {
+	char* script = NULL;
+	char* option = NULL;
+
+	int opt;
+	while((opt = getopt(argc, argv, "c:f:o:h")) != -1) {
+		switch(opt) {
+			case 'c':
+				core_count = atoi(optarg);
+				break;
+			case 'f':
+				script = optarg;
+				break;
+			case 'o':
+				option = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if(optind >= argc || core_count < 1 || core_count > THREAD_MAX) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	//Frames are pinned for DMA
+	struct rlimit limit = { RLIM_INFINITY, RLIM_INFINITY };
+	setrlimit(RLIMIT_MEMLOCK, &limit);
+
+	for(int i = optind; i < argc; i++) {
+		if(!hosted_ni_add(argv[i], core_count, option))
+			return 1;
+	}
+
+	if(script && !hosted_readline_open(script))
+		return 1;
+
+	lb_argc = 1;
+	lb_argv = argv;
+
+	hosted_thread_setup(core_count);
+
+	pthread_t threads[THREAD_MAX];
+	for(int i = 1; i < core_count; i++)
+		pthread_create(&threads[i], NULL, core_main, (void*)(uint64_t)i);
+
+	int status = (int)(uint64_t)core_main((void*)0);
+
+	for(int i = 1; i < core_count; i++)
+		pthread_join(threads[i], NULL);
+
+	hosted_ni_close();
+
+	return status;
+}
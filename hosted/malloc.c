@@ -0,0 +1,23 @@
+#include <stdlib.h>
+#include <_malloc.h>
+#include <gmalloc.h>
+
+/* Pools only need to be distinct non-NULL tags */
+static char gmalloc_pool;
+void* __gmalloc_pool = &gmalloc_pool;
+
+void* __malloc(size_t size, void* pool) {
+	return malloc(size);
+}
+
+void __free(void* ptr, void* pool) {
+	free(ptr);
+}
+
+void* gmalloc(size_t size) {
+	return malloc(size);
+}
+
+void gfree(void* ptr) {
+	free(ptr);
+}
@@ -0,0 +1,263 @@
+#include <string.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+#include <util/map.h>
+
+#define MAP_LOAD	3 / 4
+
+static size_t map_index(Map* map, void* key) {
+	return map->hash(key) & (map->capacity - 1);
+}
+
+Map* map_create(size_t initial_capacity, MapHash hash, MapEquals equals, void* pool) {
+	size_t capacity = 1;
+	while(capacity < initial_capacity)
+		capacity <<= 1;
+
+	Map* map = __malloc(sizeof(Map), pool);
+	if(!map)
+		return NULL;
+
+	map->table = __malloc(sizeof(List*) * capacity, pool);
+	if(!map->table) {
+		__free(map, pool);
+		return NULL;
+	}
+	bzero(map->table, sizeof(List*) * capacity);
+
+	map->capacity = capacity;
+	map->threshold = capacity * MAP_LOAD;
+	map->size = 0;
+	map->hash = hash ? hash : map_uint64_hash;
+	map->equals = equals ? equals : map_uint64_equals;
+	map->pool = pool;
+
+	return map;
+}
+
+void map_destroy(Map* map) {
+	for(size_t i = 0; i < map->capacity; i++) {
+		List* list = map->table[i];
+		if(!list)
+			continue;
+
+		ListIterator iter;
+		list_iterator_init(&iter, list);
+		while(list_iterator_has_next(&iter))
+			__free(list_iterator_next(&iter), map->pool);
+
+		list_destroy(list);
+	}
+
+	__free(map->table, map->pool);
+	__free(map, map->pool);
+}
+
+bool map_is_empty(Map* map) {
+	return map->size == 0;
+}
+
+static MapEntry* map_entry(Map* map, void* key) {
+	List* list = map->table[map_index(map, key)];
+	if(!list)
+		return NULL;
+
+	for(ListEntry* entry = list->head; entry; entry = entry->next) {
+		MapEntry* map_entry = entry->data;
+		if(map->equals(map_entry->key, key))
+			return map_entry;
+	}
+
+	return NULL;
+}
+
+/* Double the table. Entries move, the MapEntry structs stay */
+static bool map_grow(Map* map) {
+	size_t capacity = map->capacity * 2;
+	List** table = __malloc(sizeof(List*) * capacity, map->pool);
+	if(!table)
+		return false;
+	bzero(table, sizeof(List*) * capacity);
+
+	for(size_t i = 0; i < map->capacity; i++) {
+		List* list = map->table[i];
+		if(!list)
+			continue;
+
+		while(!list_is_empty(list)) {
+			MapEntry* entry = list_remove_first(list);
+			size_t index = map->hash(entry->key) & (capacity - 1);
+			if(!table[index])
+				table[index] = list_create(map->pool);
+
+			list_add(table[index], entry);
+		}
+		list_destroy(list);
+	}
+
+	__free(map->table, map->pool);
+	map->table = table;
+	map->capacity = capacity;
+	map->threshold = capacity * MAP_LOAD;
+
+	return true;
+}
+
+bool map_put(Map* map, void* key, void* data) {
+	if(map_entry(map, key))
+		return false;
+
+	if(map->size + 1 > map->threshold)
+		map_grow(map);
+
+	size_t index = map_index(map, key);
+	if(!map->table[index]) {
+		map->table[index] = list_create(map->pool);
+		if(!map->table[index])
+			return false;
+	}
+
+	MapEntry* entry = __malloc(sizeof(MapEntry), map->pool);
+	if(!entry)
+		return false;
+
+	entry->key = key;
+	entry->data = data;
+
+	if(!list_add(map->table[index], entry)) {
+		__free(entry, map->pool);
+		return false;
+	}
+	map->size++;
+
+	return true;
+}
+
+bool map_update(Map* map, void* key, void* data) {
+	MapEntry* entry = map_entry(map, key);
+	if(!entry)
+		return false;
+
+	entry->data = data;
+
+	return true;
+}
+
+void* map_get(Map* map, void* key) {
+	MapEntry* entry = map_entry(map, key);
+
+	return entry ? entry->data : NULL;
+}
+
+void* map_get_key(Map* map, void* key) {
+	MapEntry* entry = map_entry(map, key);
+
+	return entry ? entry->key : NULL;
+}
+
+bool map_contains(Map* map, void* key) {
+	return map_entry(map, key) != NULL;
+}
+
+void* map_remove(Map* map, void* key) {
+	List* list = map->table[map_index(map, key)];
+	if(!list)
+		return NULL;
+
+	ListIterator iter;
+	list_iterator_init(&iter, list);
+	while(list_iterator_has_next(&iter)) {
+		MapEntry* entry = list_iterator_next(&iter);
+		if(map->equals(entry->key, key)) {
+			void* data = entry->data;
+			list_iterator_remove(&iter);
+			__free(entry, map->pool);
+			map->size--;
+
+			return data;
+		}
+	}
+
+	return NULL;
+}
+
+int map_capacity(Map* map) {
+	return map->capacity;
+}
+
+int map_size(Map* map) {
+	return map->size;
+}
+
+void map_iterator_init(MapIterator* iter, Map* map) {
+	iter->map = map;
+	iter->index = 0;
+	iter->entry = NULL;
+	iter->list_iter.list = NULL;
+	iter->list_iter.prev = NULL;
+	iter->list_iter.entry = NULL;
+}
+
+bool map_iterator_has_next(MapIterator* iter) {
+	while(!list_iterator_has_next(&iter->list_iter)) {
+		if(iter->index >= iter->map->capacity)
+			return false;
+
+		List* list = iter->map->table[iter->index++];
+		if(list)
+			list_iterator_init(&iter->list_iter, list);
+	}
+
+	return true;
+}
+
+MapEntry* map_iterator_next(MapIterator* iter) {
+	if(!map_iterator_has_next(iter))
+		return NULL;
+
+	iter->entry = list_iterator_next(&iter->list_iter);
+
+	return iter->entry;
+}
+
+/* The returned entry is a copy, valid until the next call */
+MapEntry* map_iterator_remove(MapIterator* iter) {
+	static __thread MapEntry removed;
+
+	if(!iter->entry)
+		return NULL;
+
+	removed = *iter->entry;
+	list_iterator_remove(&iter->list_iter);
+	__free(iter->entry, iter->map->pool);
+	iter->entry = NULL;
+	iter->map->size--;
+
+	return &removed;
+}
+
+uint64_t map_uint64_hash(void* key) {
+	uint64_t h = (uint64_t)key;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+bool map_uint64_equals(void* key1, void* key2) {
+	return key1 == key2;
+}
+
+uint64_t map_string_hash(void* key) {
+	uint64_t h = 0xcbf29ce484222325UL;
+	for(char* c = key; *c; c++)
+		h = (h ^ (uint8_t)*c) * 0x100000001b3UL;
+
+	return h;
+}
+
+bool map_string_equals(void* key1, void* key2) {
+	return !strcmp(key1, key2);
+}
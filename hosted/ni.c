@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <thread.h>
+#include <util/map.h>
+#include <util/set.h>
+#include <net/ni.h>
+#include <net/interface.h>
+
+#include "hosted.h"
+
+#define NI_CONFIG_SIZE		8
+
+static HostedNI* nis[NI_MAX_COUNT];
+static int count;
+
+/* Registers a NI, the driver opens it with one queue per core */
+NetworkInterface* hosted_ni_add(char* ifname, int queue_count, char* option) {
+	if(count >= NI_MAX_COUNT) {
+		printf("Can'nt add more than %d NIs\n", NI_MAX_COUNT);
+		return NULL;
+	}
+
+	HostedNI* hosted = calloc(1, sizeof(HostedNI));
+	if(!hosted)
+		return NULL;
+
+	NetworkInterface* ni = &hosted->ni;
+	ni->pool = hosted;
+	ni->config = map_create(NI_CONFIG_SIZE, map_string_hash, map_string_equals, ni->pool);
+	ni->ip_interfaces = map_create(NI_CONFIG_SIZE, NULL, NULL, ni->pool);
+
+	hosted->index = count;
+	hosted->arp = arp_create();
+	strncpy(hosted->name, ifname, IF_NAMESIZE - 1);
+
+	//Sets mac
+	if(!hosted_driver->open(ni, ifname, queue_count, option)) {
+		printf("Can'nt open %s with %s\n", ifname, hosted_driver->name);
+		return NULL;
+	}
+
+	hosted->nic.ni = ni;
+	hosted->nic.pool = ni->pool;
+	hosted->nic.mac = ni->mac;
+
+	nis[count++] = hosted;
+
+	return ni;
+}
+
+void hosted_ni_close() {
+	for(int i = 0; i < count; i++) {
+		if(hosted_driver->close)
+			hosted_driver->close(&nis[i]->ni);
+	}
+}
+
+/* MAC of a Linux interface, as PacketNgin keeps it: first byte highest */
+bool hosted_ni_mac(char* ifname, uint64_t* mac) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0)
+		return false;
+
+	struct ifreq ifr;
+	bzero(&ifr, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IF_NAMESIZE - 1);
+	bool result = ioctl(fd, SIOCGIFHWADDR, &ifr) == 0;
+	close(fd);
+
+	if(!result) {
+		printf("Can'nt get MAC of %s\n", ifname);
+		return false;
+	}
+
+	*mac = 0;
+	for(int i = 0; i < 6; i++)
+		*mac = *mac << 8 | (uint8_t)ifr.ifr_hwaddr.sa_data[i];
+
+	return true;
+}
+
+int ni_count() {
+	return count;
+}
+
+NetworkInterface* ni_get(int index) {
+	if(index < 0 || index >= count)
+		return NULL;
+
+	return &nis[index]->ni;
+}
+
+NIC* nic_get(int index) {
+	if(index < 0 || index >= count)
+		return NULL;
+
+	return &nis[index]->nic;
+}
+
+Packet* ni_alloc(NetworkInterface* ni, uint16_t size) {
+	return hosted_driver->alloc(ni, size);
+}
+
+void ni_free(Packet* packet) {
+	hosted_driver->free(packet);
+}
+
+bool ni_has_input(NetworkInterface* ni) {
+	return hosted_driver->has_input(ni);
+}
+
+Packet* ni_input(NetworkInterface* ni) {
+	Packet* packet = hosted_driver->input(ni);
+	if(packet)
+		ni->input_packets++;
+
+	return packet;
+}
+
+bool ni_output(NetworkInterface* ni, Packet* packet) {
+	if(!hosted_driver->output(ni, packet)) {
+		ni->output_drop_packets++;
+		return false;
+	}
+
+	ni->output_packets++;
+
+	return true;
+}
+
+bool ni_output_available(NetworkInterface* ni) {
+	return true;
+}
+
+bool ni_ip_add(NetworkInterface* ni, uint32_t addr) {
+	if(map_contains(ni->ip_interfaces, (void*)(uint64_t)addr))
+		return false;
+
+	IPv4Interface* interface = calloc(1, sizeof(IPv4Interface));
+	if(!interface)
+		return false;
+
+	interface->netmask = 0xffffff00;
+	interface->tcp_ports = set_create(64, NULL, NULL, ni->pool);
+	interface->udp_ports = set_create(64, NULL, NULL, ni->pool);
+	interface->tcp_next_port = PORT_FIRST;
+	interface->udp_next_port = PORT_FIRST;
+
+	if(!interface->tcp_ports || !interface->udp_ports || !map_put(ni->ip_interfaces, (void*)(uint64_t)addr, interface)) {
+		if(interface->tcp_ports)
+			set_destroy(interface->tcp_ports);
+		if(interface->udp_ports)
+			set_destroy(interface->udp_ports);
+		free(interface);
+		return false;
+	}
+
+	return true;
+}
+
+IPv4Interface* ni_ip_get(NetworkInterface* ni, uint32_t addr) {
+	return map_get(ni->ip_interfaces, (void*)(uint64_t)addr);
+}
+
+bool ni_ip_remove(NetworkInterface* ni, uint32_t addr) {
+	IPv4Interface* interface = map_remove(ni->ip_interfaces, (void*)(uint64_t)addr);
+	if(!interface)
+		return false;
+
+	set_destroy(interface->tcp_ports);
+	set_destroy(interface->udp_ports);
+	free(interface);
+
+	return true;
+}
+
+bool ni_config_put(NetworkInterface* ni, char* key, void* data) {
+	if(map_contains(ni->config, key))
+		return map_update(ni->config, key, data);
+
+	return map_put(ni->config, key, data);
+}
+
+void* ni_config_get(NetworkInterface* ni, char* key) {
+	return map_get(ni->config, key);
+}
+
+void* ni_config_remove(NetworkInterface* ni, char* key) {
+	return map_remove(ni->config, key);
+}
@@ -0,0 +1,61 @@
+#include <net/packet.h>
+#include <net/ether.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+#include <net/checksum.h>
+
+/* Sum of the pseudo header, folded into the L4 checksum */
+static uint32_t pseudo_sum(IP* ip, uint16_t length) {
+	uint32_t source = endian32(ip->source);
+	uint32_t destination = endian32(ip->destination);
+
+	return (source >> 16) + (source & 0xffff) + (destination >> 16) + (destination & 0xffff) +
+		ip->protocol + length;
+}
+
+static uint16_t l4_checksum(IP* ip, uint16_t length) {
+	uint32_t sum = (uint16_t)~checksum(ip->body, length);
+	sum += pseudo_sum(ip, length);
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+static void ip_pack(Packet* packet, uint16_t body_len) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+
+	ip->length = endian16(ip->ihl * 4 + body_len);
+	ip->checksum = 0;
+	ip->checksum = endian16(checksum(ip, ip->ihl * 4));
+
+	packet->end = packet->start + ETHER_LEN + ip->ihl * 4 + body_len;
+}
+
+void tcp_pack(Packet* packet, uint16_t tcp_body_len) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+	uint16_t length = TCP_LEN + tcp_body_len;
+
+	tcp->checksum = 0;
+	tcp->checksum = endian16(l4_checksum(ip, length));
+
+	ip_pack(packet, length);
+}
+
+void udp_pack(Packet* packet, uint16_t udp_body_len) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	UDP* udp = (UDP*)ip->body;
+	uint16_t length = UDP_LEN + udp_body_len;
+
+	udp->length = endian16(length);
+	udp->checksum = 0;
+	uint16_t sum = l4_checksum(ip, length);
+	udp->checksum = endian16(sum ? sum : 0xffff);
+
+	ip_pack(packet, length);
+}
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <thread.h>
+#include <net/ni.h>
+
+#include "hosted.h"
+
+/*
+ * AF_PACKET driver on TPACKET_V3 rings. Works on any Linux kernel and any
+ * interface, veth and tap included.
+ *
+ * RX is zero-copy: the kernel fills whole blocks and ni_input() walks the
+ * packets of a block in place. The Packet header is written into the
+ * PACKET_RESERVE area in front of each frame. A block goes back to the
+ * kernel when the next burst starts, so a Packet is valid until then.
+ * TX copies into fixed frames of the TX ring, flushed between bursts.
+ * With more than one core the sockets of a NI form a fanout group.
+ */
+
+#define PACKET_BLOCK_SIZE	(1 << 18)
+#define PACKET_BLOCK_COUNT	64
+#define PACKET_FRAME_SIZE	2048
+#define PACKET_TX_BLOCK_COUNT	16
+#define PACKET_RETIRE_TIMEOUT	1	//Milli seconds before a partly filled block is handed over
+#define PACKET_HEADROOM		128	//Space for encapsulation in front of RX frames
+#define PACKET_RESERVE_SIZE	(PACKET_HEADROOM + 64)
+#define PACKET_BATCH		64
+#define PACKET_POOL_COUNT	1024	//Packets for ni_alloc() per core
+
+typedef struct _PacketQueue {
+	int			fd;
+	uint8_t*		map;
+	size_t			map_size;
+
+	uint8_t*		rx;
+	uint32_t		block_index;
+	bool			in_block;	//Current block is owned by us
+	uint32_t		remaining;
+	struct tpacket3_hdr*	next;
+	uint64_t		time;
+
+	uint8_t*		tx;
+	uint32_t		frame_count;
+	uint32_t		frame_index;
+	uint32_t		tx_pending;
+} PacketQueue;
+
+typedef struct _PacketNI {
+	int		ifindex;
+	int		fanout;
+	PacketQueue	queues[THREAD_MAX];
+} PacketNI;
+
+/* ni_alloc() packets of a core */
+typedef struct _PacketPool {
+	uint8_t*	area;
+	Packet**	packets;
+	uint32_t	free_count;
+} PacketPool;
+
+static PacketPool pools[THREAD_MAX];
+static PacketNI* packet_nis[NI_MAX_COUNT];
+static int packet_ni_count;
+
+static inline PacketQueue* packet_queue(NetworkInterface* ni) {
+	return &((PacketNI*)ni->priv)->queues[thread_id()];
+}
+
+static bool packet_open(NetworkInterface* ni, char* ifname, int queue_count, char* option) {
+	PacketNI* packet_ni = calloc(1, sizeof(PacketNI));
+	if(!packet_ni)
+		return false;
+
+	for(int i = 0; i < THREAD_MAX; i++)
+		packet_ni->queues[i].fd = -1;
+
+	packet_ni->ifindex = if_nametoindex(ifname);
+	if(!packet_ni->ifindex) {
+		printf("Can'nt find %s\n", ifname);
+		free(packet_ni);
+		return false;
+	}
+
+	//Fanout group ids are global: keep them apart per process and NI
+	packet_ni->fanout = (getpid() + packet_ni->ifindex) & 0xffff;
+
+	if(!hosted_ni_mac(ifname, &ni->mac)) {
+		free(packet_ni);
+		return false;
+	}
+
+	ni->priv = packet_ni;
+	packet_nis[packet_ni_count++] = packet_ni;
+
+	return true;
+}
+
+static bool pool_create(PacketPool* pool) {
+	pool->area = malloc((size_t)PACKET_POOL_COUNT * PACKET_FRAME_SIZE);
+	pool->packets = malloc(sizeof(Packet*) * PACKET_POOL_COUNT);
+	if(!pool->area || !pool->packets)
+		return false;
+
+	for(uint32_t i = 0; i < PACKET_POOL_COUNT; i++)
+		pool->packets[i] = (Packet*)(pool->area + (size_t)i * PACKET_FRAME_SIZE);
+	pool->free_count = PACKET_POOL_COUNT;
+
+	return true;
+}
+
+static bool packet_attach(NetworkInterface* ni, int core) {
+	PacketNI* packet_ni = ni->priv;
+	PacketQueue* queue = &packet_ni->queues[core];
+
+	if(!pools[core].area && !pool_create(&pools[core]))
+		return false;
+
+	queue->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if(queue->fd < 0) {
+		printf("Can'nt create AF_PACKET socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	int version = TPACKET_V3;
+	int reserve = PACKET_RESERVE_SIZE;
+	int one = 1;
+	if(setsockopt(queue->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+			setsockopt(queue->fd, SOL_PACKET, PACKET_RESERVE, &reserve, sizeof(reserve)) < 0) {
+		printf("Can'nt set TPACKET_V3: %s\n", strerror(errno));
+		return false;
+	}
+
+	//Best effort: not every kernel has them
+	setsockopt(queue->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+	setsockopt(queue->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+
+	struct tpacket_req3 req;
+	bzero(&req, sizeof(req));
+	req.tp_block_size = PACKET_BLOCK_SIZE;
+	req.tp_block_nr = PACKET_BLOCK_COUNT;
+	req.tp_frame_size = PACKET_FRAME_SIZE;
+	req.tp_frame_nr = PACKET_BLOCK_SIZE / PACKET_FRAME_SIZE * PACKET_BLOCK_COUNT;
+	req.tp_retire_blk_tov = PACKET_RETIRE_TIMEOUT;
+	if(setsockopt(queue->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		printf("Can'nt create RX ring: %s\n", strerror(errno));
+		return false;
+	}
+
+	bzero(&req, sizeof(req));
+	req.tp_block_size = PACKET_BLOCK_SIZE;
+	req.tp_block_nr = PACKET_TX_BLOCK_COUNT;
+	req.tp_frame_size = PACKET_FRAME_SIZE;
+	req.tp_frame_nr = PACKET_BLOCK_SIZE / PACKET_FRAME_SIZE * PACKET_TX_BLOCK_COUNT;
+	if(setsockopt(queue->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+		printf("Can'nt create TX ring: %s\n", strerror(errno));
+		return false;
+	}
+	queue->frame_count = req.tp_frame_nr;
+
+	//RX ring first, then TX ring
+	size_t rx_size = (size_t)PACKET_BLOCK_SIZE * PACKET_BLOCK_COUNT;
+	queue->map_size = rx_size + (size_t)PACKET_BLOCK_SIZE * PACKET_TX_BLOCK_COUNT;
+	queue->map = mmap(NULL, queue->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE, queue->fd, 0);
+	if(queue->map == MAP_FAILED) {
+		queue->map = NULL;
+		printf("Can'nt map rings: %s\n", strerror(errno));
+		return false;
+	}
+	queue->rx = queue->map;
+	queue->tx = queue->map + rx_size;
+
+	struct sockaddr_ll addr;
+	bzero(&addr, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = packet_ni->ifindex;
+	if(bind(queue->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		printf("Can'nt bind AF_PACKET socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	if(thread_count() > 1) {
+		int fanout = packet_ni->fanout | PACKET_FANOUT_HASH << 16;
+		if(setsockopt(queue->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+			printf("Can'nt join fanout group: %s\n", strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void packet_close(NetworkInterface* ni) {
+	PacketNI* packet_ni = ni->priv;
+
+	for(int i = 0; i < THREAD_MAX; i++) {
+		PacketQueue* queue = &packet_ni->queues[i];
+		if(queue->fd < 0)
+			continue;
+
+		if(queue->map)
+			munmap(queue->map, queue->map_size);
+		close(queue->fd);
+		queue->fd = -1;
+	}
+}
+
+static Packet* packet_alloc(NetworkInterface* ni, uint16_t size) {
+	PacketPool* pool = &pools[thread_id()];
+	if(!pool->free_count)
+		return NULL;
+
+	Packet* packet = pool->packets[--pool->free_count];
+	packet->ni = ni;
+	packet->time = 0;
+	packet->size = PACKET_FRAME_SIZE - offsetof(Packet, buffer);
+	packet->start = PACKET_HEADROOM;
+	packet->end = packet->start + size;
+
+	return packet;
+}
+
+/* RX ring packets are given back with their block */
+static void packet_free(Packet* packet) {
+	PacketPool* pool = &pools[thread_id()];
+	uint8_t* p = (uint8_t*)packet;
+
+	if(p >= pool->area && p < pool->area + (size_t)PACKET_POOL_COUNT * PACKET_FRAME_SIZE)
+		pool->packets[pool->free_count++] = packet;
+}
+
+static void packet_tx_flush(PacketQueue* queue) {
+	if(!queue->tx_pending)
+		return;
+
+	sendto(queue->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+	queue->tx_pending = 0;
+}
+
+static bool packet_has_input(NetworkInterface* ni) {
+	PacketQueue* queue = packet_queue(ni);
+	if(queue->remaining)
+		return true;
+
+	struct tpacket_block_desc* block = (struct tpacket_block_desc*)(queue->rx + (size_t)queue->block_index * PACKET_BLOCK_SIZE);
+	if(queue->in_block) {
+		__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		queue->block_index = (queue->block_index + 1) % PACKET_BLOCK_COUNT;
+		queue->in_block = false;
+		block = (struct tpacket_block_desc*)(queue->rx + (size_t)queue->block_index * PACKET_BLOCK_SIZE);
+	}
+
+	//Between bursts: push out TX of this core on every NI
+	int core = thread_id();
+	for(int i = 0; i < packet_ni_count; i++)
+		packet_tx_flush(&packet_nis[i]->queues[core]);
+
+	if(!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+		return false;
+
+	queue->in_block = true;
+	queue->remaining = block->hdr.bh1.num_pkts;
+	queue->next = (struct tpacket3_hdr*)((uint8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+	queue->time = hosted_time();
+
+	return queue->remaining > 0;
+}
+
+static Packet* packet_input(NetworkInterface* ni) {
+	if(!packet_has_input(ni))
+		return NULL;
+
+	PacketQueue* queue = packet_queue(ni);
+	struct tpacket3_hdr* hdr = queue->next;
+	uint8_t* data = (uint8_t*)hdr + hdr->tp_mac;
+
+	//Header goes into the reserved space in front of the frame
+	Packet* packet = (Packet*)(data - PACKET_HEADROOM - offsetof(Packet, buffer));
+	packet->ni = ni;
+	packet->time = queue->time;
+	packet->start = PACKET_HEADROOM;
+	packet->end = packet->start + hdr->tp_snaplen;
+	packet->size = packet->end;
+
+	queue->next = (struct tpacket3_hdr*)((uint8_t*)hdr + hdr->tp_next_offset);
+	queue->remaining--;
+
+	return packet;
+}
+
+static bool packet_output(NetworkInterface* ni, Packet* packet) {
+	PacketQueue* queue = packet_queue(ni);
+	uint8_t* frame = queue->tx + (size_t)queue->frame_index * PACKET_FRAME_SIZE;
+	struct tpacket3_hdr* hdr = (struct tpacket3_hdr*)frame;
+	uint32_t length = packet->end - packet->start;
+	uint32_t offset = TPACKET3_HDRLEN - sizeof(struct sockaddr_ll);
+
+	if(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+		packet_tx_flush(queue);
+		packet_free(packet);
+		return false;
+	}
+
+	if(offset + length > PACKET_FRAME_SIZE) {
+		packet_free(packet);
+		return false;
+	}
+
+	memcpy(frame + offset, packet->buffer + packet->start, length);
+	hdr->tp_len = length;
+	hdr->tp_snaplen = length;
+	hdr->tp_next_offset = 0;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+	queue->frame_index = (queue->frame_index + 1) % queue->frame_count;
+	if(++queue->tx_pending >= PACKET_BATCH)
+		packet_tx_flush(queue);
+
+	packet_free(packet);
+
+	return true;
+}
+
+static Driver packet_driver = {
+	.name		= "AF_PACKET",
+	.open		= packet_open,
+	.attach		= packet_attach,
+	.close		= packet_close,
+	.alloc		= packet_alloc,
+	.free		= packet_free,
+	.has_input	= packet_has_input,
+	.input		= packet_input,
+	.output		= packet_output,
+};
+
+Driver* hosted_driver = &packet_driver;
@@ -0,0 +1,71 @@
+#include <util/set.h>
+#include <net/ni.h>
+#include <net/interface.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+
+#include "hosted.h"
+
+static bool port_alloc0(Set* ports, uint16_t port) {
+	if(set_contains(ports, (void*)(uint64_t)port))
+		return false;
+
+	return set_put(ports, (void*)(uint64_t)port);
+}
+
+/* Next free ephemeral port after the last one handed out */
+static uint16_t port_alloc(Set* ports, uint16_t* next) {
+	for(uint32_t i = PORT_FIRST; i <= UINT16_MAX; i++) {
+		uint16_t port = *next;
+		*next = port == UINT16_MAX ? PORT_FIRST : port + 1;
+
+		if(port_alloc0(ports, port))
+			return port;
+	}
+
+	return 0;
+}
+
+bool tcp_port_alloc0(NetworkInterface* ni, uint32_t addr, uint16_t port) {
+	IPv4Interface* interface = ni_ip_get(ni, addr);
+	if(!interface)
+		return false;
+
+	return port_alloc0(interface->tcp_ports, port);
+}
+
+uint16_t tcp_port_alloc(NetworkInterface* ni, uint32_t addr) {
+	IPv4Interface* interface = ni_ip_get(ni, addr);
+	if(!interface)
+		return 0;
+
+	return port_alloc(interface->tcp_ports, &interface->tcp_next_port);
+}
+
+void tcp_port_free(NetworkInterface* ni, uint32_t addr, uint16_t port) {
+	IPv4Interface* interface = ni_ip_get(ni, addr);
+	if(interface)
+		set_remove(interface->tcp_ports, (void*)(uint64_t)port);
+}
+
+bool udp_port_alloc0(NetworkInterface* ni, uint32_t addr, uint16_t port) {
+	IPv4Interface* interface = ni_ip_get(ni, addr);
+	if(!interface)
+		return false;
+
+	return port_alloc0(interface->udp_ports, port);
+}
+
+uint16_t udp_port_alloc(NetworkInterface* ni, uint32_t addr) {
+	IPv4Interface* interface = ni_ip_get(ni, addr);
+	if(!interface)
+		return 0;
+
+	return port_alloc(interface->udp_ports, &interface->udp_next_port);
+}
+
+void udp_port_free(NetworkInterface* ni, uint32_t addr, uint16_t port) {
+	IPv4Interface* interface = ni_ip_get(ni, addr);
+	if(interface)
+		set_remove(interface->udp_ports, (void*)(uint64_t)port);
+}
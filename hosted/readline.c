@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <thread.h>
+#include <readline.h>
+
+#include "hosted.h"
+
+#define READLINE_SIZE		4096
+#define READLINE_INTERVAL	10000	//Micro seconds between polls of stdin
+
+static int fd = 0;
+static bool eof;
+static char buffer[READLINE_SIZE];
+static int length;
+static char line[READLINE_SIZE];
+static uint64_t polled;
+
+bool hosted_readline_open(char* script) {
+	fd = open(script, O_RDONLY);
+	if(fd < 0) {
+		printf("Can'nt open %s: %s\n", script, strerror(errno));
+		fd = 0;
+		return false;
+	}
+
+	return true;
+}
+
+/* Move one line from buffer to line */
+static char* readline_take() {
+	char* newline = memchr(buffer, '\n', length);
+	if(!newline) {
+		if(length < READLINE_SIZE - 1)
+			return NULL;
+
+		newline = buffer + READLINE_SIZE - 1;	//Too long: split
+	}
+
+	int size = newline - buffer;
+	memcpy(line, buffer, size);
+	line[size] = '\0';
+
+	length -= size + 1;
+	memmove(buffer, newline + 1, length);
+
+	return line;
+}
+
+/* Only the first core reads the console, like PacketNgin's stdin */
+char* readline() {
+	if(thread_id() != 0)
+		return NULL;
+
+	char* taken = readline_take();
+	if(taken || eof)
+		return taken;
+
+	//Script lines are read right away, the console at most every interval
+	if(fd == 0) {
+		uint64_t now = hosted_time();
+		if(now - polled < READLINE_INTERVAL)
+			return NULL;
+		polled = now;
+
+		struct pollfd pfd = { .fd = 0, .events = POLLIN };
+		if(poll(&pfd, 1, 0) <= 0)
+			return NULL;
+	}
+
+	ssize_t size = read(fd, buffer + length, READLINE_SIZE - length);
+	if(size > 0) {
+		length += size;
+		return readline_take();
+	}
+
+	if(fd != 0) {
+		close(fd);
+		fd = 0;
+	} else if(size == 0) {
+		eof = true;
+	}
+
+	return NULL;
+}
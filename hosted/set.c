@@ -0,0 +1,35 @@
+#include <util/set.h>
+
+/* A set is a map whose data is the key */
+Set* set_create(size_t initial_capacity, MapHash hash, MapEquals equals, void* pool) {
+	return map_create(initial_capacity, hash, equals, pool);
+}
+
+void set_destroy(Set* set) {
+	map_destroy(set);
+}
+
+bool set_is_empty(Set* set) {
+	return map_is_empty(set);
+}
+
+bool set_put(Set* set, void* key) {
+	return map_put(set, key, key);
+}
+
+bool set_contains(Set* set, void* key) {
+	return map_contains(set, key);
+}
+
+bool set_remove(Set* set, void* key) {
+	if(!map_contains(set, key))
+		return false;
+
+	map_remove(set, key);
+
+	return true;
+}
+
+size_t set_size(Set* set) {
+	return map_size(set);
+}
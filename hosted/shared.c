@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <shared.h>
+
+#include "hosted.h"
+
+void* shared_map(char* name, size_t size) {
+	char path[256];
+	if(name[0] == '/')
+		snprintf(path, sizeof(path), "%s", name);
+	else
+		snprintf(path, sizeof(path), "/dev/shm/%s", name);
+
+	//A new file: whoever still maps the old one keeps it intact
+	unlink(path);
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	if(ftruncate(fd, size) < 0) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+
+	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(ptr == MAP_FAILED) {
+		perror(path);
+		return NULL;
+	}
+
+	return ptr;
+}
+
+void shared_unmap(void* ptr, size_t size) {
+	munmap(ptr, size);
+}
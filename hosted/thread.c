@@ -0,0 +1,38 @@
+#include <time.h>
+#include <pthread.h>
+#include <thread.h>
+
+#include "hosted.h"
+
+static __thread int id;
+static int count = 1;
+static pthread_barrier_t barrier;
+
+void hosted_thread_setup(int _count) {
+	count = _count;
+	pthread_barrier_init(&barrier, NULL, _count);
+}
+
+void hosted_thread_init(int _id) {
+	id = _id;
+}
+
+int thread_id() {
+	return id;
+}
+
+int thread_count() {
+	return count;
+}
+
+void thread_barrior() {
+	if(count > 1)
+		pthread_barrier_wait(&barrier);
+}
+
+uint64_t hosted_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,48 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <util/types.h>
+
+static bool is_uint(const char* val, uint64_t max) {
+	if(!val || *val < '0' || *val > '9')
+		return false;
+
+	char* end;
+	errno = 0;
+	unsigned long long v = strtoull(val, &end, 0);
+	if(errno || *end != '\0')
+		return false;
+
+	return v <= max;
+}
+
+bool is_uint8(const char* val) {
+	return is_uint(val, UINT8_MAX);
+}
+
+bool is_uint16(const char* val) {
+	return is_uint(val, UINT16_MAX);
+}
+
+bool is_uint32(const char* val) {
+	return is_uint(val, UINT32_MAX);
+}
+
+bool is_uint64(const char* val) {
+	return is_uint(val, UINT64_MAX);
+}
+
+uint8_t parse_uint8(const char* val) {
+	return strtoull(val, NULL, 0);
+}
+
+uint16_t parse_uint16(const char* val) {
+	return strtoull(val, NULL, 0);
+}
+
+uint32_t parse_uint32(const char* val) {
+	return strtoull(val, NULL, 0);
+}
+
+uint64_t parse_uint64(const char* val) {
+	return strtoull(val, NULL, 0);
+}
@@ -0,0 +1,562 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <thread.h>
+#include <net/ni.h>
+
+#include "hosted.h"
+
+/*
+ * AF_XDP driver. Every core owns one UMEM shared by its sockets on all
+ * NIs, so a frame received on one NI is transmitted on another without a
+ * copy. The Packet header lives in the UMEM headroom in front of each
+ * frame: ni_input() returns the frame itself.
+ *
+ * A minimal XDP program redirects every queue to its socket through an
+ * XSKMAP; queues without a socket fall back to the kernel.
+ */
+
+#define XDP_FRAME_SIZE		2048
+#define XDP_RING_SIZE		2048
+#define XDP_FRAME_COUNT		(XDP_RING_SIZE * 3)	//Per NI per core: fill, TX and in flight
+#define XDP_BATCH		64
+#define XDP_HEADROOM		64			//Packet header in front of the frame
+
+#define XDP_OPTION_COPY		"copy"	//Copy mode even when the driver does zero-copy
+#define XDP_OPTION_SKB		"skb"	//Generic XDP, for drivers without native XDP
+
+typedef struct _XDPRing {
+	uint32_t*	producer;
+	uint32_t*	consumer;
+	uint32_t*	flags;
+	void*		ring;
+	uint32_t	mask;
+	uint32_t	cached;		//Local producer or consumer index
+	void*		map;
+	size_t		map_size;
+} XDPRing;
+
+/* Frames of a core */
+typedef struct _XDPUmem {
+	uint8_t*	area;
+	size_t		size;
+	int		fd;		//Socket that registered the UMEM
+	uint64_t*	frames;		//Free frame stack
+	uint32_t	free_count;
+} XDPUmem;
+
+typedef struct _XDPQueue {
+	int		fd;
+	XDPUmem*	umem;
+	XDPRing		fill;
+	XDPRing		completion;
+	XDPRing		rx;
+	XDPRing		tx;
+	uint32_t	rx_index;	//Current RX batch
+	uint32_t	rx_count;
+	uint32_t	tx_pending;
+	uint64_t	time;
+} XDPQueue;
+
+typedef struct _XDP {
+	int		ifindex;
+	int		map_fd;
+	int		prog_fd;
+	int		link_fd;
+	uint32_t	bind_flags;
+	XDPQueue	queues[THREAD_MAX];
+} XDP;
+
+static XDPUmem umems[THREAD_MAX];
+static XDP* xdps[NI_MAX_COUNT];
+static int xdp_count;
+
+static inline XDPQueue* xdp_queue(NetworkInterface* ni) {
+	return &((XDP*)ni->priv)->queues[thread_id()];
+}
+
+static inline uint64_t frame_addr(uint64_t addr) {
+	return addr & ~((uint64_t)XDP_FRAME_SIZE - 1);
+}
+
+static inline Packet* frame_packet(XDPUmem* umem, uint64_t addr) {
+	return (Packet*)(umem->area + frame_addr(addr));
+}
+
+static inline uint64_t packet_frame(XDPUmem* umem, Packet* packet) {
+	return (uint8_t*)packet - umem->area;
+}
+
+/* Producer side: fill and TX */
+static inline uint32_t ring_free(XDPRing* ring) {
+	return ring->mask + 1 - (ring->cached - __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE));
+}
+
+static inline void ring_submit(XDPRing* ring) {
+	__atomic_store_n(ring->producer, ring->cached, __ATOMIC_RELEASE);
+}
+
+/* Consumer side: RX and completion */
+static inline uint32_t ring_available(XDPRing* ring) {
+	return __atomic_load_n(ring->producer, __ATOMIC_ACQUIRE) - ring->cached;
+}
+
+static inline void ring_release(XDPRing* ring, uint32_t count) {
+	ring->cached += count;
+	__atomic_store_n(ring->consumer, ring->cached, __ATOMIC_RELEASE);
+}
+
+static inline bool ring_need_wakeup(XDPRing* ring) {
+	return __atomic_load_n(ring->flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP;
+}
+
+static long bpf(int cmd, union bpf_attr* attr) {
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* r2 = ctx->rx_queue_index; return bpf_redirect_map(xsks, r2, XDP_PASS) */
+static int xdp_prog_load(int map_fd) {
+	struct bpf_insn insns[] = {
+		{ .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = offsetof(struct xdp_md, rx_queue_index) },
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD, .imm = map_fd },
+		{ 0 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	static char license[] = "GPL";
+	static char log[4096];
+
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uint64_t)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.license = (uint64_t)license;
+	attr.log_buf = (uint64_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	strncpy(attr.prog_name, "lb_xsk", sizeof(attr.prog_name) - 1);
+
+	int fd = bpf(BPF_PROG_LOAD, &attr);
+	if(fd < 0)
+		printf("Can'nt load XDP program: %s\n%s\n", strerror(errno), log);
+
+	return fd;
+}
+
+static bool xdp_prog_attach(XDP* xdp, int queue_count, bool skb) {
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = queue_count;
+	strncpy(attr.map_name, "lb_xsks", sizeof(attr.map_name) - 1);
+
+	xdp->map_fd = bpf(BPF_MAP_CREATE, &attr);
+	if(xdp->map_fd < 0) {
+		printf("Can'nt create XSKMAP: %s\n", strerror(errno));
+		return false;
+	}
+
+	xdp->prog_fd = xdp_prog_load(xdp->map_fd);
+	if(xdp->prog_fd < 0)
+		return false;
+
+	//The link detaches the program when the process exits
+	uint32_t modes[] = { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE };
+	for(int i = skb ? 1 : 0; i < 2; i++) {
+		bzero(&attr, sizeof(attr));
+		attr.link_create.prog_fd = xdp->prog_fd;
+		attr.link_create.target_ifindex = xdp->ifindex;
+		attr.link_create.attach_type = BPF_XDP;
+		attr.link_create.flags = modes[i];
+
+		xdp->link_fd = bpf(BPF_LINK_CREATE, &attr);
+		if(xdp->link_fd >= 0)
+			return true;
+	}
+
+	printf("Can'nt attach XDP program: %s\n", strerror(errno));
+
+	return false;
+}
+
+static bool xdp_open(NetworkInterface* ni, char* ifname, int queue_count, char* option) {
+	XDP* xdp = calloc(1, sizeof(XDP));
+	if(!xdp)
+		return false;
+
+	xdp->map_fd = xdp->prog_fd = xdp->link_fd = -1;
+	for(int i = 0; i < THREAD_MAX; i++)
+		xdp->queues[i].fd = -1;
+
+	bool skb = option && !strcmp(option, XDP_OPTION_SKB);
+	bool copy = skb || (option && !strcmp(option, XDP_OPTION_COPY));
+	xdp->bind_flags = XDP_USE_NEED_WAKEUP | (copy ? XDP_COPY : XDP_ZEROCOPY);
+
+	xdp->ifindex = if_nametoindex(ifname);
+	if(!xdp->ifindex) {
+		printf("Can'nt find %s\n", ifname);
+		goto error;
+	}
+
+	if(!hosted_ni_mac(ifname, &ni->mac))
+		goto error;
+
+	if(!xdp_prog_attach(xdp, queue_count, skb))
+		goto error;
+
+	ni->priv = xdp;
+	xdps[xdp_count++] = xdp;
+
+	return true;
+
+error:
+	if(xdp->link_fd >= 0)
+		close(xdp->link_fd);
+	if(xdp->prog_fd >= 0)
+		close(xdp->prog_fd);
+	if(xdp->map_fd >= 0)
+		close(xdp->map_fd);
+	free(xdp);
+
+	return false;
+}
+
+static bool ring_map(XDPRing* ring, int fd, struct xdp_ring_offset* offset, size_t entry, uint64_t pgoff) {
+	ring->map_size = offset->desc + XDP_RING_SIZE * entry;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if(ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		return false;
+	}
+
+	ring->producer = ring->map + offset->producer;
+	ring->consumer = ring->map + offset->consumer;
+	ring->flags = ring->map + offset->flags;
+	ring->ring = ring->map + offset->desc;
+	ring->mask = XDP_RING_SIZE - 1;
+
+	return true;
+}
+
+static void ring_unmap(XDPRing* ring) {
+	if(ring->map)
+		munmap(ring->map, ring->map_size);
+	ring->map = NULL;
+}
+
+static bool umem_create(XDPUmem* umem, int fd) {
+	uint32_t count = XDP_FRAME_COUNT * ni_count();
+
+	umem->size = (size_t)count * XDP_FRAME_SIZE;
+	umem->area = mmap(NULL, umem->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if(umem->area == MAP_FAILED) {
+		umem->area = NULL;
+		return false;
+	}
+
+	struct xdp_umem_reg reg;
+	bzero(&reg, sizeof(reg));
+	reg.addr = (uint64_t)umem->area;
+	reg.len = umem->size;
+	reg.chunk_size = XDP_FRAME_SIZE;
+	reg.headroom = XDP_HEADROOM;
+	if(setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0) {
+		printf("Can'nt register UMEM: %s\n", strerror(errno));
+		munmap(umem->area, umem->size);
+		umem->area = NULL;
+		return false;
+	}
+
+	umem->frames = malloc(sizeof(uint64_t) * count);
+	if(!umem->frames)
+		return false;
+
+	for(uint32_t i = 0; i < count; i++)
+		umem->frames[i] = (uint64_t)(count - 1 - i) * XDP_FRAME_SIZE;
+	umem->free_count = count;
+	umem->fd = fd;
+
+	return true;
+}
+
+/* Completed TX frames back to the free stack */
+static void xdp_complete(XDPQueue* queue) {
+	XDPUmem* umem = queue->umem;
+	uint32_t count = ring_available(&queue->completion);
+	uint64_t* addrs = queue->completion.ring;
+
+	for(uint32_t i = 0; i < count; i++)
+		umem->frames[umem->free_count++] = frame_addr(addrs[(queue->completion.cached + i) & queue->completion.mask]);
+
+	if(count)
+		ring_release(&queue->completion, count);
+}
+
+static void xdp_fill(XDPQueue* queue) {
+	XDPUmem* umem = queue->umem;
+	uint32_t count = ring_free(&queue->fill);
+	if(count > umem->free_count)
+		count = umem->free_count;
+	if(!count)
+		return;
+
+	uint64_t* addrs = queue->fill.ring;
+	for(uint32_t i = 0; i < count; i++)
+		addrs[queue->fill.cached++ & queue->fill.mask] = umem->frames[--umem->free_count];
+
+	ring_submit(&queue->fill);
+}
+
+static void xdp_kick(XDPQueue* queue) {
+	if(ring_need_wakeup(&queue->tx))
+		sendto(queue->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+static void xdp_tx_submit(XDPQueue* queue) {
+	if(!queue->tx_pending)
+		return;
+
+	ring_submit(&queue->tx);
+	queue->tx_pending = 0;
+	xdp_kick(queue);
+}
+
+static bool xdp_attach(NetworkInterface* ni, int core) {
+	XDP* xdp = ni->priv;
+	XDPQueue* queue = &xdp->queues[core];
+	XDPUmem* umem = &umems[core];
+	bool shared = umem->area != NULL;
+
+	queue->umem = umem;
+	queue->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if(queue->fd < 0) {
+		printf("Can'nt create AF_XDP socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	if(!shared && !umem_create(umem, queue->fd))
+		return false;
+
+	//Every (NI, queue) has its own fill and completion ring, even on a shared UMEM
+	int size = XDP_RING_SIZE;
+	if(setsockopt(queue->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+			setsockopt(queue->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+			setsockopt(queue->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+			setsockopt(queue->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0) {
+		printf("Can'nt size AF_XDP rings: %s\n", strerror(errno));
+		return false;
+	}
+
+	struct xdp_mmap_offsets offsets;
+	socklen_t length = sizeof(offsets);
+	if(getsockopt(queue->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &length) < 0)
+		return false;
+
+	if(!ring_map(&queue->fill, queue->fd, &offsets.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) ||
+			!ring_map(&queue->completion, queue->fd, &offsets.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) ||
+			!ring_map(&queue->rx, queue->fd, &offsets.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) ||
+			!ring_map(&queue->tx, queue->fd, &offsets.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING)) {
+		printf("Can'nt map AF_XDP rings: %s\n", strerror(errno));
+		return false;
+	}
+
+	struct sockaddr_xdp addr;
+	bzero(&addr, sizeof(addr));
+	addr.sxdp_family = AF_XDP;
+	addr.sxdp_ifindex = xdp->ifindex;
+	addr.sxdp_queue_id = core;
+	if(shared) {
+		//Mode is inherited from the socket that registered the UMEM
+		addr.sxdp_flags = XDP_SHARED_UMEM;
+		addr.sxdp_shared_umem_fd = umem->fd;
+	} else {
+		addr.sxdp_flags = xdp->bind_flags;
+	}
+
+	if(bind(queue->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		//veth and most virtual NICs can only copy
+		if(shared || !(xdp->bind_flags & XDP_ZEROCOPY)) {
+			printf("Can'nt bind AF_XDP socket: %s\n", strerror(errno));
+			return false;
+		}
+
+		addr.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+		if(bind(queue->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+			printf("Can'nt bind AF_XDP socket: %s\n", strerror(errno));
+			return false;
+		}
+		printf("NIC queue %d: AF_XDP copy mode\n", core);
+	}
+
+	uint32_t key = core;
+	union bpf_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.map_fd = xdp->map_fd;
+	attr.key = (uint64_t)&key;
+	attr.value = (uint64_t)&queue->fd;
+	if(bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		printf("Can'nt add AF_XDP socket to XSKMAP: %s\n", strerror(errno));
+		return false;
+	}
+
+	//A third of the frames waits in the fill ring, the rest covers TX
+	xdp_fill(queue);
+
+	return true;
+}
+
+static void xdp_close(NetworkInterface* ni) {
+	XDP* xdp = ni->priv;
+
+	for(int i = 0; i < THREAD_MAX; i++) {
+		XDPQueue* queue = &xdp->queues[i];
+		if(queue->fd < 0)
+			continue;
+
+		ring_unmap(&queue->fill);
+		ring_unmap(&queue->completion);
+		ring_unmap(&queue->rx);
+		ring_unmap(&queue->tx);
+		close(queue->fd);
+		queue->fd = -1;
+	}
+
+	close(xdp->link_fd);
+	close(xdp->prog_fd);
+	close(xdp->map_fd);
+}
+
+static Packet* xdp_alloc(NetworkInterface* ni, uint16_t size) {
+	XDPQueue* queue = xdp_queue(ni);
+	XDPUmem* umem = queue->umem;
+
+	if(!umem->free_count)
+		xdp_complete(queue);
+	if(!umem->free_count)
+		return NULL;
+
+	Packet* packet = frame_packet(umem, umem->frames[--umem->free_count]);
+	packet->ni = ni;
+	packet->time = 0;
+	packet->size = XDP_FRAME_SIZE - offsetof(Packet, buffer);
+	packet->start = XDP_HEADROOM + XDP_PACKET_HEADROOM - offsetof(Packet, buffer);
+	packet->end = packet->start + size;
+
+	return packet;
+}
+
+static void xdp_free(Packet* packet) {
+	XDPUmem* umem = &umems[thread_id()];
+
+	umem->frames[umem->free_count++] = packet_frame(umem, packet);
+}
+
+/* End of an RX batch: hand the frames back to the fill ring */
+static void xdp_rx_release(XDPQueue* queue) {
+	if(!queue->rx_count)
+		return;
+
+	ring_release(&queue->rx, queue->rx_count);
+	queue->rx_count = 0;
+	queue->rx_index = 0;
+}
+
+static bool xdp_has_input(NetworkInterface* ni) {
+	XDPQueue* queue = xdp_queue(ni);
+	if(queue->rx_index < queue->rx_count)
+		return true;
+
+	xdp_rx_release(queue);
+
+	//Between bursts: push out TX of this core on every NI
+	int core = thread_id();
+	for(int i = 0; i < xdp_count; i++) {
+		XDPQueue* _queue = &xdps[i]->queues[core];
+		xdp_tx_submit(_queue);
+		xdp_complete(_queue);
+	}
+	xdp_fill(queue);
+
+	uint32_t count = ring_available(&queue->rx);
+	if(!count) {
+		if(ring_need_wakeup(&queue->fill))
+			recvfrom(queue->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		return false;
+	}
+
+	queue->rx_count = count < XDP_BATCH ? count : XDP_BATCH;
+	queue->time = hosted_time();
+
+	return true;
+}
+
+static Packet* xdp_input(NetworkInterface* ni) {
+	if(!xdp_has_input(ni))
+		return NULL;
+
+	XDPQueue* queue = xdp_queue(ni);
+	struct xdp_desc* descs = queue->rx.ring;
+	struct xdp_desc* desc = &descs[(queue->rx.cached + queue->rx_index++) & queue->rx.mask];
+
+	Packet* packet = frame_packet(queue->umem, desc->addr);
+	packet->ni = ni;
+	packet->time = queue->time;
+	packet->size = XDP_FRAME_SIZE - offsetof(Packet, buffer);
+	packet->start = desc->addr - frame_addr(desc->addr) - offsetof(Packet, buffer);
+	packet->end = packet->start + desc->len;
+
+	return packet;
+}
+
+static bool xdp_output(NetworkInterface* ni, Packet* packet) {
+	XDPQueue* queue = xdp_queue(ni);
+
+	if(!ring_free(&queue->tx)) {
+		xdp_tx_submit(queue);
+		xdp_complete(queue);
+		if(!ring_free(&queue->tx)) {
+			xdp_free(packet);
+			return false;
+		}
+	}
+
+	struct xdp_desc* descs = queue->tx.ring;
+	struct xdp_desc* desc = &descs[queue->tx.cached++ & queue->tx.mask];
+	desc->addr = packet_frame(queue->umem, packet) + offsetof(Packet, buffer) + packet->start;
+	desc->len = packet->end - packet->start;
+	desc->options = 0;
+
+	if(++queue->tx_pending >= XDP_BATCH)
+		xdp_tx_submit(queue);
+
+	return true;
+}
+
+static Driver xdp_driver = {
+	.name		= "AF_XDP",
+	.open		= xdp_open,
+	.attach		= xdp_attach,
+	.close		= xdp_close,
+	.alloc		= xdp_alloc,
+	.free		= xdp_free,
+	.has_input	= xdp_has_input,
+	.input		= xdp_input,
+	.output		= xdp_output,
+};
+
+Driver* hosted_driver = &xdp_driver;
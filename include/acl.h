@@ -0,0 +1,64 @@
+#ifndef __ACL_H__
+#define __ACL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Client prefix filter of a service, compiled to a DIR-24-8 table: the top
+ * 24 bits of an address index tbl24, and the entries holding prefixes
+ * longer than /24 point to a 256 entry group of tbl8. Longer prefixes are
+ * painted last, so every entry is already the longest match: a lookup is
+ * one or two reads. A table is never modified once published; updates
+ * compile a new one.
+ */
+#define ACL_ALLOW		1
+#define ACL_DENY		2
+
+#define ACL_TBL24_SIZE		(1 << 24)
+#define ACL_TBL8_SIZE		256
+#define ACL_EXTENDED		0x80000000	//Index is a tbl8 group
+#define ACL_DENIED		0x40000000
+#define ACL_INDEX_MASK		0x3fffffff	//Rule + 1, 0: no rule matched
+#define ACL_RULE_MAX		(1 << 22)
+#define ACL_FREE_DELAY		1000000		//Old tables are freed after 1 sec.
+
+typedef struct _AclRule {
+	uint32_t	addr;
+	uint8_t		length;
+	uint8_t		action;
+} AclRule;
+
+typedef struct _Acl {
+	uint32_t*	tbl24;
+	uint32_t*	tbl8;
+	uint32_t	tbl8_count;	//Groups
+	uint32_t	count;
+	AclRule*	rules;		//By address, then length
+	uint8_t		fallback;	//No rule matched: deny if any rule allows
+	uint32_t	stride;		//Hits of a core, padded to a cache line
+	uint64_t*	hits;		//core * stride + rule + 1, 0 for the fallback
+	void*		hits_buffer;
+	void*		pool;
+} Acl;
+
+/* rules sorted by acl_compare, without duplicates */
+Acl* acl_create(AclRule* rules, uint32_t count, void* pool);
+void acl_destroy(Acl* acl);
+/* Hits of the rules of old still in acl, before acl is published */
+void acl_carry(Acl* acl, Acl* old);
+int acl_compare(const void* a, const void* b);
+uint64_t acl_hits(Acl* acl, uint32_t index);
+
+/* false if addr is denied */
+static inline bool acl_check(Acl* acl, uint32_t addr, int core) {
+	uint32_t entry = acl->tbl24[addr >> 8];
+	if(entry & ACL_EXTENDED)
+		entry = acl->tbl8[(size_t)(entry & ACL_INDEX_MASK) << 8 | (addr & 0xff)];
+
+	acl->hits[core * acl->stride + (entry & ACL_INDEX_MASK)]++;
+
+	return !(entry & ACL_DENIED);
+}
+
+#endif /*__ACL_H__*/
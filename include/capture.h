@@ -0,0 +1,64 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+
+#include "session.h"
+
+/*
+ * Sampled capture of forwarded packets, headers only. Each core writes its
+ * own preallocated ring, the frame before and after translation, and never
+ * waits: a record being dumped is taken again if its core overwrote it.
+ */
+#define CAPTURE_SNAPLEN		128	//Ethernet, IP, tunnel and TCP headers
+#define CAPTURE_RECORDS		4096	//Per core, a power of 2
+
+#define CAPTURE_BEFORE		0	//As received
+#define CAPTURE_AFTER		1	//As sent
+
+/* Which sessions are captured, 0 matches any address or port */
+typedef struct _CaptureFilter {
+	uint32_t	sample;		//1 in sample matching packets
+	uint32_t	vip_addr;
+	uint16_t	vip_port;
+	uint32_t	server_addr;
+	uint16_t	server_port;
+	uint32_t	client_addr;
+} CaptureFilter;
+
+typedef struct _CaptureRecord {
+	uint32_t	sequence;	//Odd while written
+	uint8_t		ni_num;
+	uint8_t		point;
+	uint16_t	caplen;
+	uint32_t	length;
+	uint64_t	time;		//Packet time, us
+	uint64_t	index;		//Position in the core's ring
+	uint8_t		data[CAPTURE_SNAPLEN];
+} CaptureRecord;
+
+typedef struct _CaptureRing {
+	uint64_t	head;		//Records written
+	uint64_t	start;		//head at capture_start, set by the console
+	uint32_t	countdown;	//Matching packets until the next sample
+	CaptureRecord	records[CAPTURE_RECORDS];
+} __attribute__((aligned(64))) CaptureRing;
+
+/* Read by the datapath before anything else */
+extern bool capture_running;
+
+/* Empty the rings and capture what filter matches */
+bool capture_start(CaptureFilter* filter);
+void capture_stop();
+/* Rings as pcapng, one interface per NIC, records ordered by time */
+bool capture_dump(char* path);
+void capture_print();
+
+/* Record packet of session before translation, true if it was sampled */
+bool capture_before(Session* session, Packet* packet, int ni_num, int core);
+/* Record a sampled packet after translation, about to leave on ni */
+void capture_after(Packet* packet, NetworkInterface* ni, int core);
+
+#endif /*__CAPTURE_H__*/
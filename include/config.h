@@ -0,0 +1,59 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "endpoint.h"
+
+/*
+ * The whole desired configuration in a file, one service or server a line
+ * with the options of service add and server add:
+ *
+ *   # comment
+ *   service -t|-u addr:port nic [-s schedule] [-stateless] [-out addr nic]...
+ *   server -t|-u addr:port nic [-m mode] [-w weight] [-c max] [-b] [-s seconds] [-mtu bytes]
+ *
+ * Applying it changes only what differs. The file is parsed and checked
+ * first: nothing is touched if a line is wrong. New services and servers
+ * are made out of sight, every server list is built anew and swapped in,
+ * then VIP and scheduler tables are compiled once. Services and servers
+ * left out of the file take no new sessions and go once theirs are gone.
+ * ACLs and limits of services kept are kept.
+ */
+#define CONFIG_FILE		"lb.conf"
+#define CONFIG_LINE_SIZE	1024
+#define CONFIG_PRIVATE_MAX	8	//-out per service
+
+typedef struct _ConfigService {
+	Endpoint	endpoint;
+	uint8_t		schedule;
+	bool		stateless;
+	uint8_t		private_count;
+	Endpoint	private_endpoints[CONFIG_PRIVATE_MAX];
+} ConfigService;
+
+typedef struct _ConfigServer {
+	Endpoint	endpoint;
+	uint8_t		mode;
+	uint8_t		weight;
+	uint32_t	max_sessions;
+	bool		backup;
+	uint32_t	slow_start;	//ms
+	uint16_t	mtu;		//0: TUNNEL_MTU
+} ConfigServer;
+
+/* What an apply did, by kind: services, servers */
+typedef struct _ConfigDiff {
+	uint32_t	added[2];
+	uint32_t	changed[2];
+	uint32_t	removed[2];
+	uint32_t	failed[2];
+} ConfigDiff;
+
+/* false, with nothing changed, if the file can'nt be read or parsed */
+bool config_apply(char* path, ConfigDiff* diff);
+/* Write the services and servers in use to path, in the same form */
+bool config_save(char* path);
+
+#endif /*__CONFIG_H__*/
@@ -0,0 +1,49 @@
+#ifndef __FEEDBACK_H__
+#define __FEEDBACK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+
+#include "server.h"
+
+/*
+ * Load reports of backends: an agent on a server sends FeedbackReport in a
+ * UDP datagram to a private address of the loadbalancer, on feedback_port.
+ * Each report becomes a capacity, 0 ~ 100 % of the server's weight, and is
+ * smoothed into the server's share of new sessions. A server not heard from
+ * for feedback_timeout is scheduled by its static weight again.
+ */
+#define FEEDBACK_PORT		5999		//Below the ports NAT hands out
+#define FEEDBACK_TIMEOUT	3000		//ms
+#define FEEDBACK_MAGIC		0x4c424642	//"LBFB"
+#define FEEDBACK_VERSION	1
+#define FEEDBACK_SMOOTH		2		//A report moves capacity by 1 / (1 << FEEDBACK_SMOOTH)
+#define FEEDBACK_QUEUE_HALF	8		//Queue depth taking half the capacity
+
+/* What value of a report is */
+#define FEEDBACK_CAPACITY	1	//0 ~ 100 %
+#define FEEDBACK_CPU		2	//0 ~ 100 % busy
+#define FEEDBACK_QUEUE		3	//Requests waiting
+
+/* Network byte order */
+typedef struct _FeedbackReport {
+	uint32_t	magic;
+	uint8_t		version;
+	uint8_t		type;
+	uint16_t	port;		//Server port, 0: every server of the source address
+	uint32_t	value;
+} __attribute__((packed)) FeedbackReport;
+
+extern bool feedback_running;
+extern uint16_t feedback_port;
+
+void feedback_start(uint16_t port, uint32_t timeout);
+void feedback_stop();
+/* Report of a datagram from addr on ni, false if body is not one */
+bool feedback_receive(NetworkInterface* ni, uint32_t addr, void* body, uint32_t length);
+/* Smoothed capacity of server, 100 without fresh reports */
+uint32_t feedback_capacity(Server* server);
+void feedback_dump();
+
+#endif /*__FEEDBACK_H__*/
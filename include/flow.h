@@ -0,0 +1,41 @@
+#ifndef __FLOW_H__
+#define __FLOW_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * 5-tuple flow key. Packed into 16 bytes so that the hash is two crc32 steps
+ * and the compare is two 64-bit loads.
+ */
+typedef struct _FlowKey {
+	uint32_t	source;
+	uint32_t	destination;
+	uint16_t	source_port;
+	uint16_t	destination_port;
+	uint8_t		protocol;
+	uint8_t		padding[3];
+} __attribute__ ((packed, aligned(8))) FlowKey;
+
+#define FLOW_HASH_SEED	0x5bd1e995
+
+void flow_init();
+bool flow_hw_crc32c();
+
+void flow_key_init(FlowKey* key, uint8_t protocol, uint32_t source, uint16_t source_port, uint32_t destination, uint16_t destination_port);
+
+/*
+ * Symmetric: a key and its reverse (source <-> destination) hash to the
+ * same value, so both directions of a flow land on the same core/bucket.
+ */
+uint32_t flow_hash(FlowKey* key);
+uint32_t flow_hash_addr(uint32_t addr);
+
+uint32_t flow_crc32c_hw(uint32_t crc, uint64_t data);
+uint32_t flow_crc32c_sw(uint32_t crc, uint64_t data);
+
+/* Map callbacks for maps keyed by FlowKey* */
+uint64_t flow_map_hash(void* key);
+bool flow_map_equals(void* key1, void* key2);
+
+#endif /*__FLOW_H__*/
@@ -0,0 +1,47 @@
+#ifndef __FORWARD_H__
+#define __FORWARD_H__
+
+#include <stdbool.h>
+#include <net/packet.h>
+
+#include "session.h"
+#include "server.h"
+#include "tunnel.h"
+
+/* Forwarding specializations, one per (mode, protocol) */
+#define FORWARD_NAT_TCP		0
+#define FORWARD_NAT_UDP		1
+#define FORWARD_DNAT_TCP	2
+#define FORWARD_DNAT_UDP	3
+#define FORWARD_DR		4
+#define FORWARD_IPIP		5
+#define FORWARD_GUE		6
+#define FORWARD_COUNT		7
+
+#define FORWARD_IS_TUNNEL(forward)	((forward) == FORWARD_IPIP || (forward) == FORWARD_GUE)
+
+#define FORWARD_TRANSLATE	0	//client -> server
+#define FORWARD_UNTRANSLATE	1	//server -> client
+#define FORWARD_STATELESS	2	//client -> server, forwarded without session
+
+/*
+ * Rewrite packet headers for session. Returns false when the session is
+ * finished; the caller frees it once the packet has been sent.
+ */
+bool forward_translate(Session* session, Packet* packet);
+bool forward_untranslate(Session* session, Packet* packet);
+
+/*
+ * Stateless DR/tunnel: rewrite packet towards server. private_addr is the
+ * LB's address on the server's NI, hash the flow hash of the packet, tunnel
+ * the server's tunnel as loaded by the caller or NULL.
+ */
+bool forward_stateless(Server* server, Tunnel* tunnel, uint32_t private_addr, uint32_t hash, Packet* packet);
+
+/*
+ * Run one specialization over a group of packets. Finished sessions are
+ * appended to finished[]; returns how many were appended.
+ */
+int forward_burst(uint8_t forward, uint8_t direction, Session** sessions, Packet** packets, int count, Session** finished);
+
+#endif /*__FORWARD_H__*/
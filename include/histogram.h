@@ -0,0 +1,49 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Log-bucketed histogram of 32 bit values (HDR style): each power of 2 is
+ * split in HISTOGRAM_SUB_COUNT linear buckets, so any value is known within
+ * 1 / HISTOGRAM_SUB_COUNT. Larger values go to the last bucket.
+ */
+#define HISTOGRAM_SUB_BITS	3
+#define HISTOGRAM_SUB_COUNT	(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKET_COUNT	((32 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct _Histogram {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	buckets[HISTOGRAM_BUCKET_COUNT];
+} __attribute__((aligned(64))) Histogram;
+
+static inline uint32_t histogram_bucket(uint64_t value) {
+	if(value < HISTOGRAM_SUB_COUNT)
+		return value;
+	if(value > UINT32_MAX)
+		return HISTOGRAM_BUCKET_COUNT - 1;
+
+	uint32_t exponent = 63 - __builtin_clzl(value);
+	uint32_t sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1);
+
+	return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT + sub;
+}
+
+/* count samples of value */
+static inline void histogram_add(Histogram* histogram, uint64_t value, uint32_t count) {
+	histogram->buckets[histogram_bucket(value)] += count;
+	histogram->count += count;
+	histogram->sum += value * count;
+}
+
+/* Highest value that falls in bucket */
+uint64_t histogram_bucket_max(uint32_t bucket);
+void histogram_reset(Histogram* histogram);
+void histogram_merge(Histogram* histogram, Histogram* other);
+/* Highest value of the bucket holding the percentile, 0 ~ 100 */
+uint64_t histogram_percentile(Histogram* histogram, double percentile);
+uint64_t histogram_max(Histogram* histogram);
+
+#endif /*__HISTOGRAM_H__*/
@@ -0,0 +1,63 @@
+#ifndef __LIMIT_H__
+#define __LIMIT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * New session rate limits of a service: a token bucket per client, hashed
+ * into a fixed table per core, and one for the whole service per core. A
+ * core owns 1 / thread_count() of each rate and burst. Buckets are refilled
+ * when used, from lb_clock: nothing runs per bucket.
+ *
+ * Tokens are kept as credits: a core earns rate credits per millisecond,
+ * a session costs 1000 * thread_count() and a bucket holds burst * 1000.
+ */
+#define LIMIT_SLOTS		4096	//Power of 2, client buckets per core
+#define LIMIT_SLOT_BITS		12
+#define LIMIT_FREE_DELAY	1000000	//Old limits are freed after 1 sec.
+
+/* What is done with a refused new session */
+#define LIMIT_DROP		0
+#define LIMIT_RESET		1	//TCP SYN answered with RST, others dropped
+
+/* limit_admit() */
+#define LIMIT_OK		0
+#define LIMIT_CLIENT		1
+#define LIMIT_SERVICE		2
+
+typedef struct _LimitBucket {
+	uint32_t	key;		//Client address
+	uint32_t	time;		//lb_clock of the last refill
+	uint64_t	credits;
+} LimitBucket;
+
+typedef struct _LimitCore {
+	LimitBucket	service;
+	uint64_t	refused[3];	//By limit_admit() result
+	uint64_t	resets;
+	LimitBucket	clients[LIMIT_SLOTS];
+} __attribute__((aligned(64))) LimitCore;
+
+typedef struct _Limit {
+	uint32_t	client_rate;	//New sessions per second, 0: unlimited
+	uint32_t	client_burst;
+	uint32_t	service_rate;
+	uint32_t	service_burst;
+	uint8_t		action;
+	LimitCore*	cores;
+	void*		buffer;
+	void*		pool;
+} Limit;
+
+/* A burst of 0 is one second of rate */
+Limit* limit_create(uint32_t client_rate, uint32_t client_burst, uint32_t service_rate, uint32_t service_burst,
+		uint8_t action, void* pool);
+void limit_destroy(Limit* limit);
+/* Counters of old, before limit is published */
+void limit_carry(Limit* limit, Limit* old);
+/* Take a token of client addr and of the service, or none: LIMIT_OK or which was empty */
+uint8_t limit_admit(Limit* limit, uint32_t addr, int core);
+void limit_dump(Limit* limit);
+
+#endif /*__LIMIT_H__*/
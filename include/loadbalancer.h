@@ -6,18 +6,79 @@
 #include <net/ni.h>
 #include <stdbool.h>
 
+#include "vip.h"
+#include "stats.h"
+#include "histogram.h"
+
+#define LB_BURST	32
+#define LB_CLOCK_PERIOD	1000	//us
+
+/* Packet classes of the classification stage */
+#define LB_CLASS_FLOW	0	//TCP/UDP, goes to session lookup
+#define LB_CLASS_ARP	1
+#define LB_CLASS_ICMP	2
+#define LB_CLASS_OTHER	3
+#define LB_CLASS_COUNT	4
+
+/* Stages of lb_process, cycles are counted while profiling is on */
+#define LB_STAGE_CLASSIFY	0
+#define LB_STAGE_LOOKUP		1	//VIP and session lookup, stateless forwarding
+#define LB_STAGE_SESSION	2	//New and finished sessions
+#define LB_STAGE_FORWARD	3
+#define LB_STAGE_OUTPUT		4
+#define LB_STAGE_SLOW		5	//ARP, ICMP
+#define LB_STAGE_COUNT		6
+
+/* Milliseconds, counted by the first core: for lazy refills and ramps */
+extern volatile uint32_t lb_clock;
+
 int lb_ginit();
 int lb_init();
 void lb_loop();
 bool lb_process(Packet* packet, int ni_num);
+int lb_process_burst(Packet** packets, int count, int ni_num);
 Map* lb_get_services(int ni_num);
 Map* lb_get_servers(int ni_num); 
 Map* lb_get_sessions(int ni_num); 
+VIPTable* lb_get_vips(int ni_num);
+VIPTable* lb_set_vips(int ni_num, VIPTable* vips);
+void lb_config_update();
+/* Batch configuration changes: lb_config_update() is put off to the last release */
+void lb_config_hold();
+void lb_config_release();
+void lb_profile_set(bool on);
+bool lb_profile_get();
+/* Clear the stage cycles and histograms of every core */
+void lb_latency_reset();
+/* Histogram of stage on NIC ni_num, every core merged */
+void lb_latency(int ni_num, uint8_t stage, Histogram* histogram);
+void lb_latency_dump();
+void lb_dump();
+void lb_stats_dump();
+
+/* Datapath counters of a NIC on one core. Only that core writes them */
+typedef struct _LoadBalancerCore {
+	uint64_t classes[LB_CLASS_COUNT];
+	uint64_t new_sessions;
+	uint64_t stages[LB_STAGE_COUNT];	//Cycles, while profiling
+} __attribute__((aligned(STATS_CACHE_LINE))) LoadBalancerCore;
 
 typedef struct _LoadBalancer {
+	NetworkInterface* ni;
 	Map* services;
 	Map* servers;
 	Map* sessions;
+	VIPTable* vips;
+
+	LoadBalancerCore* cores;	//thread_count()
+	void* cores_buffer;
+	Stats* stats;
+	Histogram* latency;	//LB_STAGE_COUNT per core, while profiling
+	void* latency_buffer;
 } LoadBalancer;
 
+LoadBalancer* lb_get(int ni_num);
+/* Sum of every core's counters of NIC ni_num, read while they are written */
+void lb_sum(int ni_num, LoadBalancerCore* total);
+
 #endif /* __LOADBALANCER_H__ */
@@ -0,0 +1,55 @@
+#ifndef __MAGLEV_H__
+#define __MAGLEV_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <util/list.h>
+#include <util/map.h>
+
+#include "flow.h"
+#include "server.h"
+
+#define MAGLEV_SIZE		65537	//Prime, >> 100 * servers
+#define MAGLEV_CACHE_SIZE	4096	//Power of 2
+#define MAGLEV_FREE_DELAY	1000000	//Old tables are freed after 1 sec.
+
+/* One generation of the consistent hashing lookup table */
+typedef struct _MaglevTable {
+	uint32_t	count;
+	uint16_t	generation;	//Never 0
+	Server**	servers;
+	uint32_t*	private_addrs;	//private address on each server's NI
+	void*		pool;
+	uint16_t	lookup[MAGLEV_SIZE];
+} MaglevTable;
+
+/*
+ * Consistent hashing state of a service. While the previous generation is
+ * kept (one service timeout after a membership change), flows whose
+ * backend differs between generations are pinned in a small direct-mapped
+ * cache; everything else is stateless.
+ *
+ * Tables are published with an atomic store and freed MAGLEV_FREE_DELAY
+ * after they are replaced. A cache entry is one word, written and read
+ * whole: flow hash << 32 | table generation << 16 | server index, 0 when
+ * empty. The flow hash picks the slot in both tables, so flows sharing it
+ * would be pinned alike anyway.
+ */
+typedef struct _Maglev {
+	MaglevTable*	current;
+	MaglevTable*	previous;
+	uint16_t	generation;	//Of the last table made
+	uint64_t	event_id;
+	void*		pool;
+	uint64_t	cache[MAGLEV_CACHE_SIZE];
+} Maglev;
+
+Maglev* maglev_create(void* pool);
+void maglev_destroy(Maglev* maglev);
+/* maglev_destroy() once readers on other cores are done with it */
+void maglev_retire(Maglev* maglev);
+/* modes is a mask of 1 << MODE_* (0 takes any server). new_flow is true for a TCP SYN */
+bool maglev_update(Maglev* maglev, List* active_servers, List* deactive_servers, Map* private_endpoints, uint32_t modes, uint64_t drain);
+Server* maglev_get(Maglev* maglev, FlowKey* key, bool new_flow, uint32_t* private_addr);
+
+#endif /*__MAGLEV_H__*/
@@ -0,0 +1,88 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "stats.h"
+#include "histogram.h"
+
+/*
+ * Counters and latency histograms published to a shared memory region that
+ * an external collector maps read only (tools/lb-metrics). Thread 0 copies
+ * them every METRICS_PERIOD under a sequence lock: the datapath is never
+ * touched and readers never block the writer.
+ */
+#define METRICS_MAGIC		0x544d424c	//"LBMT"
+#define METRICS_VERSION		4
+#define METRICS_NAME		"lb-metrics"
+#define METRICS_PERIOD		100000	//us
+
+#define METRICS_NIC_MAX		16
+#define METRICS_SERVICE_MAX	1024
+#define METRICS_SERVER_MAX	8192
+#define METRICS_STAGE_COUNT	6	//LB_STAGE_COUNT
+
+typedef struct _MetricsNIC {
+	StatsCore	total;
+	uint64_t	classes[4];	//LB_CLASS_COUNT
+	uint64_t	sessions;
+	Histogram	latency[METRICS_STAGE_COUNT];
+} MetricsNIC;
+
+/* A service or a server */
+typedef struct _MetricsEntry {
+	uint8_t		protocol;
+	uint8_t		ni_num;
+	bool		active;		//Not being removed
+	char		kind[8];	//Schedule or mode, as given to the console
+	uint32_t	addr;
+	uint16_t	port;
+	uint8_t		weight;
+	uint32_t	sessions;
+	StatsCore	total;
+} MetricsEntry;
+
+typedef struct _Metrics {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	size;		//sizeof(Metrics) of the writer
+	uint32_t	sequence;	//Odd while written
+	uint32_t	core_count;
+	uint64_t	generation;	//Publications so far
+	bool		profile;	//Latency is recorded
+	bool		truncated;	//More services or servers than fit
+	uint32_t	nic_count;
+	uint32_t	service_count;
+	uint32_t	server_count;
+	MetricsNIC	nics[METRICS_NIC_MAX];
+	MetricsEntry	services[METRICS_SERVICE_MAX];
+	MetricsEntry	servers[METRICS_SERVER_MAX];
+} Metrics;
+
+/* Publish to a new region name, instead of the current one */
+bool metrics_open(char* name);
+void metrics_close();
+/* Name of the region, NULL when closed */
+char* metrics_name();
+bool metrics_init();
+void metrics_publish();
+
+/* Consistent copy of metrics, false if the writer kept it busy */
+static inline bool metrics_read(volatile Metrics* metrics, Metrics* copy) {
+	for(int i = 0; i < 1000; i++) {
+		uint32_t sequence = __atomic_load_n(&metrics->sequence, __ATOMIC_ACQUIRE);
+		if(sequence & 1)
+			continue;
+
+		memcpy(copy, (void*)metrics, sizeof(Metrics));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&metrics->sequence, __ATOMIC_RELAXED) == sequence)
+			return true;
+	}
+
+	return false;
+}
+
+#endif /*__METRICS_H__*/
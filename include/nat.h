@@ -7,5 +7,7 @@
 
 Session* nat_tcp_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint);
 Session* nat_udp_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint);
+/* Move a NAT session to port of its private address, false if taken. Other modes have no port to move */
+bool nat_set_port(Session* session, uint16_t port);
 
 #endif /*__NAT_H__*/
@@ -1,6 +1,8 @@
 #ifndef __SCHEDULE_H__
 #define __SCHEDULE_H__
 
+#include <util/list.h>
+
 #include "server.h"
 #include "service.h"
 
@@ -9,15 +11,45 @@
 #define SCHEDULE_LEAST			3
 #define SCHEDULE_SOURCE_IP_HASH		4
 #define SCHEDULE_WEIGHTED_ROUND_ROBIN	5
+#define SCHEDULE_CONSISTENT_HASH	6
+
+#define SCHEDULE_STRIDE		2654435761U	//Prime, larger than whole weights
+#define SCHEDULE_WEIGHTS_PERIOD	10000		//us, shares checked for slow starts and feedback
+#define SCHEDULE_LOAD_SHIFT	16		//Fraction bits of the per session loads
 
 typedef struct _RoundRobin {
 	uint32_t robin;
+	void*	pool;
 } RoundRobin;
 
+/*
+ * Active servers of a weighted round robin or least connection service
+ * with their shares, built whole when the list or a share changes and
+ * published like the round robin state. Picks read it without walking
+ * the list or computing a share.
+ */
+typedef struct _ScheduleWeights {
+	uint32_t	count;
+	bool		scaled;		//Weights in 1/SERVER_SHARE_SCALE: a server below its full share
+	uint64_t	whole;
+	Server**	servers;
+	uint64_t*	cumulative;	//Weights of servers 0 ~ i
+	uint64_t*	loads;		//Load a session adds, 0 for no share
+	uint32_t*	shares;		//At build time
+	uint8_t*	weights;	//At build time
+	void*		pool;
+} ScheduleWeights;
+
+ScheduleWeights* schedule_weights_create(List* servers, void* pool);
+void schedule_weights_destroy(ScheduleWeights* weights);
+/* A share or weight moved since the weights were built */
+bool schedule_weights_stale(ScheduleWeights* weights);
+
 Server* schedule_round_robin(Service* service, Endpoint* client_endpoint);
 Server* schedule_weighted_round_robin(Service* service, Endpoint* client_endpoint);
 Server* schedule_random(Service* service, Endpoint* client_endpoint);
 Server* schedule_least(Service* service, Endpoint* client_endpoint);
 Server* schedule_source_ip_hash(Service* service, Endpoint* client_endpoint);
+Server* schedule_consistent_hash(Service* service, Endpoint* client_endpoint);
 
 #endif /*__SCHEDULE_H__*/
@@ -7,6 +7,7 @@
 
 #include "session.h"
 #include "endpoint.h"
+#include "stats.h"
 
 #define SERVER_STATE_ACTIVE	1
 #define SERVER_STATE_DEACTIVE	2
@@ -14,9 +15,16 @@
 #define MODE_NAT	1
 #define MODE_DNAT	2
 #define MODE_DR		3
+#define MODE_IPIP	4
+#define MODE_GUE	5
+
+#define MODE_IS_TUNNEL(mode)	((mode) == MODE_IPIP || (mode) == MODE_GUE)
 
 #define SERVERS	"net.lb.servers"
 
+#define SERVER_RAMP_SCALE	16	//Steps of the slow start ramp
+#define SERVER_SHARE_SCALE	(SERVER_RAMP_SCALE * 100)	//Warm, at 100 % capacity
+
 typedef struct _Server {
 	Endpoint	endpoint;
 
@@ -25,23 +33,53 @@ typedef struct _Server {
 	uint8_t		mode;
 	uint8_t		weight;
 	Map*		sessions;
+	uint32_t	max_sessions;	//0: no cap
+	uint32_t	active_sessions;	//Of every core, kept on session alloc and free
+	bool		backup;		//Scheduled only when no other server has room
+	uint32_t	slow_start;	//ms to ramp up to weight after activation, 0: none
+	uint16_t	mtu;		//Path MTU of MODE_IPIP and MODE_GUE, 0: TUNNEL_MTU
+	uint32_t	activated;	//lb_clock
+	bool		ramping;	//Cleared once the window has passed
+	uint32_t	capacity;	//Feedback reports smoothed, % << 8
+	uint32_t	reported;	//lb_clock of the last report
+	uint64_t	reports;
 	
 	Session*	(*create)(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint);
-	void*		priv;
+	void*		priv;		//Tunnel* in MODE_IPIP and MODE_GUE
+	Stats*		stats;
 } Server;
 
 Server* server_alloc(Endpoint* server_endpoint);
+/* A server of its NIC in no service's lists yet: see service_rebuild_servers() */
+Server* server_create(Endpoint* server_endpoint);
 bool server_free(Server* server);
 bool server_set_mode(Server* server, uint8_t mode);
+bool server_set_backup(Server* server, bool backup);
+/* Packets too big for mtu with the outer header are refused (ICMP if DF). 0: TUNNEL_MTU */
+bool server_set_mtu(Server* server, uint16_t mtu);
+/* Restarts the ramp: the server takes new sessions slowly for window ms */
+void server_set_slow_start(Server* server, uint32_t window);
+/* Share of its weight the server takes now, 1 ~ SERVER_RAMP_SCALE */
+uint32_t server_ramp(Server* server);
+/* Share of its weight the server takes now, by ramp and reported capacity: 0 ~ SERVER_SHARE_SCALE */
+uint32_t server_share(Server* server);
+
+/* Cores check the cap apart: each may take one session over it */
+static inline bool server_full(Server* server) {
+	return server->max_sessions && __atomic_load_n(&server->active_sessions, __ATOMIC_RELAXED) >= server->max_sessions;
+}
 
 Server* server_get(Endpoint* server_endpoint);
 
-Session* server_get_session(Endpoint* client_endpoint);
+Session* server_get_session(Endpoint* server_endpoint, Endpoint* private_endpoint);
 
 bool server_remove(Server* server, uint64_t wait);
+/* No new sessions: removed once its sessions are gone, checked every second */
+bool server_retire(Server* server);
 bool server_remove_force(Server* server);
 void server_is_remove_grace(Server* server);
 
 void server_dump();
+void server_stats_dump();
 
 #endif/* __SERVER_H__*/
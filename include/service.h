@@ -8,6 +8,10 @@
 #include "session.h"
 #include "endpoint.h"
 #include "server.h"
+#include "stats.h"
+#include "top.h"
+#include "acl.h"
+#include "limit.h"
 
 #define SERVICE_STATE_ACTIVE	1
 #define SERVICE_STATE_DEACTIVE	2
@@ -26,17 +30,39 @@ typedef struct _Service {
 	Map*		private_endpoints;
 	List*		active_servers;
 	List*		deactive_servers;
+	List*		backup_servers;	//Active ones, taking what the others have no room for
+	Server*		spill;		//Last server spilled to, tried first while it has room
+	uint32_t	spill_full;	//lb_clock + 1 when no active server had room
 	
 	Map*		sessions;
 
+	bool		stateless;	//DR without sessions, consistent hashing
 	uint8_t		schedule;
 	Server*		(*next)(struct _Service*, Endpoint* client_endpoint);
-	void*		priv;
+	//Scheduler state, published before next and retired after it
+	struct _RoundRobin* robin;
+	struct _ScheduleWeights* weights;	//w and l, rebuilt by service_update() and service_refresh()
+	struct _Maglev*	maglev;
+	Stats*		stats;
+	Top*		top;		//TOP_KIND_COUNT per core, from the first session top on
+	void*		top_buffer;
+	Acl*		acl;		//Client filter, NULL: all allowed
+	Limit*		limit;		//New session rates, NULL: unlimited
 } Service;
 
+/* The list an active server is kept in */
+static inline List* service_servers(Service* service, Server* server) {
+	return server->backup ? service->backup_servers : service->active_servers;
+}
 
 Service* service_alloc(Endpoint* service_endpoint);
 bool service_set_schedule(Service* service, uint8_t schedule);
+bool service_set_stateless(Service* service);
+bool service_update(Service* service);
+/* Scheduler weights rebuilt if a share moved: slow starts, feedback */
+void service_refresh(Service* service);
+/* Server lists made anew from the servers of the private NICs and swapped in, old ones freed later */
+bool service_rebuild_servers(Service* service);
 
 bool service_add_private_addr(Service* service, Endpoint* private_endpoint);
 bool service_set_private_addr(Service* service, Endpoint* private_endpoint);
@@ -47,13 +73,33 @@ bool service_free(Service* service);
 Service* service_get(Endpoint* service_endpoint);
 bool service_empty(NetworkInterface* ni);
 
-Session* service_alloc_session(Endpoint* service_endpoint, Endpoint* client_endpoint);
-Session* service_get_session(Endpoint* client_endpoint);
+/* limited, if not NULL, is set when a rate limit refused the session */
+Session* service_alloc_session(Service* service, Endpoint* client_endpoint, bool* limited);
+/* The session of client_endpoint on server, unscheduled: with NAT port private_port if not 0 */
+Session* service_install_session(Service* service, Server* server, Endpoint* client_endpoint, uint16_t private_port);
+Session* service_get_session(Endpoint* client_endpoint, Endpoint* service_endpoint);
 bool service_free_session(Session* session);
 
 void service_is_remove_grace(Service* service);
 bool service_remove(Service* service, uint64_t wait);
+/* No new sessions: removed once its sessions are gone, checked every second */
+bool service_retire(Service* service);
 bool service_remove_force(Service* service);
 void service_dump();
+void service_stats_dump();
+
+/* Count every session of every service and keep their top talkers */
+bool service_top_start(uint32_t sample);
+void service_top_stop();
+void service_top_dump(Service* service, int count);
+
+/* Add or replace rules, remove them, or all of them: one new table each */
+bool service_acl_add(Service* service, AclRule* rules, uint32_t count);
+bool service_acl_remove(Service* service, AclRule* rules, uint32_t count);
+bool service_acl_flush(Service* service);
+void service_acl_dump(Service* service);
+
+/* Replace the service's limits, NULL to remove them */
+bool service_limit_set(Service* service, Limit* limit);
 
 #endif /*__SERVICE_H__*/
@@ -4,30 +4,42 @@
 #include <net/ni.h>
 
 #include "endpoint.h"
+#include "flow.h"
 
 #define SESSION_IN	1
 #define SESSION_OUT	2
 
 #define SESSIONS	"net.lb.sessions"
 
+struct _Server;
+struct _Service;
+
 typedef struct _Session {
+	struct _Server*	server;
+	struct _Service* service;
 	Endpoint*	server_endpoint;
 	Endpoint*	public_endpoint;
 	Endpoint	client_endpoint;
 	Endpoint	private_endpoint;
 
+	FlowKey		public_key;	//client -> service
+	FlowKey		private_key;	//server -> private
+
 	uint64_t	event_id;
 	bool		fin;
 	
-	bool(*translate)(struct _Session* session, Packet* packet);
-	bool(*untranslate)(struct _Session* session, Packet* packet);
+	uint8_t		forward;	//FORWARD_* specialization
+	uint64_t	packets;	//Both directions, counted while top_running
+	uint64_t	bytes;
+	uint32_t	synced;		//lb_clock of the last sync record
 	bool(*free)(struct _Session* session);
 } Session;
 
 bool session_recharge(Session* session); //move in untranslate & translate
 //bool session_free(Session* session);
 bool session_set_fin(Session* session); //move in untranslate
-uint64_t session_get_private_key(Session* session);
-uint64_t session_get_public_key(Session* session);
+void session_init_key(Session* session);
+FlowKey* session_get_private_key(Session* session);
+FlowKey* session_get_public_key(Session* session);
 
 #endif /*__SESSION_H__*/
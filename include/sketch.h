@@ -0,0 +1,55 @@
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * New session rate of every client and /24, for flood detection. Each core
+ * counts in its own count-min sketch, two of them swapped every window.
+ * Keys whose count on one core reaches its share of a threshold are noted
+ * as candidates; at the end of the window the first core sums the sketches
+ * and keeps the candidates over the threshold. Memory is fixed whatever the
+ * number of sources: nothing is allocated per client.
+ */
+#define SKETCH_DEPTH		4
+#define SKETCH_WIDTH		16384	//Power of 2: over-count mostly below 1 / 6000 of the window
+#define SKETCH_WIDTH_BITS	14
+#define SKETCH_CANDIDATES	256	//Per core and window
+#define SKETCH_PERIOD		1000000	//us, window
+#define SKETCH_OFFENDERS	64	//Reported per window
+#define SKETCH_BLOCK_MAX	1024
+#define SKETCH_BLOCK_SLOTS	2048	//Power of 2, twice SKETCH_BLOCK_MAX
+#define SKETCH_BLOCK_SLOT_BITS	11
+
+/* Keys: the client, or its /24 with this bit set */
+#define SKETCH_PREFIX		(1ULL << 32)
+#define SKETCH_PREFIX_MASK	0xffffff00
+
+typedef struct _SketchCore {
+	uint32_t	counters[2][SKETCH_DEPTH][SKETCH_WIDTH];	//Per window parity
+	uint64_t	candidates[2][SKETCH_CANDIDATES];
+	uint32_t	candidate_count[2];
+	uint32_t	candidates_lost[2];
+	uint64_t	sessions[2];
+} __attribute__((aligned(64))) SketchCore;
+
+typedef struct _SketchOffender {
+	uint64_t	key;
+	uint32_t	count;		//New sessions in the window
+} SketchOffender;
+
+/* Read by the datapath before anything else */
+extern bool sketch_running;
+
+/* threshold, prefix_threshold: new sessions per second. block: seconds, 0 to only report */
+bool sketch_start(uint32_t threshold, uint32_t prefix_threshold, uint32_t block);
+void sketch_stop();
+bool sketch_init();
+/* Count a new session of addr, false if addr or its /24 is blocked */
+bool sketch_admit(uint32_t addr, int core);
+/* Estimated new sessions of key in the last window */
+uint32_t sketch_estimate(uint64_t key);
+void sketch_dump();
+
+#endif /*__SKETCH_H__*/
@@ -0,0 +1,42 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Sessions saved to a file, to be loaded back by a restarted loadbalancer
+ * with the same services and servers. The file is a SnapshotHeader, the
+ * scheduler state of every service and then one sync record per session
+ * (network byte order), fixed size all: it can be mapped and read in
+ * place. Loading makes each session on its recorded server and NAT port,
+ * without the scheduler, the limits or sync.
+ */
+#define SNAPSHOT_MAGIC		0x4c425353	//"LBSS"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_FILE		"lb.sessions"	//Saved at exit, when there are sessions
+
+typedef struct _SnapshotHeader {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	service_size;	//sizeof(SnapshotService)
+	uint32_t	record_size;	//sizeof(SyncRecord)
+	uint32_t	service_count;
+	uint32_t	session_count;
+} SnapshotHeader;
+
+typedef struct _SnapshotService {
+	uint8_t		protocol;
+	uint8_t		ni;
+	uint16_t	port;
+	uint32_t	addr;
+	uint32_t	robin;		//Round robin position of rr and w
+	uint32_t	reserved;
+} SnapshotService;
+
+/* Sessions saved, -1 on error */
+int64_t snapshot_save(char* path);
+/* Sessions loaded, -1 on error. Sessions failed to load are counted in failed */
+int64_t snapshot_load(char* path, uint32_t* failed);
+
+#endif /*__SNAPSHOT_H__*/
@@ -0,0 +1,69 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define STATS_IN	0	//Client -> server, or received by a NIC. Same as FORWARD_TRANSLATE
+#define STATS_OUT	1	//Server -> client, or sent by a NIC. Same as FORWARD_UNTRANSLATE
+
+/* Why the datapath dropped a packet, counted on the NIC it came from */
+#define STATS_DROP_NO_SERVICE	0	//No VIP, or not forwarded (ARP, ICMP, other)
+#define STATS_DROP_NO_SESSION	1	//Server side packet without session
+#define STATS_DROP_NO_SERVER	2	//Scheduler miss or session allocation failure
+#define STATS_DROP_TUNNEL	3	//Too big or not encapsulated
+#define STATS_DROP_OUTPUT	4	//NIC refused it
+#define STATS_DROP_BLOCKED	5	//New session of a blocked source
+#define STATS_DROP_DENIED	6	//Client denied by the service's ACL
+#define STATS_DROP_LIMITED	7	//Over a new session rate limit
+#define STATS_DROP_COUNT	8
+
+#define STATS_CACHE_LINE	64
+#define STATS_SAMPLE_PERIOD	1000000	//us
+#define STATS_SAMPLE_COUNT	64	//Windows up to a minute
+
+/* Counters of one core. Only that core writes them: no atomics, no sharing */
+typedef struct _StatsCore {
+	uint64_t	packets[2];
+	uint64_t	bytes[2];
+	uint64_t	sessions_created;
+	uint64_t	sessions_freed;		//Expired included
+	uint64_t	sessions_expired;
+	uint64_t	alloc_failures;
+	uint64_t	schedule_misses;
+	uint64_t	drops[STATS_DROP_COUNT];
+} __attribute__((aligned(STATS_CACHE_LINE))) StatsCore;
+
+/* Sum of the cores, taken every STATS_SAMPLE_PERIOD */
+typedef struct _StatsSample {
+	uint64_t	packets[2];
+	uint64_t	bytes[2];
+	uint64_t	sessions_created;
+	uint64_t	drops;
+} StatsSample;
+
+/* Counters of a NIC, service or server */
+typedef struct _Stats {
+	StatsCore*	cores;		//thread_count() cache lines
+	int		core_count;
+	void*		buffer;
+	void*		pool;
+	uint32_t	sample_count;
+	StatsSample	samples[STATS_SAMPLE_COUNT];
+} Stats;
+
+bool stats_ginit();
+bool stats_init();
+Stats* stats_create(void* pool);
+void stats_destroy(Stats* stats);
+/* Sum of every core, read while they are written */
+void stats_sum(Stats* stats, StatsCore* total);
+/* Per second over the last seconds, false until there are enough samples */
+bool stats_rate(Stats* stats, uint32_t seconds, StatsSample* rate);
+void stats_print(Stats* stats);
+
+static inline StatsCore* stats_core(Stats* stats, int core) {
+	return &stats->cores[core];
+}
+
+#endif /*__STATS_H__*/
@@ -0,0 +1,96 @@
+#ifndef __SYNC_H__
+#define __SYNC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+
+#include "session.h"
+
+/*
+ * Session replication to a peer loadbalancer with the same services and
+ * servers. Cores append records of the sessions they create, free and keep
+ * using to a ring of their own; the first core ships them in batches of UDP
+ * datagrams, at most rate records per second, from a local address of a NIC
+ * to the peer. A peer starting sync says hello, and is sent every session
+ * (bulk resync). Records received are applied to the session tables:
+ * sessions are created with the same server and NAT port, recharged, or
+ * freed.
+ */
+#define SYNC_PORT		5998
+#define SYNC_MAGIC		0x4c425359	//"LBSY"
+#define SYNC_VERSION		1
+#define SYNC_RING_SIZE		4096		//Power of 2, records per core
+#define SYNC_BATCH		48		//Records per datagram
+#define SYNC_PERIOD		1000		//us, of shipping
+#define SYNC_RATE		100000		//Records per second
+#define SYNC_REFRESH		10000		//ms between refreshes of a session in use
+#define SYNC_HELLO_PERIOD	1000		//ms, until the peer is heard
+
+/* Datagrams */
+#define SYNC_DATA		1
+#define SYNC_HELLO		2
+
+/* Records */
+#define SYNC_RECORD_CREATE	1
+#define SYNC_RECORD_DELETE	2
+#define SYNC_RECORD_REFRESH	3
+
+/* Network byte order */
+typedef struct _SyncHeader {
+	uint32_t	magic;
+	uint8_t		version;
+	uint8_t		type;
+	uint16_t	count;		//Records that follow
+	uint32_t	sequence;	//Of data datagrams, restarting at hello
+} __attribute__((packed)) SyncHeader;
+
+typedef struct _SyncRecord {
+	uint8_t		type;
+	uint8_t		protocol;
+	uint8_t		service_ni;
+	uint8_t		server_ni;
+	uint32_t	service_addr;
+	uint32_t	client_addr;
+	uint32_t	server_addr;
+	uint16_t	service_port;
+	uint16_t	client_port;
+	uint16_t	server_port;
+	uint16_t	private_port;	//NAT port, 0 in other modes
+} __attribute__((packed)) SyncRecord;
+
+typedef struct _SyncCore {
+	volatile uint32_t	head;		//Written by the core
+	volatile uint32_t	tail;		//Written by the first core
+	bool			applying;	//Peer records: nothing to send back
+	uint64_t		overflows;
+	uint64_t		applied[4];	//By record type, 0: failed
+	SyncRecord		records[SYNC_RING_SIZE];
+} __attribute__((aligned(64))) SyncCore;
+
+extern bool sync_running;
+
+bool sync_init();
+bool sync_start(NetworkInterface* ni, uint32_t addr, uint32_t peer, uint16_t port, uint32_t rate);
+void sync_stop();
+void sync_record(SyncRecord* record, uint8_t type, Session* session);
+/* Create records of every session, count of them: NULL if none */
+SyncRecord* sync_collect(uint32_t* count);
+/* The session of a create record, made unless there is one: NULL if it can'nt be */
+Session* sync_install(SyncRecord* record);
+/* Queue a record of session on core's ring */
+void sync_session(uint8_t type, Session* session, int core);
+/* Datagram from the peer on ni, false if it is not one */
+bool sync_receive(NetworkInterface* ni, uint32_t source, uint32_t destination, uint16_t port, void* body, uint32_t length);
+void sync_dump();
+
+/* A session in use, not synced for SYNC_REFRESH */
+static inline void sync_refresh(Session* session, int core, uint32_t now) {
+	if(now - session->synced < SYNC_REFRESH)
+		return;
+
+	session->synced = now;
+	sync_session(SYNC_RECORD_REFRESH, session, core);
+}
+
+#endif /*__SYNC_H__*/
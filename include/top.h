@@ -0,0 +1,50 @@
+#ifndef __TOP_H__
+#define __TOP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Space-saving heavy hitters: TOP_SIZE keys in a min-heap on their count,
+ * found through a small linear probing table. A new key takes the place of
+ * the smallest and inherits its count as error, so any key with more than
+ * total / TOP_SIZE is held. Every update is O(log TOP_SIZE).
+ */
+#define TOP_SIZE	64
+#define TOP_SLOTS	128	//Power of 2, twice TOP_SIZE
+#define TOP_SLOT_BITS	7
+
+/* Summaries of a service, per core */
+#define TOP_FLOW_BYTES		0
+#define TOP_FLOW_PACKETS	1
+#define TOP_CLIENT_BYTES	2
+#define TOP_CLIENT_PACKETS	3
+#define TOP_KIND_COUNT		4
+
+typedef struct _TopEntry {
+	uint64_t	key;
+	uint64_t	count;		//Ranked by
+	uint64_t	error;		//Inherited, count - error was really seen
+	uint64_t	other;		//Packets when ranked by bytes and the reverse, since held
+	uint8_t		slot;
+} TopEntry;
+
+typedef struct _Top {
+	uint32_t	size;
+	uint32_t	countdown;	//Packets until the next sample, in a core's first Top
+	TopEntry	heap[TOP_SIZE];
+	uint8_t		slots[TOP_SLOTS];	//Heap index + 1, 0 if free
+} __attribute__((aligned(64))) Top;
+
+#define TOP_DEFAULT_SAMPLE	16
+
+/* Per session and top-K accounting is done while this is set */
+extern bool top_running;
+/* Tops see 1 in top_sample packets, weighted by it. Sessions see all */
+extern uint32_t top_sample;
+
+void top_add(Top* top, uint64_t key, uint64_t count, uint64_t other);
+/* Keys of count tops summed, by count - error first, returns how many in entries */
+int top_merge(Top* tops, int count, int stride, TopEntry* entries);
+
+#endif /*__TOP_H__*/
@@ -0,0 +1,48 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/packet.h>
+#include <net/ip.h>
+#include <net/udp.h>
+
+#include "server.h"
+#include "session.h"
+#include "endpoint.h"
+
+#define TUNNEL_MTU		1500	//Path MTU to a server without -mtu
+#define TUNNEL_MTU_MIN		576	//Every IPv4 host takes datagrams this big
+#define TUNNEL_TTL		64
+#define TUNNEL_GUE_PORT		6080
+#define TUNNEL_GUE_LEN		4
+#define TUNNEL_FREE_DELAY	1000000	//Old tunnels are freed after 1 sec.
+
+#define TUNNEL_OK		0
+#define TUNNEL_TOO_BIG		1	//DF set, answer ICMP fragmentation needed
+#define TUNNEL_NO_ROOM		2	//drop
+
+/* Outer header of a server, built once when the mode is set */
+typedef struct _Tunnel {
+	uint8_t		mode;
+	uint16_t	overhead;	//IPIP 20, GUE 32
+	uint16_t	mtu;		//Of the path to the server, outer header included
+	uint32_t	source;		//LB address on the server's NI
+	uint32_t	partial;	//Checksum sum of constant outer IP words
+	void*		pool;
+	uint8_t		header[IP_LEN + UDP_LEN + TUNNEL_GUE_LEN];
+} Tunnel;
+
+Tunnel* tunnel_create(Server* server, uint8_t mode, void* pool);
+void tunnel_destroy(Tunnel* tunnel);
+void tunnel_set_source(Tunnel* tunnel, uint32_t source);
+void tunnel_set_mtu(Tunnel* tunnel, uint16_t mtu);
+
+uint8_t tunnel_check(Tunnel* tunnel, Packet* packet);
+void tunnel_encap(Tunnel* tunnel, Packet* packet, uint32_t source, uint32_t hash);
+bool tunnel_frag_needed(Tunnel* tunnel, Packet* packet);
+
+Session* ipip_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint);
+Session* gue_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint);
+
+#endif /*__TUNNEL_H__*/
@@ -0,0 +1,56 @@
+#ifndef __VIP_H__
+#define __VIP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "endpoint.h"
+
+/* Role of a packet, decided from its addresses before any session lookup */
+#define VIP_ROLE_NONE		0
+#define VIP_ROLE_SERVICE	1	//client -> VIP
+#define VIP_ROLE_PRIVATE	2	//backend -> private (SNAT) address
+#define VIP_ROLE_SERVER		3	//backend -> client (DNAT return)
+
+typedef struct _VIPEntry {
+	uint64_t	key;	//addr << 32 | protocol << 16 | port
+	uint8_t		role;
+	void*		data;	//Service* or Server*
+} VIPEntry;
+
+/* Object dropped from the tables, destroyed once no core can reach it */
+typedef struct _VIPRetired {
+	struct _VIPRetired*	next;
+	void			(*destroy)(void* object);
+	void*			object;
+} VIPRetired;
+
+/*
+ * Per NI sorted tables. destinations is matched against the destination
+ * endpoint (a private address is a wildcard entry with protocol and port
+ * 0), sources against the source endpoint.
+ */
+typedef struct _VIPTable {
+	uint32_t	destination_count;
+	uint32_t	source_count;
+	VIPEntry*	destinations;
+	VIPEntry*	sources;
+	void*		pool;
+	VIPRetired*	retired;	//Destroyed with the table
+	VIPEntry	entries[0];
+} VIPTable;
+
+#define VIP_FREE_DELAY	1000000	//Old tables are freed after 1 sec.
+
+bool vip_rebuild();
+
+/*
+ * Destroy object once the tables rebuilt without it are old enough: readers
+ * on other cores may still reach it through the table they hold. Unlink it
+ * from the configuration first, lb_config_update() rebuilds the tables.
+ */
+void vip_retire(void (*destroy)(void* object), void* object);
+uint8_t vip_lookup(VIPTable* table, Endpoint* source_endpoint, Endpoint* destination_endpoint, void** data);
+void vip_dump();
+
+#endif /*__VIP_H__*/
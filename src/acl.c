@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+
+#include "acl.h"
+
+int acl_compare(const void* a, const void* b) {
+	const AclRule* x = a;
+	const AclRule* y = b;
+
+	if(x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	if(x->length != y->length)
+		return x->length < y->length ? -1 : 1;
+
+	return 0;
+}
+
+static void acl_fill(uint32_t* entries, size_t count, uint32_t entry) {
+	if(!entry) {
+		bzero(entries, count * sizeof(uint32_t));
+		return;
+	}
+
+	for(size_t i = 0; i < count; i++)
+		entries[i] = entry;
+}
+
+Acl* acl_create(AclRule* rules, uint32_t count, void* pool) {
+	if(count > ACL_RULE_MAX) {
+		printf("Too many rules: %u, up to %u\n", count, ACL_RULE_MAX);
+		return NULL;
+	}
+
+	Acl* acl = __malloc(sizeof(Acl), pool);
+	if(!acl)
+		return NULL;
+	bzero(acl, sizeof(Acl));
+	acl->pool = pool;
+	acl->count = count;
+	acl->fallback = ACL_ALLOW;
+
+	//Every /24 holding a longer prefix needs a group; rules are sorted by address
+	uint32_t last = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		if(rules[i].action == ACL_ALLOW)
+			acl->fallback = ACL_DENY;
+		if(rules[i].length <= 24)
+			continue;
+		if(acl->tbl8_count && rules[i].addr >> 8 == last)
+			continue;
+
+		last = rules[i].addr >> 8;
+		acl->tbl8_count++;
+	}
+
+	acl->stride = (count + 1 + 7) & ~7;
+	size_t hits_size = sizeof(uint64_t) * acl->stride * thread_count();
+	acl->tbl24 = __malloc(sizeof(uint32_t) * ACL_TBL24_SIZE, pool);
+	acl->tbl8 = __malloc(sizeof(uint32_t) * ACL_TBL8_SIZE * (acl->tbl8_count ? acl->tbl8_count : 1), pool);
+	acl->rules = __malloc(sizeof(AclRule) * (count ? count : 1), pool);
+	acl->hits_buffer = __malloc(hits_size + 64, pool);
+	if(!acl->tbl24 || !acl->tbl8 || !acl->rules || !acl->hits_buffer) {
+		printf("Can'nt allocate ACL of %u rules\n", count);
+		acl_destroy(acl);
+		return NULL;
+	}
+
+	acl->hits = (uint64_t*)(((uintptr_t)acl->hits_buffer + 63) & ~(uintptr_t)63);
+	bzero(acl->hits, hits_size);
+	memcpy(acl->rules, rules, sizeof(AclRule) * count);
+
+	//Paint shorter prefixes first, longer ones over them
+	acl_fill(acl->tbl24, ACL_TBL24_SIZE, acl->fallback == ACL_DENY ? ACL_DENIED : 0);
+	uint32_t groups = 0;
+	for(int length = 0; length <= 32; length++) {
+		for(uint32_t i = 0; i < count; i++) {
+			AclRule* rule = &acl->rules[i];
+			if(rule->length != length)
+				continue;
+
+			uint32_t entry = (i + 1) | (rule->action == ACL_DENY ? ACL_DENIED : 0);
+			if(length <= 24) {
+				acl_fill(&acl->tbl24[rule->addr >> 8], 1 << (24 - length), entry);
+				continue;
+			}
+
+			uint32_t* tbl24 = &acl->tbl24[rule->addr >> 8];
+			if(!(*tbl24 & ACL_EXTENDED)) {
+				acl_fill(&acl->tbl8[(size_t)groups << 8], ACL_TBL8_SIZE, *tbl24);
+				*tbl24 = ACL_EXTENDED | groups++;
+			}
+
+			uint32_t* group = &acl->tbl8[(size_t)(*tbl24 & ACL_INDEX_MASK) << 8];
+			acl_fill(&group[rule->addr & 0xff], 1 << (32 - length), entry);
+		}
+	}
+
+	return acl;
+}
+
+void acl_destroy(Acl* acl) {
+	if(acl->tbl24)
+		__free(acl->tbl24, acl->pool);
+	if(acl->tbl8)
+		__free(acl->tbl8, acl->pool);
+	if(acl->rules)
+		__free(acl->rules, acl->pool);
+	if(acl->hits_buffer)
+		__free(acl->hits_buffer, acl->pool);
+	__free(acl, acl->pool);
+}
+
+void acl_carry(Acl* acl, Acl* old) {
+	int cores = thread_count();
+	for(int core = 0; core < cores; core++)
+		acl->hits[core * acl->stride] += old->hits[core * old->stride];
+
+	//Both sorted the same way
+	uint32_t j = 0;
+	for(uint32_t i = 0; i < old->count; i++) {
+		while(j < acl->count && acl_compare(&acl->rules[j], &old->rules[i]) < 0)
+			j++;
+		if(j == acl->count)
+			break;
+		if(acl_compare(&acl->rules[j], &old->rules[i]))
+			continue;
+
+		for(int core = 0; core < cores; core++)
+			acl->hits[core * acl->stride + j + 1] += old->hits[core * old->stride + i + 1];
+	}
+}
+
+uint64_t acl_hits(Acl* acl, uint32_t index) {
+	uint64_t hits = 0;
+	int cores = thread_count();
+	for(int core = 0; core < cores; core++)
+		hits += acl->hits[core * acl->stride + index];
+
+	return hits;
+}
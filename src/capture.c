@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+
+#include "capture.h"
+#include "service.h"
+#include "server.h"
+
+extern void* __gmalloc_pool;
+
+bool capture_running;
+static CaptureFilter filter;
+static CaptureRing* rings;	//thread_count(), allocated by the first capture
+static void* rings_buffer;
+
+bool capture_start(CaptureFilter* _filter) {
+	if(!rings) {
+		size_t size = sizeof(CaptureRing) * thread_count();
+		rings_buffer = __malloc(size + 64, __gmalloc_pool);
+		if(!rings_buffer) {
+			printf("Can'nt allocate capture rings\n");
+			return false;
+		}
+		rings = (CaptureRing*)(((uintptr_t)rings_buffer + 63) & ~(uintptr_t)63);
+		bzero(rings, size);
+	}
+
+	capture_running = false;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	filter = *_filter;
+	if(!filter.sample)
+		filter.sample = 1;
+
+	//Records before start are not dumped any more
+	for(int i = 0; i < thread_count(); i++) {
+		rings[i].start = __atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE);
+		rings[i].countdown = filter.sample;
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	capture_running = true;
+
+	return true;
+}
+
+void capture_stop() {
+	capture_running = false;
+}
+
+static inline bool capture_match(uint32_t addr, uint16_t port, uint32_t _addr, uint16_t _port) {
+	return (!addr || addr == _addr) && (!port || port == _port);
+}
+
+static void capture_record(CaptureRing* ring, Packet* packet, int ni_num, uint8_t point) {
+	uint64_t index = ring->head;
+	CaptureRecord* record = &ring->records[index & (CAPTURE_RECORDS - 1)];
+	uint32_t sequence = record->sequence;
+	__atomic_store_n(&record->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	uint32_t length = packet->end - packet->start;
+	uint16_t caplen = length < CAPTURE_SNAPLEN ? length : CAPTURE_SNAPLEN;
+	record->ni_num = ni_num;
+	record->point = point;
+	record->caplen = caplen;
+	record->length = length;
+	record->time = packet->time;
+	record->index = index;
+	memcpy(record->data, packet->buffer + packet->start, caplen);
+
+	__atomic_store_n(&record->sequence, sequence + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, index + 1, __ATOMIC_RELEASE);
+}
+
+bool capture_before(Session* session, Packet* packet, int ni_num, int core) {
+	Endpoint* service = &session->service->endpoint;
+	Endpoint* server = &session->server->endpoint;
+	if(!capture_match(filter.vip_addr, filter.vip_port, service->addr, service->port) ||
+			!capture_match(filter.server_addr, filter.server_port, server->addr, server->port) ||
+			!capture_match(filter.client_addr, 0, session->client_endpoint.addr, 0))
+		return false;
+
+	CaptureRing* ring = &rings[core];
+	if(ring->countdown > 1) {
+		ring->countdown--;
+		return false;
+	}
+	ring->countdown = filter.sample;
+
+	capture_record(ring, packet, ni_num, CAPTURE_BEFORE);
+
+	return true;
+}
+
+void capture_after(Packet* packet, NetworkInterface* ni, int core) {
+	int count = ni_count();
+	int ni_num = 0;
+	for(int i = 0; i < count; i++) {
+		if(ni_get(i) == ni) {
+			ni_num = i;
+			break;
+		}
+	}
+
+	capture_record(&rings[core], packet, ni_num, CAPTURE_AFTER);
+}
+
+/* Copy the records of ring still intact, returns how many */
+static int capture_collect(CaptureRing* ring, CaptureRecord* records) {
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t from = head > CAPTURE_RECORDS ? head - CAPTURE_RECORDS : 0;
+	if(from < ring->start)
+		from = ring->start;
+
+	int count = 0;
+	for(uint64_t i = from; i < head; i++) {
+		CaptureRecord* record = &ring->records[i & (CAPTURE_RECORDS - 1)];
+		uint32_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+		if(sequence & 1)
+			continue;
+
+		memcpy(&records[count], record, sizeof(CaptureRecord));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		//Overwritten meanwhile
+		if(__atomic_load_n(&record->sequence, __ATOMIC_RELAXED) != sequence || records[count].index != i)
+			continue;
+
+		count++;
+	}
+
+	return count;
+}
+
+static int capture_compare(const void* a, const void* b) {
+	const CaptureRecord* x = a;
+	const CaptureRecord* y = b;
+
+	if(x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	if(x->index != y->index)
+		return x->index < y->index ? -1 : 1;
+
+	return 0;
+}
+
+bool capture_dump(char* path) {
+	if(!rings) {
+		printf("Nothing captured\n");
+		return false;
+	}
+
+	FILE* fp = fopen(path, "w");
+	if(!fp) {
+		printf("Can'nt open %s\n", path);
+		return false;
+	}
+
+	CaptureRecord* records = __malloc(sizeof(CaptureRecord) * CAPTURE_RECORDS * thread_count(), __gmalloc_pool);
+	if(!records) {
+		printf("Can'nt allocate capture records\n");
+		fclose(fp);
+		return false;
+	}
+
+	int count = 0;
+	for(int i = 0; i < thread_count(); i++)
+		count += capture_collect(&rings[i], records + count);
+	qsort(records, count, sizeof(CaptureRecord), capture_compare);
+
+	void write32(uint32_t value) {
+		fwrite(&value, 4, 1, fp);
+	}
+
+	//pcapng section header, then one interface per NIC
+	write32(0x0a0d0d0a);
+	write32(28);
+	write32(0x1a2b3c4d);
+	write32(1);		//Version 1.0
+	write32(0xffffffff);	//Section length unknown
+	write32(0xffffffff);
+	write32(28);
+
+	int ni_total = ni_count();
+	for(int i = 0; i < ni_total; i++) {
+		write32(1);
+		write32(20);
+		write32(1);	//LINKTYPE_ETHERNET
+		write32(CAPTURE_SNAPLEN);
+		write32(20);
+	}
+
+	//Enhanced packet blocks: direction flag in, as received, or out, as sent
+	static const uint8_t padding[4];
+	for(int i = 0; i < count; i++) {
+		CaptureRecord* record = &records[i];
+		uint32_t pad = (4 - record->caplen % 4) % 4;
+		uint32_t length = 44 + record->caplen + pad;
+
+		write32(6);
+		write32(length);
+		write32(record->ni_num);
+		write32(record->time >> 32);
+		write32(record->time);
+		write32(record->caplen);
+		write32(record->length);
+		fwrite(record->data, record->caplen, 1, fp);
+		fwrite(padding, pad, 1, fp);
+		write32(2 | 4 << 16);	//epb_flags
+		write32(record->point == CAPTURE_BEFORE ? 1 : 2);
+		write32(0);		//End of options
+		write32(length);
+	}
+
+	__free(records, __gmalloc_pool);
+	fclose(fp);
+	printf("%d packets dumped to %s\n", count, path);
+
+	return true;
+}
+
+void capture_print() {
+	void print_addr_port(char* name, uint32_t addr, uint16_t port) {
+		if(!addr && !port)
+			return;
+
+		printf(" %s %d.%d.%d.%d", name, (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+		if(port)
+			printf(":%d", port);
+	}
+
+	printf("Capture %s, 1 in %u", capture_running ? "on" : "off", filter.sample ? filter.sample : 1);
+	print_addr_port("vip", filter.vip_addr, filter.vip_port);
+	print_addr_port("server", filter.server_addr, filter.server_port);
+	print_addr_port("client", filter.client_addr, 0);
+	printf("\n");
+
+	if(!rings)
+		return;
+
+	for(int i = 0; i < thread_count(); i++) {
+		uint64_t count = rings[i].head - rings[i].start;
+		printf("\tcore %d\t%lu records\t%lu held\n", i, count, count < CAPTURE_RECORDS ? count : CAPTURE_RECORDS);
+	}
+}
@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/map.h>
+#include <util/types.h>
+#include <util/event.h>
+#include <net/ni.h>
+#include <net/ip.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+
+#include "config.h"
+#include "service.h"
+#include "server.h"
+#include "tunnel.h"
+#include "schedule.h"
+#include "loadbalancer.h"
+
+#define CONFIG_ARGS	64
+
+extern void* __gmalloc_pool;
+
+/* By SCHEDULE_ and MODE_ value */
+static char* schedules[] = { NULL, "rr", "r", "l", "h", "w", "ch" };
+static char* modes[] = { NULL, "nat", "dnat", "dr", "ipip", "gue" };
+
+#define SCHEDULE_COUNT	(sizeof(schedules) / sizeof(char*))
+#define MODE_COUNT	(sizeof(modes) / sizeof(char*))
+
+typedef struct _Config {
+	uint32_t	service_count;
+	uint32_t	server_count;
+	ConfigService*	services;
+	ConfigServer*	servers;
+	Map*		service_keys;	//Of the services and servers in the file
+	Map*		server_keys;
+} Config;
+
+/* Services and servers are kept per NIC: the NIC is part of the key */
+static inline uint64_t config_key(Endpoint* endpoint) {
+	return (uint64_t)endpoint->ni_num << 56 | (uint64_t)endpoint->protocol << 48 |
+		(uint64_t)endpoint->addr << 16 | (uint64_t)endpoint->port;
+}
+
+static int config_ni_num(NetworkInterface* ni) {
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		if(ni_get(i) == ni)
+			return i;
+	}
+
+	return -1;
+}
+
+static uint8_t config_name(char* name, char** names, int count) {
+	for(int i = 1; i < count; i++) {
+		if(!strcmp(name, names[i]))
+			return i;
+	}
+
+	return 0;
+}
+
+static bool config_nic(char* str, Endpoint* endpoint) {
+	if(!is_uint8(str))
+		return false;
+
+	endpoint->ni_num = parse_uint8(str);
+	endpoint->ni = ni_get(endpoint->ni_num);
+
+	return endpoint->ni != NULL;
+}
+
+/* addr[:port] */
+static bool config_addr(char* str, Endpoint* endpoint, bool port) {
+	unsigned int a, b, c, d, _port = 0;
+	int length = 0;
+	if(port) {
+		if(sscanf(str, "%u.%u.%u.%u:%u%n", &a, &b, &c, &d, &_port, &length) != 5 || _port > 0xffff)
+			return false;
+	} else if(sscanf(str, "%u.%u.%u.%u%n", &a, &b, &c, &d, &length) != 4)
+		return false;
+
+	if(str[length] || a > 0xff || b > 0xff || c > 0xff || d > 0xff)
+		return false;
+
+	endpoint->addr = a << 24 | b << 16 | c << 8 | d;
+	endpoint->port = _port;
+
+	return true;
+}
+
+/* -t|-u addr:port nic */
+static bool config_endpoint(char** argv, Endpoint* endpoint) {
+	if(!strcmp(argv[0], "-t"))
+		endpoint->protocol = IP_PROTOCOL_TCP;
+	else if(!strcmp(argv[0], "-u"))
+		endpoint->protocol = IP_PROTOCOL_UDP;
+	else
+		return false;
+
+	return config_addr(argv[1], endpoint, true) && config_nic(argv[2], endpoint);
+}
+
+static bool config_parse_service(int argc, char** argv, ConfigService* service) {
+	bzero(service, sizeof(ConfigService));
+	if(argc < 4 || !config_endpoint(argv + 1, &service->endpoint))
+		return false;
+
+	bool scheduled = false;
+	for(int i = 4; i < argc; i++) {
+		if(!strcmp(argv[i], "-stateless")) {
+			service->stateless = true;
+		} else if(!strcmp(argv[i], "-s") && i + 1 < argc) {
+			service->schedule = config_name(argv[++i], schedules, SCHEDULE_COUNT);
+			if(!service->schedule)
+				return false;
+			scheduled = true;
+		} else if(!strcmp(argv[i], "-out") && i + 2 < argc && service->private_count < CONFIG_PRIVATE_MAX) {
+			Endpoint* private_endpoint = &service->private_endpoints[service->private_count];
+			if(!config_addr(argv[i + 1], private_endpoint, false) || !config_nic(argv[i + 2], private_endpoint))
+				return false;
+
+			//One private address a NIC
+			for(int j = 0; j < service->private_count; j++) {
+				if(service->private_endpoints[j].ni == private_endpoint->ni)
+					return false;
+			}
+			service->private_count++;
+			i += 2;
+		} else
+			return false;
+	}
+
+	if(service->stateless) {
+		if(scheduled && service->schedule != SCHEDULE_CONSISTENT_HASH)
+			return false;
+		service->schedule = SCHEDULE_CONSISTENT_HASH;
+	} else if(!scheduled)
+		service->schedule = SCHEDULE_ROUND_ROBIN;
+
+	return true;
+}
+
+static bool config_parse_server(int argc, char** argv, ConfigServer* server) {
+	bzero(server, sizeof(ConfigServer));
+	if(argc < 4 || !config_endpoint(argv + 1, &server->endpoint))
+		return false;
+
+	server->mode = MODE_NAT;
+	server->weight = 1;
+	for(int i = 4; i < argc; i++) {
+		if(!strcmp(argv[i], "-b")) {
+			server->backup = true;
+			continue;
+		}
+
+		if(i + 1 >= argc)
+			return false;
+
+		char* value = argv[++i];
+		if(!strcmp(argv[i - 1], "-m")) {
+			server->mode = config_name(value, modes, MODE_COUNT);
+			if(!server->mode)
+				return false;
+		} else if(!strcmp(argv[i - 1], "-w")) {
+			if(!is_uint8(value))
+				return false;
+			server->weight = parse_uint8(value);
+		} else if(!strcmp(argv[i - 1], "-c")) {
+			if(!is_uint32(value))
+				return false;
+			server->max_sessions = parse_uint32(value);
+		} else if(!strcmp(argv[i - 1], "-s")) {
+			if(!is_uint32(value) || parse_uint32(value) > UINT32_MAX / 1000)
+				return false;
+			server->slow_start = parse_uint32(value) * 1000;
+		} else if(!strcmp(argv[i - 1], "-mtu")) {
+			if(!is_uint16(value) || (parse_uint16(value) && parse_uint16(value) < TUNNEL_MTU_MIN))
+				return false;
+			server->mtu = parse_uint16(value);
+		} else
+			return false;
+	}
+
+	return true;
+}
+
+/* Each service and server once in a file */
+static bool config_unique(Map* keys, Endpoint* endpoint, void* data) {
+	void* key = (void*)config_key(endpoint);
+
+	return !map_contains(keys, key) && map_put(keys, key, data);
+}
+
+static void config_free(Config* config) {
+	if(config->services)
+		__free(config->services, __gmalloc_pool);
+	if(config->servers)
+		__free(config->servers, __gmalloc_pool);
+	if(config->service_keys)
+		map_destroy(config->service_keys);
+	if(config->server_keys)
+		map_destroy(config->server_keys);
+}
+
+static bool config_parse(char* path, Config* config) {
+	bzero(config, sizeof(Config));
+
+	FILE* fp = fopen(path, "r");
+	if(!fp) {
+		printf("Can'nt open file %s\n", path);
+		return false;
+	}
+
+	//Lines bound both counts
+	char line[CONFIG_LINE_SIZE];
+	uint32_t count = 0;
+	while(fgets(line, sizeof(line), fp))
+		count++;
+	rewind(fp);
+
+	config->services = __malloc(sizeof(ConfigService) * (count ? count : 1), __gmalloc_pool);
+	config->servers = __malloc(sizeof(ConfigServer) * (count ? count : 1), __gmalloc_pool);
+	config->service_keys = map_create(count ? count : 1, NULL, NULL, __gmalloc_pool);
+	config->server_keys = map_create(count ? count : 1, NULL, NULL, __gmalloc_pool);
+	if(!config->services || !config->servers || !config->service_keys || !config->server_keys) {
+		printf("Can'nt allocate config of %u lines\n", count);
+		goto fail;
+	}
+
+	uint32_t number = 0;
+	while(fgets(line, sizeof(line), fp)) {
+		number++;
+		char* comment = strchr(line, '#');
+		if(comment)
+			*comment = '\0';
+
+		int argc = 0;
+		char* argv[CONFIG_ARGS];
+		for(char* token = strtok(line, " \t\r\n"); token && argc < CONFIG_ARGS; token = strtok(NULL, " \t\r\n"))
+			argv[argc++] = token;
+		if(!argc)
+			continue;
+
+		bool parsed = false;
+		if(!strcmp(argv[0], "service")) {
+			ConfigService* service = &config->services[config->service_count];
+			parsed = config_parse_service(argc, argv, service) &&
+				config_unique(config->service_keys, &service->endpoint, service);
+			config->service_count += parsed;
+		} else if(!strcmp(argv[0], "server")) {
+			ConfigServer* server = &config->servers[config->server_count];
+			parsed = config_parse_server(argc, argv, server) &&
+				config_unique(config->server_keys, &server->endpoint, server);
+			config->server_count += parsed;
+		}
+
+		if(!parsed) {
+			printf("Wrong or repeated line %u of %s\n", number, path);
+			goto fail;
+		}
+	}
+	fclose(fp);
+
+	return true;
+
+fail:
+	fclose(fp);
+	config_free(config);
+
+	return false;
+}
+
+static void config_service_apply(ConfigService* wanted, ConfigDiff* diff) {
+	bool added = false;
+	bool changed = false;
+	Service* service = service_get(&wanted->endpoint);
+	if(!service) {
+		service = service_alloc(&wanted->endpoint);
+		if(!service) {
+			printf("Can'nt create service\n");
+			diff->failed[0]++;
+			return;
+		}
+		added = true;
+	} else if(service->state != SERVICE_STATE_ACTIVE) {
+		//Back before it was gone
+		if(service->event_id != 0) {
+			event_timer_remove(service->event_id);
+			service->event_id = 0;
+		}
+		service->state = SERVICE_STATE_ACTIVE;
+		changed = true;
+	}
+
+	bool failed = false;
+	if(service->stateless != wanted->stateless || service->schedule != wanted->schedule) {
+		service->stateless = false;
+		if(wanted->stateless)
+			failed |= !service_set_stateless(service);
+		else
+			failed |= !service_set_schedule(service, wanted->schedule);
+		changed = true;
+	}
+
+	//Private addresses gone or moved, then new ones
+	if(service->private_endpoints) {
+		int count = 0;
+		NetworkInterface* removes[map_size(service->private_endpoints)];
+		MapIterator iter;
+		map_iterator_init(&iter, service->private_endpoints);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Endpoint* private_endpoint = entry->data;
+
+			bool kept = false;
+			for(int i = 0; i < wanted->private_count; i++) {
+				kept |= wanted->private_endpoints[i].ni == private_endpoint->ni &&
+					wanted->private_endpoints[i].addr == private_endpoint->addr;
+			}
+			if(!kept)
+				removes[count++] = entry->key;
+		}
+
+		for(int i = 0; i < count; i++)
+			failed |= !service_remove_private_addr(service, removes[i]);
+		changed |= count > 0;
+	}
+
+	for(int i = 0; i < wanted->private_count; i++) {
+		Endpoint* private_endpoint = &wanted->private_endpoints[i];
+		if(service->private_endpoints && map_contains(service->private_endpoints, private_endpoint->ni))
+			continue;
+
+		failed |= !service_add_private_addr(service, private_endpoint);
+		changed = true;
+	}
+
+	if(failed) {
+		printf("Can'nt change service\n");
+		diff->failed[0]++;
+	} else if(added)
+		diff->added[0]++;
+	else if(changed)
+		diff->changed[0]++;
+}
+
+static void config_server_apply(ConfigServer* wanted, ConfigDiff* diff) {
+	bool added = false;
+	bool changed = false;
+	Server* server = server_get(&wanted->endpoint);
+	if(!server) {
+		server = server_create(&wanted->endpoint);
+		if(!server) {
+			printf("Can'nt create server\n");
+			diff->failed[1]++;
+			return;
+		}
+		added = true;
+	} else if(server->state != SERVER_STATE_ACTIVE) {
+		//Back before it was gone, ramping again if it slow starts
+		if(server->event_id != 0) {
+			event_timer_remove(server->event_id);
+			server->event_id = 0;
+		}
+		server->state = SERVER_STATE_ACTIVE;
+		if(server->slow_start)
+			server_set_slow_start(server, server->slow_start);
+		changed = true;
+	}
+
+	if(server->mode != wanted->mode) {
+		if(!server_set_mode(server, wanted->mode)) {
+			printf("Can'nt change server mode\n");
+			diff->failed[1]++;
+			return;
+		}
+		changed = true;
+	}
+
+	//Lists are rebuilt afterwards: backup is just the flag here
+	changed |= server->weight != wanted->weight || server->max_sessions != wanted->max_sessions ||
+		server->backup != wanted->backup;
+	server->weight = wanted->weight;
+	server->max_sessions = wanted->max_sessions;
+	server->backup = wanted->backup;
+
+	if(server->slow_start != wanted->slow_start) {
+		server_set_slow_start(server, wanted->slow_start);
+		changed = true;
+	}
+
+	if(server->mtu != wanted->mtu) {
+		server_set_mtu(server, wanted->mtu);
+		changed = true;
+	}
+
+	if(added)
+		diff->added[1]++;
+	else if(changed)
+		diff->changed[1]++;
+}
+
+bool config_apply(char* path, ConfigDiff* diff) {
+	Config config;
+	if(!config_parse(path, &config))
+		return false;
+
+	bzero(diff, sizeof(ConfigDiff));
+
+	//VIP and scheduler tables once, at the end
+	lb_config_hold();
+
+	for(uint32_t i = 0; i < config.service_count; i++)
+		config_service_apply(&config.services[i], diff);
+
+	for(uint32_t i = 0; i < config.server_count; i++)
+		config_server_apply(&config.servers[i], diff);
+
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			Service* service = map_iterator_next(&iter)->data;
+			Endpoint endpoint = service->endpoint;
+			endpoint.ni_num = i;
+			if(service->state != SERVICE_STATE_ACTIVE || map_contains(config.service_keys, (void*)config_key(&endpoint)))
+				continue;
+
+			service_retire(service);
+			diff->removed[0]++;
+		}
+	}
+
+	for(int i = 0; i < count; i++) {
+		Map* servers = ni_config_get(ni_get(i), SERVERS);
+		if(!servers)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, servers);
+		while(map_iterator_has_next(&iter)) {
+			Server* server = map_iterator_next(&iter)->data;
+			Endpoint endpoint = server->endpoint;
+			endpoint.ni_num = i;
+			if(server->state != SERVER_STATE_ACTIVE || map_contains(config.server_keys, (void*)config_key(&endpoint)))
+				continue;
+
+			server_retire(server);
+			diff->removed[1]++;
+		}
+	}
+
+	//Every service switches to lists of the new servers at once
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			if(!service_rebuild_servers(map_iterator_next(&iter)->data)) {
+				printf("Can'nt rebuild server lists\n");
+				diff->failed[0]++;
+			}
+		}
+	}
+
+	lb_config_release();
+	config_free(&config);
+
+	return true;
+}
+
+static void config_print_endpoint(FILE* fp, char* kind, Endpoint* endpoint) {
+	uint32_t addr = endpoint->addr;
+	fprintf(fp, "%s %s %d.%d.%d.%d:%d %d", kind, endpoint->protocol == IP_PROTOCOL_TCP ? "-t" : "-u",
+			(addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff,
+			endpoint->port, config_ni_num(endpoint->ni));
+}
+
+bool config_save(char* path) {
+	FILE* fp = fopen(path, "w");
+	if(!fp) {
+		printf("Can'nt open file %s\n", path);
+		return false;
+	}
+
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			Service* service = map_iterator_next(&iter)->data;
+			if(service->state != SERVICE_STATE_ACTIVE)
+				continue;
+
+			config_print_endpoint(fp, "service", &service->endpoint);
+			if(service->stateless)
+				fprintf(fp, " -stateless");
+			else if(service->schedule < SCHEDULE_COUNT)
+				fprintf(fp, " -s %s", schedules[service->schedule]);
+
+			if(service->private_endpoints) {
+				MapIterator _iter;
+				map_iterator_init(&_iter, service->private_endpoints);
+				while(map_iterator_has_next(&_iter)) {
+					Endpoint* private_endpoint = map_iterator_next(&_iter)->data;
+					uint32_t addr = private_endpoint->addr;
+					fprintf(fp, " -out %d.%d.%d.%d %d", (addr >> 24) & 0xff, (addr >> 16) & 0xff,
+							(addr >> 8) & 0xff, addr & 0xff, config_ni_num(private_endpoint->ni));
+				}
+			}
+			fprintf(fp, "\n");
+		}
+	}
+
+	for(int i = 0; i < count; i++) {
+		Map* servers = ni_config_get(ni_get(i), SERVERS);
+		if(!servers)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, servers);
+		while(map_iterator_has_next(&iter)) {
+			Server* server = map_iterator_next(&iter)->data;
+			if(server->state != SERVER_STATE_ACTIVE)
+				continue;
+
+			config_print_endpoint(fp, "server", &server->endpoint);
+			if(server->mode < MODE_COUNT)
+				fprintf(fp, " -m %s", modes[server->mode]);
+			fprintf(fp, " -w %u", server->weight);
+			if(server->max_sessions)
+				fprintf(fp, " -c %u", server->max_sessions);
+			if(server->backup)
+				fprintf(fp, " -b");
+			if(server->slow_start)
+				fprintf(fp, " -s %u", server->slow_start / 1000);
+			if(server->mtu)
+				fprintf(fp, " -mtu %u", server->mtu);
+			fprintf(fp, "\n");
+		}
+	}
+
+	bool result = !ferror(fp);
+	if(!result)
+		printf("Can'nt write file %s\n", path);
+	fclose(fp);
+
+	return result;
+}
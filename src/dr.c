@@ -4,16 +4,13 @@
 #include <_malloc.h>
 #undef DONT_MAKE_WRAPPER
 #include <net/packet.h>
-#include <net/ether.h>
-#include <net/arp.h>
 
 #include "dr.h"
 #include "endpoint.h"
 #include "session.h"
 #include "server.h"
+#include "forward.h"
 
-static bool dr_translate(Session* session, Packet* packet);
-static bool dr_untranslate(Session* session, Packet* packet);
 static bool dr_free(Session* session);
 
 Session* dr_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint) {
@@ -33,8 +30,7 @@ Session* dr_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint,
 	session_recharge(session);
 	session->fin = false;
 
-	session->translate = dr_translate;
-	session->untranslate = dr_untranslate;
+	session->forward = FORWARD_DR;
 	session->free = dr_free;
 
 	return session;
@@ -45,20 +41,3 @@ static bool dr_free(Session* session) {
 
 	return true;
 }
-
-static bool dr_translate(Session* session, Packet* packet) {
-	Ether* ether = (Ether*)(packet->buffer + packet->start);
-
-	Endpoint* server_endpoint = session->server_endpoint;
-	ether->smac = endian48(server_endpoint->ni->mac);
-	ether->dmac = endian48(arp_get_mac(server_endpoint->ni, session->private_endpoint.addr, server_endpoint->addr));
-	session_recharge(session);
-
-	return true;
-}
-
-static bool dr_untranslate(Session* session, Packet* packet) {
-	//do nothing
-	return true;
-}
-
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <util/map.h>
+#include <util/types.h>
+#include <net/ip.h>
+
+#include "feedback.h"
+#include "loadbalancer.h"
+
+bool feedback_running;
+uint16_t feedback_port = FEEDBACK_PORT;
+static uint32_t feedback_timeout = FEEDBACK_TIMEOUT;
+
+void feedback_start(uint16_t port, uint32_t timeout) {
+	feedback_port = port;
+	feedback_timeout = timeout;
+	feedback_running = true;
+}
+
+void feedback_stop() {
+	feedback_running = false;
+}
+
+static bool feedback_fresh(Server* server) {
+	return server->reports && lb_clock - server->reported <= feedback_timeout;
+}
+
+/* Capacity in % of a report */
+static bool feedback_value(uint8_t type, uint32_t value, uint32_t* capacity) {
+	switch(type) {
+		case FEEDBACK_CAPACITY:
+			*capacity = value < 100 ? value : 100;
+			return true;
+		case FEEDBACK_CPU:
+			*capacity = value < 100 ? 100 - value : 0;
+			return true;
+		case FEEDBACK_QUEUE:
+			*capacity = (uint64_t)100 * FEEDBACK_QUEUE_HALF / (FEEDBACK_QUEUE_HALF + (uint64_t)value);
+			return true;
+		default:
+			return false;
+	}
+}
+
+/* Cores receiving reports of the same server at once may lose one */
+static void feedback_update(Server* server, uint32_t capacity) {
+	capacity <<= 8;
+	if(feedback_fresh(server))
+		server->capacity = server->capacity - (server->capacity >> FEEDBACK_SMOOTH) + (capacity >> FEEDBACK_SMOOTH);
+	else
+		server->capacity = capacity;
+
+	server->reported = lb_clock;
+	server->reports++;
+}
+
+bool feedback_receive(NetworkInterface* ni, uint32_t addr, void* body, uint32_t length) {
+	if(length < sizeof(FeedbackReport))
+		return false;
+
+	FeedbackReport* report = body;
+	if(endian32(report->magic) != FEEDBACK_MAGIC || report->version != FEEDBACK_VERSION)
+		return false;
+
+	uint32_t capacity;
+	if(!feedback_value(report->type, endian32(report->value), &capacity))
+		return false;
+
+	Map* servers = ni_config_get(ni, SERVERS);
+	if(!servers)
+		return true;
+
+	uint16_t port = endian16(report->port);
+	if(port) {
+		uint8_t protocols[] = { IP_PROTOCOL_TCP, IP_PROTOCOL_UDP };
+		for(int i = 0; i < 2; i++) {
+			uint64_t key = (uint64_t)protocols[i] << 48 | (uint64_t)addr << 16 | (uint64_t)port;
+			Server* server = map_get(servers, (void*)key);
+			if(server)
+				feedback_update(server, capacity);
+		}
+
+		return true;
+	}
+
+	MapIterator iter;
+	map_iterator_init(&iter, servers);
+	while(map_iterator_has_next(&iter)) {
+		MapEntry* entry = map_iterator_next(&iter);
+		Server* server = entry->data;
+		if(server->endpoint.addr == addr)
+			feedback_update(server, capacity);
+	}
+
+	return true;
+}
+
+uint32_t feedback_capacity(Server* server) {
+	if(!feedback_running || !feedback_fresh(server))
+		return 100;
+
+	return (server->capacity + 128) >> 8;
+}
+
+void feedback_dump() {
+	if(!feedback_running) {
+		printf("Feedback off\n");
+		return;
+	}
+
+	printf("Feedback on UDP port %u, reports expire after %u ms\n", feedback_port, feedback_timeout);
+	printf("Addr:Port\t\tCapacity\tReports\tLast\n");
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* servers = ni_config_get(ni_get(i), SERVERS);
+		if(!servers)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, servers);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Server* server = entry->data;
+			if(!server->reports)
+				continue;
+
+			uint32_t addr = server->endpoint.addr;
+			printf("%d.%d.%d.%d:%d\t\t", (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff,
+					server->endpoint.port);
+			if(feedback_fresh(server))
+				printf("%u%%\t\t", feedback_capacity(server));
+			else
+				printf("stale\t\t");
+			printf("%lu\t%u ms ago\n", server->reports, lb_clock - server->reported);
+		}
+	}
+}
@@ -0,0 +1,178 @@
+#include <stdbool.h>
+#include <net/packet.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+
+#include "forward.h"
+#include "server.h"
+#include "session.h"
+#include "tunnel.h"
+#include "flow.h"
+
+/* (id, mode, protocol) of every specialization */
+#define FORWARD_KERNELS(X)					\
+	X(FORWARD_NAT_TCP,	MODE_NAT,	IP_PROTOCOL_TCP)	\
+	X(FORWARD_NAT_UDP,	MODE_NAT,	IP_PROTOCOL_UDP)	\
+	X(FORWARD_DNAT_TCP,	MODE_DNAT,	IP_PROTOCOL_TCP)	\
+	X(FORWARD_DNAT_UDP,	MODE_DNAT,	IP_PROTOCOL_UDP)	\
+	X(FORWARD_DR,		MODE_DR,	0)			\
+	X(FORWARD_IPIP,		MODE_IPIP,	0)			\
+	X(FORWARD_GUE,		MODE_GUE,	0)
+
+/*
+ * Forwarding template. mode and protocol are always constants at the call
+ * site, so every branch on them folds away in the specialized copies.
+ */
+static inline __attribute__ ((always_inline)) bool translate(Session* session, Packet* packet, const uint8_t mode, const uint8_t protocol) {
+	Endpoint* server_endpoint = session->server_endpoint;
+	Endpoint* private_endpoint = &session->private_endpoint;
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+
+	ether->smac = endian48(server_endpoint->ni->mac);
+	ether->dmac = endian48(arp_get_mac(server_endpoint->ni, server_endpoint->addr, private_endpoint->addr));
+
+	if(mode == MODE_DR) {
+		session_recharge(session);
+		return true;
+	}
+
+	//Inner headers are untouched: no L4 checksum work
+	if(mode == MODE_IPIP || mode == MODE_GUE) {
+		//Mode changed under a racing session: end it
+		Tunnel* tunnel = __atomic_load_n(&session->server->priv, __ATOMIC_ACQUIRE);
+		if(!tunnel)
+			return false;
+
+		tunnel_encap(tunnel, packet, tunnel->source, mode == MODE_GUE ? flow_hash(&session->public_key) : 0);
+		session_recharge(session);
+		return true;
+	}
+
+	if(mode == MODE_NAT)
+		ip->source = endian32(private_endpoint->addr);
+	ip->destination = endian32(server_endpoint->addr);
+
+	if(protocol == IP_PROTOCOL_TCP) {
+		TCP* tcp = (TCP*)ip->body;
+		if(mode == MODE_NAT)
+			tcp->source = endian16(private_endpoint->port);
+		tcp->destination = endian16(server_endpoint->port);
+
+		tcp_pack(packet, endian16(ip->length) - ip->ihl * 4 - TCP_LEN);
+
+		if(session->fin && tcp->ack)
+			return false;
+	} else {
+		UDP* udp = (UDP*)ip->body;
+		if(mode == MODE_NAT)
+			udp->source = endian16(private_endpoint->port);
+		udp->destination = endian16(server_endpoint->port);
+
+		udp_pack(packet, endian16(ip->length) - ip->ihl * 4 - UDP_LEN);
+	}
+
+	session_recharge(session);
+
+	return true;
+}
+
+static inline __attribute__ ((always_inline)) bool untranslate(Session* session, Packet* packet, const uint8_t mode, const uint8_t protocol) {
+	//DR, IPIP, GUE: return traffic bypasses the loadbalancer
+	if(mode == MODE_DR || mode == MODE_IPIP || mode == MODE_GUE)
+		return true;
+
+	Endpoint* public_endpoint = session->public_endpoint;
+	Endpoint* client_endpoint = &session->client_endpoint;
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+
+	ether->smac = endian48(public_endpoint->ni->mac);
+	ether->dmac = endian48(arp_get_mac(public_endpoint->ni, client_endpoint->addr, public_endpoint->addr));
+
+	ip->source = endian32(public_endpoint->addr);
+	if(mode == MODE_NAT)
+		ip->destination = endian32(client_endpoint->addr);
+
+	if(protocol == IP_PROTOCOL_TCP) {
+		TCP* tcp = (TCP*)ip->body;
+		tcp->source = endian16(public_endpoint->port);
+		if(mode == MODE_NAT)
+			tcp->destination = endian16(client_endpoint->port);
+
+		tcp_pack(packet, endian16(ip->length) - ip->ihl * 4 - TCP_LEN);
+
+		if(tcp->fin) {
+			session_set_fin(session);
+			return true;
+		}
+	} else {
+		UDP* udp = (UDP*)ip->body;
+		udp->source = endian16(public_endpoint->port);
+		if(mode == MODE_NAT)
+			udp->destination = endian16(client_endpoint->port);
+
+		udp_pack(packet, endian16(ip->length) - ip->ihl * 4 - UDP_LEN);
+	}
+
+	session_recharge(session);
+
+	return true;
+}
+
+bool forward_translate(Session* session, Packet* packet) {
+	switch(session->forward) {
+#define X(id, mode, protocol)	case id: return translate(session, packet, mode, protocol);
+		FORWARD_KERNELS(X)
+#undef X
+	}
+
+	return true;
+}
+
+bool forward_untranslate(Session* session, Packet* packet) {
+	switch(session->forward) {
+#define X(id, mode, protocol)	case id: return untranslate(session, packet, mode, protocol);
+		FORWARD_KERNELS(X)
+#undef X
+	}
+
+	return true;
+}
+
+bool forward_stateless(Server* server, Tunnel* tunnel, uint32_t private_addr, uint32_t hash, Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+
+	ether->smac = endian48(server->endpoint.ni->mac);
+	ether->dmac = endian48(arp_get_mac(server->endpoint.ni, server->endpoint.addr, private_addr));
+
+	if(tunnel)
+		tunnel_encap(tunnel, packet, private_addr, hash);
+
+	return true;
+}
+
+int forward_burst(uint8_t forward, uint8_t direction, Session** sessions, Packet** packets, int count, Session** finished) {
+	int finished_count = 0;
+
+	switch(forward << 1 | direction) {
+#define X(id, mode, protocol)									\
+		case id << 1 | FORWARD_TRANSLATE:						\
+			for(int i = 0; i < count; i++)						\
+				if(!translate(sessions[i], packets[i], mode, protocol))		\
+					finished[finished_count++] = sessions[i];		\
+			break;									\
+		case id << 1 | FORWARD_UNTRANSLATE:						\
+			for(int i = 0; i < count; i++)						\
+				if(!untranslate(sessions[i], packets[i], mode, protocol))	\
+					finished[finished_count++] = sessions[i];		\
+			break;
+		FORWARD_KERNELS(X)
+#undef X
+	}
+
+	return finished_count;
+}
@@ -0,0 +1,52 @@
+#include <string.h>
+
+#include "histogram.h"
+
+uint64_t histogram_bucket_max(uint32_t bucket) {
+	if(bucket < HISTOGRAM_SUB_COUNT)
+		return bucket;
+
+	uint32_t exponent = bucket / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+	uint64_t sub = HISTOGRAM_SUB_COUNT + bucket % HISTOGRAM_SUB_COUNT;
+	uint32_t shift = exponent - HISTOGRAM_SUB_BITS;
+
+	return ((sub + 1) << shift) - 1;
+}
+
+void histogram_reset(Histogram* histogram) {
+	bzero(histogram, sizeof(Histogram));
+}
+
+void histogram_merge(Histogram* histogram, Histogram* other) {
+	histogram->count += other->count;
+	histogram->sum += other->sum;
+	for(int i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+		histogram->buckets[i] += other->buckets[i];
+}
+
+uint64_t histogram_percentile(Histogram* histogram, double percentile) {
+	if(!histogram->count)
+		return 0;
+
+	uint64_t rank = (uint64_t)(histogram->count * percentile / 100);
+	if(rank >= histogram->count)
+		rank = histogram->count - 1;
+
+	uint64_t seen = 0;
+	for(int i = 0; i < HISTOGRAM_BUCKET_COUNT; i++) {
+		seen += histogram->buckets[i];
+		if(seen > rank)
+			return histogram_bucket_max(i);
+	}
+
+	return histogram_bucket_max(HISTOGRAM_BUCKET_COUNT - 1);
+}
+
+uint64_t histogram_max(Histogram* histogram) {
+	for(int i = HISTOGRAM_BUCKET_COUNT - 1; i >= 0; i--) {
+		if(histogram->buckets[i])
+			return histogram_bucket_max(i);
+	}
+
+	return 0;
+}
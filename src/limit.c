@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+
+#include "limit.h"
+#include "loadbalancer.h"
+
+Limit* limit_create(uint32_t client_rate, uint32_t client_burst, uint32_t service_rate, uint32_t service_burst,
+		uint8_t action, void* pool) {
+	Limit* limit = __malloc(sizeof(Limit), pool);
+	if(!limit)
+		return NULL;
+
+	size_t size = sizeof(LimitCore) * thread_count();
+	limit->buffer = __malloc(size + 64, pool);
+	if(!limit->buffer) {
+		__free(limit, pool);
+		return NULL;
+	}
+
+	//A core's share of a burst must hold a session
+	uint32_t limit_burst(uint32_t rate, uint32_t burst) {
+		if(!burst)
+			burst = rate;
+		if(burst < thread_count())
+			burst = thread_count();
+
+		return burst;
+	}
+
+	limit->client_rate = client_rate;
+	limit->client_burst = client_rate ? limit_burst(client_rate, client_burst) : 0;
+	limit->service_rate = service_rate;
+	limit->service_burst = service_rate ? limit_burst(service_rate, service_burst) : 0;
+	limit->action = action;
+	limit->pool = pool;
+	limit->cores = (LimitCore*)(((uintptr_t)limit->buffer + 63) & ~(uintptr_t)63);
+	bzero(limit->cores, size);
+
+	//Full from the start
+	for(int i = 0; i < thread_count(); i++) {
+		limit->cores[i].service.time = lb_clock;
+		limit->cores[i].service.credits = (uint64_t)limit->service_burst * 1000;
+	}
+
+	return limit;
+}
+
+void limit_destroy(Limit* limit) {
+	__free(limit->buffer, limit->pool);
+	__free(limit, limit->pool);
+}
+
+void limit_carry(Limit* limit, Limit* old) {
+	for(int i = 0; i < thread_count(); i++) {
+		for(int j = 0; j < 3; j++)
+			limit->cores[i].refused[j] += old->cores[i].refused[j];
+		limit->cores[i].resets += old->cores[i].resets;
+	}
+}
+
+static inline void limit_refill(LimitBucket* bucket, uint32_t rate, uint32_t burst, uint32_t now) {
+	uint64_t credits = bucket->credits + (uint64_t)(now - bucket->time) * rate;
+	uint64_t full = (uint64_t)burst * 1000;
+	bucket->credits = credits < full ? credits : full;
+	bucket->time = now;
+}
+
+uint8_t limit_admit(Limit* limit, uint32_t addr, int core) {
+	LimitCore* _core = &limit->cores[core];
+	uint64_t cost = (uint64_t)1000 * thread_count();
+	uint32_t now = lb_clock;
+
+	LimitBucket* client = NULL;
+	if(limit->client_rate) {
+		client = &_core->clients[(addr * 0x9e3779b9) >> (32 - LIMIT_SLOT_BITS)];
+		if(client->key != addr) {
+			//Taken over by another client: full
+			client->key = addr;
+			client->time = now;
+			client->credits = (uint64_t)limit->client_burst * 1000;
+		} else {
+			limit_refill(client, limit->client_rate, limit->client_burst, now);
+		}
+
+		if(client->credits < cost) {
+			_core->refused[LIMIT_CLIENT]++;
+			return LIMIT_CLIENT;
+		}
+	}
+
+	if(limit->service_rate) {
+		LimitBucket* service = &_core->service;
+		limit_refill(service, limit->service_rate, limit->service_burst, now);
+		if(service->credits < cost) {
+			_core->refused[LIMIT_SERVICE]++;
+			return LIMIT_SERVICE;
+		}
+		service->credits -= cost;
+	}
+
+	if(client)
+		client->credits -= cost;
+
+	return LIMIT_OK;
+}
+
+void limit_dump(Limit* limit) {
+	uint64_t refused[3] = { 0 };
+	uint64_t resets = 0;
+	for(int i = 0; i < thread_count(); i++) {
+		for(int j = 0; j < 3; j++)
+			refused[j] += limit->cores[i].refused[j];
+		resets += limit->cores[i].resets;
+	}
+
+	void print_limit(char* name, uint32_t rate, uint32_t burst, uint64_t refused) {
+		if(rate)
+			printf("\t%s\t%u/s burst %u\t%lu refused\n", name, rate, burst, refused);
+		else
+			printf("\t%s\tunlimited\n", name);
+	}
+
+	printf("New sessions, excess %s\n", limit->action == LIMIT_RESET ? "reset" : "dropped");
+	print_limit("client", limit->client_rate, limit->client_burst, refused[LIMIT_CLIENT]);
+	print_limit("service", limit->service_rate, limit->service_burst, refused[LIMIT_SERVICE]);
+	if(limit->action == LIMIT_RESET)
+		printf("\t%lu resets sent\n", resets);
+}
@@ -1,4 +1,9 @@
 #include <stdio.h>
+#include <string.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+#include <thread.h>
 #include <util/list.h>
 #include <util/event.h>
 #include <util/types.h>
@@ -14,9 +19,25 @@
 #include "service.h"
 #include "server.h"
 #include "session.h"
+#include "flow.h"
+#include "forward.h"
+#include "vip.h"
+#include "maglev.h"
+#include "schedule.h"
+#include "tunnel.h"
+#include "stats.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "capture.h"
+#include "sketch.h"
+#include "feedback.h"
+#include "sync.h"
 
 extern void* __gmalloc_pool;
 static LoadBalancer** loadbalancers;
+static int lb_count;
+static bool lb_profile;
+volatile uint32_t lb_clock;
 
 int lb_ginit() {
 	uint32_t count = ni_count();
@@ -24,19 +45,65 @@ int lb_ginit() {
 		return -1;
 
 	loadbalancers = (LoadBalancer**)__malloc(sizeof(LoadBalancer*) * count, __gmalloc_pool);
+	lb_count = count;
+
+	flow_init();
+	if(!stats_ginit())
+		return -1;
 
 	for(int i = 0; i < count; i++) {
 		NIC* nic = nic_get(i);
 		loadbalancers[i] = (LoadBalancer*)__malloc(sizeof(LoadBalancer), nic->pool);
+		loadbalancers[i]->ni = ni_get(i);
 		loadbalancers[i]->services = map_create(16, NULL, NULL, nic->pool);
 		loadbalancers[i]->servers = map_create(16, NULL, NULL, nic->pool);
-		loadbalancers[i]->sessions = map_create(1024, NULL, NULL, nic->pool);
+		loadbalancers[i]->sessions = map_create(1024, flow_map_hash, flow_map_equals, nic->pool);
+		loadbalancers[i]->vips = NULL;
+		loadbalancers[i]->stats = stats_create(nic->pool);
+		if(!loadbalancers[i]->stats)
+			return -2;
+
+		size_t size = sizeof(LoadBalancerCore) * thread_count();
+		loadbalancers[i]->cores_buffer = __malloc(size + 64, nic->pool);
+		if(!loadbalancers[i]->cores_buffer)
+			return -2;
+		loadbalancers[i]->cores = (LoadBalancerCore*)(((uintptr_t)loadbalancers[i]->cores_buffer + 63) & ~(uintptr_t)63);
+		bzero(loadbalancers[i]->cores, size);
+
+		//Histograms of a core must not share lines with another's
+		size = sizeof(Histogram) * thread_count() * LB_STAGE_COUNT;
+		loadbalancers[i]->latency_buffer = __malloc(size + 64, nic->pool);
+		if(!loadbalancers[i]->latency_buffer)
+			return -2;
+		loadbalancers[i]->latency = (Histogram*)(((uintptr_t)loadbalancers[i]->latency_buffer + 63) & ~(uintptr_t)63);
+		bzero(loadbalancers[i]->latency, size);
+
+		if(!ni_config_put(ni_get(i), SESSIONS, loadbalancers[i]->sessions))
+			return -2;
 	}   
 
 
 	return 0;
 }
 
+LoadBalancer* lb_get(int ni_num) {
+	return loadbalancers[ni_num];
+}
+
+void lb_sum(int ni_num, LoadBalancerCore* total) {
+	LoadBalancer* lb = loadbalancers[ni_num];
+
+	bzero(total, sizeof(LoadBalancerCore));
+	for(int i = 0; i < thread_count(); i++) {
+		LoadBalancerCore* core = &lb->cores[i];
+		for(int j = 0; j < LB_CLASS_COUNT; j++)
+			total->classes[j] += core->classes[j];
+		total->new_sessions += core->new_sessions;
+		for(int j = 0; j < LB_STAGE_COUNT; j++)
+			total->stages[j] += core->stages[j];
+	}
+}
+
 Map* lb_get_services(int ni_num) {
 	    return loadbalancers[ni_num]->services;
 }
@@ -49,9 +116,56 @@ Map* lb_get_sessions(int ni_num) {
 	    return loadbalancers[ni_num]->sessions;
 }
 
+VIPTable* lb_get_vips(int ni_num) {
+	    return loadbalancers[ni_num]->vips;
+}
+
+VIPTable* lb_set_vips(int ni_num, VIPTable* vips) {
+	VIPTable* old = loadbalancers[ni_num]->vips;
+	loadbalancers[ni_num]->vips = vips;
+
+	return old;
+}
+
+
+static bool lb_tick(void* context) {
+	lb_clock++;
+
+	return true;
+}
+
+/* Slow starts ramp and feedback moves shares between config changes */
+static bool lb_schedule_tick(void* context) {
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter))
+			service_refresh(map_iterator_next(&iter)->data);
+	}
+
+	return true;
+}
 
 int lb_init() {
 	event_init();
+	if(thread_id() == 0 && !event_timer_add(lb_tick, NULL, LB_CLOCK_PERIOD, LB_CLOCK_PERIOD))
+		return -1;
+	if(thread_id() == 0 && !event_timer_add(lb_schedule_tick, NULL, SCHEDULE_WEIGHTS_PERIOD, SCHEDULE_WEIGHTS_PERIOD))
+		return -1;
+	if(!stats_init())
+		return -1;
+	if(!metrics_init())
+		return -1;
+	if(!sketch_init())
+		return -1;
+	if(!sync_init())
+		return -1;
+
 	return 0;
 }
 
@@ -59,70 +173,647 @@ void lb_loop() {
 	event_loop();
 }
 
-bool lb_process(Packet* packet, int ni_num) {
-	if(arp_process(packet))
-		return true;
+void lb_profile_set(bool on) {
+	lb_profile = on;
+}
 
-	if(icmp_process(packet))
-		return true;
+bool lb_profile_get() {
+	return lb_profile;
+}
 
-	Ether* ether = (Ether*)(packet->buffer + packet->start);
-	if(endian16(ether->type) == ETHER_TYPE_IPv4) {
-		IP* ip = (IP*)ether->payload;
+static inline uint64_t lb_cycles() {
+	return __builtin_ia32_rdtsc();
+}
+
+/*
+ * Charge the cycles since mark to stage. latency is the core's row of
+ * histograms; count packets shared the cycles (0: the sum only).
+ */
+static inline void lb_stage(uint64_t* stages, Histogram* latency, uint8_t stage, uint64_t* mark, uint32_t count) {
+	uint64_t now = lb_cycles();
+	uint64_t cycles = now - *mark;
+	stages[stage] += cycles;
+	if(count)
+		histogram_add(&latency[stage], cycles / count, count);
+	*mark = now;
+}
+
+/* Counters of the NIC a packet leaves from */
+static inline Stats* lb_ni_stats(NetworkInterface* ni) {
+	for(int i = 0; i < lb_count; i++) {
+		if(loadbalancers[i]->ni == ni)
+			return loadbalancers[i]->stats;
+	}
+
+	return NULL;
+}
 
-		Endpoint destination_endpoint;
-		Endpoint source_endpoint;
+/* Per flow counters and the core's top talkers of the service */
+static void lb_top(Session* session, uint32_t length, int core) {
+	session->packets++;
+	session->bytes += length;
 
-		destination_endpoint.ni = packet->ni;
-		destination_endpoint.ni_num = ni_num;
-		source_endpoint.ni = packet->ni;
-		source_endpoint.ni_num = ni_num;
+	Top* top = session->service->top;
+	if(!top)
+		return;
 
-		source_endpoint.addr = endian32(ip->source);
-		destination_endpoint.addr = endian32(ip->destination);
-		destination_endpoint.protocol = ip->protocol;
-		source_endpoint.protocol = ip->protocol;
+	top += core * TOP_KIND_COUNT;
+	if(top->countdown > 1) {
+		top->countdown--;
+		return;
+	}
+	//Random gaps of mean top_sample: a fixed one locks onto periodic traffic
+	uint32_t sample = top_sample;
+	top->countdown = 1 + ((lb_cycles() * 0x9e3779b97f4a7c15) >> 40) % (2 * sample - 1);
+
+	Endpoint* client = &session->client_endpoint;
+	uint64_t flow = (uint64_t)client->addr << 32 | (uint64_t)client->port << 16;
+	uint64_t bytes = (uint64_t)length * sample;
+	top_add(&top[TOP_FLOW_BYTES], flow, bytes, sample);
+	top_add(&top[TOP_FLOW_PACKETS], flow, sample, bytes);
+	top_add(&top[TOP_CLIENT_BYTES], (uint64_t)client->addr << 32, bytes, sample);
+	top_add(&top[TOP_CLIENT_PACKETS], (uint64_t)client->addr << 32, sample, bytes);
+}
+
+/* Count a packet of session on its service and server */
+static inline void lb_account(Session* session, uint8_t direction, uint32_t length, int core) {
+	StatsCore* service = stats_core(session->service->stats, core);
+	service->packets[direction]++;
+	service->bytes[direction] += length;
+
+	StatsCore* server = stats_core(session->server->stats, core);
+	server->packets[direction]++;
+	server->bytes[direction] += length;
+
+	if(sync_running)
+		sync_refresh(session, core, lb_clock);
+
+	if(__builtin_expect(top_running, 0))
+		lb_top(session, length, core);
+}
+
+/* Send a forwarded packet. A refused one is freed and counted on input */
+static inline void lb_output(NetworkInterface* ni, Packet* packet, int core, StatsCore* input) {
+	uint32_t length = packet->end - packet->start;
+	if(!ni_output(ni, packet)) {
+		input->drops[STATS_DROP_OUTPUT]++;
+		ni_free(packet);
+		return;
+	}
+
+	Stats* stats = lb_ni_stats(ni);
+	if(stats) {
+		StatsCore* output = stats_core(stats, core);
+		output->packets[STATS_OUT]++;
+		output->bytes[STATS_OUT] += length;
+	}
+}
+
+/*
+ * Classify packet by reading ether type and IP protocol once. Only
+ * LB_CLASS_FLOW packets go to the session lookup.
+ */
+static inline uint8_t lb_classify(Packet* packet, IP** _ip) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	uint16_t type = endian16(ether->type);
+
+	if(__builtin_expect(type == ETHER_TYPE_IPv4, 1)) {
+		IP* ip = (IP*)ether->payload;
+		*_ip = ip;
 
 		switch(ip->protocol) {
 			case IP_PROTOCOL_TCP:
-				;
-				TCP* tcp = (TCP*)ip->body;
-				source_endpoint.port = endian16(tcp->source);
-				destination_endpoint.port = endian16(tcp->destination);
-				break;
 			case IP_PROTOCOL_UDP:
-				;
-				UDP* udp = (UDP*)ip->body;
-				source_endpoint.port = endian16(udp->source);
-				destination_endpoint.port = endian16(udp->destination);
-				break;
+				return LB_CLASS_FLOW;
+			case IP_PROTOCOL_ICMP:
+				return LB_CLASS_ICMP;
 			default:
-				return false;
+				return LB_CLASS_OTHER;
+		}
+	} else if(type == ETHER_TYPE_ARP) {
+		return LB_CLASS_ARP;
+	}
+
+	return LB_CLASS_OTHER;
+}
+
+/* ARP, ICMP and anything else the datapath does not forward */
+static bool lb_slow_path(Packet* packet, uint8_t class) {
+	switch(class) {
+		case LB_CLASS_ARP:
+			return arp_process(packet);
+		case LB_CLASS_ICMP:
+			return icmp_process(packet);
+		default:
+			return false;
+	}
+}
+
+/*
+ * Encapsulated packet must fit the server's MTU. Returns false when packet
+ * was answered with ICMP fragmentation needed or dropped. A NULL tunnel is a
+ * session racing a mode change and drops.
+ */
+static bool lb_tunnel_check(Tunnel* tunnel, Packet* packet, StatsCore* input) {
+	switch(tunnel ? tunnel_check(tunnel, packet) : TUNNEL_NO_ROOM) {
+		case TUNNEL_OK:
+			return true;
+		case TUNNEL_TOO_BIG:
+			input->drops[STATS_DROP_TUNNEL]++;
+			if(!tunnel_frag_needed(tunnel, packet) || !ni_output(packet->ni, packet))
+				ni_free(packet);
+			return false;
+		default:
+			input->drops[STATS_DROP_TUNNEL]++;
+			ni_free(packet);
+			return false;
+	}
+}
+
+/* Sessionless DR: pick the backend by consistent hash on every packet */
+static bool lb_stateless(Service* service, Packet* packet, IP* ip, Endpoint* source_endpoint, Endpoint* destination_endpoint, int core, StatsCore* input) {
+	FlowKey key;
+	flow_key_init(&key, ip->protocol, source_endpoint->addr, source_endpoint->port, destination_endpoint->addr, destination_endpoint->port);
+
+	bool new_flow = false;
+	if(ip->protocol == IP_PROTOCOL_TCP) {
+		TCP* tcp = (TCP*)ip->body;
+		new_flow = tcp->syn && !tcp->ack;
+	}
+
+	uint32_t private_addr;
+	Maglev* maglev = __atomic_load_n(&service->maglev, __ATOMIC_ACQUIRE);
+	Server* server = maglev ? maglev_get(maglev, &key, new_flow, &private_addr) : NULL;
+	if(!server) {
+		stats_core(service->stats, core)->schedule_misses++;
+		input->drops[STATS_DROP_NO_SERVER]++;
+		return false;
+	}
+
+	//Checked and encapsulated with the same tunnel: the mode may change in between
+	Tunnel* tunnel = __atomic_load_n(&server->priv, __ATOMIC_ACQUIRE);
+	if(tunnel && !lb_tunnel_check(tunnel, packet, input))
+		return true;
+
+	uint32_t length = packet->end - packet->start;
+	StatsCore* counters[] = { stats_core(service->stats, core), stats_core(server->stats, core) };
+	for(int i = 0; i < 2; i++) {
+		counters[i]->packets[STATS_IN]++;
+		counters[i]->bytes[STATS_IN] += length;
+	}
+
+	if(!forward_stateless(server, tunnel, private_addr, flow_hash(&key), packet)) {
+		input->drops[STATS_DROP_OUTPUT]++;
+		return false;
+	}
+
+	lb_output(server->endpoint.ni, packet, core, input);
+
+	return true;
+}
+
+/* Answer a refused SYN with RST|ACK, in place */
+static bool lb_reset(Packet* packet, IP* ip) {
+	TCP* tcp = (TCP*)ip->body;
+	if(!tcp->syn || tcp->ack)
+		return false;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->dmac = ether->smac;
+	ether->smac = endian48(packet->ni->mac);
+
+	uint32_t source = ip->source;
+	ip->source = ip->destination;
+	ip->destination = source;
+	ip->ihl = IP_LEN / 4;
+	ip->ttl = 64;
+
+	uint16_t port = tcp->source;
+	uint32_t sequence = endian32(tcp->sequence);
+	tcp->source = tcp->destination;
+	tcp->destination = port;
+	tcp->acknowledgement = endian32(sequence + 1);
+	tcp->sequence = 0;
+	tcp->offset = TCP_LEN / 4;
+	tcp->ns = 0;
+	tcp->reserved = 0;
+	tcp->fin = tcp->syn = tcp->psh = tcp->urg = tcp->ece = tcp->cwr = 0;
+	tcp->rst = tcp->ack = 1;
+	tcp->window = 0;
+	tcp->urgent = 0;
+	tcp_pack(packet, 0);
+
+	return true;
+}
+
+/* A new session over a rate limit: dropped, or reset and *direction FORWARD_STATELESS */
+static void lb_limited(Service* service, Packet* packet, IP* ip, uint8_t* direction, int core, StatsCore* input) {
+	input->drops[STATS_DROP_LIMITED]++;
+
+	Limit* limit = service->limit;
+	if(!limit || limit->action != LIMIT_RESET || ip->protocol != IP_PROTOCOL_TCP || !lb_reset(packet, ip))
+		return;
+
+	limit->cores[core].resets++;
+	lb_output(packet->ni, packet, core, input);
+	*direction = FORWARD_STATELESS;
+}
+
+/*
+ * Find (or create) the session of packet. direction is set to
+ * FORWARD_TRANSLATE for client -> server and FORWARD_UNTRANSLATE for
+ * server -> client traffic. Packets of stateless services are forwarded,
+ * and refused SYNs answered, right here: NULL is returned with
+ * FORWARD_STATELESS.
+ */
+/* mark is the caller's stage mark while profiling, NULL otherwise */
+static Session* lb_lookup(Packet* packet, IP* ip, int ni_num, uint8_t* direction, int core, StatsCore* input, uint64_t* mark) {
+	Endpoint destination_endpoint;
+	Endpoint source_endpoint;
+
+	destination_endpoint.ni = packet->ni;
+	destination_endpoint.ni_num = ni_num;
+	source_endpoint.ni = packet->ni;
+	source_endpoint.ni_num = ni_num;
+
+	source_endpoint.addr = endian32(ip->source);
+	destination_endpoint.addr = endian32(ip->destination);
+	destination_endpoint.protocol = ip->protocol;
+	source_endpoint.protocol = ip->protocol;
+
+	//TCP and UDP ports are at the same offset
+	UDP* udp = (UDP*)ip->body;
+	source_endpoint.port = endian16(udp->source);
+	destination_endpoint.port = endian16(udp->destination);
+
+	Session* session;
+	Acl* acl;
+	void* data = NULL;
+	switch(vip_lookup(loadbalancers[ni_num]->vips, &source_endpoint, &destination_endpoint, &data)) {
+		case VIP_ROLE_SERVICE:
+			//Before lb_limited(), which may answer the packet: FORWARD_STATELESS
+			*direction = FORWARD_TRANSLATE;
+			acl = ((Service*)data)->acl;
+			if(acl && !acl_check(acl, source_endpoint.addr, core)) {
+				input->drops[STATS_DROP_DENIED]++;
+				return NULL;
+			}
+
+			if(((Service*)data)->stateless) {
+				if(!lb_stateless((Service*)data, packet, ip, &source_endpoint, &destination_endpoint, core, input))
+					return NULL;
+
+				*direction = FORWARD_STATELESS;
+				return NULL;
+			}
+
+			session = service_get_session(&source_endpoint, &destination_endpoint);
+			if(!session) {
+				if(sketch_running && !sketch_admit(source_endpoint.addr, core)) {
+					input->drops[STATS_DROP_BLOCKED]++;
+					return NULL;
+				}
+
+				LoadBalancer* lb = loadbalancers[ni_num];
+				uint64_t start = mark ? lb_cycles() : 0;
+				bool limited = false;
+				session = service_alloc_session((Service*)data, &source_endpoint, &limited);
+				if(session)
+					lb->cores[core].new_sessions++;
+				else if(limited)
+					lb_limited((Service*)data, packet, ip, direction, core, input);
+				else
+					input->drops[STATS_DROP_NO_SERVER]++;
+
+				//Scheduler pick and allocation, out of the caller's lookup stage
+				if(mark) {
+					uint64_t cycles = lb_cycles() - start;
+					lb->cores[core].stages[LB_STAGE_SESSION] += cycles;
+					histogram_add(&lb->latency[core * LB_STAGE_COUNT + LB_STAGE_SESSION], cycles, 1);
+					*mark += cycles;
+				}
+			}
+
+			return session;
+		case VIP_ROLE_PRIVATE:
+			//Agent reports, anything else on the port goes on as return traffic
+			if(feedback_running && ip->protocol == IP_PROTOCOL_UDP && destination_endpoint.port == feedback_port &&
+					feedback_receive(packet->ni, source_endpoint.addr, udp->body, packet->end - (uint32_t)(udp->body - packet->buffer))) {
+				ni_free(packet);
+				*direction = FORWARD_STATELESS;
+				return NULL;
+			}
+		case VIP_ROLE_SERVER:
+			*direction = FORWARD_UNTRANSLATE;
+			session = server_get_session(&source_endpoint, &destination_endpoint);
+			if(!session)
+				input->drops[STATS_DROP_NO_SESSION]++;
+
+			return session;
+		default:
+			//Not a VIP: the peer's sessions to a local sync address
+			if(sync_running && ip->protocol == IP_PROTOCOL_UDP &&
+					sync_receive(packet->ni, source_endpoint.addr, destination_endpoint.addr, destination_endpoint.port,
+					udp->body, packet->end - (uint32_t)(udp->body - packet->buffer))) {
+				ni_free(packet);
+				*direction = FORWARD_STATELESS;
+				return NULL;
+			}
+
+			input->drops[STATS_DROP_NO_SERVICE]++;
+			return NULL;
+	}
+}
+
+bool lb_process(Packet* packet, int ni_num) {
+	LoadBalancer* lb = loadbalancers[ni_num];
+	bool profile = lb_profile;
+	uint64_t mark = profile ? lb_cycles() : 0;
+	int core = thread_id();
+	StatsCore* input = stats_core(lb->stats, core);
+	uint32_t length = packet->end - packet->start;
+	input->packets[STATS_IN]++;
+	input->bytes[STATS_IN] += length;
+	Histogram* latency = lb->latency + core * LB_STAGE_COUNT;
+	uint64_t* stages = lb->cores[core].stages;
+
+	IP* ip = NULL;
+	uint8_t class = lb_classify(packet, &ip);
+	lb->cores[core].classes[class]++;
+	if(profile)
+		lb_stage(stages, latency, LB_STAGE_CLASSIFY, &mark, 1);
+
+	if(class != LB_CLASS_FLOW) {
+		bool result = lb_slow_path(packet, class);
+		if(!result)
+			input->drops[STATS_DROP_NO_SERVICE]++;
+		if(profile)
+			lb_stage(stages, latency, LB_STAGE_SLOW, &mark, 1);
+
+		return result;
+	}
+
+	uint8_t direction = FORWARD_TRANSLATE;
+	Session* session = lb_lookup(packet, ip, ni_num, &direction, core, input, profile ? &mark : NULL);
+	if(profile)
+		lb_stage(stages, latency, LB_STAGE_LOOKUP, &mark, 1);
+	if(!session)
+		return direction == FORWARD_STATELESS;
+
+	bool alive;
+	if(direction == FORWARD_TRANSLATE) {
+		if(FORWARD_IS_TUNNEL(session->forward) && !lb_tunnel_check(__atomic_load_n(&session->server->priv, __ATOMIC_ACQUIRE), packet, input))
+			return true;
+
+		lb_account(session, direction, length, core);
+		NetworkInterface* server_ni = session->server_endpoint->ni;
+		bool sampled = capture_running && capture_before(session, packet, ni_num, core);
+		alive = forward_translate(session, packet);
+		if(sampled)
+			capture_after(packet, server_ni, core);
+		if(profile)
+			lb_stage(stages, latency, LB_STAGE_FORWARD, &mark, 1);
+		lb_output(server_ni, packet, core, input);
+		if(profile)
+			lb_stage(stages, latency, LB_STAGE_OUTPUT, &mark, 1);
+		if(!alive)
+			service_free_session(session);
+	} else {
+		lb_account(session, direction, length, core);
+		NetworkInterface* _ni = session->public_endpoint->ni;
+		bool sampled = capture_running && capture_before(session, packet, ni_num, core);
+		alive = forward_untranslate(session, packet);
+		if(sampled)
+			capture_after(packet, _ni, core);
+		if(profile)
+			lb_stage(stages, latency, LB_STAGE_FORWARD, &mark, 1);
+		lb_output(_ni, packet, core, input);
+		if(profile)
+			lb_stage(stages, latency, LB_STAGE_OUTPUT, &mark, 1);
+		if(!alive)
+			service_free_session(session);
+	}
+
+	if(profile)
+		lb_stage(stages, latency, LB_STAGE_SESSION, &mark, !alive);
+
+	return true;
+}
+
+int lb_process_burst(Packet** packets, int count, int ni_num) {
+	Session* sessions[2][FORWARD_COUNT][LB_BURST];
+	Packet* grouped[2][FORWARD_COUNT][LB_BURST];
+	bool captured[2][FORWARD_COUNT][LB_BURST];	//Written only while capturing
+	int group_count[2][FORWARD_COUNT] = { { 0 } };
+	Session* finished[LB_BURST];
+	int finished_count = 0;
+	int processed = 0;
+	bool profile = lb_profile;
+	bool capture = capture_running;
+	uint64_t mark = profile ? lb_cycles() : 0;
+	int core = thread_id();
+	uint64_t* classes = loadbalancers[ni_num]->cores[core].classes;
+	uint64_t* stages = loadbalancers[ni_num]->cores[core].stages;
+	StatsCore* input = stats_core(loadbalancers[ni_num]->stats, core);
+	Histogram* latency = loadbalancers[ni_num]->latency + core * LB_STAGE_COUNT;
+
+	//Lookup all packets first, then run each specialization once
+	for(int i = 0; i < count; i++) {
+		Packet* packet = packets[i];
+		uint32_t length = packet->end - packet->start;
+		input->packets[STATS_IN]++;
+		input->bytes[STATS_IN] += length;
+
+		IP* ip = NULL;
+		uint8_t class = lb_classify(packet, &ip);
+		classes[class]++;
+		if(profile)
+			lb_stage(stages, latency, LB_STAGE_CLASSIFY, &mark, 1);
+
+		if(__builtin_expect(class != LB_CLASS_FLOW, 0)) {
+			if(lb_slow_path(packet, class)) {
+				processed++;
+			} else {
+				input->drops[STATS_DROP_NO_SERVICE]++;
+				ni_free(packet);
+			}
+			if(profile)
+				lb_stage(stages, latency, LB_STAGE_SLOW, &mark, 1);
+			continue;
 		}
 
-		//Service
-		Session* session = service_get_session(&source_endpoint);
+		uint8_t direction = FORWARD_TRANSLATE;
+		Session* session = lb_lookup(packet, ip, ni_num, &direction, core, input, profile ? &mark : NULL);
 		if(!session) {
-			session = service_alloc_session(&destination_endpoint, &source_endpoint);
+			if(direction == FORWARD_STATELESS)
+				processed++;
+			else
+				ni_free(packet);
+			if(profile)
+				lb_stage(stages, latency, LB_STAGE_LOOKUP, &mark, 1);
+			continue;
 		}
 
-		if(session) {
-			NetworkInterface* server_ni = session->server_endpoint->ni;
-			session->translate(session, packet);
-			ni_output(server_ni, packet);
-			return true;
+		if(FORWARD_IS_TUNNEL(session->forward) && direction == FORWARD_TRANSLATE) {
+			if(profile)
+				lb_stage(stages, latency, LB_STAGE_LOOKUP, &mark, 1);
+			bool fit = lb_tunnel_check(__atomic_load_n(&session->server->priv, __ATOMIC_ACQUIRE), packet, input);
+			if(profile)
+				lb_stage(stages, latency, LB_STAGE_FORWARD, &mark, 1);
+			if(!fit) {
+				processed++;
+				continue;
+			}
 		}
 
-		//Server
-		session = server_get_session(&destination_endpoint);
-		if(session) {
-			NetworkInterface* _ni = session->public_endpoint->ni;
-			session->untranslate(session, packet);
-			ni_output(_ni, packet);
-			return true;
+		lb_account(session, direction, length, core);
+		int index = group_count[direction][session->forward]++;
+		sessions[direction][session->forward][index] = session;
+		grouped[direction][session->forward][index] = packet;
+		if(capture)
+			captured[direction][session->forward][index] = capture_before(session, packet, ni_num, core);
+		//Reading session->forward is part of the lookup
+		if(profile)
+			lb_stage(stages, latency, LB_STAGE_LOOKUP, &mark, 1);
+	}
+
+	for(uint8_t direction = 0; direction < 2; direction++) {
+		for(uint8_t forward = 0; forward < FORWARD_COUNT; forward++) {
+			int group = group_count[direction][forward];
+			if(!group)
+				continue;
+
+			Session** _sessions = sessions[direction][forward];
+			Packet** _packets = grouped[direction][forward];
+			finished_count += forward_burst(forward, direction, _sessions, _packets, group, finished + finished_count);
+			if(profile)
+				lb_stage(stages, latency, LB_STAGE_FORWARD, &mark, group);
+
+			for(int i = 0; i < group; i++) {
+				NetworkInterface* ni = direction == FORWARD_TRANSLATE ?
+						_sessions[i]->server_endpoint->ni : _sessions[i]->public_endpoint->ni;
+				if(capture && captured[direction][forward][i])
+					capture_after(_packets[i], ni, core);
+				lb_output(ni, _packets[i], core, input);
+			}
+			processed += group;
+			if(profile)
+				lb_stage(stages, latency, LB_STAGE_OUTPUT, &mark, group);
+		}
+	}
+
+	//Sessions are freed only after every packet that refers them is sent
+	for(int i = 0; i < finished_count; i++) {
+		bool duplicated = false;
+		for(int j = 0; j < i; j++) {
+			if(finished[j] == finished[i]) {
+				duplicated = true;
+				break;
+			}
+		}
+
+		if(!duplicated)
+			service_free_session(finished[i]);
+	}
+	if(profile)
+		lb_stage(stages, latency, LB_STAGE_SESSION, &mark, finished_count);
+
+	return processed;
+}
+
+static uint32_t config_holds;
+static bool config_pending;
+
+void lb_config_hold() {
+	config_holds++;
+}
+
+void lb_config_release() {
+	if(!config_holds || --config_holds)
+		return;
+
+	if(config_pending)
+		lb_config_update();
+}
+
+/* Recompile tables derived from the configuration */
+void lb_config_update() {
+	//Once, at the last release
+	config_pending = !!config_holds;
+	if(config_pending)
+		return;
+
+	vip_rebuild();
+
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			service_update(entry->data);
+		}
+	}
+}
+
+void lb_latency_reset() {
+	for(int i = 0; i < lb_count; i++) {
+		LoadBalancer* lb = loadbalancers[i];
+		for(int j = 0; j < thread_count() * LB_STAGE_COUNT; j++)
+			histogram_reset(&lb->latency[j]);
+		for(int j = 0; j < thread_count(); j++) {
+			bzero(lb->cores[j].stages, sizeof(lb->cores[j].stages));
+			lb->cores[j].new_sessions = 0;
 		}
-		return false;
 	}
+}
+
+void lb_latency(int ni_num, uint8_t stage, Histogram* histogram) {
+	LoadBalancer* lb = loadbalancers[ni_num];
+
+	histogram_reset(histogram);
+	for(int i = 0; i < thread_count(); i++)
+		histogram_merge(histogram, &lb->latency[i * LB_STAGE_COUNT + stage]);
+}
 
-	return false;
+void lb_latency_dump() {
+	static const char* names[LB_STAGE_COUNT] = { "classify", "lookup", "session", "forward", "output", "slow" };
+
+	printf("Profiling %s, cycles per packet (session: per new or freed session)\n", lb_profile ? "on" : "off");
+	printf("NIC\tStage\t\tCount\t\tMean\tp50\tp90\tp99\tp99.9\tMax\n");
+	for(int i = 0; i < lb_count; i++) {
+		for(int j = 0; j < LB_STAGE_COUNT; j++) {
+			Histogram histogram;
+			lb_latency(i, j, &histogram);
+			if(!histogram.count)
+				continue;
+
+			printf("%d\t%-8s\t%-10lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n", i, names[j], histogram.count,
+					histogram.sum / histogram.count, histogram_percentile(&histogram, 50),
+					histogram_percentile(&histogram, 90), histogram_percentile(&histogram, 99),
+					histogram_percentile(&histogram, 99.9), histogram_max(&histogram));
+		}
+	}
+}
+
+void lb_stats_dump() {
+	for(int i = 0; i < lb_count; i++) {
+		printf("NIC %d\n", i);
+		stats_print(loadbalancers[i]->stats);
+	}
+}
+
+void lb_dump() {
+	printf("NIC\tFlow\t\tARP\t\tICMP\t\tOther\n");
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		LoadBalancerCore total;
+		lb_sum(i, &total);
+		printf("%d\t%lu\t\t%lu\t\t%lu\t\t%lu\n", i, total.classes[LB_CLASS_FLOW], total.classes[LB_CLASS_ARP],
+				total.classes[LB_CLASS_ICMP], total.classes[LB_CLASS_OTHER]);
+	}
 }
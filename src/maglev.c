@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+#include <util/event.h>
+
+#include "maglev.h"
+#include "flow.h"
+#include "server.h"
+
+Maglev* maglev_create(void* pool) {
+	Maglev* maglev = __malloc(sizeof(Maglev), pool);
+	if(!maglev)
+		return NULL;
+
+	bzero(maglev, sizeof(Maglev));
+	maglev->pool = pool;
+
+	return maglev;
+}
+
+static void maglev_table_free(MaglevTable* table) {
+	if(!table)
+		return;
+
+	if(table->servers)
+		__free(table->servers, table->pool);
+	if(table->private_addrs)
+		__free(table->private_addrs, table->pool);
+	__free(table, table->pool);
+}
+
+static bool maglev_table_free_event(void* context) {
+	maglev_table_free(context);
+
+	return false;
+}
+
+/* Readers on other cores may still hold the table */
+static void maglev_table_retire(MaglevTable* table) {
+	if(table && !event_timer_add(maglev_table_free_event, table, MAGLEV_FREE_DELAY, 0))
+		maglev_table_free(table);
+}
+
+void maglev_destroy(Maglev* maglev) {
+	if(maglev->event_id)
+		event_timer_remove(maglev->event_id);
+
+	maglev_table_free(maglev->current);
+	maglev_table_free(maglev->previous);
+	__free(maglev, maglev->pool);
+}
+
+static bool maglev_destroy_event(void* context) {
+	maglev_destroy(context);
+
+	return false;
+}
+
+void maglev_retire(Maglev* maglev) {
+	//No drain while waiting: the tables go together
+	if(maglev->event_id)
+		event_timer_remove(maglev->event_id);
+	maglev->event_id = 0;
+
+	if(!event_timer_add(maglev_destroy_event, maglev, MAGLEV_FREE_DELAY, 0))
+		maglev_destroy(maglev);
+}
+
+static int server_compare(const void* a, const void* b) {
+	Server* x = *(Server**)a;
+	Server* y = *(Server**)b;
+	uint64_t _x = (uint64_t)x->endpoint.addr << 16 | x->endpoint.port;
+	uint64_t _y = (uint64_t)y->endpoint.addr << 16 | y->endpoint.port;
+
+	return _x < _y ? -1 : _x > _y;
+}
+
+/*
+ * Maglev population (Eisenbud et al., NSDI'16). Servers are sorted by
+ * address first so every loadbalancer instance builds the same table from
+ * the same membership.
+ */
+static MaglevTable* maglev_table_create(List* servers, Map* private_endpoints, uint32_t modes, void* pool) {
+	MaglevTable* table = __malloc(sizeof(MaglevTable), pool);
+	if(!table)
+		return NULL;
+
+	bzero(table, sizeof(MaglevTable));
+	table->pool = pool;
+
+	uint32_t size = list_size(servers);
+	if(size == 0)
+		return table;
+
+	table->servers = __malloc(sizeof(Server*) * size, pool);
+	table->private_addrs = __malloc(sizeof(uint32_t) * size, pool);
+	uint32_t* offsets = __malloc(sizeof(uint32_t) * size * 3, pool);
+	if(!table->servers || !table->private_addrs || !offsets)
+		goto fail;
+
+	ListIterator iter;
+	list_iterator_init(&iter, servers);
+	while(list_iterator_has_next(&iter)) {
+		Server* server = list_iterator_next(&iter);
+		if(modes && !(modes & (1 << server->mode)))
+			continue;
+
+		table->servers[table->count++] = server;
+		if(table->count == 0xffff)
+			break;
+	}
+	if(table->count == 0) {
+		__free(offsets, pool);
+		return table;
+	}
+
+	qsort(table->servers, table->count, sizeof(Server*), server_compare);
+
+	uint32_t* skips = offsets + size;
+	uint32_t* nexts = skips + size;
+	for(uint32_t i = 0; i < table->count; i++) {
+		Server* server = table->servers[i];
+		FlowKey key;
+		flow_key_init(&key, server->endpoint.protocol, server->endpoint.addr, server->endpoint.port, 0, 0);
+		uint32_t hash = flow_hash(&key);
+
+		offsets[i] = hash % MAGLEV_SIZE;
+		skips[i] = flow_hash_addr(hash) % (MAGLEV_SIZE - 1) + 1;
+		nexts[i] = 0;
+		Endpoint* private_endpoint = private_endpoints ? map_get(private_endpoints, server->endpoint.ni) : NULL;
+		table->private_addrs[i] = private_endpoint ? private_endpoint->addr : 0;
+	}
+
+	memset(table->lookup, 0xff, sizeof(table->lookup));
+	uint32_t filled = 0;
+	while(1) {
+		for(uint32_t i = 0; i < table->count; i++) {
+			uint32_t slot = (offsets[i] + (uint64_t)nexts[i] * skips[i]) % MAGLEV_SIZE;
+			while(table->lookup[slot] != 0xffff) {
+				nexts[i]++;
+				slot = (offsets[i] + (uint64_t)nexts[i] * skips[i]) % MAGLEV_SIZE;
+			}
+
+			table->lookup[slot] = i;
+			nexts[i]++;
+			if(++filled == MAGLEV_SIZE)
+				goto done;
+		}
+	}
+
+done:
+	__free(offsets, pool);
+
+	return table;
+
+fail:
+	if(offsets)
+		__free(offsets, pool);
+	maglev_table_free(table);
+
+	return NULL;
+}
+
+static bool maglev_is_member(Server* server, List* active_servers, List* deactive_servers) {
+	ListIterator iter;
+	list_iterator_init(&iter, active_servers);
+	while(list_iterator_has_next(&iter))
+		if(list_iterator_next(&iter) == server)
+			return true;
+
+	list_iterator_init(&iter, deactive_servers);
+	while(list_iterator_has_next(&iter))
+		if(list_iterator_next(&iter) == server)
+			return true;
+
+	return false;
+}
+
+static bool maglev_drain_event(void* context) {
+	Maglev* maglev = context;
+	maglev->event_id = 0;
+
+	MaglevTable* previous = maglev->previous;
+	__atomic_store_n(&maglev->previous, NULL, __ATOMIC_RELEASE);
+	maglev_table_retire(previous);
+
+	//Generations wrap: leave no entry to match a later table
+	for(int i = 0; i < MAGLEV_CACHE_SIZE; i++)
+		__atomic_store_n(&maglev->cache[i], 0, __ATOMIC_RELAXED);
+
+	return false;
+}
+
+bool maglev_update(Maglev* maglev, List* active_servers, List* deactive_servers, Map* private_endpoints, uint32_t modes, uint64_t drain) {
+	if(!active_servers)
+		return false;
+
+	MaglevTable* table = maglev_table_create(active_servers, private_endpoints, modes, maglev->pool);
+	if(!table)
+		return false;
+
+	if(++maglev->generation == 0)
+		maglev->generation = 1;
+	table->generation = maglev->generation;
+
+	//Keep one generation back for established flows
+	MaglevTable* old = maglev->previous;
+	MaglevTable* previous = maglev->current;
+	__atomic_store_n(&maglev->previous, previous, __ATOMIC_RELEASE);
+	__atomic_store_n(&maglev->current, table, __ATOMIC_RELEASE);
+	maglev_table_retire(old);
+
+	//Removed servers must not be returned any more, cached or not
+	if(previous) {
+		for(uint32_t i = 0; i < previous->count; i++) {
+			if(!maglev_is_member(previous->servers[i], active_servers, deactive_servers))
+				__atomic_store_n(&previous->servers[i], NULL, __ATOMIC_RELAXED);
+		}
+	}
+
+	if(maglev->event_id)
+		event_timer_remove(maglev->event_id);
+	maglev->event_id = 0;
+	if(previous)
+		maglev->event_id = event_timer_add(maglev_drain_event, maglev, drain, 0);
+
+	return true;
+}
+
+/* The table of a cache entry's generation, if still kept */
+static inline MaglevTable* maglev_cache_table(uint64_t entry, MaglevTable* current, MaglevTable* previous) {
+	uint16_t generation = entry >> 16;
+	if(generation == current->generation)
+		return current;
+	if(generation == previous->generation)
+		return previous;
+
+	return NULL;
+}
+
+Server* maglev_get(Maglev* maglev, FlowKey* key, bool new_flow, uint32_t* private_addr) {
+	MaglevTable* current = __atomic_load_n(&maglev->current, __ATOMIC_ACQUIRE);
+	if(!current || !current->count)
+		return NULL;
+
+	uint32_t hash = flow_hash(key);
+	uint16_t index = current->lookup[hash % MAGLEV_SIZE];
+	Server* server = __atomic_load_n(&current->servers[index], __ATOMIC_RELAXED);
+	*private_addr = current->private_addrs[index];
+
+	MaglevTable* previous = __atomic_load_n(&maglev->previous, __ATOMIC_ACQUIRE);
+	if(__builtin_expect(!previous, 1))
+		return server;
+
+	//Membership changed recently
+	uint64_t* entry = &maglev->cache[hash & (MAGLEV_CACHE_SIZE - 1)];
+	uint64_t cached = __atomic_load_n(entry, __ATOMIC_RELAXED);
+	if(cached && (uint32_t)(cached >> 32) == hash) {
+		MaglevTable* table = maglev_cache_table(cached, current, previous);
+		uint16_t _index = cached & 0xffff;
+		Server* _server = table && _index < table->count ? __atomic_load_n(&table->servers[_index], __ATOMIC_RELAXED) : NULL;
+		if(_server) {
+			*private_addr = table->private_addrs[_index];
+			return _server;
+		}
+	}
+
+	if(!previous->count)
+		return server;
+
+	uint16_t _index = previous->lookup[hash % MAGLEV_SIZE];
+	Server* old = __atomic_load_n(&previous->servers[_index], __ATOMIC_RELAXED);
+	if(!old || old == server)
+		return server;
+
+	//Flow would move: new flows stay on the new backend, others on the old
+	MaglevTable* table = current;
+	if(!new_flow) {
+		table = previous;
+		index = _index;
+		server = old;
+		*private_addr = previous->private_addrs[_index];
+	}
+	__atomic_store_n(entry, (uint64_t)hash << 32 | (uint64_t)table->generation << 16 | index, __ATOMIC_RELAXED);
+
+	return server;
+}
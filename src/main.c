@@ -6,14 +6,28 @@
 #include <util/cmd.h>
 #include <util/types.h>
 #include <readline.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
 
 #include "endpoint.h"
 #include "service.h"
 #include "server.h"
 #include "schedule.h"
 #include "loadbalancer.h"
+#include "vip.h"
+#include "metrics.h"
+#include "capture.h"
+#include "sketch.h"
+#include "feedback.h"
+#include "sync.h"
+#include "snapshot.h"
+#include "config.h"
+
+extern void* __gmalloc_pool;
 
 static bool is_continue;
+static bool is_save;	//Sessions at exit
 
 static uint32_t str_to_addr(char* argv) {
 	char* str = argv;
@@ -43,12 +57,14 @@ static uint16_t str_to_port(char* argv) {
 static int cmd_exit(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
 	if(argc == 1) {
 		is_continue = false;
+		is_save = true;
 		return 0;
 	}
 
 	if(argc == 2) {
 		if(!strcmp(argv[1], "-f")) {
 			is_continue = false;
+			is_save = false;
 		}
 	} else {
 		return -1;
@@ -119,10 +135,17 @@ static int cmd_service(int argc, char** argv, void(*callback)(char* result, int
 					schedule = SCHEDULE_SOURCE_IP_HASH;
 				else if(!strcmp(argv[i], "w"))
 					schedule = SCHEDULE_WEIGHTED_ROUND_ROBIN;
+				else if(!strcmp(argv[i], "ch"))
+					schedule = SCHEDULE_CONSISTENT_HASH;
 				else
 					return i;
 
-				service_set_schedule(service, schedule);
+				if(!service_set_schedule(service, schedule))
+					return i;
+				continue;
+			} else if(!strcmp(argv[i], "-stateless") && !!service) {
+				if(!service_set_stateless(service))
+					return i;
 				continue;
 			} else if(!strcmp(argv[i], "-out") && !!service) {
 				i++;
@@ -283,18 +306,53 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 				uint8_t mode;
 				if(!strcmp(argv[i], "nat")) {
 					mode = MODE_NAT;
-					continue;
 				} else if(!strcmp(argv[i], "dnat")) {
 					mode = MODE_DNAT;
-					continue;
 				} else if(!strcmp(argv[i], "dr")) {
 					mode = MODE_DR;
-					continue;
+				} else if(!strcmp(argv[i], "ipip")) {
+					mode = MODE_IPIP;
+				} else if(!strcmp(argv[i], "gue")) {
+					mode = MODE_GUE;
 				} else
 					return i;
 
 				if(!server_set_mode(server, mode))
 					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-w") && !!server) {
+				i++;
+				if(!is_uint8(argv[i]))
+					return i;
+
+				server->weight = parse_uint8(argv[i]);
+				continue;
+			} else if(!strcmp(argv[i], "-c") && !!server) {
+				i++;
+				if(!is_uint32(argv[i]))
+					return i;
+
+				server->max_sessions = parse_uint32(argv[i]);
+				continue;
+			} else if(!strcmp(argv[i], "-b") && !!server) {
+				if(!server_set_backup(server, true))
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-s") && !!server) {
+				i++;
+				if(!is_uint32(argv[i]) || parse_uint32(argv[i]) > UINT32_MAX / 1000)
+					return i;
+
+				server_set_slow_start(server, parse_uint32(argv[i]) * 1000);
+				continue;
+			} else if(!strcmp(argv[i], "-mtu") && !!server) {
+				i++;
+				if(!is_uint16(argv[i]) || !server_set_mtu(server, parse_uint16(argv[i])))
+					return i;
+
+				continue;
 			} else
 				return i;
 		}
@@ -390,6 +448,523 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 	return 0;
 }
 
+static int cmd_stats(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc == 1) {
+		printf("Loadbalancer Packet Classes\n");
+		lb_dump();
+
+		return 0;
+	} else if(!strcmp(argv[1], "vip")) {
+		printf("Loadbalancer VIP Table\n");
+		vip_dump();
+
+		return 0;
+	} else if(!strcmp(argv[1], "latency")) {
+		if(argc > 2) {
+			if(!strcmp(argv[2], "on"))
+				lb_profile_set(true);
+			else if(!strcmp(argv[2], "off"))
+				lb_profile_set(false);
+			else if(!strcmp(argv[2], "reset"))
+				lb_latency_reset();
+			else
+				return 2;
+
+			return 0;
+		}
+
+		printf("Loadbalancer Stage Latency\n");
+		lb_latency_dump();
+
+		return 0;
+	} else if(!strcmp(argv[1], "nic")) {
+		printf("Loadbalancer NIC Counters\n");
+		lb_stats_dump();
+
+		return 0;
+	} else if(!strcmp(argv[1], "service")) {
+		printf("Loadbalancer Service Counters\n");
+		service_stats_dump();
+
+		return 0;
+	} else if(!strcmp(argv[1], "server")) {
+		printf("Loadbalancer Server Counters\n");
+		server_stats_dump();
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static int cmd_metrics(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc == 1) {
+		char* name = metrics_name();
+		if(name)
+			printf("Metrics published to %s every %d ms\n", name, METRICS_PERIOD / 1000);
+		else
+			printf("Metrics not published\n");
+
+		return 0;
+	}
+
+	if(!strcmp(argv[1], "off")) {
+		metrics_close();
+
+		return 0;
+	}
+
+	if(!metrics_open(strcmp(argv[1], "on") ? argv[1] : METRICS_NAME))
+		return 1;
+
+	return 0;
+}
+
+static int cmd_capture(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc == 1) {
+		capture_print();
+
+		return 0;
+	}
+
+	if(!strcmp(argv[1], "off")) {
+		capture_stop();
+
+		return 0;
+	} else if(!strcmp(argv[1], "dump")) {
+		if(argc != 3)
+			return -1;
+
+		return capture_dump(argv[2]) ? 0 : 1;
+	} else if(strcmp(argv[1], "on")) {
+		return 1;
+	}
+
+	CaptureFilter filter = { .sample = 1 };
+	for(int i = 2; i < argc; i++) {
+		if(i + 1 >= argc)
+			return i;
+
+		if(!strcmp(argv[i], "-n")) {
+			i++;
+			if(!is_uint32(argv[i]))
+				return i;
+			filter.sample = parse_uint32(argv[i]);
+		} else if(!strcmp(argv[i], "-vip")) {
+			i++;
+			filter.vip_addr = str_to_addr(argv[i]);
+			if(strchr(argv[i], ':'))
+				filter.vip_port = str_to_port(argv[i]);
+		} else if(!strcmp(argv[i], "-server")) {
+			i++;
+			filter.server_addr = str_to_addr(argv[i]);
+			if(strchr(argv[i], ':'))
+				filter.server_port = str_to_port(argv[i]);
+		} else if(!strcmp(argv[i], "-client")) {
+			i++;
+			filter.client_addr = str_to_addr(argv[i]);
+		} else
+			return i;
+	}
+
+	return capture_start(&filter) ? 0 : 1;
+}
+
+static int cmd_ddos(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc == 1) {
+		sketch_dump();
+
+		return 0;
+	}
+
+	if(!strcmp(argv[1], "off")) {
+		sketch_stop();
+
+		return 0;
+	} else if(strcmp(argv[1], "on")) {
+		return 1;
+	}
+
+	uint32_t threshold = 1000;
+	uint32_t prefix_threshold = 10000;
+	uint32_t block = 0;
+	for(int i = 2; i < argc; i++) {
+		if(i + 1 >= argc || !is_uint32(argv[i + 1]))
+			return i;
+
+		uint32_t value = parse_uint32(argv[i + 1]);
+		if(!strcmp(argv[i], "-c") && value)
+			threshold = value;
+		else if(!strcmp(argv[i], "-n") && value)
+			prefix_threshold = value;
+		else if(!strcmp(argv[i], "-b"))
+			block = value;
+		else
+			return i;
+		i++;
+	}
+
+	return sketch_start(threshold, prefix_threshold, block) ? 0 : 1;
+}
+
+/* addr[/length], /32 without one */
+static void str_to_rule(char* argv, AclRule* rule) {
+	rule->addr = str_to_addr(argv);
+	rule->length = strchr(argv, '/') ? str_to_port(argv) : 32;
+}
+
+static int cmd_acl(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc < 4 || (strcmp(argv[1], "-t") && strcmp(argv[1], "-u")) || !is_uint8(argv[3]))
+		return -1;
+
+	Endpoint service_endpoint = { .ni = ni_get(parse_uint8(argv[3])) };
+	service_endpoint.protocol = !strcmp(argv[1], "-t") ? IP_PROTOCOL_TCP : IP_PROTOCOL_UDP;
+	service_endpoint.addr = str_to_addr(argv[2]);
+	service_endpoint.port = str_to_port(argv[2]);
+	Service* service = service_endpoint.ni ? service_get(&service_endpoint) : NULL;
+	if(!service) {
+		printf("Can'nt found service\n");
+		return -1;
+	}
+
+	if(argc == 4) {
+		service_acl_dump(service);
+
+		return 0;
+	}
+
+	if(!strcmp(argv[4], "flush"))
+		return service_acl_flush(service) ? 0 : 1;
+
+	uint8_t action;
+	if(!strcmp(argv[4], "allow"))
+		action = ACL_ALLOW;
+	else if(!strcmp(argv[4], "deny"))
+		action = ACL_DENY;
+	else if(!strcmp(argv[4], "del"))
+		action = 0;
+	else
+		return 4;
+
+	if(argc < 6)
+		return 5;
+
+	uint32_t count = argc - 5;
+	FILE* fp = NULL;
+	char line[64];
+	if(!strcmp(argv[5], "-f")) {
+		//One prefix per line, all in one update
+		if(argc != 7)
+			return 6;
+
+		fp = fopen(argv[6], "r");
+		if(!fp) {
+			printf("Can'nt open %s\n", argv[6]);
+			return 6;
+		}
+
+		count = 0;
+		while(fgets(line, sizeof(line), fp))
+			count++;
+		rewind(fp);
+	}
+
+	AclRule* rules = __malloc(sizeof(AclRule) * (count ? count : 1), __gmalloc_pool);
+	if(!rules) {
+		printf("Can'nt allocate ACL rules\n");
+		if(fp)
+			fclose(fp);
+		return 1;
+	}
+
+	uint32_t size = 0;
+	if(fp) {
+		while(size < count && fgets(line, sizeof(line), fp)) {
+			if(line[0] < '0' || line[0] > '9')
+				continue;
+
+			str_to_rule(line, &rules[size]);
+			rules[size++].action = action;
+		}
+		fclose(fp);
+	} else {
+		for(int i = 5; i < argc; i++) {
+			str_to_rule(argv[i], &rules[size]);
+			rules[size++].action = action;
+		}
+	}
+
+	if(!size) {
+		__free(rules, __gmalloc_pool);
+		return 5;
+	}
+
+	bool result = action ? service_acl_add(service, rules, size) : service_acl_remove(service, rules, size);
+	__free(rules, __gmalloc_pool);
+
+	return result ? 0 : 1;
+}
+
+static int cmd_limit(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc < 4 || (strcmp(argv[1], "-t") && strcmp(argv[1], "-u")) || !is_uint8(argv[3]))
+		return -1;
+
+	Endpoint service_endpoint = { .ni = ni_get(parse_uint8(argv[3])) };
+	service_endpoint.protocol = !strcmp(argv[1], "-t") ? IP_PROTOCOL_TCP : IP_PROTOCOL_UDP;
+	service_endpoint.addr = str_to_addr(argv[2]);
+	service_endpoint.port = str_to_port(argv[2]);
+	Service* service = service_endpoint.ni ? service_get(&service_endpoint) : NULL;
+	if(!service) {
+		printf("Can'nt found service\n");
+		return -1;
+	}
+
+	if(argc == 4) {
+		if(service->limit)
+			limit_dump(service->limit);
+		else
+			printf("No limits\n");
+
+		return 0;
+	}
+
+	if(argc == 5 && !strcmp(argv[4], "off"))
+		return service_limit_set(service, NULL) ? 0 : 1;
+
+	//rate[/burst]
+	bool parse_rate(char* str, uint32_t* rate, uint32_t* burst) {
+		char* slash = strchr(str, '/');
+		if(slash)
+			*slash = '\0';
+		bool result = is_uint32(str) && (!slash || is_uint32(slash + 1));
+		if(result) {
+			*rate = parse_uint32(str);
+			*burst = slash ? parse_uint32(slash + 1) : 0;
+		}
+		if(slash)
+			*slash = '/';
+
+		return result;
+	}
+
+	uint32_t client_rate = 0, client_burst = 0;
+	uint32_t service_rate = 0, service_burst = 0;
+	uint8_t action = LIMIT_DROP;
+	for(int i = 4; i < argc; i++) {
+		if(!strcmp(argv[i], "-r")) {
+			action = LIMIT_RESET;
+		} else if(!strcmp(argv[i], "-c")) {
+			i++;
+			if(i >= argc || !parse_rate(argv[i], &client_rate, &client_burst))
+				return i;
+		} else if(!strcmp(argv[i], "-s")) {
+			i++;
+			if(i >= argc || !parse_rate(argv[i], &service_rate, &service_burst))
+				return i;
+		} else
+			return i;
+	}
+
+	if(!client_rate && !service_rate)
+		return service_limit_set(service, NULL) ? 0 : 1;
+
+	Limit* limit = limit_create(client_rate, client_burst, service_rate, service_burst, action,
+			service->endpoint.ni->pool);
+	if(!limit) {
+		printf("Can'nt allocate limits\n");
+		return 1;
+	}
+
+	return service_limit_set(service, limit) ? 0 : 1;
+}
+
+static int cmd_feedback(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc == 1) {
+		feedback_dump();
+
+		return 0;
+	}
+
+	if(!strcmp(argv[1], "off")) {
+		feedback_stop();
+
+		return 0;
+	} else if(strcmp(argv[1], "on")) {
+		return 1;
+	}
+
+	uint16_t port = FEEDBACK_PORT;
+	uint32_t timeout = FEEDBACK_TIMEOUT;
+	for(int i = 2; i < argc; i++) {
+		if(i + 1 >= argc || !is_uint32(argv[i + 1]))
+			return i;
+
+		uint32_t value = parse_uint32(argv[i + 1]);
+		if(!strcmp(argv[i], "-p") && value && value <= UINT16_MAX)
+			port = value;
+		else if(!strcmp(argv[i], "-t") && value && value <= UINT32_MAX / 1000)
+			timeout = value * 1000;
+		else
+			return i;
+		i++;
+	}
+
+	feedback_start(port, timeout);
+
+	return 0;
+}
+
+static int cmd_sync(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc == 1) {
+		sync_dump();
+
+		return 0;
+	}
+
+	if(!strcmp(argv[1], "off")) {
+		sync_stop();
+
+		return 0;
+	} else if(strcmp(argv[1], "on")) {
+		return 1;
+	}
+
+	if(argc < 5)
+		return -1;
+
+	uint32_t addr = str_to_addr(argv[2]);
+	uint32_t peer = str_to_addr(argv[3]);
+	if(!is_uint8(argv[4]))
+		return 4;
+	NetworkInterface* ni = ni_get(parse_uint8(argv[4]));
+	if(!ni)
+		return 4;
+
+	uint16_t port = SYNC_PORT;
+	uint32_t rate = SYNC_RATE;
+	for(int i = 5; i < argc; i++) {
+		if(i + 1 >= argc || !is_uint32(argv[i + 1]))
+			return i;
+
+		uint32_t value = parse_uint32(argv[i + 1]);
+		if(!strcmp(argv[i], "-p") && value && value <= UINT16_MAX)
+			port = value;
+		else if(!strcmp(argv[i], "-r") && value)
+			rate = value;
+		else
+			return i;
+		i++;
+	}
+
+	return sync_start(ni, addr, peer, port, rate) ? 0 : 1;
+}
+
+static int cmd_session(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc < 2)
+		return -1;
+
+	if(argc <= 3 && (!strcmp(argv[1], "save") || !strcmp(argv[1], "load"))) {
+		char* path = argc == 3 ? argv[2] : SNAPSHOT_FILE;
+		if(!strcmp(argv[1], "save")) {
+			int64_t count = snapshot_save(path);
+			if(count < 0)
+				return 1;
+
+			printf("%ld sessions saved to %s\n", count, path);
+			return 0;
+		}
+
+		uint32_t failed;
+		int64_t count = snapshot_load(path, &failed);
+		if(count < 0)
+			return 1;
+
+		printf("%ld sessions loaded from %s, %u failed\n", count, path, failed);
+		return 0;
+	}
+
+	if(argc < 3 || strcmp(argv[1], "top"))
+		return -1;
+
+	if(!strcmp(argv[2], "on")) {
+		uint32_t sample = TOP_DEFAULT_SAMPLE;
+		if(argc == 5 && !strcmp(argv[3], "-n") && is_uint32(argv[4]))
+			sample = parse_uint32(argv[4]);
+		else if(argc != 3)
+			return 3;
+
+		return service_top_start(sample) ? 0 : 1;
+	}
+	if(!strcmp(argv[2], "off")) {
+		service_top_stop();
+
+		return 0;
+	}
+
+	Endpoint service_endpoint = { .ni = NULL };
+	int count = 10;
+	int i;
+	for(i = 2; i < argc; i++) {
+		if(!strcmp(argv[i], "-t") || !strcmp(argv[i], "-u")) {
+			service_endpoint.protocol = !strcmp(argv[i], "-t") ? IP_PROTOCOL_TCP : IP_PROTOCOL_UDP;
+			if(i + 2 >= argc)
+				return i;
+			i++;
+			service_endpoint.addr = str_to_addr(argv[i]);
+			service_endpoint.port = str_to_port(argv[i]);
+			i++;
+			if(!is_uint8(argv[i]))
+				return i;
+			service_endpoint.ni = ni_get(parse_uint8(argv[i]));
+			if(!service_endpoint.ni)
+				return i;
+		} else if(!strcmp(argv[i], "-n")) {
+			i++;
+			if(i >= argc || !is_uint32(argv[i]))
+				return i;
+			count = parse_uint32(argv[i]);
+		} else
+			return i;
+	}
+
+	Service* service = service_endpoint.ni ? service_get(&service_endpoint) : NULL;
+	if(!service) {
+		printf("Can'nt found service\n");
+		return -1;
+	}
+
+	service_top_dump(service, count);
+
+	return 0;
+}
+
+static int cmd_config(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc < 2 || argc > 3)
+		return -1;
+
+	char* path = argc == 3 ? argv[2] : CONFIG_FILE;
+	if(!strcmp(argv[1], "apply")) {
+		ConfigDiff diff;
+		if(!config_apply(path, &diff))
+			return 1;
+
+		char* kinds[] = { "Services", "Servers" };
+		for(int i = 0; i < 2; i++)
+			printf("%s\t%u added, %u changed, %u removed, %u failed\n", kinds[i],
+					diff.added[i], diff.changed[i], diff.removed[i], diff.failed[i]);
+
+		return 0;
+	} else if(!strcmp(argv[1], "save")) {
+		if(!config_save(path))
+			return 1;
+
+		printf("Config saved to %s\n", path);
+		return 0;
+	}
+
+	return -1;
+}
+
 Command commands[] = {
 	{
 		.name = "exit",
@@ -413,6 +988,66 @@ Command commands[] = {
 		.args = "-add ip [rip ip] port [rip port]\n-del ip [rip ip] port [rip port]",
 		.func = cmd_server
 	},
+	{
+		.name = "stats",
+		.desc = "Show statistics",
+		.args = "",
+		.func = cmd_stats
+	},
+	{
+		.name = "metrics",
+		.desc = "Publish counters to shared memory",
+		.args = "[on | name | off]",
+		.func = cmd_metrics
+	},
+	{
+		.name = "capture",
+		.desc = "Capture forwarded packet headers",
+		.args = "on [-n sample] [-vip addr[:port]] [-server addr[:port]] [-client addr] | off | dump file",
+		.func = cmd_capture
+	},
+	{
+		.name = "ddos",
+		.desc = "Detect and block new session floods",
+		.args = "on [-c per client/s] [-n per /24/s] [-b block seconds] | off",
+		.func = cmd_ddos
+	},
+	{
+		.name = "acl",
+		.desc = "Allow or deny client prefixes of a service",
+		.args = "-t|-u addr:port nic [allow | deny | del prefix[/length]... | allow | deny | del -f file | flush]",
+		.func = cmd_acl
+	},
+	{
+		.name = "limit",
+		.desc = "Limit new sessions per second of a service",
+		.args = "-t|-u addr:port nic [-c per client[/burst]] [-s per service[/burst]] [-r] | off",
+		.func = cmd_limit
+	},
+	{
+		.name = "feedback",
+		.desc = "Weigh servers by the load their agents report",
+		.args = "on [-p port] [-t timeout seconds] | off",
+		.func = cmd_feedback
+	},
+	{
+		.name = "sync",
+		.desc = "Replicate sessions to a standby loadbalancer",
+		.args = "on addr peer nic [-p port] [-r records/s] | off",
+		.func = cmd_sync
+	},
+	{
+		.name = "session",
+		.desc = "Top talkers of a service, save and load sessions",
+		.args = "top on [-n sample] | off | -t|-u [addr:port] [nic] [-n count] | save | load [file]",
+		.func = cmd_session
+	},
+	{
+		.name = "config",
+		.desc = "Apply a config file of every service and server, or save the current one",
+		.args = "apply | save [file]",
+		.func = cmd_config
+	},
 	{
 		.name = NULL,
 		.desc = NULL,
@@ -439,6 +1074,23 @@ void destroy() {
 }
 
 void gdestroy() {
+	if(!is_save)
+		return;
+
+	//Every core has stopped: the tables hold still
+	size_t sessions = 0;
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* _sessions = ni_config_get(ni_get(i), SESSIONS);
+		if(_sessions)
+			sessions += map_size(_sessions);
+	}
+	if(!sessions)
+		return;
+
+	int64_t saved = snapshot_save(SNAPSHOT_FILE);
+	if(saved >= 0)
+		printf("%ld sessions saved to %s\n", saved, SNAPSHOT_FILE);
 }
 
 int main(int argc, char** argv) {
@@ -456,16 +1108,21 @@ int main(int argc, char** argv) {
 	thread_barrior();
 
 	int count = ni_count();
+	Packet* packets[LB_BURST];
 	while(is_continue) {
 		for(int i = 0; i < count; i++) {
 			NetworkInterface* ni = ni_get(i);
-			if(ni_has_input(ni)) {
+			int burst = 0;
+			while(burst < LB_BURST && ni_has_input(ni)) {
 				Packet* packet = ni_input(ni);
 				if(!packet)
-					continue;
+					break;
 
-				lb_process(packet);
+				packets[burst++] = packet;
 			}
+
+			if(burst)
+				lb_process_burst(packets, burst, i);
 		}
 		lb_loop();
 
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread.h>
+#include <shared.h>
+#include <net/ip.h>
+#include <util/map.h>
+#include <util/event.h>
+
+#include "metrics.h"
+#include "loadbalancer.h"
+#include "service.h"
+#include "server.h"
+#include "schedule.h"
+
+static Metrics* metrics;
+static char name[64];
+
+bool metrics_open(char* _name) {
+	Metrics* _metrics = shared_map(_name, sizeof(Metrics));
+	if(!_metrics) {
+		printf("Can'nt map metrics %s\n", _name);
+		return false;
+	}
+
+	metrics_close();
+
+	_metrics->magic = METRICS_MAGIC;
+	_metrics->version = METRICS_VERSION;
+	_metrics->size = sizeof(Metrics);
+	_metrics->core_count = thread_count();
+	metrics = _metrics;
+	snprintf(name, sizeof(name), "%s", _name);
+	metrics_publish();
+
+	return true;
+}
+
+void metrics_close() {
+	if(!metrics)
+		return;
+
+	shared_unmap(metrics, sizeof(Metrics));
+	metrics = NULL;
+}
+
+char* metrics_name() {
+	return metrics ? name : NULL;
+}
+
+static bool metrics_tick(void* context) {
+	metrics_publish();
+
+	return true;
+}
+
+/* Published by the first core, which also runs the console */
+bool metrics_init() {
+	if(thread_id() != 0)
+		return true;
+
+	return event_timer_add(metrics_tick, NULL, METRICS_PERIOD, METRICS_PERIOD) != 0;
+}
+
+static char* metrics_schedule(uint8_t schedule) {
+	switch(schedule) {
+		case SCHEDULE_ROUND_ROBIN:		return "rr";
+		case SCHEDULE_RANDOM:			return "r";
+		case SCHEDULE_LEAST:			return "l";
+		case SCHEDULE_SOURCE_IP_HASH:		return "h";
+		case SCHEDULE_WEIGHTED_ROUND_ROBIN:	return "w";
+		case SCHEDULE_CONSISTENT_HASH:		return "ch";
+		default:				return "";
+	}
+}
+
+static char* metrics_mode(uint8_t mode) {
+	switch(mode) {
+		case MODE_NAT:	return "nat";
+		case MODE_DNAT:	return "dnat";
+		case MODE_DR:	return "dr";
+		case MODE_IPIP:	return "ipip";
+		case MODE_GUE:	return "gue";
+		default:	return "";
+	}
+}
+
+static void metrics_entry(MetricsEntry* entry, Endpoint* endpoint, int ni_num, char* kind, Map* sessions, Stats* stats) {
+	entry->protocol = endpoint->protocol;
+	entry->ni_num = ni_num;
+	strncpy(entry->kind, kind, sizeof(entry->kind) - 1);
+	entry->kind[sizeof(entry->kind) - 1] = '\0';
+	entry->addr = endpoint->addr;
+	entry->port = endpoint->port;
+	entry->sessions = sessions ? map_size(sessions) : 0;
+	stats_sum(stats, &entry->total);
+}
+
+void metrics_publish() {
+	if(!metrics)
+		return;
+
+	//Sequence lock: odd while the region is written
+	uint32_t sequence = metrics->sequence;
+	__atomic_store_n(&metrics->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	int count = ni_count();
+	if(count > METRICS_NIC_MAX)
+		count = METRICS_NIC_MAX;
+
+	metrics->profile = lb_profile_get();
+	metrics->truncated = false;
+	metrics->nic_count = count;
+	metrics->service_count = 0;
+	metrics->server_count = 0;
+	for(int i = 0; i < count; i++) {
+		LoadBalancer* lb = lb_get(i);
+		MetricsNIC* nic = &metrics->nics[i];
+
+		stats_sum(lb->stats, &nic->total);
+		LoadBalancerCore counters;
+		lb_sum(i, &counters);
+		memcpy(nic->classes, counters.classes, sizeof(nic->classes));
+		nic->sessions = map_size(lb->sessions);
+		for(int j = 0; j < LB_STAGE_COUNT; j++)
+			lb_latency(i, j, &nic->latency[j]);
+
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(services) {
+			MapIterator iter;
+			map_iterator_init(&iter, services);
+			while(map_iterator_has_next(&iter)) {
+				Service* service = map_iterator_next(&iter)->data;
+				if(metrics->service_count == METRICS_SERVICE_MAX) {
+					metrics->truncated = true;
+					break;
+				}
+
+				MetricsEntry* entry = &metrics->services[metrics->service_count++];
+				metrics_entry(entry, &service->endpoint, i, metrics_schedule(service->schedule),
+						service->sessions, service->stats);
+				entry->active = service->state == SERVICE_STATE_ACTIVE;
+				entry->weight = 0;
+			}
+		}
+
+		Map* servers = ni_config_get(ni_get(i), SERVERS);
+		if(servers) {
+			MapIterator iter;
+			map_iterator_init(&iter, servers);
+			while(map_iterator_has_next(&iter)) {
+				Server* server = map_iterator_next(&iter)->data;
+				if(metrics->server_count == METRICS_SERVER_MAX) {
+					metrics->truncated = true;
+					break;
+				}
+
+				MetricsEntry* entry = &metrics->servers[metrics->server_count++];
+				metrics_entry(entry, &server->endpoint, i, metrics_mode(server->mode), server->sessions,
+						server->stats);
+				entry->active = server->state == SERVER_STATE_ACTIVE;
+				entry->weight = server->weight;
+			}
+		}
+	}
+	metrics->generation++;
+
+	__atomic_store_n(&metrics->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
@@ -5,8 +5,6 @@
 #undef DONT_MAKE_WRAPPER
 #include <util/map.h>
 #include <net/packet.h>
-#include <net/ether.h>
-#include <net/arp.h>
 #include <net/ip.h>
 #include <net/tcp.h>
 #include <net/udp.h>
@@ -15,11 +13,8 @@
 #include "endpoint.h"
 #include "session.h"
 #include "service.h"
+#include "forward.h"
 
-static bool nat_tcp_translate(Session* session, Packet* packet);
-static bool nat_udp_translate(Session* session, Packet* packet);
-static bool nat_tcp_untranslate(Session* session, Packet* packet);
-static bool nat_udp_untranslate(Session* session, Packet* packet);
 static bool nat_tcp_free(Session* session);
 static bool nat_udp_free(Session* session);
 
@@ -41,8 +36,7 @@ Session* nat_tcp_session_alloc(Endpoint* server_endpoint, Endpoint* service_endp
 	session_recharge(session);
 	session->fin = false;
 
-	session->translate = nat_tcp_translate;
-	session->untranslate = nat_tcp_untranslate;
+	session->forward = FORWARD_NAT_TCP;
 	session->free = nat_tcp_free;
 
 	//add recharege
@@ -67,13 +61,36 @@ Session* nat_udp_session_alloc(Endpoint* server_endpoint, Endpoint* service_endp
 	session_recharge(session);
 	session->fin = false;
 
-	session->translate = nat_udp_translate;
-	session->untranslate = nat_udp_untranslate;
+	session->forward = FORWARD_NAT_UDP;
 	session->free = nat_udp_free;
 
 	return session;
 }
 
+bool nat_set_port(Session* session, uint16_t port) {
+	NetworkInterface* ni = session->server_endpoint->ni;
+	uint32_t addr = session->private_endpoint.addr;
+	uint16_t old = session->private_endpoint.port;
+	if(port == old)
+		return true;
+
+	if(session->forward == FORWARD_NAT_TCP) {
+		if(!tcp_port_alloc0(ni, addr, port))
+			return false;
+		tcp_port_free(ni, addr, old);
+	} else if(session->forward == FORWARD_NAT_UDP) {
+		if(!udp_port_alloc0(ni, addr, port))
+			return false;
+		udp_port_free(ni, addr, old);
+	} else {
+		return true;
+	}
+
+	session->private_endpoint.port = port;
+
+	return true;
+}
+
 static bool nat_tcp_free(Session* session) {
 	tcp_port_free(session->server_endpoint->ni, session->private_endpoint.addr, session->private_endpoint.port);
 	__free(session, session->server_endpoint->ni->pool);
@@ -87,90 +104,3 @@ static bool nat_udp_free(Session* session) {
 
 	return true;
 }
-
-static bool nat_tcp_translate(Session* session, Packet* packet) {
-	Endpoint* server_endpoint = session->server_endpoint;
-	Endpoint* private_endpoint = &(session->private_endpoint);
-	Ether* ether = (Ether*)(packet->buffer + packet->start);
-	IP* ip = (IP*)ether->payload;
-	TCP* tcp = (TCP*)ip->body;
-
-	ether->smac = endian48(session->server_endpoint->ni->mac);
-	ether->dmac = endian48(arp_get_mac(session->server_endpoint->ni, server_endpoint->addr, private_endpoint->addr));
-	ip->source = endian32(private_endpoint->addr);
-	ip->destination = endian32(server_endpoint->addr);
-	tcp->source = endian16(private_endpoint->port);
-	tcp->destination = endian16(server_endpoint->port);
-
-	tcp_pack(packet, endian16(ip->length) - ip->ihl * 4 - TCP_LEN);
-	session_recharge(session);
-
-	if(session->fin && tcp->ack)
-		service_free_session(session);
-	else
-		session_recharge(session);
-
-	return true;
-}
-
-static bool nat_udp_translate(Session* session, Packet* packet) {
-	Endpoint* server_endpoint = session->server_endpoint;
-	Endpoint* private_endpoint = &(session->private_endpoint);
-	Ether* ether = (Ether*)(packet->buffer + packet->start);
-	IP* ip = (IP*)ether->payload;
-	UDP* udp = (UDP*)ip->body;
-
-	ether->smac = endian48(session->server_endpoint->ni->mac);
-	ether->dmac = endian48(arp_get_mac(session->server_endpoint->ni, server_endpoint->addr, private_endpoint->addr));
-	ip->source = endian32(private_endpoint->addr);
-	ip->destination = endian32(server_endpoint->addr);
-	udp->source = endian16(private_endpoint->port);
-	udp->destination = endian16(server_endpoint->port);
-
-	udp_pack(packet, endian16(ip->length) - ip->ihl * 4 - UDP_LEN);
-
-	session_recharge(session);
-
-	return true;
-}
-
-static bool nat_tcp_untranslate(Session* session, Packet* packet) {
-	Endpoint* public_endpoint = session->public_endpoint;
-	Ether* ether = (Ether*)(packet->buffer + packet->start);
-	IP* ip = (IP*)ether->payload;
-	TCP* tcp = (TCP*)ip->body;
-
-	ether->smac = endian48(session->public_endpoint->ni->mac);
-	ether->dmac = endian48(arp_get_mac(session->public_endpoint->ni, session->client_endpoint.addr, session->public_endpoint->addr));
-	ip->source = endian32(public_endpoint->addr);
-	ip->destination = endian32(session->client_endpoint.addr);
-	tcp->source = endian16(public_endpoint->port);
-	tcp->destination = endian16(session->client_endpoint.port);
-
-	tcp_pack(packet, endian16(ip->length) - ip->ihl * 4 - TCP_LEN);
-	if(tcp->fin) {
-		session_set_fin(session);
-	} else
-		session_recharge(session);
-	return true;
-}
-
-static bool nat_udp_untranslate(Session* session, Packet* packet) {
-	Endpoint* public_endpoint = session->public_endpoint;
-	Ether* ether = (Ether*)(packet->buffer + packet->start);
-	IP* ip = (IP*)ether->payload;
-	UDP* udp = (UDP*)ip->body;
-
-	ether->smac = endian48(session->public_endpoint->ni->mac);
-	ether->dmac = endian48(arp_get_mac(session->public_endpoint->ni, session->client_endpoint.addr, session->public_endpoint->addr));
-	ip->source = endian32(public_endpoint->addr);
-	ip->destination = endian32(session->client_endpoint.addr);
-	udp->source = endian16(public_endpoint->port);
-	udp->destination = endian16(session->client_endpoint.port);
-
-	udp_pack(packet, endian16(ip->length) - ip->ihl * 4 - UDP_LEN);
-
-	session_recharge(session);
-
-	return true;
-}
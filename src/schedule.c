@@ -1,44 +1,109 @@
+#include <string.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+
 #include "schedule.h"
 #include "server.h"
 #include "service.h"
 #include "endpoint.h"
+#include "flow.h"
+#include "maglev.h"
 
 Server* schedule_round_robin(Service* service, Endpoint* client_endpoint) {
-	uint32_t count = list_size(service->active_servers);
-	RoundRobin* roundrobin = service->priv;
-	if(count == 0)
+	List* servers = service->active_servers;
+	uint32_t count = list_size(servers);
+	RoundRobin* roundrobin = __atomic_load_n(&service->robin, __ATOMIC_ACQUIRE);
+	if(count == 0 || !roundrobin)
 		return NULL; 
 
 	uint32_t index = (roundrobin->robin++) % count;
 
-	return list_get(service->active_servers, index);
+	return list_get(servers, index);
 }
 
-Server* schedule_weighted_round_robin(Service* service, Endpoint* client_endpoint) {
-	uint32_t count = list_size(service->active_servers);
-	RoundRobin* roundrobin = service->priv;
-	if(count == 0)
-		return NULL; 
+ScheduleWeights* schedule_weights_create(List* servers, void* pool) {
+	uint32_t count = servers ? list_size(servers) : 0;
+	size_t size = sizeof(ScheduleWeights) + (sizeof(Server*) + sizeof(uint64_t) * 2 + sizeof(uint32_t) + sizeof(uint8_t)) * count;
+	ScheduleWeights* weights = __malloc(size, pool);
+	if(!weights)
+		return NULL;
+
+	bzero(weights, size);
+	weights->pool = pool;
+	weights->servers = (Server**)(weights + 1);
+	weights->cumulative = (uint64_t*)(weights->servers + count);
+	weights->loads = weights->cumulative + count;
+	weights->shares = (uint32_t*)(weights->loads + count);
+	weights->weights = (uint8_t*)(weights->shares + count);
+
+	//Weights count in 1/SERVER_SHARE_SCALE while a server slow starts or reports load
+	uint32_t i = 0;
+	if(count) {
+		ListIterator iter;
+		list_iterator_init(&iter, servers);
+		while(list_iterator_has_next(&iter) && i < count) {
+			Server* server = list_iterator_next(&iter);
+			uint32_t share = server_share(server);
+			weights->servers[i] = server;
+			weights->shares[i] = share;
+			weights->weights[i] = server->weight;
+			weights->scaled |= share < SERVER_SHARE_SCALE;
+			//A server below its full share counts as if it had more sessions, none at 0
+			weights->loads[i] = share ? ((uint64_t)SERVER_SHARE_SCALE << SCHEDULE_LOAD_SHIFT) / share : 0;
+			i++;
+		}
+	}
+	weights->count = i;
+
+	for(uint32_t j = 0; j < i; j++) {
+		uint64_t weight = (uint64_t)weights->weights[j] * weights->shares[j];
+		if(!weights->scaled)
+			weight /= SERVER_SHARE_SCALE;
+		weights->whole += weight;
+		weights->cumulative[j] = weights->whole;
+	}
+
+	return weights;
+}
 
-	uint32_t whole_weight = 0;
-	ListIterator iter;
-	list_iterator_init(&iter, service->active_servers);
-	while(list_iterator_has_next(&iter)) {
-		Server* server = list_iterator_next(&iter);
-		whole_weight += server->weight;
+void schedule_weights_destroy(ScheduleWeights* weights) {
+	__free(weights, weights->pool);
+}
+
+bool schedule_weights_stale(ScheduleWeights* weights) {
+	for(uint32_t i = 0; i < weights->count; i++) {
+		Server* server = weights->servers[i];
+		if(server_share(server) != weights->shares[i] || server->weight != weights->weights[i])
+			return true;
 	}
 
-	uint32_t _index = (roundrobin->robin++) & whole_weight;
-	list_iterator_init(&iter, service->active_servers);
-	while(list_iterator_has_next(&iter)) {
-		Server* server = list_iterator_next(&iter);
-		if(_index < server->weight)
-			return server;
+	return false;
+}
+
+Server* schedule_weighted_round_robin(Service* service, Endpoint* client_endpoint) {
+	RoundRobin* roundrobin = __atomic_load_n(&service->robin, __ATOMIC_ACQUIRE);
+	ScheduleWeights* weights = __atomic_load_n(&service->weights, __ATOMIC_ACQUIRE);
+	if(!roundrobin || !weights || weights->whole == 0)
+		return NULL;
+
+	//Scaled weights are long runs of a server: stride over them by a prime, every index once per round
+	uint64_t index = (roundrobin->robin++) % weights->whole;
+	if(weights->scaled)
+		index = index * SCHEDULE_STRIDE % weights->whole;
+
+	//First server whose cumulative weight is past index
+	uint32_t lo = 0;
+	uint32_t hi = weights->count - 1;
+	while(lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if(weights->cumulative[mid] > index)
+			hi = mid;
 		else
-			_index -= server->weight;
+			lo = mid + 1;
 	}
 
-	return NULL;
+	return weights->servers[lo];
 }
 
 Server* schedule_random(Service* service, Endpoint* client_endpoint) {
@@ -50,43 +115,60 @@ Server* schedule_random(Service* service, Endpoint* client_endpoint) {
 		return time;
 	}
 
-	uint32_t count = list_size(service->active_servers);
+	List* servers = service->active_servers;
+	uint32_t count = list_size(servers);
 	if(count == 0)
 		return NULL;
 
 	uint32_t random_num = cpu_tsc() % count;
 
-	return list_get(service->active_servers, random_num);
+	return list_get(servers, random_num);
 }
 
 Server* schedule_least(Service* service, Endpoint* client_endpoint) {
-	uint32_t count = list_size(service->active_servers);
-	if(count == 0)
-		return NULL; 
+	ScheduleWeights* weights = __atomic_load_n(&service->weights, __ATOMIC_ACQUIRE);
+	if(!weights)
+		return NULL;
 
-	List* servers = service->active_servers;
-	ListIterator iter;
-	list_iterator_init(&iter, servers);
 	Server* server = NULL;
-	uint32_t session_count = UINT32_MAX;
-	while(list_iterator_has_next(&iter)) {
-		Server* _server = list_iterator_next(&iter);
-
-		if(map_size(_server->sessions) < session_count)
+	uint64_t load = UINT64_MAX;
+	for(uint32_t i = 0; i < weights->count; i++) {
+		if(!weights->loads[i])
+			continue;
+
+		Server* _server = weights->servers[i];
+		uint32_t _session_count = __atomic_load_n(&_server->active_sessions, __ATOMIC_RELAXED);
+		uint64_t _load = ((uint64_t)_session_count + 1) * weights->loads[i];
+		if(_load < load) {
 			server = _server;
+			load = _load;
+		}
 	}
 
 	return server;
 }
 
 Server* schedule_source_ip_hash(Service* service, Endpoint* client_endpoint) {
-	uint32_t count = list_size(service->active_servers);
+	List* servers = service->active_servers;
+	uint32_t count = list_size(servers);
 	if(count == 0)
 		return NULL;
 
-	uint32_t index = client_endpoint->addr % count;
+	uint32_t index = flow_hash_addr(client_endpoint->addr) % count;
+
+	return list_get(servers, index);
+}
+
+Server* schedule_consistent_hash(Service* service, Endpoint* client_endpoint) {
+	FlowKey key;
+	flow_key_init(&key, client_endpoint->protocol, client_endpoint->addr, client_endpoint->port, service->endpoint.addr, service->endpoint.port);
+
+	Maglev* maglev = __atomic_load_n(&service->maglev, __ATOMIC_ACQUIRE);
+	if(!maglev)
+		return NULL;
 
-	return list_get(service->active_servers, index);
+	uint32_t private_addr;
+	return maglev_get(maglev, &key, true, &private_addr);
 }
 
 Server* schedule_min_request_time(Service* service, Endpoint* client_endpoint) {
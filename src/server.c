@@ -20,6 +20,11 @@
 #include "nat.h"
 #include "dnat.h"
 #include "dr.h"
+#include "tunnel.h"
+#include "flow.h"
+#include "loadbalancer.h"
+#include "feedback.h"
+#include "vip.h"
 
 extern void* __gmalloc_pool;
 
@@ -38,6 +43,10 @@ static bool server_add(NetworkInterface* ni, Server* server) {
 		return false;
 	}
 
+	return true;
+}
+
+static void server_join(NetworkInterface* ni, Server* server) {
 	//Add to service active & deactive server list
 	uint32_t count = ni_count();
 	for(int i = 0; i < count; i++) {
@@ -58,17 +67,15 @@ static bool server_add(NetworkInterface* ni, Server* server) {
 			//list_remove_data(service->active_servers, server);
 			//list_remove_data(service->deactive_servers, server);
 			if(server->state == SERVER_STATE_ACTIVE) {
-				list_add(service->active_servers, server);
+				list_add(service_servers(service, server), server);
 			} else {
 				list_add(service->deactive_servers, server);
 			}
 		}
 	}
-
-	return true;
 }
 
-Server* server_alloc(Endpoint* server_endpoint) {
+Server* server_create(Endpoint* server_endpoint) {
 	size_t size = sizeof(Server);
 	Server* server = (Server*)malloc(size);
 	if(!server) {
@@ -81,51 +88,189 @@ Server* server_alloc(Endpoint* server_endpoint) {
 
 	server->state = SERVER_STATE_ACTIVE;
 	server->event_id = 0;
+	server->weight = 1;
 	server_set_mode(server, MODE_NAT);
+	server->stats = stats_create(server->endpoint.ni->pool);
+	if(!server->stats)
+		goto error;
 
 	if(!server_add(server->endpoint.ni, server))
 		goto error;
-return server;
+
+	return server;
 
 error:
+	stats_destroy(server->stats);
+	free(server);
+
 	return NULL;
 }
 
+Server* server_alloc(Endpoint* server_endpoint) {
+	Server* server = server_create(server_endpoint);
+	if(!server)
+		return NULL;
+
+	server_join(server->endpoint.ni, server);
+	lb_config_update();
+
+	return server;
+}
+
+static bool server_has_session(Server* server) {
+	return server->sessions && !map_is_empty(server->sessions);
+}
+
+static bool server_tunnel_free_event(void* context) {
+	tunnel_destroy(context);
+
+	return false;
+}
+
 bool server_set_mode(Server* server, uint8_t mode) {
+	Session* (*create)(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint) = NULL;
 	switch(mode) {
 		case MODE_NAT:
 			switch(server->endpoint.protocol) {
 				case IP_PROTOCOL_TCP:
-					server->create = nat_tcp_session_alloc;
+					create = nat_tcp_session_alloc;
 					break;
 				case IP_PROTOCOL_UDP:
-					server->create = nat_udp_session_alloc;
+					create = nat_udp_session_alloc;
 					break;
 			}
 			break;
 		case MODE_DNAT:
 			switch(server->endpoint.protocol) {
 				case IP_PROTOCOL_TCP:
-					server->create = dnat_tcp_session_alloc;
+					create = dnat_tcp_session_alloc;
 					break;
 				case IP_PROTOCOL_UDP:
-					server->create = dnat_udp_session_alloc;
+					create = dnat_udp_session_alloc;
 					break;
 			}
 			break;
 		case MODE_DR:
-			server->create = dr_session_alloc;
+			create = dr_session_alloc;
+			break;
+		case MODE_IPIP:
+			create = ipip_session_alloc;
+			break;
+		case MODE_GUE:
+			create = gue_session_alloc;
 			break;
 		default:
 			return false;
 	}
 
+	//Sessions keep the forward kernel and tunnel of the mode they were made in
+	if(mode != server->mode && server_has_session(server))
+		return false;
+
+	//Outer header is built once per server
+	Tunnel* tunnel = NULL;
+	if(MODE_IS_TUNNEL(mode)) {
+		tunnel = tunnel_create(server, mode, server->endpoint.ni->pool);
+		if(!tunnel) {
+			printf("Can'nt allocation tunnel\n");
+			return false;
+		}
+	}
+
+	//Packets in flight may still hold the old tunnel
+	Tunnel* old = server->priv;
+	server->create = create;
+	__atomic_store_n(&server->priv, tunnel, __ATOMIC_RELEASE);
 	server->mode = mode;
+	if(old && !event_timer_add(server_tunnel_free_event, old, TUNNEL_FREE_DELAY, 0))
+		tunnel_destroy(old);
+
+	lb_config_update();
+
+	return true;
+}
+
+bool server_set_mtu(Server* server, uint16_t mtu) {
+	if(mtu && mtu < TUNNEL_MTU_MIN)
+		return false;
+
+	server->mtu = mtu;
+	if(server->priv)
+		tunnel_set_mtu(server->priv, mtu);
 
 	return true;
 }
 
+void server_set_slow_start(Server* server, uint32_t window) {
+	server->slow_start = window;
+	server->activated = lb_clock;
+	server->ramping = !!window;
+}
+
+uint32_t server_ramp(Server* server) {
+	if(!server->ramping)
+		return SERVER_RAMP_SCALE;
+
+	//Cores may clear it together, to the same value
+	uint32_t elapsed = lb_clock - server->activated;
+	if(elapsed >= server->slow_start) {
+		server->ramping = false;
+		return SERVER_RAMP_SCALE;
+	}
+
+	uint32_t ramp = (uint64_t)elapsed * SERVER_RAMP_SCALE / server->slow_start;
+
+	return ramp ? ramp : 1;
+}
+
+uint32_t server_share(Server* server) {
+	return server_ramp(server) * feedback_capacity(server);
+}
+
+bool server_set_backup(Server* server, bool backup) {
+	if(server->backup == backup)
+		return true;
+
+	uint32_t count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Service* service = entry->data;
+			if(server->state != SERVER_STATE_ACTIVE || !service->backup_servers)
+				continue;
+
+			if(list_remove_data(service_servers(service, server), server))
+				list_add(backup ? service->backup_servers : service->active_servers, server);
+		}
+	}
+
+	server->backup = backup;
+	lb_config_update();
+
+	return true;
+}
+
+static void server_destroy(void* object) {
+	Server* server = object;
+	if(server->priv)
+		tunnel_destroy(server->priv);
+
+	if(server->sessions)
+		map_destroy(server->sessions);
+	stats_destroy(server->stats);
+
+	free(server);
+}
+
+/* Removed from its NIC's servers already */
 bool server_free(Server* server) {
+	//Cores may still walk the old lists: rebuilt without it
 	uint32_t count = ni_count();
 	for(int i = 0; i < count; i++) {
 		NetworkInterface* service_ni = ni_get(i);
@@ -140,43 +285,45 @@ bool server_free(Server* server) {
 			MapEntry* entry = map_iterator_next(&iter);
 			Service* service = entry->data;
 
-			if(map_contains(service->private_endpoints, server->endpoint.ni)) {
-				if(list_remove_data(service->active_servers, server))
-					continue;
-				else if(list_remove_data(service->deactive_servers, server))
-					continue;
-			}
+			if(service->private_endpoints && map_contains(service->private_endpoints, server->endpoint.ni))
+				service_rebuild_servers(service);
 		}
 	}
 
-	free(server);
+	//Old VIP tables, lists and maglev tables still point to it
+	vip_retire(server_destroy, server);
+	lb_config_update();
 
 	return true;
 }
 
 Server* server_get(Endpoint* server_endpoint) {
 	Map* servers = ni_config_get(server_endpoint->ni, SERVERS);
+	if(!servers)
+		return NULL;
+
 	uint64_t key = (uint64_t)server_endpoint->protocol << 48 | (uint64_t)server_endpoint->addr << 16 | (uint64_t)server_endpoint->port;
 	Server* server = map_get(servers, (void*)key);
 
 	return server;
 }
 
-Session* server_get_session(Endpoint* client_endpoint) {
-	Map* sessions = ni_config_get(client_endpoint->ni, SESSIONS);
-	uint64_t key = ((uint64_t)client_endpoint->protocol << 48 | (uint64_t)client_endpoint->addr << 16 | (uint64_t)client_endpoint->port);
+Session* server_get_session(Endpoint* server_endpoint, Endpoint* private_endpoint) {
+	Map* sessions = ni_config_get(server_endpoint->ni, SESSIONS);
+	if(!sessions)
+		return NULL;
 
-	Session* session = map_get(sessions, (void*)key);
+	FlowKey key;
+	flow_key_init(&key, server_endpoint->protocol, server_endpoint->addr, server_endpoint->port, private_endpoint->addr, private_endpoint->port);
 
-	return session;
+	return map_get(sessions, &key);
 }
 
 void server_is_remove_grace(Server* server) {
 	if(server->state == SERVER_STATE_ACTIVE)
 		return;
 
-	Map* sessions = ni_config_get(server->endpoint.ni, SESSIONS);
-	if(map_is_empty(sessions)) { //none session //		
+	if(!server_has_session(server)) { //none session //		
 		if(server->event_id != 0) {
 			event_timer_remove(server->event_id);
 			server->event_id = 0;
@@ -191,30 +338,42 @@ void server_is_remove_grace(Server* server) {
 	}
 }
 
-bool server_remove(Server* server, uint64_t wait) {
-	bool server_delete_event(void* context) {
-		Server* server = context;
-		server_remove_force(server);
+static bool server_delete_event(void* context) {
+	Server* server = context;
+	server->event_id = 0;
+	server_remove_force(server);
+
+	return false;
+}
 
+static bool server_delete0_event(void* context) {
+	Server* server = context;
+
+	if(!server_has_session(server)) {
+		server->event_id = 0;
+		server_remove_force(server);
 		return false;
 	}
-	bool server_delete0_event(void* context) {
-		Server* server = context;
 
-		Map* sessions = ni_config_get(server->endpoint.ni, SESSIONS);
-		if(map_is_empty(sessions)) {
-			server_remove_force(server);
-			return false;
-		}
+	return true;
+}
 
-		return true;
-	}
+bool server_retire(Server* server) {
+	server->state = SERVER_STATE_DEACTIVE;
+	if(server->event_id != 0)
+		event_timer_remove(server->event_id);
+	server->event_id = event_timer_add(server_delete0_event, server, 1000000, 1000000);
+
+	return server->event_id != 0;
+}
 
-	Map* sessions = ni_config_get(server->endpoint.ni, SESSIONS);
-	if(map_is_empty(sessions)) {
+bool server_remove(Server* server, uint64_t wait) {
+	if(!server_has_session(server)) {
 		server_remove_force(server);
 		return true;
-	} else {
+	}
+
+	if(server->state == SERVER_STATE_ACTIVE) {
 		server->state = SERVER_STATE_DEACTIVE;
 
 		uint32_t count = ni_count();
@@ -229,18 +388,21 @@ bool server_remove(Server* server, uint64_t wait) {
 			while(map_iterator_has_next(&iter)) {
 				MapEntry* entry = map_iterator_next(&iter);
 				Service* service = entry->data;
-				if(list_remove_data(service->active_servers, server))
+				if(list_remove_data(service_servers(service, server), server))
 					list_add(service->deactive_servers, server);
 			}
 		}
+		lb_config_update();
+	}
 
-		if(wait)
-			server->event_id = event_timer_add(server_delete_event, server, wait, 0);
-		else
-			server->event_id = event_timer_add(server_delete0_event, server, 1000000, 1000000);
+	if(!wait)
+		return server_retire(server);
 
-		return true;
-	}
+	if(server->event_id != 0)
+		event_timer_remove(server->event_id);
+	server->event_id = event_timer_add(server_delete_event, server, wait, 0);
+
+	return true;
 }
 
 bool server_remove_force(Server* server) {
@@ -249,27 +411,35 @@ bool server_remove_force(Server* server) {
 		server->event_id = 0;
 	}
 
-	Map* sessions = ni_config_get(server->endpoint.ni, SESSIONS);
-	if(map_is_empty(sessions)) {
-		//delet from ni
-		Map* servers = ni_config_get(server->endpoint.ni, SERVERS);
-		uint64_t key = (uint64_t)server->endpoint.protocol << 48 | (uint64_t)server->endpoint.addr << 16 | (uint64_t)server->endpoint.port;
-		map_remove(servers, (void*)key);
+	//Sessions of this server only. Freeing edits the maps: collect first
+	if(server_has_session(server)) {
+		size_t count = map_size(server->sessions);
+		Session** sessions = malloc(sizeof(Session*) * count);
+		if(!sessions) {
+			printf("Can'nt allocate session list\n");
+			return false;
+		}
 
-		server_free(server);
-		return true;
-	}
+		size_t index = 0;
+		MapIterator iter;
+		map_iterator_init(&iter, server->sessions);
+		while(map_iterator_has_next(&iter) && index < count) {
+			MapEntry* entry = map_iterator_next(&iter);
+			sessions[index++] = entry->data;
+		}
 
-	server->state = SERVER_STATE_DEACTIVE;
-	MapIterator iter;
-	map_iterator_init(&iter, sessions);
-	while(map_iterator_has_next(&iter)) {
-		MapEntry* entry = map_iterator_next(&iter);
-		Session* session = entry->data;
-		
-		service_free_session(session);
+		for(size_t i = 0; i < index; i++)
+			service_free_session(sessions[i]);
+		free(sessions);
 	}
 
+	//delet from ni
+	Map* servers = ni_config_get(server->endpoint.ni, SERVERS);
+	uint64_t key = (uint64_t)server->endpoint.protocol << 48 | (uint64_t)server->endpoint.addr << 16 | (uint64_t)server->endpoint.port;
+	map_remove(servers, (void*)key);
+
+	server_free(server);
+
 	return true;
 }
 
@@ -289,6 +459,10 @@ void server_dump() {
 			printf("DNAT\t");
 		else if(mode == MODE_DR)
 			printf("DR\t");
+		else if(mode == MODE_IPIP)
+			printf("IPIP\t");
+		else if(mode == MODE_GUE)
+			printf("GUE\t");
 		else
 			printf("Unnowkn\t");
 	}
@@ -310,7 +484,18 @@ void server_dump() {
 			printf("0\t");
 	}
 
-	printf("State\t\tAddr:Port\t\tMode\tNIC\tSessions\n");
+	void print_cap(Server* server) {
+		if(server->max_sessions)
+			printf("%u/%u", server->active_sessions, server->max_sessions);
+		else
+			printf("%u", server->active_sessions);
+		if(server->backup)
+			printf("\tbackup");
+		if(server_ramp(server) < SERVER_RAMP_SCALE)
+			printf("\tslow start %u/%u ms", lb_clock - server->activated, server->slow_start);
+	}
+
+	printf("State\t\tAddr:Port\t\tMode\tNIC\tSessions\tActive/Max\n");
 	uint8_t count = ni_count();
 	for(int i = 0; i < count; i++) {
 		Map* servers = ni_config_get(ni_get(i), SERVERS);
@@ -328,7 +513,31 @@ void server_dump() {
 			print_mode(server->mode);
 			print_ni_num(server->endpoint.ni);
 			print_session_count(server->sessions);
+			printf("\t");
+			print_cap(server);
 			printf("\n");
 		}
 	}
 }
+
+void server_stats_dump() {
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* servers = ni_config_get(ni_get(i), SERVERS);
+		if(!servers)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, servers);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Server* server = entry->data;
+			uint32_t addr = server->endpoint.addr;
+
+			printf("%s %d.%d.%d.%d:%d NIC %d\n", server->endpoint.protocol == IP_PROTOCOL_TCP ? "TCP" : "UDP",
+					(addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff,
+					server->endpoint.port, i);
+			stats_print(server->stats);
+		}
+	}
+}
@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #define DONT_MAKE_WRAPPER
 #include <_malloc.h>
 #undef DONT_MAKE_WRAPPER
+#include <thread.h>
 #include <util/event.h>
 #include <util/set.h>
 #include <net/interface.h>
@@ -16,11 +18,21 @@
 
 #include "service.h"
 #include "server.h"
+#include "tunnel.h"
 #include "session.h"
 #include "schedule.h"
+#include "flow.h"
+#include "maglev.h"
+#include "loadbalancer.h"
+#include "nat.h"
+#include "sync.h"
+#include "vip.h"
 
 extern void* __gmalloc_pool;
 
+static void service_schedule_retire(RoundRobin* robin, ScheduleWeights* weights, Maglev* maglev);
+static bool service_top_alloc(Service* service);
+
 Service* service_alloc(Endpoint* service_endpoint) {
 	bool service_add(NetworkInterface* ni, Service* service) {
 		Map* services = ni_config_get(ni, SERVICES);
@@ -62,16 +74,29 @@ Service* service_alloc(Endpoint* service_endpoint) {
 
 	service->timeout = SERVICE_DEFAULT_TIMEOUT;
 	service->state = SERVICE_STATE_ACTIVE;
+	service->stats = stats_create(service_endpoint->ni->pool);
+	if(!service->stats)
+		goto stats_create_fail;
 
 	service_set_schedule(service, SCHEDULE_ROUND_ROBIN);
+	//Without it the service is just left out of session top
+	if(top_running)
+		service_top_alloc(service);
 
 	//add to service list
 	if(!service_add(service_endpoint->ni, service))
 		goto service_add_fail;
 
+	lb_config_update();
+
 	return service;
 
 service_add_fail:
+	stats_destroy(service->stats);
+
+stats_create_fail:
+	__free(service, service_endpoint->ni->pool);
+
 service_alloc_fail:
 	//port free
 	if(service_endpoint->protocol == IP_PROTOCOL_TCP) {
@@ -91,6 +116,29 @@ port_alloc_fail:
 	return false;
 }
 
+static void service_destroy(void* object) {
+	Service* service = object;
+	if(service->private_endpoints)
+		map_destroy(service->private_endpoints);
+	if(service->active_servers)
+		list_destroy(service->active_servers);
+	if(service->deactive_servers)
+		list_destroy(service->deactive_servers);
+	if(service->backup_servers)
+		list_destroy(service->backup_servers);
+	if(service->sessions)
+		map_destroy(service->sessions);
+	stats_destroy(service->stats);
+	if(service->top_buffer)
+		__free(service->top_buffer, service->endpoint.ni->pool);
+	if(service->acl)
+		acl_destroy(service->acl);
+	if(service->limit)
+		limit_destroy(service->limit);
+
+	__free(service, service->endpoint.ni->pool);
+}
+
 bool service_free(Service* service) {
 	bool service_remove(NetworkInterface* ni, Service* service) {
 		Map* services = ni_config_get(ni, SERVICES);
@@ -106,25 +154,16 @@ bool service_free(Service* service) {
 	//remove from service list
 	service_remove(service->endpoint.ni, service);
 
-	//remove private endpoirnts
+	//remove private endpoirnts. Removing edits the map: first one each time
 	if(service->private_endpoints) {
-		MapIterator iter;
-		map_iterator_init(&iter, service->private_endpoints);
-
-		while(map_iterator_has_next(&iter)) {
+		while(!map_is_empty(service->private_endpoints)) {
+			MapIterator iter;
+			map_iterator_init(&iter, service->private_endpoints);
 			MapEntry* entry = map_iterator_next(&iter);
-			NetworkInterface* ni = entry->key;
-			//uint32_t addr = (uint32_t)(uintptr_t)entry->data;
-			service_remove_private_addr(service, ni);
+			if(!service_remove_private_addr(service, entry->key))
+				break;
 		}
-
-		map_destroy(service->private_endpoints);
 	}
-	//server list free
-	if(service->active_servers)
-		list_destroy(service->active_servers);
-	if(service->deactive_servers)
-		list_destroy(service->deactive_servers);
 
 	//port free
 	if(service->endpoint.protocol == IP_PROTOCOL_TCP) {
@@ -139,37 +178,229 @@ bool service_free(Service* service) {
 		ni_ip_remove(service->endpoint.ni, service->endpoint.addr);
 	}
 
-	//service free
-	__free(service, service->endpoint.ni->pool);
+	service_schedule_retire(service->robin, service->weights, service->maglev);
+
+	//Old VIP tables still point to it
+	vip_retire(service_destroy, service);
+	lb_config_update();
 
 	return true;
 }
 
+static bool service_robin_free_event(void* context) {
+	RoundRobin* robin = context;
+	__free(robin, robin->pool);
+
+	return false;
+}
+
+static bool service_weights_free_event(void* context) {
+	schedule_weights_destroy(context);
+
+	return false;
+}
+
+/* Readers on other cores may still hold the old scheduler state */
+static void service_schedule_retire(RoundRobin* robin, ScheduleWeights* weights, Maglev* maglev) {
+	if(robin && !event_timer_add(service_robin_free_event, robin, VIP_FREE_DELAY, 0))
+		__free(robin, robin->pool);
+	if(weights && !event_timer_add(service_weights_free_event, weights, VIP_FREE_DELAY, 0))
+		schedule_weights_destroy(weights);
+	if(maglev)
+		maglev_retire(maglev);
+}
+
 bool service_set_schedule(Service* service, uint8_t schedule) {
+	if(service->stateless && schedule != SCHEDULE_CONSISTENT_HASH)
+		return false;
+
+	Server* (*next)(Service*, Endpoint*);
+	RoundRobin* robin = NULL;
+	Maglev* maglev = NULL;
 	switch(schedule) {
 		case SCHEDULE_ROUND_ROBIN:
-			service->next = schedule_round_robin;
+			next = schedule_round_robin;
 			break;
 		case SCHEDULE_RANDOM:
-			service->next = schedule_random;
+			next = schedule_random;
 			break;
 		case SCHEDULE_LEAST:
-			service->next = schedule_least;
+			next = schedule_least;
 			break;
 		case SCHEDULE_SOURCE_IP_HASH:
-			service->next = schedule_source_ip_hash;
+			next = schedule_source_ip_hash;
 			break;
 		case SCHEDULE_WEIGHTED_ROUND_ROBIN:
-			service->next = schedule_weighted_round_robin;
+			next = schedule_weighted_round_robin;
+			break;
+		case SCHEDULE_CONSISTENT_HASH:
+			next = schedule_consistent_hash;
 			break;
 		default:
 			return false;
 	}
+
+	if(schedule == SCHEDULE_ROUND_ROBIN || schedule == SCHEDULE_WEIGHTED_ROUND_ROBIN) {
+		robin = __malloc(sizeof(RoundRobin), service->endpoint.ni->pool);
+		if(!robin)
+			return false;
+		bzero(robin, sizeof(RoundRobin));
+		robin->pool = service->endpoint.ni->pool;
+	} else if(schedule == SCHEDULE_CONSISTENT_HASH) {
+		maglev = maglev_create(service->endpoint.ni->pool);
+		if(!maglev)
+			return false;
+	}
+
+	//A core still in the old scheduler finds its state gone (NULL) or not yet freed
+	RoundRobin* old_robin = service->robin;
+	Maglev* old_maglev = service->maglev;
 	service->schedule = schedule;
+	__atomic_store_n(&service->robin, robin, __ATOMIC_RELEASE);
+	__atomic_store_n(&service->maglev, maglev, __ATOMIC_RELEASE);
+	service_update(service);	//Tables filled before next picks from them
+	__atomic_store_n(&service->next, next, __ATOMIC_RELEASE);
+	service_schedule_retire(old_robin, NULL, old_maglev);
+
+	return true;
+}
+
+bool service_set_stateless(Service* service) {
+	service->stateless = true;
+	if(!service_set_schedule(service, SCHEDULE_CONSISTENT_HASH)) {
+		service->stateless = false;
+		return false;
+	}
+
+	return true;
+}
+
+static bool service_weights_update(Service* service) {
+	ScheduleWeights* weights = NULL;
+	if(service->schedule == SCHEDULE_WEIGHTED_ROUND_ROBIN || service->schedule == SCHEDULE_LEAST) {
+		weights = schedule_weights_create(service->active_servers, service->endpoint.ni->pool);
+		if(!weights)
+			return false;
+	}
+
+	ScheduleWeights* old = service->weights;
+	__atomic_store_n(&service->weights, weights, __ATOMIC_RELEASE);
+	service_schedule_retire(NULL, old, NULL);
 
 	return true;
 }
 
+void service_refresh(Service* service) {
+	if(service->weights && schedule_weights_stale(service->weights))
+		service_weights_update(service);
+}
+
+/* Rebuild scheduler state after server membership changed */
+bool service_update(Service* service) {
+	//Outer source of tunnels is the private address on the server's NI
+	void set_tunnel_source(List* servers) {
+		if(!servers || !service->private_endpoints)
+			return;
+
+		ListIterator iter;
+		list_iterator_init(&iter, servers);
+		while(list_iterator_has_next(&iter)) {
+			Server* server = list_iterator_next(&iter);
+			if(!MODE_IS_TUNNEL(server->mode))
+				continue;
+
+			Endpoint* private_endpoint = map_get(service->private_endpoints, server->endpoint.ni);
+			if(private_endpoint)
+				tunnel_set_source(server->priv, private_endpoint->addr);
+		}
+	}
+
+	set_tunnel_source(service->active_servers);
+	set_tunnel_source(service->deactive_servers);
+	set_tunnel_source(service->backup_servers);
+
+	//The spill target may have left the lists, a server with room joined them
+	__atomic_store_n(&service->spill, NULL, __ATOMIC_RELAXED);
+	__atomic_store_n(&service->spill_full, 0, __ATOMIC_RELAXED);
+
+	if(!service_weights_update(service))
+		return false;
+
+	if(service->schedule != SCHEDULE_CONSISTENT_HASH || !service->maglev)
+		return true;
+
+	//Stateless services can only forward without rewriting L3/L4
+	uint32_t modes = service->stateless ? 1 << MODE_DR | 1 << MODE_IPIP | 1 << MODE_GUE : 0;
+
+	return maglev_update(service->maglev, service->active_servers, service->deactive_servers,
+			service->private_endpoints, modes, service->timeout);
+}
+
+static bool service_list_free_event(void* context) {
+	list_destroy(context);
+
+	return false;
+}
+
+/* Readers on other cores may still walk the old list */
+static void service_list_retire(List* list) {
+	if(list && !event_timer_add(service_list_free_event, list, VIP_FREE_DELAY, 0))
+		list_destroy(list);
+}
+
+bool service_rebuild_servers(Service* service) {
+	if(!service->private_endpoints || !service->active_servers)
+		return true;
+
+	List* active_servers = list_create(service->endpoint.ni->pool);
+	List* deactive_servers = list_create(service->endpoint.ni->pool);
+	List* backup_servers = list_create(service->endpoint.ni->pool);
+	if(!active_servers || !deactive_servers || !backup_servers)
+		goto fail;
+
+	MapIterator iter;
+	map_iterator_init(&iter, service->private_endpoints);
+	while(map_iterator_has_next(&iter)) {
+		MapEntry* entry = map_iterator_next(&iter);
+		Map* servers = ni_config_get(entry->key, SERVERS);
+		if(!servers)
+			continue;
+
+		MapIterator _iter;
+		map_iterator_init(&_iter, servers);
+		while(map_iterator_has_next(&_iter)) {
+			Server* server = map_iterator_next(&_iter)->data;
+			List* list = server->state != SERVER_STATE_ACTIVE ? deactive_servers :
+					server->backup ? backup_servers : active_servers;
+			if(!list_add(list, server))
+				goto fail;
+		}
+	}
+
+	//Cores scheduling now keep the lists they read until they are freed
+	List* old_active = service->active_servers;
+	List* old_deactive = service->deactive_servers;
+	List* old_backup = service->backup_servers;
+	service->active_servers = active_servers;
+	service->deactive_servers = deactive_servers;
+	service->backup_servers = backup_servers;
+	service_list_retire(old_active);
+	service_list_retire(old_deactive);
+	service_list_retire(old_backup);
+
+	return true;
+
+fail:
+	if(active_servers)
+		list_destroy(active_servers);
+	if(deactive_servers)
+		list_destroy(deactive_servers);
+	if(backup_servers)
+		list_destroy(backup_servers);
+
+	return false;
+}
+
 bool service_add_private_addr(Service* service, Endpoint* _private_endpoint) {
 	if(!service->private_endpoints) {
 		service->private_endpoints = map_create(16, NULL, NULL, service->endpoint.ni->pool);
@@ -202,6 +433,16 @@ bool service_add_private_addr(Service* service, Endpoint* _private_endpoint) {
 
 			goto list_create_fail;
 		}
+
+		service->backup_servers = list_create(service->endpoint.ni->pool);
+		if(!service->backup_servers) {
+			list_destroy(service->active_servers);
+			list_destroy(service->deactive_servers);
+			service->active_servers = NULL;
+			service->deactive_servers = NULL;
+
+			goto list_create_fail;
+		}
 	}
 
 	Map* servers = ni_config_get(private_endpoint->ni, SERVERS);
@@ -215,7 +456,7 @@ bool service_add_private_addr(Service* service, Endpoint* _private_endpoint) {
 			Server* server = entry->data;
 
 			if(server->state == SERVER_STATE_ACTIVE) {
-				if(!list_add(service->active_servers, server))
+				if(!list_add(service_servers(service, server), server))
 					goto server_add_fail;
 			} else {
 				if(!list_add(service->deactive_servers, server))
@@ -228,6 +469,8 @@ bool service_add_private_addr(Service* service, Endpoint* _private_endpoint) {
 		goto private_endpoint_put_fail;
 	}
 
+	lb_config_update();
+
 	return true;
 
 private_endpoint_put_fail:
@@ -243,7 +486,7 @@ server_add_fail:
 		Server* server = entry->data;
 
 		if(server->state == SERVER_STATE_ACTIVE) {
-			list_remove_data(service->active_servers, server);
+			list_remove_data(service_servers(service, server), server);
 			continue;
 		} else {
 			list_remove_data(service->deactive_servers, server);
@@ -264,34 +507,26 @@ bool service_remove_private_addr(Service* service, NetworkInterface* ni) {
 	if(!service->private_endpoints)
 		return false;
 
-	//Remove servers belong NetworkInterface
-	List* servers = ni_config_get(ni, SERVERS);
-	ListIterator iter;
-	list_iterator_init(&iter, servers);
-	while(list_iterator_has_next(&iter)) {
-		Server* server = list_iterator_next(&iter);
-
-		if(server->state == SERVER_STATE_ACTIVE) {
-			list_remove_data(service->active_servers, server);
-		} else {
-			list_remove_data(service->deactive_servers, server);
-		}
-	}
-
 	//Remove Address in NetworkInterface
 	Endpoint* private_endpoint = map_remove(service->private_endpoints, ni);
 	if(!private_endpoint)
 		return false;
+
+	//Servers of the NI leave with it: cores may still walk the old lists
+	service_rebuild_servers(service);
+	lb_config_update();
 	uint32_t addr = private_endpoint->addr;
 	__free(private_endpoint, service->endpoint.ni->pool);
 
+	//Still the private address of another service
 	uint16_t count = ni_count();
 	for(int i = 0; i < count; i++) {
-		NetworkInterface* ni = ni_get(i);
-		Map* Services = ni_config_get(ni, SERVICES);
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
 
 		MapIterator iter;
-		map_iterator_init(&iter, Services);
+		map_iterator_init(&iter, services);
 
 		while(map_iterator_has_next(&iter)) {
 			MapEntry* entry = map_iterator_next(&iter);
@@ -304,7 +539,7 @@ bool service_remove_private_addr(Service* service, NetworkInterface* ni) {
 
 			Endpoint* _private_endpoint = map_get(_service->private_endpoints, ni);
 
-			if(addr == _private_endpoint->addr)
+			if(_private_endpoint && addr == _private_endpoint->addr)
 				return true;
 		}
 	}
@@ -314,38 +549,108 @@ bool service_remove_private_addr(Service* service, NetworkInterface* ni) {
 	return true;
 }
 
-Session* service_get_session(Endpoint* client_endpoint) {
+Session* service_get_session(Endpoint* client_endpoint, Endpoint* service_endpoint) {
 	Map* sessions = ni_config_get(client_endpoint->ni, SESSIONS);
 	if(!sessions)
 		return NULL;
 
-	Session* session = map_get(sessions, (void*)((uint64_t)client_endpoint->protocol << 48 | (uint64_t)client_endpoint->addr << 16 | (uint64_t)client_endpoint->port));
+	FlowKey key;
+	flow_key_init(&key, client_endpoint->protocol, client_endpoint->addr, client_endpoint->port, service_endpoint->addr, service_endpoint->port);
 
-	return session;
+	return map_get(sessions, &key);
 }
 
 
-Session* service_alloc_session(Endpoint* service_endpoint, Endpoint* client_endpoint) {
-	Service* service = service_get(service_endpoint);
-	if(!service)
+/*
+ * The scheduler's pick is full, or there was none: the last server spilled
+ * to while it has room, else the next server with room after the pick in
+ * the list, then the first backup with room. With most servers full the
+ * list is walked once per server filling up, not once per session, and
+ * once a tick when none has room.
+ */
+static Server* service_spill(Service* service, Server* full) {
+	List* servers = service->active_servers;
+	List* backup_servers = service->backup_servers;
+	if(!servers)
 		return NULL;
 
-	if(!service->sessions) {
-		service->sessions = map_create(4096, NULL, NULL, service->endpoint.ni->pool);
-		if(!service->sessions)
-			return NULL;
+	Server* spill = __atomic_load_n(&service->spill, __ATOMIC_RELAXED);
+	if(spill && spill->state == SERVER_STATE_ACTIVE && !spill->backup && !server_full(spill))
+		return spill;
+
+	uint32_t clock = lb_clock + 1;
+	if(__atomic_load_n(&service->spill_full, __ATOMIC_RELAXED) == clock)
+		goto backup;
+
+	Server* before = NULL;
+	bool after = !full;
+	ListIterator iter;
+	list_iterator_init(&iter, servers);
+	while(list_iterator_has_next(&iter)) {
+		Server* server = list_iterator_next(&iter);
+		if(server == full) {
+			after = true;
+			continue;
+		}
+		if(server_full(server))
+			continue;
+		if(after) {
+			__atomic_store_n(&service->spill, server, __ATOMIC_RELAXED);
+			return server;
+		}
+		if(!before)
+			before = server;
+	}
+	if(before) {
+		__atomic_store_n(&service->spill, before, __ATOMIC_RELAXED);
+		return before;
 	}
+	__atomic_store_n(&service->spill_full, clock, __ATOMIC_RELAXED);
 
-	if(!((client_endpoint->addr == service->endpoint.addr) && (client_endpoint->protocol == service->endpoint.protocol) && (client_endpoint->port == service->endpoint.port)))
+backup:
+	if(!backup_servers)
 		return NULL;
 
+	list_iterator_init(&iter, backup_servers);
+	while(list_iterator_has_next(&iter)) {
+		Server* server = list_iterator_next(&iter);
+		if(!server_full(server))
+			return server;
+	}
+
+	return NULL;
+}
+
+Session* service_alloc_session(Service* service, Endpoint* client_endpoint, bool* limited) {
 	if(service->state != SERVICE_STATE_ACTIVE)
 		return NULL;
 
-	Server* server = service->next(service, client_endpoint);
-	if(!server)
+	//Before the scheduler: refused clients cost neither a server nor a port
+	Limit* limit = service->limit;
+	if(limit && limit_admit(limit, client_endpoint->addr, thread_id()) != LIMIT_OK) {
+		stats_core(service->stats, thread_id())->drops[STATS_DROP_LIMITED]++;
+		if(limited)
+			*limited = true;
+		return NULL;
+	}
+
+	Server* (*next)(Service*, Endpoint*) = __atomic_load_n(&service->next, __ATOMIC_ACQUIRE);
+	Server* server = next(service, client_endpoint);
+	if(!server || server_full(server))
+		server = service_spill(service, server);
+	if(!server) {
+		stats_core(service->stats, thread_id())->schedule_misses++;
 		return NULL;
+	}
 
+	Session* session = service_install_session(service, server, client_endpoint, 0);
+	if(session && sync_running)
+		sync_session(SYNC_RECORD_CREATE, session, thread_id());
+
+	return session;
+}
+
+Session* service_install_session(Service* service, Server* server, Endpoint* client_endpoint, uint16_t private_port) {
 	if(!service->private_endpoints)
 		return NULL;
 
@@ -354,59 +659,70 @@ Session* service_alloc_session(Endpoint* service_endpoint, Endpoint* client_endp
 	if(!session)
 		goto error_get_session;
 
+	if(private_port && !nat_set_port(session, private_port))
+		goto error_session_map_put1;
+
+	session->server = server;
+	session->service = service;
+	session->packets = 0;
+	session->bytes = 0;
+	session->synced = lb_clock;
+	session_init_key(session);
+
 	//Add to Service
-	uint64_t public_key = session_get_public_key(session);
+	FlowKey* public_key = session_get_public_key(session);
 	if(!service->sessions) {
-		service->sessions = map_create(4096, NULL, NULL, service->endpoint.ni->pool);
+		service->sessions = map_create(4096, flow_map_hash, flow_map_equals, service->endpoint.ni->pool);
 		if(!service->sessions)
 			goto service_map_createa_fail;
 	}
-	if(!map_put(service->sessions, (void*)public_key, session))
+	if(!map_put(service->sessions, public_key, session))
 		goto error_session_map_put1;
 
 	//Add to Service Interface NI
 	Map* sessions = ni_config_get(service->endpoint.ni, SESSIONS);
-	if(!map_put(sessions, (void*)public_key, session))
+	if(!map_put(sessions, public_key, session))
 		goto error_session_map_put1;
 
-	uint64_t private_key = session_get_private_key(session);
+	FlowKey* private_key = session_get_private_key(session);
 	//Add to Server
 	if(!server->sessions) {
-		server->sessions = map_create(4096, NULL, NULL, server->endpoint.ni->pool);
+		server->sessions = map_create(4096, flow_map_hash, flow_map_equals, server->endpoint.ni->pool);
 		if(!server->sessions)
 			goto server_map_createa_fail;
 	}
-	if(!map_put(server->sessions, (void*)private_key, session))
+	if(!map_put(server->sessions, private_key, session))
 		goto error_session_map_put2;
 
 	//Add to Server Interface NI
 	sessions = ni_config_get(server->endpoint.ni, SESSIONS);
-	if(!map_put(sessions, (void*)private_key, session))
+	if(!map_put(sessions, private_key, session))
 		goto error_session_map_put2;
 
+	int core = thread_id();
+	stats_core(service->stats, core)->sessions_created++;
+	stats_core(server->stats, core)->sessions_created++;
+	__atomic_fetch_add(&server->active_sessions, 1, __ATOMIC_RELAXED);
 
-
-	session->fin = false;
-	session->event_id = 0;
-	session_recharge(session);
-
+	//Session timer is already armed by server->create
 	return session;
 
-	map_remove(sessions, (void*)private_key);
-
 error_session_map_put2:
 	sessions = ni_config_get(service->endpoint.ni, SESSIONS);
-	map_remove(sessions, (void*)public_key);
+	map_remove(sessions, public_key);
+	map_remove(service->sessions, public_key);
 
 server_map_createa_fail:
 
 error_session_map_put1:
+	if(session->event_id != 0)
+		event_timer_remove(session->event_id);
 	session->free(session);
 
 service_map_createa_fail:
 
 error_get_session:
-error_get_server:
+	stats_core(service->stats, thread_id())->alloc_failures++;
 
 	return NULL;
 }
@@ -414,27 +730,39 @@ error_get_server:
 bool service_free_session(Session* session) {
 	//Remove from Service Interface NI
 	Map* sessions = ni_config_get(session->public_endpoint->ni, SESSIONS);
-	uint64_t client_key = session_get_public_key(session);
-	if(!map_remove(sessions, (void*)client_key)) {
+	FlowKey* client_key = session_get_public_key(session);
+	if(!map_remove(sessions, client_key)) {
 		printf("Can'nt remove session from servers\n");
 		goto session_free_fail;
 	}
 
 	//Remove from Server NI
 	sessions = ni_config_get(session->server_endpoint->ni, SESSIONS);
-	uint64_t private_key = session_get_private_key(session);
-	if(!map_remove(sessions, (void*)private_key)) {
+	FlowKey* private_key = session_get_private_key(session);
+	if(!map_remove(sessions, private_key)) {
 		printf("Can'nt remove session from private ni\n");
 		goto session_free_fail;
 	}
 
 	Server* server = server_get(session->server_endpoint);
 	//Remove from Server
-	if(!map_remove(server->sessions, (void*)private_key)) {
+	if(!map_remove(server->sessions, private_key)) {
 		printf("Can'nt remove session from servers\n");
 		goto session_free_fail;
 	}
 
+	//Remove from Service
+	Service* service = session->service;
+	if(service->sessions)
+		map_remove(service->sessions, client_key);
+
+	int core = thread_id();
+	stats_core(service->stats, core)->sessions_freed++;
+	stats_core(server->stats, core)->sessions_freed++;
+	__atomic_fetch_sub(&server->active_sessions, 1, __ATOMIC_RELAXED);
+	if(sync_running)
+		sync_session(SYNC_RECORD_DELETE, session, core);
+
 	if(session->event_id != 0) {
 		event_timer_remove(session->event_id);
 		session->event_id = 0;
@@ -464,50 +792,66 @@ Service* service_get(Endpoint* service_endpoint) {
 	return map_get(services, (void*)key);
 }
 
+static bool service_has_session(Service* service) {
+	return service->sessions && !map_is_empty(service->sessions);
+}
+
 void service_is_remove_grace(Service* service) {
 	if(service->state == SERVICE_STATE_ACTIVE)
 		return;
 
-	Map* sessions = ni_config_get(service->endpoint.ni, SESSIONS);
-	if(map_is_empty(sessions)) { //none session
-		if(service->event_id != 0)
+	if(!service_has_session(service)) { //none session
+		if(service->event_id != 0) {
 			event_timer_remove(service->event_id);
+			service->event_id = 0;
+		}
 
 		service_remove_force(service);
 	}
 }
 
-bool service_remove(Service* service, uint64_t wait) {
-	bool service_delete_event(void* context) {
+static bool service_delete_event(void* context) {
+	Service* service = context;
+	service->event_id = 0;
+	service_remove_force(service);
+
+	return false;
+}
+
+static bool service_delete0_event(void* context) {
+	Service* service = context;
+	if(!service_has_session(service)) { //none session
+		service->event_id = 0;
 		service_remove_force(service);
 
 		return false;
 	}
-	bool service_delete0_event(void* context) {
-		Map* sessions = ni_config_get(service->endpoint.ni, SESSIONS);
-		if(map_is_empty(sessions)) { //none session
-			service_remove_force(service);
 
-			return true;
-		}
+	return true;
+}
 
-		return false;
-	}
+bool service_retire(Service* service) {
+	service->state = SERVICE_STATE_DEACTIVE;
+	if(service->event_id != 0)
+		event_timer_remove(service->event_id);
+	service->event_id = event_timer_add(service_delete0_event, service, 1000000, 1000000);
 
-	Map* sessions = ni_config_get(service->endpoint.ni, SESSIONS);
-	if(map_is_empty(sessions)) { //none session
+	return service->event_id != 0;
+}
+
+bool service_remove(Service* service, uint64_t wait) {
+	if(!service_has_session(service)) { //none session
 		service_remove_force(service); 
 		return true;
-	} else {
-		service->state = SERVICE_STATE_DEACTIVE;
+	}
 
-		if(wait)
-			service->event_id = event_timer_add(service_delete_event, service, wait, 0);
-		else
-			service->event_id = event_timer_add(service_delete0_event, service, 1000000, 1000000);
+	if(!wait)
+		return service_retire(service);
 
-		return true;
-	}
+	service->state = SERVICE_STATE_DEACTIVE;
+	if(service->event_id != 0)
+		event_timer_remove(service->event_id);
+	service->event_id = event_timer_add(service_delete_event, service, wait, 0);
 
 	return true;
 }
@@ -520,18 +864,26 @@ bool service_remove_force(Service* service) {
 
 	service->state = SERVICE_STATE_DEACTIVE;
 
-	Map* sessions = ni_config_get(service->endpoint.ni, SESSIONS);
-	if(!map_is_empty(sessions)) {
-	}
+	//Sessions of this service. Freeing edits the maps: collect first
+	if(service->sessions && !map_is_empty(service->sessions)) {
+		size_t count = map_size(service->sessions);
+		Session** sessions = __malloc(sizeof(Session*) * count, __gmalloc_pool);
+		if(!sessions) {
+			printf("Can'nt allocate session list\n");
+			return false;
+		}
 
-	Map* private_endpoints = service->private_endpoints;
-	MapIterator iter;
-	map_iterator_init(&iter, private_endpoints);
-	while(map_iterator_has_next(&iter)) {
-		MapEntry* entry = map_iterator_next(&iter);
-		//uint32_t addr = entry->data;
-		NetworkInterface* ni = entry->key;
-		service_remove_private_addr(service, ni);
+		size_t index = 0;
+		MapIterator iter;
+		map_iterator_init(&iter, service->sessions);
+		while(map_iterator_has_next(&iter) && index < count) {
+			MapEntry* entry = map_iterator_next(&iter);
+			sessions[index++] = entry->data;
+		}
+
+		for(size_t i = 0; i < index; i++)
+			service_free_session(sessions[i]);
+		__free(sessions, __gmalloc_pool);
 	}
 
 	service_free(service);
@@ -577,6 +929,9 @@ void service_dump() {
 			case SCHEDULE_WEIGHTED_ROUND_ROBIN:
 				printf("Weight Round-Robin\t\t");
 				break;
+			case SCHEDULE_CONSISTENT_HASH:
+				printf("Consistent Hash\t");
+				break;
 			default:
 				printf("Unnowkn\t");
 				break;
@@ -633,3 +988,279 @@ void service_dump() {
 		}
 	}
 }
+
+void service_stats_dump() {
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Service* service = entry->data;
+			uint32_t addr = service->endpoint.addr;
+
+			printf("%s %d.%d.%d.%d:%d NIC %d\n", service->endpoint.protocol == IP_PROTOCOL_TCP ? "TCP" : "UDP",
+					(addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff,
+					service->endpoint.port, i);
+			stats_print(service->stats);
+		}
+	}
+}
+
+static bool service_top_alloc(Service* service) {
+	if(service->top)
+		return true;
+
+	size_t size = sizeof(Top) * TOP_KIND_COUNT * thread_count();
+	void* buffer = __malloc(size + 64, service->endpoint.ni->pool);
+	if(!buffer) {
+		printf("Can'nt allocate top talkers\n");
+		return false;
+	}
+
+	Top* top = (Top*)(((uintptr_t)buffer + 63) & ~(uintptr_t)63);
+	bzero(top, size);
+	service->top_buffer = buffer;
+	service->top = top;
+
+	return true;
+}
+
+bool service_top_start(uint32_t sample) {
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			if(!service_top_alloc(entry->data))
+				return false;
+		}
+	}
+
+	top_sample = sample ? sample : 1;
+	top_running = true;
+
+	return true;
+}
+
+void service_top_stop() {
+	top_running = false;
+}
+
+void service_top_dump(Service* service, int count) {
+	static const char* titles[TOP_KIND_COUNT] = { "Flows by bytes", "Flows by packets", "Clients by bytes",
+		"Clients by packets" };
+
+	if(!service->top) {
+		printf("Not counted: session top on\n");
+		return;
+	}
+
+	TopEntry* entries = __malloc(sizeof(TopEntry) * TOP_SIZE * thread_count(), __gmalloc_pool);
+	if(!entries) {
+		printf("Can'nt allocate top talkers\n");
+		return;
+	}
+
+	for(int kind = 0; kind < TOP_KIND_COUNT; kind++) {
+		bool bytes = kind == TOP_FLOW_BYTES || kind == TOP_CLIENT_BYTES;
+		bool flow = kind == TOP_FLOW_BYTES || kind == TOP_FLOW_PACKETS;
+		int size = top_merge(&service->top[kind], thread_count(), sizeof(Top) * TOP_KIND_COUNT, entries);
+
+		printf("%s, up to %d per core, 1 in %u packets%s\n", titles[kind], TOP_SIZE, top_sample,
+				top_running ? "" : " (stopped)");
+		printf("%s\t\t%s\t%s\t%s%s\n", flow ? "Client:Port" : "Client\t", bytes ? "Bytes\t" : "Packets\t",
+				bytes ? "Packets\t" : "Bytes\t", "Error", flow ? "\tServer\t\t\tSession bytes" : "");
+		for(int i = 0; i < size && i < count; i++) {
+			TopEntry* entry = &entries[i];
+			uint32_t addr = entry->key >> 32;
+			printf("%d.%d.%d.%d", (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+			if(flow)
+				printf(":%d\t", (uint16_t)(entry->key >> 16));
+			else
+				printf("\t");
+			printf("\t%-12lu\t%-12lu\t+%lu", entry->count - entry->error, entry->other, entry->error);
+
+			if(flow) {
+				//Still open: its own counters are exact
+				Endpoint client_endpoint = service->endpoint;
+				client_endpoint.addr = addr;
+				client_endpoint.port = entry->key >> 16;
+				Session* session = service_get_session(&client_endpoint, &service->endpoint);
+				if(session) {
+					uint32_t server_addr = session->server->endpoint.addr;
+					printf("\t%d.%d.%d.%d:%d\t\t%lu", (server_addr >> 24) & 0xff, (server_addr >> 16) & 0xff,
+							(server_addr >> 8) & 0xff, server_addr & 0xff, session->server->endpoint.port,
+							session->bytes);
+				} else {
+					printf("\tclosed");
+				}
+			}
+			printf("\n");
+		}
+	}
+
+	__free(entries, __gmalloc_pool);
+}
+
+static bool service_acl_free_event(void* context) {
+	acl_destroy(context);
+
+	return false;
+}
+
+/* Publish acl in place of the service's table, freed once no core holds it */
+static bool service_acl_set(Service* service, Acl* acl) {
+	Acl* old = service->acl;
+	if(acl && old)
+		acl_carry(acl, old);
+	__atomic_store_n(&service->acl, acl, __ATOMIC_RELEASE);
+
+	if(old) {
+		if(!event_timer_add(service_acl_free_event, old, ACL_FREE_DELAY, 0))
+			acl_destroy(old);
+	}
+
+	return true;
+}
+
+static void service_acl_normalize(AclRule* rules, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++) {
+		if(rules[i].length > 32)
+			rules[i].length = 32;
+		rules[i].addr &= rules[i].length ? ~(uint32_t)0 << (32 - rules[i].length) : 0;
+	}
+}
+
+bool service_acl_add(Service* service, AclRule* rules, uint32_t count) {
+	Acl* old = service->acl;
+	uint32_t old_count = old ? old->count : 0;
+	AclRule* merged = __malloc(sizeof(AclRule) * (old_count + count), __gmalloc_pool);
+	if(!merged) {
+		printf("Can'nt allocate ACL rules\n");
+		return false;
+	}
+
+	//New rules replace equal old ones
+	service_acl_normalize(rules, count);
+	qsort(rules, count, sizeof(AclRule), acl_compare);
+	uint32_t size = 0;
+	uint32_t i = 0;
+	uint32_t j = 0;
+	while(i < old_count || j < count) {
+		AclRule* rule;
+		int compare = j == count ? -1 : i == old_count ? 1 : acl_compare(&old->rules[i], &rules[j]);
+		if(compare < 0) {
+			rule = &old->rules[i++];
+		} else {
+			if(!compare)
+				i++;
+			rule = &rules[j++];
+		}
+
+		if(size && !acl_compare(&merged[size - 1], rule))
+			merged[size - 1] = *rule;
+		else
+			merged[size++] = *rule;
+	}
+
+	Acl* acl = acl_create(merged, size, service->endpoint.ni->pool);
+	__free(merged, __gmalloc_pool);
+	if(!acl)
+		return false;
+
+	return service_acl_set(service, acl);
+}
+
+bool service_acl_remove(Service* service, AclRule* rules, uint32_t count) {
+	Acl* old = service->acl;
+	if(!old)
+		return false;
+
+	AclRule* kept = __malloc(sizeof(AclRule) * (old->count ? old->count : 1), __gmalloc_pool);
+	if(!kept) {
+		printf("Can'nt allocate ACL rules\n");
+		return false;
+	}
+
+	service_acl_normalize(rules, count);
+	qsort(rules, count, sizeof(AclRule), acl_compare);
+	uint32_t size = 0;
+	uint32_t j = 0;
+	for(uint32_t i = 0; i < old->count; i++) {
+		while(j < count && acl_compare(&rules[j], &old->rules[i]) < 0)
+			j++;
+		if(j < count && !acl_compare(&rules[j], &old->rules[i]))
+			continue;
+
+		kept[size++] = old->rules[i];
+	}
+
+	bool result = size < old->count;
+	if(!result)
+		printf("No such rule\n");
+
+	if(result && !size) {
+		service_acl_set(service, NULL);
+	} else if(result) {
+		Acl* acl = acl_create(kept, size, service->endpoint.ni->pool);
+		result = acl && service_acl_set(service, acl);
+	}
+	__free(kept, __gmalloc_pool);
+
+	return result;
+}
+
+bool service_acl_flush(Service* service) {
+	return service_acl_set(service, NULL);
+}
+
+void service_acl_dump(Service* service) {
+	Acl* acl = service->acl;
+	if(!acl) {
+		printf("No rules: every client allowed\n");
+		return;
+	}
+
+	printf("Rule\t\t\tAction\tHits\n");
+	for(uint32_t i = 0; i < acl->count; i++) {
+		AclRule* rule = &acl->rules[i];
+		printf("%d.%d.%d.%d/%d\t\t%s\t%lu\n", (rule->addr >> 24) & 0xff, (rule->addr >> 16) & 0xff,
+				(rule->addr >> 8) & 0xff, rule->addr & 0xff, rule->length,
+				rule->action == ACL_ALLOW ? "allow" : "deny", acl_hits(acl, i + 1));
+	}
+	printf("Otherwise\t\t%s\t%lu\n", acl->fallback == ACL_ALLOW ? "allow" : "deny", acl_hits(acl, 0));
+	printf("%u rules, %u tbl8 groups, %lu KB\n", acl->count, acl->tbl8_count,
+			(sizeof(uint32_t) * (ACL_TBL24_SIZE + (size_t)ACL_TBL8_SIZE * acl->tbl8_count) +
+			 sizeof(uint64_t) * acl->stride * thread_count()) / 1024);
+}
+
+static bool service_limit_free_event(void* context) {
+	limit_destroy(context);
+
+	return false;
+}
+
+bool service_limit_set(Service* service, Limit* limit) {
+	Limit* old = service->limit;
+	if(limit && old)
+		limit_carry(limit, old);
+	__atomic_store_n(&service->limit, limit, __ATOMIC_RELEASE);
+
+	//Readers on other cores may still hold the old limits
+	if(old) {
+		if(!event_timer_add(service_limit_free_event, old, LIMIT_FREE_DELAY, 0))
+			limit_destroy(old);
+	}
+
+	return true;
+}
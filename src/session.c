@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <gmalloc.h>
+#include <thread.h>
 #include <util/map.h>
 #include <util/event.h>
 #include <net/ether.h>
@@ -9,17 +10,23 @@
 #include <net/tcp.h>
 #include <net/udp.h>
 
+#include "flow.h"
 #include "session.h"
 #include "service.h"
 
-bool session_recharge(Session* session) {
-	bool session_free_event(void* context) {
-		Session* session = context;
-		session->event_id = 0;
-		service_free_session(session);
+static bool session_free_event(void* context) {
+	Session* session = context;
+	session->event_id = 0;
 
-		return false;
-	}
+	int core = thread_id();
+	stats_core(session->service->stats, core)->sessions_expired++;
+	stats_core(session->server->stats, core)->sessions_expired++;
+	service_free_session(session);
+
+	return false;
+}
+
+bool session_recharge(Session* session) {
 	if(session->fin)
 		return true;
 
@@ -33,22 +40,22 @@ bool session_recharge(Session* session) {
 		return event_timer_update(session->event_id);
 }
 
+static bool session_fin_event(void* context) {
+	Session* session = context;
+	session->event_id = 0;
+
+	printf("Timeout fin\n");
+	service_free_session(session);
+
+	return false;
+}
+
 bool session_set_fin(Session* session) {
-	bool gc(void* context) {
-		Session* session = context;
-		session->event_id = 0;
-		
-		printf("Timeout fin\n");
-		service_free_session(session);
-		
-		return false;
-	}
-		
 	if(session->event_id)
 		event_timer_remove(session->event_id);
 
 	session->fin = true;
-	session->event_id = event_timer_add(gc, session, 3000, 3000);
+	session->event_id = event_timer_add(session_fin_event, session, 3000, 3000);
 	if(session->event_id == 0) {
 		printf("Can'nt add service\n");
 		return false;
@@ -57,10 +64,19 @@ bool session_set_fin(Session* session) {
 	return true;
 }
 
-inline uint64_t session_get_private_key(Session* session) {
-	return (uint64_t)session->private_endpoint.protocol << 48 | (uint64_t)session->private_endpoint.addr << 16 | (uint64_t)session->private_endpoint.port;
+void session_init_key(Session* session) {
+	flow_key_init(&session->public_key, session->client_endpoint.protocol,
+			session->client_endpoint.addr, session->client_endpoint.port,
+			session->public_endpoint->addr, session->public_endpoint->port);
+	flow_key_init(&session->private_key, session->client_endpoint.protocol,
+			session->server_endpoint->addr, session->server_endpoint->port,
+			session->private_endpoint.addr, session->private_endpoint.port);
+}
+
+inline FlowKey* session_get_private_key(Session* session) {
+	return &session->private_key;
 }
 
-inline uint64_t session_get_public_key(Session* session) {
-	return (uint64_t)session->client_endpoint.protocol << 48 | (uint64_t)session->client_endpoint.addr << 16 | (uint64_t)session->client_endpoint.port;
+inline FlowKey* session_get_public_key(Session* session) {
+	return &session->public_key;
 }
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread.h>
+#include <util/event.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+
+#include "sketch.h"
+
+extern void* __gmalloc_pool;
+
+bool sketch_running;
+static uint32_t threshold;
+static uint32_t prefix_threshold;
+static uint32_t block;		//Windows, 0: report only
+static uint32_t share;		//Of threshold on one core, for candidates
+static uint32_t prefix_share;
+static volatile uint64_t epoch;
+
+static SketchCore* cores;	//thread_count(), allocated by the first start
+static void* cores_buffer;
+static uint32_t (*merged)[SKETCH_WIDTH];	//Of the last window
+
+static SketchOffender offenders[SKETCH_OFFENDERS];
+static int offender_count;
+static uint64_t last_sessions;
+static uint32_t last_lost;
+
+/* Authoritative block list, and its two lookup tables, one published */
+typedef struct _SketchBlock {
+	uint64_t	key;
+	uint64_t	expiry;		//epoch
+} SketchBlock;
+
+static SketchBlock blocks[SKETCH_BLOCK_MAX];
+static int block_count;
+static uint64_t tables[2][SKETCH_BLOCK_SLOTS];	//key + 1, 0 if free
+static uint64_t* table;
+
+static const uint64_t seeds[SKETCH_DEPTH] = {
+	0x9e3779b97f4a7c15, 0xc2b2ae3d27d4eb4f, 0x165667b19e3779f9, 0xd6e8feb86659fd93
+};
+
+static inline uint32_t sketch_index(uint64_t key, int row) {
+	return (key * seeds[row]) >> (64 - SKETCH_WIDTH_BITS);
+}
+
+static inline uint32_t sketch_slot(uint64_t key) {
+	return (key * 0x9e3779b97f4a7c15) >> (64 - SKETCH_BLOCK_SLOT_BITS);
+}
+
+static inline void sketch_count(SketchCore* core, int parity, uint64_t key, uint32_t _share) {
+	uint32_t estimate = UINT32_MAX;
+	for(int row = 0; row < SKETCH_DEPTH; row++) {
+		uint32_t count = ++core->counters[parity][row][sketch_index(key, row)];
+		if(count < estimate)
+			estimate = count;
+	}
+
+	//Once per key and window, when its own sessions bring it there
+	if(estimate != _share)
+		return;
+
+	if(core->candidate_count[parity] < SKETCH_CANDIDATES)
+		core->candidates[parity][core->candidate_count[parity]++] = key;
+	else
+		core->candidates_lost[parity]++;
+}
+
+static inline bool sketch_blocked(uint64_t* _table, uint64_t key) {
+	uint32_t slot = sketch_slot(key);
+	while(_table[slot]) {
+		if(_table[slot] == key + 1)
+			return true;
+
+		slot = (slot + 1) & (SKETCH_BLOCK_SLOTS - 1);
+	}
+
+	return false;
+}
+
+bool sketch_admit(uint32_t addr, int core) {
+	SketchCore* sketch = &cores[core];
+	int parity = epoch & 1;
+	uint64_t prefix = SKETCH_PREFIX | (addr & SKETCH_PREFIX_MASK);
+
+	//Blocked sources are still counted, so a flood keeps its block
+	sketch->sessions[parity]++;
+	sketch_count(sketch, parity, addr, share);
+	sketch_count(sketch, parity, prefix, prefix_share);
+
+	uint64_t* _table = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+	if(!_table)
+		return true;
+
+	return !sketch_blocked(_table, addr) && !sketch_blocked(_table, prefix);
+}
+
+uint32_t sketch_estimate(uint64_t key) {
+	if(!merged)
+		return 0;
+
+	uint32_t estimate = UINT32_MAX;
+	for(int row = 0; row < SKETCH_DEPTH; row++) {
+		uint32_t count = merged[row][sketch_index(key, row)];
+		if(count < estimate)
+			estimate = count;
+	}
+
+	return estimate;
+}
+
+/* Rebuild the table not in use and publish it, NULL when empty */
+static void sketch_publish() {
+	if(!block_count) {
+		__atomic_store_n(&table, NULL, __ATOMIC_RELEASE);
+		return;
+	}
+
+	uint64_t* _table = table == tables[0] ? tables[1] : tables[0];
+	bzero(_table, sizeof(tables[0]));
+	for(int i = 0; i < block_count; i++) {
+		uint32_t slot = sketch_slot(blocks[i].key);
+		while(_table[slot])
+			slot = (slot + 1) & (SKETCH_BLOCK_SLOTS - 1);
+		_table[slot] = blocks[i].key + 1;
+	}
+
+	__atomic_store_n(&table, _table, __ATOMIC_RELEASE);
+}
+
+static void sketch_block(uint64_t key) {
+	for(int i = 0; i < block_count; i++) {
+		if(blocks[i].key == key) {
+			blocks[i].expiry = epoch + block;
+			return;
+		}
+	}
+
+	if(block_count < SKETCH_BLOCK_MAX)
+		blocks[block_count++] = (SketchBlock){ .key = key, .expiry = epoch + block };
+}
+
+static bool sketch_tick(void* context) {
+	if(!sketch_running)
+		return true;
+
+	int parity = epoch & 1;
+	epoch++;
+
+	//Cores move on to the other sketches; sum the ones of the window ended
+	bzero(merged, sizeof(uint32_t) * SKETCH_DEPTH * SKETCH_WIDTH);
+	last_sessions = 0;
+	last_lost = 0;
+	for(int i = 0; i < thread_count(); i++) {
+		SketchCore* core = &cores[i];
+		for(int row = 0; row < SKETCH_DEPTH; row++) {
+			for(int j = 0; j < SKETCH_WIDTH; j++)
+				merged[row][j] += core->counters[parity][row][j];
+		}
+		last_sessions += core->sessions[parity];
+		last_lost += core->candidates_lost[parity];
+	}
+
+	offender_count = 0;
+	for(int i = 0; i < thread_count(); i++) {
+		SketchCore* core = &cores[i];
+		for(uint32_t j = 0; j < core->candidate_count[parity]; j++) {
+			uint64_t key = core->candidates[parity][j];
+			uint32_t count = sketch_estimate(key);
+			if(count < (key & SKETCH_PREFIX ? prefix_threshold : threshold))
+				continue;
+
+			int k;
+			for(k = 0; k < offender_count; k++) {
+				if(offenders[k].key == key)
+					break;
+			}
+			if(k < offender_count)
+				continue;
+
+			if(block)
+				sketch_block(key);
+			if(offender_count < SKETCH_OFFENDERS)
+				offenders[offender_count++] = (SketchOffender){ .key = key, .count = count };
+		}
+
+		bzero(core->counters[parity], sizeof(core->counters[parity]));
+		core->candidate_count[parity] = 0;
+		core->candidates_lost[parity] = 0;
+		core->sessions[parity] = 0;
+	}
+
+	//Expired blocks leave
+	bool changed = false;
+	for(int i = 0; i < block_count; i++) {
+		if(blocks[i].expiry > epoch)
+			continue;
+
+		blocks[i--] = blocks[--block_count];
+		changed = true;
+	}
+	if(changed || offender_count)
+		sketch_publish();
+
+	return true;
+}
+
+/* Windows are closed by the first core, which also runs the console */
+bool sketch_init() {
+	if(thread_id() != 0)
+		return true;
+
+	return event_timer_add(sketch_tick, NULL, SKETCH_PERIOD, SKETCH_PERIOD) != 0;
+}
+
+bool sketch_start(uint32_t _threshold, uint32_t _prefix_threshold, uint32_t _block) {
+	if(!cores) {
+		size_t size = sizeof(SketchCore) * thread_count();
+		cores_buffer = __malloc(size + 64, __gmalloc_pool);
+		merged = __malloc(sizeof(uint32_t) * SKETCH_DEPTH * SKETCH_WIDTH, __gmalloc_pool);
+		if(!cores_buffer || !merged) {
+			printf("Can'nt allocate sketches\n");
+			if(cores_buffer)
+				__free(cores_buffer, __gmalloc_pool);
+			if(merged)
+				__free(merged, __gmalloc_pool);
+			cores_buffer = NULL;
+			merged = NULL;
+			return false;
+		}
+		cores = (SketchCore*)(((uintptr_t)cores_buffer + 63) & ~(uintptr_t)63);
+	}
+
+	sketch_running = false;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	bzero(cores, sizeof(SketchCore) * thread_count());
+	bzero(merged, sizeof(uint32_t) * SKETCH_DEPTH * SKETCH_WIDTH);
+	offender_count = 0;
+	last_sessions = 0;
+	last_lost = 0;
+
+	threshold = _threshold;
+	prefix_threshold = _prefix_threshold;
+	block = ((uint64_t)_block * 1000000 + SKETCH_PERIOD - 1) / SKETCH_PERIOD;
+	share = (threshold + thread_count() - 1) / thread_count();
+	prefix_share = (prefix_threshold + thread_count() - 1) / thread_count();
+	//Blocks held are renewed or released by the new settings
+	if(!block) {
+		block_count = 0;
+		sketch_publish();
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	sketch_running = true;
+
+	return true;
+}
+
+void sketch_stop() {
+	sketch_running = false;
+	block_count = 0;
+	sketch_publish();
+}
+
+void sketch_dump() {
+	void print_key(uint64_t key) {
+		uint32_t addr = key;
+		printf("%d.%d.%d.%d%s", (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff,
+				key & SKETCH_PREFIX ? "/24" : "");
+	}
+
+	printf("DDoS detection %s, %u new sessions/s per client, %u per /24, ", sketch_running ? "on" : "off",
+			threshold, prefix_threshold);
+	if(block)
+		printf("block %lus\n", (uint64_t)block * SKETCH_PERIOD / 1000000);
+	else
+		printf("report only\n");
+
+	printf("Last window: %lu new sessions, %d over threshold", last_sessions, offender_count);
+	if(last_lost)
+		printf(", %u candidates lost", last_lost);
+	printf("\n");
+	for(int i = 0; i < offender_count; i++) {
+		printf("\t");
+		print_key(offenders[i].key);
+		printf("\t%u\n", offenders[i].count);
+	}
+
+	printf("Blocked: %d\n", block_count);
+	for(int i = 0; i < block_count; i++) {
+		printf("\t");
+		print_key(blocks[i].key);
+		printf("\t%lus left\n", (blocks[i].expiry - epoch) * SKETCH_PERIOD / 1000000);
+	}
+}
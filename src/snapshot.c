@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <string.h>
+#include <util/map.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+
+#include "snapshot.h"
+#include "sync.h"
+#include "service.h"
+#include "schedule.h"
+
+extern void* __gmalloc_pool;
+
+static RoundRobin* snapshot_robin(Service* service) {
+	if(service->schedule != SCHEDULE_ROUND_ROBIN && service->schedule != SCHEDULE_WEIGHTED_ROUND_ROBIN)
+		return NULL;
+
+	return service->robin;
+}
+
+int64_t snapshot_save(char* path) {
+	uint32_t service_count = 0;
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(services)
+			service_count += map_size(services);
+	}
+
+	SnapshotService* services = __malloc(sizeof(SnapshotService) * (service_count ? service_count : 1), __gmalloc_pool);
+	if(!services) {
+		printf("Can'nt allocate snapshot of %u services\n", service_count);
+		return -1;
+	}
+
+	uint32_t index = 0;
+	for(int i = 0; i < count; i++) {
+		Map* _services = ni_config_get(ni_get(i), SERVICES);
+		if(!_services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, _services);
+		while(map_iterator_has_next(&iter) && index < service_count) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Service* service = entry->data;
+			RoundRobin* roundrobin = snapshot_robin(service);
+
+			SnapshotService* _service = &services[index++];
+			bzero(_service, sizeof(SnapshotService));
+			_service->protocol = service->endpoint.protocol;
+			_service->ni = i;
+			_service->port = service->endpoint.port;
+			_service->addr = service->endpoint.addr;
+			_service->robin = roundrobin ? roundrobin->robin : 0;
+		}
+	}
+
+	uint32_t session_count;
+	SyncRecord* records = sync_collect(&session_count);
+
+	SnapshotHeader header = {
+		.magic = SNAPSHOT_MAGIC,
+		.version = SNAPSHOT_VERSION,
+		.service_size = sizeof(SnapshotService),
+		.record_size = sizeof(SyncRecord),
+		.service_count = index,
+		.session_count = session_count,
+	};
+
+	int64_t result = -1;
+	FILE* fp = fopen(path, "w");
+	if(!fp) {
+		printf("Can'nt open file %s\n", path);
+		goto done;
+	}
+
+	if(fwrite(&header, sizeof(header), 1, fp) != 1 ||
+			(index && fwrite(services, sizeof(SnapshotService) * index, 1, fp) != 1) ||
+			(session_count && fwrite(records, sizeof(SyncRecord) * session_count, 1, fp) != 1))
+		printf("Can'nt write file %s\n", path);
+	else
+		result = session_count;
+	fclose(fp);
+
+done:
+	if(records)
+		__free(records, __gmalloc_pool);
+	__free(services, __gmalloc_pool);
+
+	return result;
+}
+
+int64_t snapshot_load(char* path, uint32_t* failed) {
+	FILE* fp = fopen(path, "r");
+	if(!fp) {
+		printf("Can'nt open file %s\n", path);
+		return -1;
+	}
+
+	SnapshotHeader header;
+	if(fread(&header, sizeof(header), 1, fp) != 1 || header.magic != SNAPSHOT_MAGIC ||
+			header.version != SNAPSHOT_VERSION || header.service_size != sizeof(SnapshotService) ||
+			header.record_size != sizeof(SyncRecord)) {
+		printf("Not a session snapshot of this version: %s\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	//One read of the whole file
+	size_t size = sizeof(SnapshotService) * header.service_count + sizeof(SyncRecord) * header.session_count;
+	void* buffer = __malloc(size ? size : 1, __gmalloc_pool);
+	if(!buffer) {
+		printf("Can'nt allocate snapshot of %u sessions\n", header.session_count);
+		fclose(fp);
+		return -1;
+	}
+
+	if(size && fread(buffer, size, 1, fp) != 1) {
+		printf("Can'nt read file %s\n", path);
+		__free(buffer, __gmalloc_pool);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	SnapshotService* services = buffer;
+	for(uint32_t i = 0; i < header.service_count; i++) {
+		Endpoint service_endpoint = { .ni = ni_get(services[i].ni) };
+		if(!service_endpoint.ni)
+			continue;
+		service_endpoint.protocol = services[i].protocol;
+		service_endpoint.addr = services[i].addr;
+		service_endpoint.port = services[i].port;
+
+		Service* service = service_get(&service_endpoint);
+		RoundRobin* roundrobin = service ? snapshot_robin(service) : NULL;
+		if(roundrobin)
+			roundrobin->robin = services[i].robin;
+	}
+
+	SyncRecord* records = (SyncRecord*)(services + header.service_count);
+	int64_t loaded = 0;
+	*failed = 0;
+	for(uint32_t i = 0; i < header.session_count; i++) {
+		if(sync_install(&records[i]))
+			loaded++;
+		else
+			(*failed)++;
+	}
+
+	__free(buffer, __gmalloc_pool);
+
+	return loaded;
+}
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <string.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+#include <thread.h>
+#include <util/list.h>
+#include <util/event.h>
+
+#include "stats.h"
+
+extern void* __gmalloc_pool;
+static List* stats_list;	//Every Stats, for the sampling timer
+
+bool stats_ginit() {
+	stats_list = list_create(__gmalloc_pool);
+
+	return stats_list != NULL;
+}
+
+static bool stats_sample(void* context) {
+	ListIterator iter;
+	list_iterator_init(&iter, stats_list);
+	while(list_iterator_has_next(&iter)) {
+		Stats* stats = list_iterator_next(&iter);
+		StatsCore total;
+		stats_sum(stats, &total);
+
+		StatsSample* sample = &stats->samples[stats->sample_count % STATS_SAMPLE_COUNT];
+		memcpy(sample->packets, total.packets, sizeof(sample->packets));
+		memcpy(sample->bytes, total.bytes, sizeof(sample->bytes));
+		sample->sessions_created = total.sessions_created;
+		sample->drops = 0;
+		for(int i = 0; i < STATS_DROP_COUNT; i++)
+			sample->drops += total.drops[i];
+
+		stats->sample_count++;
+	}
+
+	return true;
+}
+
+/* Samples are taken by the first core */
+bool stats_init() {
+	if(thread_id() != 0)
+		return true;
+
+	return event_timer_add(stats_sample, NULL, STATS_SAMPLE_PERIOD, STATS_SAMPLE_PERIOD) != 0;
+}
+
+Stats* stats_create(void* pool) {
+	Stats* stats = __malloc(sizeof(Stats), pool);
+	if(!stats) {
+		printf("Can'nt allocate stats\n");
+		return NULL;
+	}
+	bzero(stats, sizeof(Stats));
+
+	//Cores must not share a line
+	int count = thread_count();
+	size_t size = sizeof(StatsCore) * count;
+	stats->buffer = __malloc(size + STATS_CACHE_LINE, pool);
+	if(!stats->buffer) {
+		printf("Can'nt allocate stats\n");
+		__free(stats, pool);
+		return NULL;
+	}
+
+	stats->cores = (StatsCore*)(((uintptr_t)stats->buffer + STATS_CACHE_LINE - 1) & ~(uintptr_t)(STATS_CACHE_LINE - 1));
+	bzero(stats->cores, size);
+	stats->core_count = count;
+	stats->pool = pool;
+
+	if(!list_add(stats_list, stats)) {
+		__free(stats->buffer, pool);
+		__free(stats, pool);
+		return NULL;
+	}
+
+	return stats;
+}
+
+void stats_destroy(Stats* stats) {
+	if(!stats)
+		return;
+
+	list_remove_data(stats_list, stats);
+	__free(stats->buffer, stats->pool);
+	__free(stats, stats->pool);
+}
+
+void stats_sum(Stats* stats, StatsCore* total) {
+	bzero(total, sizeof(StatsCore));
+
+	for(int i = 0; i < stats->core_count; i++) {
+		StatsCore* core = &stats->cores[i];
+		for(int j = 0; j < 2; j++) {
+			total->packets[j] += core->packets[j];
+			total->bytes[j] += core->bytes[j];
+		}
+		total->sessions_created += core->sessions_created;
+		total->sessions_freed += core->sessions_freed;
+		total->sessions_expired += core->sessions_expired;
+		total->alloc_failures += core->alloc_failures;
+		total->schedule_misses += core->schedule_misses;
+		for(int j = 0; j < STATS_DROP_COUNT; j++)
+			total->drops[j] += core->drops[j];
+	}
+}
+
+bool stats_rate(Stats* stats, uint32_t seconds, StatsSample* rate) {
+	uint32_t count = stats->sample_count;
+	if(seconds == 0 || seconds >= STATS_SAMPLE_COUNT || count <= seconds)
+		return false;
+
+	//One sample a second
+	StatsSample* last = &stats->samples[(count - 1) % STATS_SAMPLE_COUNT];
+	StatsSample* first = &stats->samples[(count - 1 - seconds) % STATS_SAMPLE_COUNT];
+	for(int i = 0; i < 2; i++) {
+		rate->packets[i] = (last->packets[i] - first->packets[i]) / seconds;
+		rate->bytes[i] = (last->bytes[i] - first->bytes[i]) / seconds;
+	}
+	rate->sessions_created = (last->sessions_created - first->sessions_created) / seconds;
+	rate->drops = (last->drops - first->drops) / seconds;
+
+	return true;
+}
+
+void stats_print(Stats* stats) {
+	static uint32_t windows[] = { 1, 10, 60 };
+
+	StatsCore total;
+	stats_sum(stats, &total);
+
+	printf("\tpackets\t%lu in\t%lu out\tbytes\t%lu in\t%lu out\n", total.packets[STATS_IN], total.packets[STATS_OUT],
+			total.bytes[STATS_IN], total.bytes[STATS_OUT]);
+	printf("\tsessions\t%lu created\t%lu freed\t%lu expired\t%lu alloc failures\t%lu schedule misses\n",
+			total.sessions_created, total.sessions_freed, total.sessions_expired, total.alloc_failures,
+			total.schedule_misses);
+	printf("\tdrops\t%lu no service\t%lu no session\t%lu no server\t%lu tunnel\t%lu output\t%lu blocked\t%lu denied\t%lu limited\n",
+			total.drops[STATS_DROP_NO_SERVICE], total.drops[STATS_DROP_NO_SESSION],
+			total.drops[STATS_DROP_NO_SERVER], total.drops[STATS_DROP_TUNNEL], total.drops[STATS_DROP_OUTPUT],
+			total.drops[STATS_DROP_BLOCKED], total.drops[STATS_DROP_DENIED],
+			total.drops[STATS_DROP_LIMITED]);
+
+	for(int i = 0; i < sizeof(windows) / sizeof(uint32_t); i++) {
+		StatsSample rate;
+		if(!stats_rate(stats, windows[i], &rate))
+			break;
+
+		printf("\t%us\t%lu/%lu pps\t%lu/%lu Bps\t%lu sessions/s\t%lu drops/s\n", windows[i], rate.packets[STATS_IN],
+				rate.packets[STATS_OUT], rate.bytes[STATS_IN], rate.bytes[STATS_OUT], rate.sessions_created,
+				rate.drops);
+	}
+}
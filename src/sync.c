@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread.h>
+#include <util/map.h>
+#include <util/event.h>
+#include <util/types.h>
+#include <net/interface.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/udp.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+
+#include "sync.h"
+#include "service.h"
+#include "server.h"
+#include "forward.h"
+#include "loadbalancer.h"
+
+extern void* __gmalloc_pool;
+
+bool sync_running;
+static SyncCore* sync_cores;	//Kept once allocated: cores may be appending
+static NetworkInterface* sync_ni;
+static uint32_t sync_addr;
+static uint32_t sync_peer;
+static uint16_t sync_port;
+static uint32_t sync_rate;
+static bool sync_added;		//sync_addr was added to sync_ni by us
+
+static uint32_t sync_sequence;	//Of the next data datagram
+static uint32_t sync_expected;	//From the peer
+static bool sync_heard;
+static volatile bool sync_resync;	//Peer said hello
+static uint32_t sync_hello;	//lb_clock of the last hello sent
+static uint32_t sync_clock;	//lb_clock of the last tick
+static uint64_t sync_credits;	//Records of the rate, * 1000
+
+//Bulk resync, every session at the peer's hello
+static SyncRecord* sync_bulk;
+static uint32_t sync_bulk_count;
+static uint32_t sync_bulk_sent;
+
+static uint64_t sync_records;
+static uint64_t sync_datagrams;
+static uint64_t sync_failures;
+static uint64_t sync_lost;	//Datagrams of the peer
+static uint64_t sync_resyncs;
+
+static uint8_t sync_ni_num(NetworkInterface* ni) {
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		if(ni_get(i) == ni)
+			return i;
+	}
+
+	return 0;
+}
+
+void sync_record(SyncRecord* record, uint8_t type, Session* session) {
+	Endpoint* client = &session->client_endpoint;
+	bool nat = session->forward == FORWARD_NAT_TCP || session->forward == FORWARD_NAT_UDP;
+
+	record->type = type;
+	record->protocol = client->protocol;
+	record->service_ni = sync_ni_num(session->public_endpoint->ni);
+	record->server_ni = sync_ni_num(session->server_endpoint->ni);
+	record->service_addr = endian32(session->public_endpoint->addr);
+	record->client_addr = endian32(client->addr);
+	record->server_addr = endian32(session->server_endpoint->addr);
+	record->service_port = endian16(session->public_endpoint->port);
+	record->client_port = endian16(client->port);
+	record->server_port = endian16(session->server_endpoint->port);
+	record->private_port = nat ? endian16(session->private_endpoint.port) : 0;
+}
+
+void sync_session(uint8_t type, Session* session, int core) {
+	SyncCore* _core = &sync_cores[core];
+	if(_core->applying)
+		return;
+
+	uint32_t head = _core->head;
+	if(head - __atomic_load_n(&_core->tail, __ATOMIC_ACQUIRE) >= SYNC_RING_SIZE) {
+		_core->overflows++;
+		return;
+	}
+
+	session->synced = lb_clock;
+	sync_record(&_core->records[head & (SYNC_RING_SIZE - 1)], type, session);
+	__atomic_store_n(&_core->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static bool sync_send(uint8_t type, SyncRecord* records, uint16_t count) {
+	uint16_t length = sizeof(SyncHeader) + count * sizeof(SyncRecord);
+	Packet* packet = ni_alloc(sync_ni, ETHER_LEN + IP_LEN + UDP_LEN + length);
+	if(!packet) {
+		sync_failures++;
+		return false;
+	}
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->dmac = endian48(arp_get_mac(sync_ni, sync_peer, sync_addr));
+	ether->smac = endian48(sync_ni->mac);
+	ether->type = endian16(ETHER_TYPE_IPv4);
+
+	IP* ip = (IP*)ether->payload;
+	ip->version = 4;
+	ip->ihl = IP_LEN / 4;
+	ip->ecn = 0;
+	ip->dscp = 0;
+	ip->id = 0;
+	ip->flags_offset = endian16(0x4000);	//Don't fragment
+	ip->ttl = 64;
+	ip->protocol = IP_PROTOCOL_UDP;
+	ip->source = endian32(sync_addr);
+	ip->destination = endian32(sync_peer);
+
+	UDP* udp = (UDP*)ip->body;
+	udp->source = endian16(sync_port);
+	udp->destination = endian16(sync_port);
+
+	SyncHeader* header = (SyncHeader*)udp->body;
+	header->magic = endian32(SYNC_MAGIC);
+	header->version = SYNC_VERSION;
+	header->type = type;
+	header->count = endian16(count);
+	header->sequence = endian32(type == SYNC_DATA ? sync_sequence++ : 0);
+	memcpy(header + 1, records, count * sizeof(SyncRecord));
+
+	udp_pack(packet, length);
+	if(!ni_output(sync_ni, packet)) {
+		ni_free(packet);
+		sync_failures++;
+		return false;
+	}
+
+	sync_records += count;
+	sync_datagrams++;
+
+	return true;
+}
+
+static void sync_each_service(void (*func)(Service* service, void* context), void* context) {
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			func(entry->data, context);
+		}
+	}
+}
+
+static void sync_count_sessions(Service* service, void* context) {
+	uint32_t* total = context;
+	if(service->sessions)
+		*total += map_size(service->sessions);
+}
+
+typedef struct _SyncCollect {
+	SyncRecord*	records;
+	uint32_t	count;
+	uint32_t	total;
+} SyncCollect;
+
+//Sessions may come and go since counting
+static void sync_record_sessions(Service* service, void* context) {
+	SyncCollect* collect = context;
+	if(!service->sessions)
+		return;
+
+	MapIterator iter;
+	map_iterator_init(&iter, service->sessions);
+	while(map_iterator_has_next(&iter) && collect->count < collect->total) {
+		MapEntry* entry = map_iterator_next(&iter);
+		sync_record(&collect->records[collect->count++], SYNC_RECORD_CREATE, entry->data);
+	}
+}
+
+SyncRecord* sync_collect(uint32_t* count) {
+	uint32_t total = 0;
+	sync_each_service(sync_count_sessions, &total);
+
+	*count = 0;
+	if(!total)
+		return NULL;
+
+	SyncCollect collect = { .records = __malloc(sizeof(SyncRecord) * total, __gmalloc_pool), .total = total };
+	if(!collect.records) {
+		printf("Can'nt allocate records of %u sessions\n", total);
+		return NULL;
+	}
+
+	sync_each_service(sync_record_sessions, &collect);
+	if(!collect.count) {
+		__free(collect.records, __gmalloc_pool);
+		return NULL;
+	}
+
+	*count = collect.count;
+	return collect.records;
+}
+
+/* Every session, to be sent as creates */
+static void sync_snapshot() {
+	if(sync_bulk)
+		__free(sync_bulk, __gmalloc_pool);
+	sync_bulk_sent = 0;
+	sync_sequence = 0;
+	sync_resyncs++;
+	sync_bulk = sync_collect(&sync_bulk_count);
+}
+
+typedef struct _SyncBatch {
+	SyncRecord	records[SYNC_BATCH];
+	uint16_t	count;
+	uint32_t	used;		//Records of the tick
+} SyncBatch;
+
+static void sync_batch_add(SyncBatch* batch, SyncRecord* record) {
+	batch->records[batch->count++] = *record;
+	batch->used++;
+	if(batch->count == SYNC_BATCH) {
+		sync_send(SYNC_DATA, batch->records, batch->count);
+		batch->count = 0;
+	}
+}
+
+/* Ships the rings, then the resync, within the rate */
+static bool sync_tick(void* context) {
+	if(!sync_running)
+		return true;
+
+	uint32_t now = lb_clock;
+	if(!sync_heard && now - sync_hello >= SYNC_HELLO_PERIOD) {
+		sync_hello = now;
+		sync_send(SYNC_HELLO, NULL, 0);
+	}
+
+	if(sync_resync) {
+		sync_resync = false;
+		sync_snapshot();
+	}
+
+	//Up to 10 ms of rate at once
+	uint64_t full = (uint64_t)sync_rate * 10;
+	sync_credits += (uint64_t)(now - sync_clock) * sync_rate;
+	if(sync_credits > full)
+		sync_credits = full;
+	sync_clock = now;
+
+	SyncBatch batch;
+	batch.count = 0;
+	batch.used = 0;
+	uint32_t budget = sync_credits / 1000;
+	int cores = thread_count();
+	for(int i = 0; i < cores && batch.used < budget; i++) {
+		SyncCore* core = &sync_cores[i];
+		uint32_t tail = core->tail;
+		uint32_t head = __atomic_load_n(&core->head, __ATOMIC_ACQUIRE);
+		while(tail != head && batch.used < budget)
+			sync_batch_add(&batch, &core->records[tail++ & (SYNC_RING_SIZE - 1)]);
+		__atomic_store_n(&core->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	while(sync_bulk && batch.used < budget) {
+		sync_batch_add(&batch, &sync_bulk[sync_bulk_sent++]);
+		if(sync_bulk_sent == sync_bulk_count) {
+			__free(sync_bulk, __gmalloc_pool);
+			sync_bulk = NULL;
+		}
+	}
+
+	if(batch.count)
+		sync_send(SYNC_DATA, batch.records, batch.count);
+	sync_credits -= (uint64_t)batch.used * 1000;
+
+	return true;
+}
+
+bool sync_init() {
+	if(thread_id() != 0)
+		return true;
+
+	return event_timer_add(sync_tick, NULL, SYNC_PERIOD, SYNC_PERIOD) != 0;
+}
+
+bool sync_start(NetworkInterface* ni, uint32_t addr, uint32_t peer, uint16_t port, uint32_t rate) {
+	sync_stop();
+
+	if(!sync_cores) {
+		size_t size = sizeof(SyncCore) * thread_count();
+		void* buffer = __malloc(size + 64, __gmalloc_pool);
+		if(!buffer) {
+			printf("Can'nt allocate sync rings\n");
+			return false;
+		}
+
+		sync_cores = (SyncCore*)(((uintptr_t)buffer + 63) & ~(uintptr_t)63);
+		bzero(sync_cores, size);
+	}
+
+	if(!ni_ip_get(ni, addr)) {
+		if(!ni_ip_add(ni, addr)) {
+			printf("Can'nt add sync address\n");
+			return false;
+		}
+		sync_added = true;
+	}
+
+	//Records of an earlier run are stale
+	for(int i = 0; i < thread_count(); i++)
+		sync_cores[i].tail = sync_cores[i].head;
+
+	sync_ni = ni;
+	sync_addr = addr;
+	sync_peer = peer;
+	sync_port = port;
+	sync_rate = rate;
+	sync_sequence = 0;
+	sync_expected = 0;
+	sync_heard = false;
+	sync_resync = false;
+	sync_hello = lb_clock - SYNC_HELLO_PERIOD;
+	sync_clock = lb_clock;
+	sync_credits = 0;
+	sync_running = true;
+
+	return true;
+}
+
+void sync_stop() {
+	if(!sync_running)
+		return;
+
+	sync_running = false;
+	if(sync_bulk)
+		__free(sync_bulk, __gmalloc_pool);
+	sync_bulk = NULL;
+
+	if(sync_added)
+		ni_ip_remove(sync_ni, sync_addr);
+	sync_added = false;
+}
+
+/* Endpoints of the service and the client of record */
+static bool sync_endpoints(SyncRecord* record, Endpoint* service_endpoint, Endpoint* client_endpoint) {
+	NetworkInterface* ni = ni_get(record->service_ni);
+	if(!ni)
+		return false;
+
+	service_endpoint->ni = ni;
+	service_endpoint->ni_num = record->service_ni;
+	service_endpoint->protocol = record->protocol;
+	service_endpoint->addr = endian32(record->service_addr);
+	service_endpoint->port = endian16(record->service_port);
+	*client_endpoint = *service_endpoint;
+	client_endpoint->addr = endian32(record->client_addr);
+	client_endpoint->port = endian16(record->client_port);
+
+	return true;
+}
+
+Session* sync_install(SyncRecord* record) {
+	Endpoint service_endpoint;
+	Endpoint client_endpoint;
+	NetworkInterface* server_ni = ni_get(record->server_ni);
+	if(!server_ni || !sync_endpoints(record, &service_endpoint, &client_endpoint))
+		return NULL;
+
+	Session* session = service_get_session(&client_endpoint, &service_endpoint);
+	if(session)
+		return session;
+
+	Endpoint server_endpoint = { .ni = server_ni, .ni_num = record->server_ni, .protocol = record->protocol };
+	server_endpoint.addr = endian32(record->server_addr);
+	server_endpoint.port = endian16(record->server_port);
+	Service* service = service_get(&service_endpoint);
+	Server* server = server_get(&server_endpoint);
+	if(!service || !server)
+		return NULL;
+
+	return service_install_session(service, server, &client_endpoint, endian16(record->private_port));
+}
+
+static void sync_apply(SyncRecord* record, SyncCore* core) {
+	Endpoint service_endpoint;
+	Endpoint client_endpoint;
+	if(record->type < SYNC_RECORD_CREATE || record->type > SYNC_RECORD_REFRESH ||
+			!sync_endpoints(record, &service_endpoint, &client_endpoint)) {
+		core->applied[0]++;
+		return;
+	}
+
+	Session* session = service_get_session(&client_endpoint, &service_endpoint);
+	if(record->type == SYNC_RECORD_DELETE) {
+		if(session)
+			service_free_session(session);
+		core->applied[SYNC_RECORD_DELETE]++;
+		return;
+	}
+
+	if(session) {
+		session_recharge(session);
+		core->applied[SYNC_RECORD_REFRESH]++;
+		return;
+	}
+
+	if(!sync_install(record)) {
+		core->applied[0]++;
+		return;
+	}
+
+	core->applied[SYNC_RECORD_CREATE]++;
+}
+
+bool sync_receive(NetworkInterface* ni, uint32_t source, uint32_t destination, uint16_t port, void* body, uint32_t length) {
+	if(ni != sync_ni || source != sync_peer || destination != sync_addr || port != sync_port)
+		return false;
+
+	SyncHeader* header = body;
+	if(length < sizeof(SyncHeader) || endian32(header->magic) != SYNC_MAGIC || header->version != SYNC_VERSION)
+		return false;
+
+	uint16_t count = endian16(header->count);
+	if(length < sizeof(SyncHeader) + count * sizeof(SyncRecord))
+		return false;
+
+	if(header->type == SYNC_HELLO) {
+		sync_heard = true;
+		sync_resync = true;
+		return true;
+	} else if(header->type != SYNC_DATA) {
+		return false;
+	}
+
+	//A restarted peer starts over from 0: not a loss
+	uint32_t sequence = endian32(header->sequence);
+	if(sync_heard && (int32_t)(sequence - sync_expected) > 0)
+		sync_lost += sequence - sync_expected;
+	sync_expected = sequence + 1;
+	sync_heard = true;
+
+	SyncCore* core = &sync_cores[thread_id()];
+	SyncRecord* records = (SyncRecord*)(header + 1);
+	core->applying = true;
+	for(uint16_t i = 0; i < count; i++)
+		sync_apply(&records[i], core);
+	core->applying = false;
+
+	return true;
+}
+
+void sync_dump() {
+	if(!sync_running) {
+		printf("Sync off\n");
+		return;
+	}
+
+	void print_addr(char* name, uint32_t addr) {
+		printf("%s %d.%d.%d.%d", name, (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+	}
+
+	print_addr("Sync from", sync_addr);
+	print_addr(" to peer", sync_peer);
+	printf(" UDP %u on NIC %u, up to %u records/s, peer %s\n", sync_port, sync_ni_num(sync_ni), sync_rate,
+			sync_heard ? "heard" : "not heard yet");
+
+	uint64_t overflows = 0;
+	uint64_t applied[4] = { 0 };
+	for(int i = 0; i < thread_count(); i++) {
+		overflows += sync_cores[i].overflows;
+		for(int j = 0; j < 4; j++)
+			applied[j] += sync_cores[i].applied[j];
+	}
+
+	printf("\tsent\t%lu records in %lu datagrams, %lu failed, %lu ring overflows\n", sync_records, sync_datagrams,
+			sync_failures, overflows);
+	printf("\tresync\t%lu", sync_resyncs);
+	if(sync_bulk)
+		printf(", %u/%u sessions sent", sync_bulk_sent, sync_bulk_count);
+	printf("\n");
+	printf("\tapplied\t%lu created, %lu deleted, %lu refreshed, %lu failed, %lu datagrams lost\n",
+			applied[SYNC_RECORD_CREATE], applied[SYNC_RECORD_DELETE], applied[SYNC_RECORD_REFRESH], applied[0], sync_lost);
+}
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "top.h"
+
+bool top_running;
+uint32_t top_sample = TOP_DEFAULT_SAMPLE;
+
+static inline uint32_t top_home(uint64_t key) {
+	return (key * 0x9e3779b97f4a7c15) >> (64 - TOP_SLOT_BITS);
+}
+
+static inline void top_place(Top* top, uint32_t index, TopEntry* entry) {
+	top->heap[index] = *entry;
+	top->slots[entry->slot] = index + 1;
+}
+
+static void top_sift_up(Top* top, uint32_t index) {
+	TopEntry entry = top->heap[index];
+	while(index) {
+		uint32_t parent = (index - 1) / 2;
+		if(top->heap[parent].count <= entry.count)
+			break;
+
+		top_place(top, index, &top->heap[parent]);
+		index = parent;
+	}
+	top_place(top, index, &entry);
+}
+
+static void top_sift_down(Top* top, uint32_t index) {
+	TopEntry entry = top->heap[index];
+	while(1) {
+		uint32_t child = index * 2 + 1;
+		if(child >= top->size)
+			break;
+		if(child + 1 < top->size && top->heap[child + 1].count < top->heap[child].count)
+			child++;
+		if(entry.count <= top->heap[child].count)
+			break;
+
+		top_place(top, index, &top->heap[child]);
+		index = child;
+	}
+	top_place(top, index, &entry);
+}
+
+/* Backward shift deletion: no tombstones under endless eviction */
+static void top_unslot(Top* top, uint32_t slot) {
+	while(1) {
+		uint32_t next = slot;
+		while(1) {
+			next = (next + 1) & (TOP_SLOTS - 1);
+			if(!top->slots[next]) {
+				top->slots[slot] = 0;
+				return;
+			}
+
+			//Move it unless its home lies cyclically in (slot, next]
+			uint32_t home = top_home(top->heap[top->slots[next] - 1].key);
+			if(((next - home) & (TOP_SLOTS - 1)) >= ((next - slot) & (TOP_SLOTS - 1)))
+				break;
+		}
+
+		top->slots[slot] = top->slots[next];
+		top->heap[top->slots[slot] - 1].slot = slot;
+		slot = next;
+	}
+}
+
+void top_add(Top* top, uint64_t key, uint64_t count, uint64_t other) {
+	uint32_t slot = top_home(key);
+	while(top->slots[slot]) {
+		uint32_t index = top->slots[slot] - 1;
+		TopEntry* entry = &top->heap[index];
+		if(entry->key == key) {
+			entry->count += count;
+			entry->other += other;
+			top_sift_down(top, index);
+			return;
+		}
+		slot = (slot + 1) & (TOP_SLOTS - 1);
+	}
+
+	if(top->size < TOP_SIZE) {
+		TopEntry entry = { .key = key, .count = count, .other = other, .slot = slot };
+		uint32_t index = top->size++;
+		top_place(top, index, &entry);
+		top_sift_up(top, index);
+		return;
+	}
+
+	//Evict the smallest: its slot goes first, then find ours again
+	TopEntry* min = &top->heap[0];
+	uint64_t error = min->count;
+	top_unslot(top, min->slot);
+
+	slot = top_home(key);
+	while(top->slots[slot])
+		slot = (slot + 1) & (TOP_SLOTS - 1);
+
+	TopEntry entry = { .key = key, .count = error + count, .error = error, .other = other, .slot = slot };
+	top_place(top, 0, &entry);
+	top_sift_down(top, 0);
+}
+
+static int top_compare(const void* a, const void* b) {
+	const TopEntry* x = a;
+	const TopEntry* y = b;
+
+	//What was surely seen, not what was inherited
+	uint64_t x_seen = x->count - x->error;
+	uint64_t y_seen = y->count - y->error;
+	if(x_seen != y_seen)
+		return x_seen > y_seen ? -1 : 1;
+
+	return 0;
+}
+
+int top_merge(Top* tops, int count, int stride, TopEntry* entries) {
+	int size = 0;
+	for(int i = 0; i < count; i++) {
+		Top* top = (Top*)((uint8_t*)tops + (size_t)i * stride);
+		for(int j = 0; j < top->size; j++) {
+			TopEntry* entry = &top->heap[j];
+			int k;
+			for(k = 0; k < size; k++) {
+				if(entries[k].key == entry->key)
+					break;
+			}
+
+			if(k == size) {
+				entries[size++] = *entry;
+			} else {
+				entries[k].count += entry->count;
+				entries[k].error += entry->error;
+				entries[k].other += entry->other;
+			}
+		}
+	}
+
+	qsort(entries, size, sizeof(TopEntry), top_compare);
+
+	return size;
+}
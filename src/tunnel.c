@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <string.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+#include <net/packet.h>
+#include <net/ether.h>
+#include <net/ip.h>
+#include <net/udp.h>
+#include <net/checksum.h>
+
+#include "tunnel.h"
+#include "server.h"
+#include "session.h"
+#include "forward.h"
+
+#define IP_FLAG_DF	0x4000
+
+static inline uint16_t fold(uint32_t sum) {
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+Tunnel* tunnel_create(Server* server, uint8_t mode, void* pool) {
+	Tunnel* tunnel = __malloc(sizeof(Tunnel), pool);
+	if(!tunnel)
+		return NULL;
+
+	bzero(tunnel, sizeof(Tunnel));
+	tunnel->mode = mode;
+	tunnel->pool = pool;
+	tunnel->mtu = server->mtu ? server->mtu : TUNNEL_MTU;
+	tunnel->overhead = mode == MODE_GUE ? IP_LEN + UDP_LEN + TUNNEL_GUE_LEN : IP_LEN;
+
+	IP* ip = (IP*)tunnel->header;
+	ip->version = 4;
+	ip->ihl = IP_LEN / 4;
+	ip->flags_offset = endian16(IP_FLAG_DF);
+	ip->ttl = TUNNEL_TTL;
+	ip->protocol = mode == MODE_GUE ? IP_PROTOCOL_UDP : IP_PROTOCOL_IP;
+	ip->destination = endian32(server->endpoint.addr);
+
+	if(mode == MODE_GUE) {
+		UDP* udp = (UDP*)ip->body;
+		udp->destination = endian16(TUNNEL_GUE_PORT);
+		udp->checksum = 0;
+
+		//GUE variant 0, no extension fields, proto_ctype IPIP
+		uint8_t* gue = udp->body;
+		gue[0] = 0;
+		gue[1] = IP_PROTOCOL_IP;
+		gue[2] = 0;
+		gue[3] = 0;
+	}
+
+	tunnel_set_source(tunnel, 0);
+
+	return tunnel;
+}
+
+void tunnel_destroy(Tunnel* tunnel) {
+	if(tunnel)
+		__free(tunnel, tunnel->pool);
+}
+
+void tunnel_set_source(Tunnel* tunnel, uint32_t source) {
+	IP* ip = (IP*)tunnel->header;
+	tunnel->source = source;
+	ip->source = endian32(source);
+
+	//Everything but source, length and checksum
+	uint16_t* words = (uint16_t*)tunnel->header;
+	tunnel->partial = endian16(words[0]) + endian16(words[2]) + endian16(words[3]) + endian16(words[4])
+		+ endian16(words[8]) + endian16(words[9]);
+}
+
+void tunnel_set_mtu(Tunnel* tunnel, uint16_t mtu) {
+	tunnel->mtu = mtu ? mtu : TUNNEL_MTU;
+}
+
+uint8_t tunnel_check(Tunnel* tunnel, Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+
+	if(endian16(ip->length) + tunnel->overhead > tunnel->mtu) {
+		if(endian16(ip->flags_offset) & IP_FLAG_DF)
+			return TUNNEL_TOO_BIG;
+		else
+			return TUNNEL_NO_ROOM;
+	}
+
+	if(packet->start < tunnel->overhead && packet->end + tunnel->overhead > packet->size)
+		return TUNNEL_NO_ROOM;
+
+	return TUNNEL_OK;
+}
+
+/* tunnel_check() must have returned TUNNEL_OK */
+void tunnel_encap(Tunnel* tunnel, Packet* packet, uint32_t source, uint32_t hash) {
+	uint16_t overhead = tunnel->overhead;
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	uint16_t length = endian16(((IP*)ether->payload)->length);
+
+	if(packet->start >= overhead) {
+		//Use headroom: move only the ether header
+		packet->start -= overhead;
+		memmove(packet->buffer + packet->start, ether, ETHER_LEN);
+		ether = (Ether*)(packet->buffer + packet->start);
+	} else {
+		memmove(ether->payload + overhead, ether->payload, packet->end - packet->start - ETHER_LEN);
+		packet->end += overhead;
+	}
+
+	IP* ip = (IP*)ether->payload;
+	memcpy(ip, tunnel->header, overhead);
+
+	length += overhead;
+	ip->length = endian16(length);
+	ip->source = endian32(source);
+	ip->checksum = endian16((uint16_t)~fold(tunnel->partial + length + (source >> 16) + (source & 0xffff)));
+
+	if(tunnel->mode == MODE_GUE) {
+		UDP* udp = (UDP*)ip->body;
+		udp->source = endian16(0xc000 | (hash & 0x3fff));	//Entropy for ECMP
+		udp->length = endian16(length - IP_LEN);
+	}
+}
+
+/*
+ * Turn packet into ICMP fragmentation needed back to the client so that
+ * path MTU discovery shrinks its segments by the tunnel overhead.
+ */
+bool tunnel_frag_needed(Tunnel* tunnel, Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+
+	uint16_t quote = ip->ihl * 4 + 8;
+	if(packet->start + ETHER_LEN + IP_LEN + 8 + quote > packet->size)
+		return false;
+
+	uint64_t smac = ether->smac;
+	uint32_t source = ip->source;
+	uint32_t destination = ip->destination;
+
+	memmove(ether->payload + IP_LEN + 8, ip, quote);
+
+	ether->dmac = smac;
+	ether->smac = endian48(packet->ni->mac);
+
+	ip->version = 4;
+	ip->ihl = IP_LEN / 4;
+	ip->ecn = 0;
+	ip->dscp = 0;
+	ip->length = endian16(IP_LEN + 8 + quote);
+	ip->id = 0;
+	ip->flags_offset = 0;
+	ip->ttl = TUNNEL_TTL;
+	ip->protocol = IP_PROTOCOL_ICMP;
+	ip->source = destination;
+	ip->destination = source;
+	ip->checksum = 0;
+	ip->checksum = endian16(checksum(ip, IP_LEN));
+
+	uint8_t* icmp = ip->body;
+	uint16_t mtu = tunnel->mtu - tunnel->overhead;
+	icmp[0] = 3;	//Destination unreachable
+	icmp[1] = 4;	//Fragmentation needed and DF set
+	icmp[2] = 0;
+	icmp[3] = 0;
+	icmp[4] = 0;
+	icmp[5] = 0;
+	icmp[6] = mtu >> 8;
+	icmp[7] = mtu & 0xff;
+	uint16_t icmp_checksum = checksum(icmp, 8 + quote);
+	icmp[2] = icmp_checksum >> 8;
+	icmp[3] = icmp_checksum & 0xff;
+
+	packet->end = packet->start + ETHER_LEN + IP_LEN + 8 + quote;
+
+	return true;
+}
+
+static bool tunnel_session_free(Session* session) {
+	__free(session, session->server_endpoint->ni->pool);
+
+	return true;
+}
+
+static Session* tunnel_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, uint8_t forward) {
+	Session* session = __malloc(sizeof(Session), server_endpoint->ni->pool);
+	if(!session) {
+		printf("Can'nt allocate Session\n");
+		return NULL;
+	}
+
+	session->server_endpoint = server_endpoint;
+	session->public_endpoint = service_endpoint;
+
+	memcpy(&session->client_endpoint, client_endpoint, sizeof(Endpoint));
+	memcpy(&session->private_endpoint, client_endpoint, sizeof(Endpoint));
+
+	session->event_id = 0;
+	session_recharge(session);
+	session->fin = false;
+
+	session->forward = forward;
+	session->free = tunnel_session_free;
+
+	return session;
+}
+
+Session* ipip_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint) {
+	return tunnel_session_alloc(server_endpoint, service_endpoint, client_endpoint, FORWARD_IPIP);
+}
+
+Session* gue_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint) {
+	return tunnel_session_alloc(server_endpoint, service_endpoint, client_endpoint, FORWARD_GUE);
+}
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+#include <util/map.h>
+#include <util/event.h>
+#include <net/ni.h>
+
+#include "vip.h"
+#include "loadbalancer.h"
+#include "service.h"
+#include "server.h"
+
+extern void* __gmalloc_pool;
+
+static VIPRetired* retired;	//Until the next rebuild drops them from the tables
+
+static inline uint64_t vip_key(uint32_t addr, uint8_t protocol, uint16_t port) {
+	return (uint64_t)addr << 32 | (uint64_t)protocol << 16 | (uint64_t)port;
+}
+
+static int vip_compare(const void* a, const void* b) {
+	uint64_t x = ((VIPEntry*)a)->key;
+	uint64_t y = ((VIPEntry*)b)->key;
+
+	return x < y ? -1 : x > y;
+}
+
+static VIPEntry* vip_search(VIPEntry* entries, uint32_t count, uint64_t key) {
+	uint32_t lo = 0;
+	uint32_t hi = count;
+	while(lo < hi) {
+		uint32_t mid = (lo + hi) >> 1;
+		if(entries[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if(lo < count && entries[lo].key == key)
+		return &entries[lo];
+
+	return NULL;
+}
+
+static VIPTable* vip_build(NetworkInterface* ni) {
+	Map* services = ni_config_get(ni, SERVICES);
+	Map* servers = ni_config_get(ni, SERVERS);
+
+	//Count upper bound of entries
+	uint32_t destination_count = services ? map_size(services) : 0;
+	uint32_t source_count = servers ? map_size(servers) : 0;
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* _services = ni_config_get(ni_get(i), SERVICES);
+		if(_services)
+			destination_count += map_size(_services);
+	}
+
+	VIPTable* table = __malloc(sizeof(VIPTable) + sizeof(VIPEntry) * (destination_count + source_count), ni->pool);
+	if(!table)
+		return NULL;
+
+	table->pool = ni->pool;
+	table->destinations = table->entries;
+	table->sources = table->entries + destination_count;
+	table->destination_count = 0;
+	table->source_count = 0;
+	table->retired = NULL;
+
+	//VIPs of this NI
+	if(services) {
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Service* service = entry->data;
+
+			VIPEntry* vip = &table->destinations[table->destination_count++];
+			vip->key = vip_key(service->endpoint.addr, service->endpoint.protocol, service->endpoint.port);
+			vip->role = VIP_ROLE_SERVICE;
+			vip->data = service;
+		}
+	}
+
+	//Private addresses of services on any NI which are bound to this NI
+	uint32_t vip_count = table->destination_count;
+	for(int i = 0; i < count; i++) {
+		Map* _services = ni_config_get(ni_get(i), SERVICES);
+		if(!_services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, _services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Service* service = entry->data;
+			if(!service->private_endpoints)
+				continue;
+
+			Endpoint* private_endpoint = map_get(service->private_endpoints, ni);
+			if(!private_endpoint)
+				continue;
+
+			uint64_t key = vip_key(private_endpoint->addr, 0, 0);
+			bool duplicated = false;
+			for(uint32_t j = vip_count; j < table->destination_count; j++) {
+				if(table->destinations[j].key == key) {
+					duplicated = true;
+					break;
+				}
+			}
+			if(duplicated)
+				continue;
+
+			VIPEntry* vip = &table->destinations[table->destination_count++];
+			vip->key = key;
+			vip->role = VIP_ROLE_PRIVATE;
+			vip->data = NULL;
+		}
+	}
+
+	//DNAT backends answer from their own address
+	if(servers) {
+		MapIterator iter;
+		map_iterator_init(&iter, servers);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Server* server = entry->data;
+			if(server->mode != MODE_DNAT)
+				continue;
+
+			VIPEntry* vip = &table->sources[table->source_count++];
+			vip->key = vip_key(server->endpoint.addr, server->endpoint.protocol, server->endpoint.port);
+			vip->role = VIP_ROLE_SERVER;
+			vip->data = server;
+		}
+	}
+
+	qsort(table->destinations, table->destination_count, sizeof(VIPEntry), vip_compare);
+	qsort(table->sources, table->source_count, sizeof(VIPEntry), vip_compare);
+
+	return table;
+}
+
+static void vip_retired_destroy(VIPRetired* list) {
+	while(list) {
+		VIPRetired* next = list->next;
+		list->destroy(list->object);
+		__free(list, __gmalloc_pool);
+		list = next;
+	}
+}
+
+static bool vip_retired_event(void* context) {
+	vip_retired_destroy(context);
+
+	return false;
+}
+
+static bool vip_free_event(void* context) {
+	VIPTable* table = context;
+	vip_retired_destroy(table->retired);
+	__free(table, table->pool);
+
+	return false;
+}
+
+/* Readers on other cores may still hold the old table */
+static void vip_table_retire(VIPTable* table) {
+	if(!event_timer_add(vip_free_event, table, VIP_FREE_DELAY, 0))
+		vip_free_event(table);
+}
+
+void vip_retire(void (*destroy)(void* object), void* object) {
+	VIPRetired* entry = __malloc(sizeof(VIPRetired), __gmalloc_pool);
+	if(!entry) {
+		//Leaked rather than freed under the readers
+		printf("Can'nt allocation retired object\n");
+		return;
+	}
+
+	entry->destroy = destroy;
+	entry->object = object;
+	entry->next = retired;
+	retired = entry;
+}
+
+bool vip_rebuild() {
+	bool result = true;
+	VIPTable* last = NULL;	//Old table retired last, carries the retired objects
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		NetworkInterface* ni = ni_get(i);
+		VIPTable* table = vip_build(ni);
+		if(!table) {
+			printf("Can'nt build VIP table\n");
+			result = false;
+			continue;
+		}
+
+		VIPTable* old = lb_set_vips(i, table);
+		if(!old)
+			continue;
+
+		if(last)
+			vip_table_retire(last);
+		last = old;
+	}
+
+	//A table kept on failure may still point to them: wait for the next rebuild
+	if(result && retired) {
+		if(last) {
+			last->retired = retired;
+		} else if(!event_timer_add(vip_retired_event, retired, VIP_FREE_DELAY, 0)) {
+			vip_retired_destroy(retired);
+		}
+		retired = NULL;
+	}
+
+	if(last)
+		vip_table_retire(last);
+
+	return result;
+}
+
+uint8_t vip_lookup(VIPTable* table, Endpoint* source_endpoint, Endpoint* destination_endpoint, void** data) {
+	if(!table)
+		return VIP_ROLE_NONE;
+
+	uint64_t key = vip_key(destination_endpoint->addr, destination_endpoint->protocol, destination_endpoint->port);
+	VIPEntry* vip = vip_search(table->destinations, table->destination_count, key);
+	if(vip) {
+		*data = vip->data;
+		return vip->role;
+	}
+
+	vip = vip_search(table->destinations, table->destination_count, vip_key(destination_endpoint->addr, 0, 0));
+	if(vip) {
+		*data = vip->data;
+		return vip->role;
+	}
+
+	if(table->source_count) {
+		key = vip_key(source_endpoint->addr, source_endpoint->protocol, source_endpoint->port);
+		vip = vip_search(table->sources, table->source_count, key);
+		if(vip) {
+			*data = vip->data;
+			return vip->role;
+		}
+	}
+
+	return VIP_ROLE_NONE;
+}
+
+void vip_dump() {
+	void print_role(uint8_t role) {
+		switch(role) {
+			case VIP_ROLE_SERVICE:
+				printf("Service\t\t");
+				break;
+			case VIP_ROLE_PRIVATE:
+				printf("Private\t\t");
+				break;
+			case VIP_ROLE_SERVER:
+				printf("Server\t\t");
+				break;
+			default:
+				printf("Unknown\t\t");
+				break;
+		}
+	}
+	void print_entry(int ni_num, VIPEntry* vip) {
+		uint32_t addr = vip->key >> 32;
+		printf("%d\t", ni_num);
+		print_role(vip->role);
+		printf("%d.%d.%d.%d:%d\t%d\n", (addr >> 24) & 0xff, (addr >> 16) & 0xff,
+				(addr >> 8) & 0xff, addr & 0xff, (uint16_t)vip->key, (uint8_t)(vip->key >> 16));
+	}
+
+	printf("NIC\tRole\t\tAddr:Port\t\tProtocol\n");
+	int count = ni_count();
+	for(int i = 0; i < count; i++) {
+		VIPTable* table = lb_get_vips(i);
+		if(!table)
+			continue;
+
+		for(uint32_t j = 0; j < table->destination_count; j++)
+			print_entry(i, &table->destinations[j]);
+		for(uint32_t j = 0; j < table->source_count; j++)
+			print_entry(i, &table->sources[j]);
+	}
+}
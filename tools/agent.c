@@ -0,0 +1,134 @@
+/*
+ * Stand-in backend agent: reports the load of the host it runs on to a
+ * loadbalancer with feedback on (include/feedback.h), from the server's
+ * address, every interval.
+ *
+ *   make tools && ./tools/lb-agent [-p port] [-s server port] [-i ms] [-n count]
+ *		[-c capacity | -q queue depth | -l] lb_private_addr
+ *
+ * -c reports a fixed capacity 0 ~ 100 %, -q a fixed queue depth and -l the
+ * CPU busy % of /proc/stat since the last report (the default).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "feedback.h"
+
+/* Busy % of every CPU since the last call, 0 on the first */
+static uint32_t cpu_busy() {
+	static uint64_t last_busy, last_total;
+
+	FILE* file = fopen("/proc/stat", "r");
+	if(!file)
+		return 0;
+
+	uint64_t user, nice, system, idle, iowait, irq, softirq, steal;
+	int count = fscanf(file, "cpu %lu %lu %lu %lu %lu %lu %lu %lu", &user, &nice, &system, &idle,
+			&iowait, &irq, &softirq, &steal);
+	fclose(file);
+	if(count != 8)
+		return 0;
+
+	uint64_t busy = user + nice + system + irq + softirq + steal;
+	uint64_t total = busy + idle + iowait;
+	uint32_t result = 0;
+	if(last_total && total > last_total)
+		result = (busy - last_busy) * 100 / (total - last_total);
+
+	last_busy = busy;
+	last_total = total;
+
+	return result;
+}
+
+static void usage(char* name) {
+	printf("Usage: %s [-p port] [-s server port] [-i ms] [-n count] [-c capacity | -q queue depth | -l] lb_private_addr\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	uint16_t port = FEEDBACK_PORT;
+	uint16_t server_port = 0;
+	uint32_t interval = 1000;
+	uint32_t count = 0;
+	uint8_t type = FEEDBACK_CPU;
+	uint32_t value = 0;
+	char* addr = NULL;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-l")) {
+			type = FEEDBACK_CPU;
+			continue;
+		}
+
+		if(argv[i][0] != '-') {
+			addr = argv[i];
+			continue;
+		}
+
+		if(i + 1 >= argc)
+			usage(argv[0]);
+
+		uint32_t option = strtoul(argv[i + 1], NULL, 0);
+		if(!strcmp(argv[i], "-p"))
+			port = option;
+		else if(!strcmp(argv[i], "-s"))
+			server_port = option;
+		else if(!strcmp(argv[i], "-i"))
+			interval = option;
+		else if(!strcmp(argv[i], "-n"))
+			count = option;
+		else if(!strcmp(argv[i], "-c")) {
+			type = FEEDBACK_CAPACITY;
+			value = option;
+		} else if(!strcmp(argv[i], "-q")) {
+			type = FEEDBACK_QUEUE;
+			value = option;
+		} else
+			usage(argv[0]);
+		i++;
+	}
+
+	struct sockaddr_in lb = { .sin_family = AF_INET, .sin_port = htons(port) };
+	if(!addr || !inet_aton(addr, &lb.sin_addr) || !interval)
+		usage(argv[0]);
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	if(type == FEEDBACK_CPU)
+		cpu_busy();
+
+	for(uint32_t sent = 0; !count || sent < count; sent++) {
+		if(type == FEEDBACK_CPU) {
+			usleep(interval * 1000);
+			value = cpu_busy();
+		}
+
+		FeedbackReport report = {
+			.magic = htonl(FEEDBACK_MAGIC),
+			.version = FEEDBACK_VERSION,
+			.type = type,
+			.port = htons(server_port),
+			.value = htonl(value),
+		};
+		if(sendto(fd, &report, sizeof(report), 0, (struct sockaddr*)&lb, sizeof(lb)) < 0)
+			perror("sendto");
+
+		if(type != FEEDBACK_CPU)
+			usleep(interval * 1000);
+	}
+
+	close(fd);
+
+	return 0;
+}
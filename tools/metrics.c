@@ -0,0 +1,298 @@
+/*
+ * Prometheus exporter of the metrics region a loadbalancer publishes
+ * (include/metrics.h). It only maps the region: no command reaches the
+ * loadbalancer and the datapath never waits for it.
+ *
+ *   make tools && ./tools/lb-metrics [-m name] [-l port]
+ *
+ * Without -l the text format is printed once, e.g. for the node_exporter
+ * textfile collector. With -l every GET on the port is answered with it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "metrics.h"
+
+#define SCOPE_NIC	0
+#define SCOPE_SERVICE	1
+#define SCOPE_SERVER	2
+
+/* Counters of StatsCore, an array when count > 1 */
+typedef struct _Family {
+	char*	name;
+	char*	help;
+	char*	type;
+	size_t	offset;
+	int	count;
+	char*	label;
+	char*	values[STATS_DROP_COUNT];
+} Family;
+
+static Family families[] = {
+	{ "packets_total", "Packets, in from clients or received, out to clients or sent", "counter",
+		offsetof(StatsCore, packets), 2, "direction", { "in", "out" } },
+	{ "bytes_total", "Bytes, in from clients or received, out to clients or sent", "counter",
+		offsetof(StatsCore, bytes), 2, "direction", { "in", "out" } },
+	{ "sessions_created_total", "Sessions created", "counter", offsetof(StatsCore, sessions_created), 1 },
+	{ "sessions_freed_total", "Sessions freed, expired included", "counter", offsetof(StatsCore, sessions_freed), 1 },
+	{ "sessions_expired_total", "Sessions expired", "counter", offsetof(StatsCore, sessions_expired), 1 },
+	{ "alloc_failures_total", "Session allocation failures", "counter", offsetof(StatsCore, alloc_failures), 1 },
+	{ "schedule_misses_total", "Scheduler found no server", "counter", offsetof(StatsCore, schedule_misses), 1 },
+	{ "drops_total", "Packets dropped", "counter", offsetof(StatsCore, drops), STATS_DROP_COUNT, "reason",
+		{ "no_service", "no_session", "no_server", "tunnel", "output", "blocked", "denied", "limited" } },
+};
+
+static char* scopes[] = { "nic", "service", "server" };
+static char* stages[METRICS_STAGE_COUNT] = { "classify", "lookup", "session", "forward", "output", "slow" };
+static char* classes[] = { "flow", "arp", "icmp", "other" };
+
+static int entity_count(Metrics* metrics, int scope) {
+	switch(scope) {
+		case SCOPE_NIC:		return metrics->nic_count;
+		case SCOPE_SERVICE:	return metrics->service_count;
+		default:		return metrics->server_count;
+	}
+}
+
+static MetricsEntry* entity_entry(Metrics* metrics, int scope, int index) {
+	return scope == SCOPE_SERVICE ? &metrics->services[index] : &metrics->servers[index];
+}
+
+static StatsCore* entity_total(Metrics* metrics, int scope, int index) {
+	if(scope == SCOPE_NIC)
+		return &metrics->nics[index].total;
+
+	return &entity_entry(metrics, scope, index)->total;
+}
+
+/* Labels of an entity, without braces */
+static void entity_labels(Metrics* metrics, int scope, int index, char* labels, size_t size) {
+	if(scope == SCOPE_NIC) {
+		snprintf(labels, size, "nic=\"%d\"", index);
+		return;
+	}
+
+	MetricsEntry* entry = entity_entry(metrics, scope, index);
+	uint32_t addr = entry->addr;
+	snprintf(labels, size, "nic=\"%d\",protocol=\"%s\",%s=\"%d.%d.%d.%d:%d\",%s=\"%s\"", entry->ni_num,
+			entry->protocol == 6 ? "tcp" : "udp", scope == SCOPE_SERVICE ? "vip" : "server",
+			(addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff, entry->port,
+			scope == SCOPE_SERVICE ? "schedule" : "mode", entry->kind);
+}
+
+static void header(FILE* out, char* scope, char* name, char* help, char* type) {
+	fprintf(out, "# HELP lb_%s_%s %s\n", scope, name, help);
+	fprintf(out, "# TYPE lb_%s_%s %s\n", scope, name, type);
+}
+
+static void render(FILE* out, Metrics* metrics) {
+	char labels[256];
+
+	for(int scope = SCOPE_NIC; scope <= SCOPE_SERVER; scope++) {
+		int count = entity_count(metrics, scope);
+
+		for(int i = 0; i < sizeof(families) / sizeof(Family); i++) {
+			Family* family = &families[i];
+			header(out, scopes[scope], family->name, family->help, family->type);
+			for(int j = 0; j < count; j++) {
+				entity_labels(metrics, scope, j, labels, sizeof(labels));
+				uint64_t* values = (uint64_t*)((uint8_t*)entity_total(metrics, scope, j) + family->offset);
+				for(int k = 0; k < family->count; k++) {
+					if(family->label)
+						fprintf(out, "lb_%s_%s{%s,%s=\"%s\"} %lu\n", scopes[scope], family->name, labels,
+								family->label, family->values[k], values[k]);
+					else
+						fprintf(out, "lb_%s_%s{%s} %lu\n", scopes[scope], family->name, labels, values[k]);
+				}
+			}
+		}
+
+		header(out, scopes[scope], "sessions", "Sessions now", "gauge");
+		for(int j = 0; j < count; j++) {
+			entity_labels(metrics, scope, j, labels, sizeof(labels));
+			uint64_t sessions = scope == SCOPE_NIC ? metrics->nics[j].sessions :
+					entity_entry(metrics, scope, j)->sessions;
+			fprintf(out, "lb_%s_sessions{%s} %lu\n", scopes[scope], labels, sessions);
+		}
+
+		if(scope == SCOPE_NIC)
+			continue;
+
+		header(out, scopes[scope], "active", "1 unless being removed", "gauge");
+		for(int j = 0; j < count; j++) {
+			entity_labels(metrics, scope, j, labels, sizeof(labels));
+			fprintf(out, "lb_%s_active{%s} %d\n", scopes[scope], labels, entity_entry(metrics, scope, j)->active);
+		}
+	}
+
+	header(out, "server", "weight", "Scheduling weight", "gauge");
+	for(int j = 0; j < metrics->server_count; j++) {
+		entity_labels(metrics, SCOPE_SERVER, j, labels, sizeof(labels));
+		fprintf(out, "lb_server_weight{%s} %d\n", labels, metrics->servers[j].weight);
+	}
+
+	header(out, "nic", "class_packets_total", "Packets received by class", "counter");
+	for(int j = 0; j < metrics->nic_count; j++) {
+		for(int k = 0; k < sizeof(classes) / sizeof(char*); k++)
+			fprintf(out, "lb_nic_class_packets_total{nic=\"%d\",class=\"%s\"} %lu\n", j, classes[k],
+					metrics->nics[j].classes[k]);
+	}
+
+	//Boundaries at powers of 2 only: a stable bucket set, exact at each
+	header(out, "nic", "stage_cycles", "Cycles of a datapath stage, while profiling", "histogram");
+	for(int j = 0; j < metrics->nic_count; j++) {
+		for(int k = 0; k < METRICS_STAGE_COUNT; k++) {
+			Histogram* histogram = &metrics->nics[j].latency[k];
+			uint64_t seen = 0;
+			for(int l = 0; l < HISTOGRAM_BUCKET_COUNT; l++) {
+				seen += histogram->buckets[l];
+				if((l + 1) % HISTOGRAM_SUB_COUNT == 0 && l != HISTOGRAM_BUCKET_COUNT - 1)
+					fprintf(out, "lb_nic_stage_cycles_bucket{nic=\"%d\",stage=\"%s\",le=\"%lu\"} %lu\n", j,
+							stages[k], histogram_bucket_max(l), seen);
+			}
+			fprintf(out, "lb_nic_stage_cycles_bucket{nic=\"%d\",stage=\"%s\",le=\"+Inf\"} %lu\n", j, stages[k],
+					histogram->count);
+			fprintf(out, "lb_nic_stage_cycles_sum{nic=\"%d\",stage=\"%s\"} %lu\n", j, stages[k], histogram->sum);
+			fprintf(out, "lb_nic_stage_cycles_count{nic=\"%d\",stage=\"%s\"} %lu\n", j, stages[k],
+					histogram->count);
+		}
+	}
+
+	fprintf(out, "# HELP lb_metrics_generation Publications of the region\n");
+	fprintf(out, "# TYPE lb_metrics_generation counter\n");
+	fprintf(out, "lb_metrics_generation %lu\n", metrics->generation);
+	fprintf(out, "# HELP lb_metrics_profile 1 while stage cycles are recorded\n");
+	fprintf(out, "# TYPE lb_metrics_profile gauge\n");
+	fprintf(out, "lb_metrics_profile %d\n", metrics->profile);
+	fprintf(out, "# HELP lb_metrics_truncated 1 if services or servers did not fit\n");
+	fprintf(out, "# TYPE lb_metrics_truncated gauge\n");
+	fprintf(out, "lb_metrics_truncated %d\n", metrics->truncated);
+}
+
+/* Consistent copy of the region name, NULL with a reason printed */
+static Metrics* snapshot(char* name) {
+	char path[256];
+	if(name[0] == '/')
+		snprintf(path, sizeof(path), "%s", name);
+	else
+		snprintf(path, sizeof(path), "/dev/shm/%s", name);
+
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(Metrics)) {
+		fprintf(stderr, "%s: not a metrics region of this version\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	volatile Metrics* region = mmap(NULL, sizeof(Metrics), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(region == MAP_FAILED) {
+		perror(path);
+		return NULL;
+	}
+
+	Metrics* metrics = NULL;
+	if(region->magic != METRICS_MAGIC || region->version != METRICS_VERSION || region->size != sizeof(Metrics)) {
+		fprintf(stderr, "%s: version %u, expected %u\n", path, region->version, METRICS_VERSION);
+		goto done;
+	}
+
+	metrics = malloc(sizeof(Metrics));
+	if(!metrics_read(region, metrics)) {
+		fprintf(stderr, "%s: writer busy\n", path);
+		free(metrics);
+		metrics = NULL;
+	}
+
+done:
+	munmap((void*)region, sizeof(Metrics));
+
+	return metrics;
+}
+
+static int serve(char* name, int port) {
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY };
+	if(bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, 16) < 0) {
+		perror("listen");
+		return 1;
+	}
+
+	while(1) {
+		int client = accept(server, NULL, NULL);
+		if(client < 0)
+			continue;
+
+		//Any request gets the metrics
+		char request[1024];
+		if(read(client, request, sizeof(request)) < 0) {
+			close(client);
+			continue;
+		}
+
+		FILE* out = fdopen(client, "w");
+		Metrics* metrics = snapshot(name);
+		if(metrics) {
+			fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+			render(out, metrics);
+			free(metrics);
+		} else {
+			fprintf(out, "HTTP/1.0 503 Service Unavailable\r\n\r\n");
+		}
+		fclose(out);
+	}
+
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	char* name = METRICS_NAME;
+	int port = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "m:l:h")) != -1) {
+		switch(opt) {
+			case 'm':
+				name = optarg;
+				break;
+			case 'l':
+				port = atoi(optarg);
+				break;
+			default:
+				printf("Usage: %s [-m name] [-l port]\n", argv[0]);
+				printf("\t-m name\tRegion given to the metrics command (default %s)\n", METRICS_NAME);
+				printf("\t-l port\tServe HTTP on port instead of printing once\n");
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if(port)
+		return serve(name, port);
+
+	Metrics* metrics = snapshot(name);
+	if(!metrics)
+		return 1;
+
+	render(stdout, metrics);
+	free(metrics);
+
+	return 0;
+}